@@ -0,0 +1,310 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Compares the metric set evaluators compiled into gputop-gens-metrics.c
+ * with the bytecode ones loaded from the XML files at runtime: both are
+ * run over the same synthesized delta vectors, their outputs must be
+ * identical and the time per report of each is printed as one tab
+ * separated line per chipset.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gputop-oa-metrics.h"
+#include "gputop-oa-bytecode.h"
+#include "gputop-gens-metrics.h"
+
+#include "util/macros.h"
+#include "util/ralloc.h"
+
+static const struct {
+    const char *chipset;
+    int gen;
+    struct gputop_gen * (*get_metrics_cb)(const struct gputop_devinfo *devinfo);
+} chipsets[] = {
+    { "hsw", 7, gputop_oa_get_metrics_hsw },
+    { "bdw", 8, gputop_oa_get_metrics_bdw },
+    { "chv", 8, gputop_oa_get_metrics_chv },
+    { "sklgt2", 9, gputop_oa_get_metrics_sklgt2 },
+    { "sklgt3", 9, gputop_oa_get_metrics_sklgt3 },
+    { "sklgt4", 9, gputop_oa_get_metrics_sklgt4 },
+    { "kblgt2", 9, gputop_oa_get_metrics_kblgt2 },
+    { "kblgt3", 9, gputop_oa_get_metrics_kblgt3 },
+    { "bxt", 9, gputop_oa_get_metrics_bxt },
+    { "glk", 9, gputop_oa_get_metrics_glk },
+    { "cflgt2", 9, gputop_oa_get_metrics_cflgt2 },
+    { "cflgt3", 9, gputop_oa_get_metrics_cflgt3 },
+    { "cnl", 10, gputop_oa_get_metrics_cnl },
+    { "icl", 11, gputop_oa_get_metrics_icl },
+    { "lkf", 11, gputop_oa_get_metrics_lkf },
+    { "tgl", 12, gputop_oa_get_metrics_tgl },
+};
+
+#define MAX_DELTAS 62
+
+static uint64_t
+get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* The equations only depend on the variables computed by the client
+ * context from the device topology, a made up GT is good enough.
+ */
+static void
+init_devinfo(struct gputop_devinfo *devinfo, int gen)
+{
+    memset(devinfo, 0, sizeof(*devinfo));
+
+    devinfo->gen = gen;
+    devinfo->timestamp_frequency = 12000000;
+    devinfo->gt_min_freq = 300000000;
+    devinfo->gt_max_freq = 1100000000;
+    devinfo->n_eu_slices = 1;
+    devinfo->n_eu_sub_slices = gen >= 11 ? 8 : 3;
+    devinfo->n_eus = devinfo->n_eu_sub_slices * 8;
+    devinfo->eu_threads_count = 7;
+    devinfo->slice_mask = 0x1;
+    devinfo->subslice_mask = gen >= 11 ? 0xff : 0x7;
+
+    gputop_oa_build_equation_constants(devinfo);
+}
+
+/* Deltas of a plausible magnitude, with some zeros to exercise the
+ * division guards.
+ */
+static void
+fill_deltas(uint64_t *deltas, uint32_t n_reports, uint64_t *seed)
+{
+    for (uint32_t d = 0; d < MAX_DELTAS; d++) {
+        for (uint32_t r = 0; r < n_reports; r++) {
+            uint64_t value = xorshift64(seed);
+            deltas[d * n_reports + r] = (value & 63) == 0 ? 0 : (value >> 40);
+        }
+    }
+}
+
+/* Doubles converted to uint64_t out of range are undefined, generated
+ * code and bytecode may disagree on those.
+ */
+static bool
+same_value(double a, double b)
+{
+    if (a >= 18446744073709551616.0 || b >= 18446744073709551616.0)
+        return true;
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static uint64_t
+time_read_all_soa(const struct gputop_devinfo *devinfo,
+                  const struct gputop_metric_set *metric_set,
+                  const uint64_t *deltas, uint32_t n_reports,
+                  double *out, int iterations)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < iterations; i++) {
+        uint64_t start = get_time_ns();
+        metric_set->read_all_soa(devinfo, metric_set, deltas, n_reports, out);
+        uint64_t duration = get_time_ns() - start;
+        if (duration < best)
+            best = duration;
+    }
+
+    return best;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [chipset...]\n"
+            "\n"
+            "  -d, --data-dir=DIR     Directory of the oa-<chipset>.xml files\n"
+            "  -n, --reports=N        Reports evaluated per metric set (default 4096)\n"
+            "  -i, --iterations=N     Runs per metric set, the best is kept (default 5)\n"
+            "  -h, --help             Display this help\n",
+            name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct option options[] = {
+        { "data-dir", required_argument, 0, 'd' },
+        { "reports", required_argument, 0, 'n' },
+        { "iterations", required_argument, 0, 'i' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    const char *data_dir = GPUTOP_DATA_DIR;
+    uint32_t n_reports = 4096;
+    int iterations = 5;
+    int opt, ret = EXIT_SUCCESS;
+
+    while ((opt = getopt_long(argc, argv, "d:n:i:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            data_dir = optarg;
+            break;
+        case 'n':
+            n_reports = MAX2(1, strtoul(optarg, NULL, 0));
+            break;
+        case 'i':
+            iterations = MAX2(1, atoi(optarg));
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t *deltas = malloc(MAX_DELTAS * n_reports * sizeof(*deltas));
+    double *generated_out = NULL, *bytecode_out = NULL;
+    size_t out_size = 0;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+    fprintf(stdout, "# chipset\tmetric_sets\tcounters\tgenerated_ns_per_report\t"
+            "bytecode_ns_per_report\tbytecode_ratio\tload_ms\tbytecode_bytes\tmismatches\n");
+
+    for (uint32_t c = 0; c < ARRAY_SIZE(chipsets); c++) {
+        if (optind < argc) {
+            bool selected = false;
+            for (int a = optind; a < argc; a++)
+                selected |= !strcmp(argv[a], chipsets[c].chipset);
+            if (!selected)
+                continue;
+        }
+
+        struct gputop_devinfo devinfo;
+        init_devinfo(&devinfo, chipsets[c].gen);
+
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s/oa-%s.xml",
+                 data_dir, chipsets[c].chipset);
+
+        uint64_t load_start = get_time_ns();
+        struct gputop_gen *bytecode_gen = gputop_oa_bytecode_load_gen(&devinfo, filename);
+        uint64_t load_duration = get_time_ns() - load_start;
+        if (!bytecode_gen) {
+            fprintf(stderr, "Failed to load %s\n", filename);
+            ret = EXIT_FAILURE;
+            continue;
+        }
+
+        struct gputop_gen *gen = chipsets[c].get_metrics_cb(&devinfo);
+        uint64_t generated_ns = 0, bytecode_ns = 0, n_evaluated = 0;
+        uint32_t n_sets = 0, n_counters = 0, mismatches = 0;
+        size_t bytecode_size = 0;
+
+        list_for_each_entry(struct gputop_metric_set, metric_set, &gen->metric_sets, link) {
+            struct hash_entry *entry =
+                _mesa_hash_table_search(bytecode_gen->metric_sets_map,
+                                        metric_set->hw_config_guid);
+            const struct gputop_metric_set *bytecode_set = entry ? entry->data : NULL;
+
+            gputop_metric_set_ensure_counters(metric_set);
+
+            if (!bytecode_set || bytecode_set->n_counters != metric_set->n_counters) {
+                fprintf(stderr, "%s: metric set %s differs\n",
+                        chipsets[c].chipset, metric_set->symbol_name);
+                mismatches++;
+                continue;
+            }
+
+            if (metric_set->n_counters * n_reports > out_size) {
+                out_size = metric_set->n_counters * n_reports;
+                generated_out = realloc(generated_out, out_size * sizeof(double));
+                bytecode_out = realloc(bytecode_out, out_size * sizeof(double));
+            }
+
+            fill_deltas(deltas, n_reports, &seed);
+
+            generated_ns += time_read_all_soa(&devinfo, metric_set, deltas, n_reports,
+                                              generated_out, iterations);
+            bytecode_ns += time_read_all_soa(&devinfo, bytecode_set, deltas, n_reports,
+                                             bytecode_out, iterations);
+
+            for (uint32_t i = 0; i < metric_set->n_counters * n_reports; i++) {
+                if (!same_value(generated_out[i], bytecode_out[i])) {
+                    if (mismatches++ < 10) {
+                        fprintf(stderr, "%s: %s::%s report %u: %.17g != %.17g\n",
+                                chipsets[c].chipset, metric_set->symbol_name,
+                                metric_set->counters[i / n_reports].symbol_name,
+                                i % n_reports, generated_out[i], bytecode_out[i]);
+                    }
+                }
+            }
+
+            n_sets++;
+            n_counters += metric_set->n_counters;
+            n_evaluated += n_reports;
+            bytecode_size += gputop_oa_bytecode_size(bytecode_set->program);
+        }
+
+        fprintf(stdout, "%s\t%u\t%u\t%.2f\t%.2f\t%.3f\t%.3f\t%zu\t%u\n",
+                chipsets[c].chipset, n_sets, n_counters,
+                (double) generated_ns / n_evaluated,
+                (double) bytecode_ns / n_evaluated,
+                (double) bytecode_ns / generated_ns,
+                load_duration / 1000000.0,
+                bytecode_size, mismatches);
+
+        if (mismatches)
+            ret = EXIT_FAILURE;
+
+        ralloc_free(gen);
+        ralloc_free(bytecode_gen);
+    }
+
+    free(bytecode_out);
+    free(generated_out);
+    free(deltas);
+
+    return ret;
+}
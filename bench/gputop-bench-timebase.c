@@ -0,0 +1,216 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Checks the timestamp conversions set up by gputop_devinfo_init_timebase()
+ * against the plain 64-bit x * numerator / denominator they replace, over
+ * the 32-bit range of the OA report timestamps. By default every value at a
+ * prime stride is checked along with the edges of the range, the powers of
+ * two and the multiples of the denominator, where rounding errors would
+ * show first. --exhaustive checks all 2^32 values. Any mismatch is printed
+ * and makes the program exit with a failure.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gputop-oa-metrics.h"
+
+#include "util/macros.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define U32_RANGE (1ULL << 32)
+#define DEFAULT_STRIDE 4099
+#define MAX_REPORTED_MISMATCHES 10
+
+/* The timestamp frequencies of the supported platforms, followed by
+ * values meant to stress the rounding of the fixed point fraction.
+ */
+static const uint64_t default_frequencies[] = {
+    12500000,
+    12000000,
+    19200000,
+    24000000,
+    25000000,
+    38400000,
+    1,
+    3,
+    999999937,
+    NSEC_PER_SEC,
+    4294967291ULL,
+};
+
+struct check {
+    const char *name;
+    const struct gputop_fixed_scale *scale;
+    uint64_t numerator;
+    uint64_t denominator;
+    uint64_t n_checked;
+    uint64_t n_mismatches;
+};
+
+static uint64_t
+get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline void
+check_value(struct check *check, uint64_t x)
+{
+    /* Both factors fit in 32 bits, the product can't overflow. */
+    uint64_t expected = x * check->numerator / check->denominator;
+    uint64_t value = gputop_fixed_scale(check->scale, x);
+
+    check->n_checked++;
+    if (unlikely(value != expected)) {
+        if (check->n_mismatches++ < MAX_REPORTED_MISMATCHES) {
+            fprintf(stderr, "MISMATCH %s: %" PRIu64 " * %" PRIu64 " / %" PRIu64
+                    " = %" PRIu64 ", got %" PRIu64 "\n",
+                    check->name, x, check->numerator, check->denominator,
+                    expected, value);
+        }
+    }
+}
+
+static void
+check_range(struct check *check, uint64_t start, uint64_t end)
+{
+    for (uint64_t x = start; x < end && x < U32_RANGE; x++)
+        check_value(check, x);
+}
+
+static void
+check_scale(struct check *check, bool exhaustive)
+{
+    if (exhaustive) {
+        check_range(check, 0, U32_RANGE);
+        return;
+    }
+
+    for (uint64_t x = 0; x < U32_RANGE; x += DEFAULT_STRIDE)
+        check_value(check, x);
+
+    check_range(check, 0, 65536);
+    check_range(check, U32_RANGE - 65536, U32_RANGE);
+
+    for (int bit = 1; bit < 32; bit++)
+        check_range(check, (1ULL << bit) - 1, (1ULL << bit) + 2);
+
+    /* Around the multiples of the denominator, at most 65536 of them. */
+    uint64_t n_multiples = (U32_RANGE - 1) / check->denominator;
+    uint64_t step = MAX2(1, n_multiples / 65536);
+    for (uint64_t k = 1; k <= n_multiples; k += step)
+        check_range(check, k * check->denominator - 1, k * check->denominator + 2);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [frequency...]\n"
+            "\n"
+            "  -e, --exhaustive       Check every 32-bit value instead of a strided subset\n"
+            "  -h, --help             Display this help\n",
+            name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct option options[] = {
+        { "exhaustive", no_argument, 0, 'e' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    bool exhaustive = false;
+    int opt, ret = EXIT_SUCCESS;
+
+    while ((opt = getopt_long(argc, argv, "eh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'e':
+            exhaustive = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int n_frequencies = optind < argc ? argc - optind : ARRAY_SIZE(default_frequencies);
+
+    fprintf(stdout, "# frequency\tconversion\tchecked\tns_per_value\tmismatches\n");
+
+    for (int f = 0; f < n_frequencies; f++) {
+        struct gputop_devinfo devinfo;
+
+        memset(&devinfo, 0, sizeof(devinfo));
+        devinfo.timestamp_frequency = optind < argc ?
+            strtoull(argv[optind + f], NULL, 0) : default_frequencies[f];
+        if (!devinfo.timestamp_frequency || devinfo.timestamp_frequency >= U32_RANGE) {
+            fprintf(stderr, "Invalid frequency %s\n", argv[optind + f]);
+            return EXIT_FAILURE;
+        }
+
+        gputop_devinfo_init_timebase(&devinfo);
+
+        struct check checks[] = {
+            { "timebase_to_ns", &devinfo.timebase_to_ns,
+              NSEC_PER_SEC, devinfo.timestamp_frequency, 0, 0 },
+            { "ns_to_timebase", &devinfo.ns_to_timebase,
+              devinfo.timestamp_frequency, NSEC_PER_SEC, 0, 0 },
+        };
+
+        for (uint32_t c = 0; c < ARRAY_SIZE(checks); c++) {
+            uint64_t start = get_time_ns();
+            check_scale(&checks[c], exhaustive);
+            uint64_t duration = get_time_ns() - start;
+
+            fprintf(stdout, "%" PRIu64 "\t%s\t%" PRIu64 "\t%.2f\t%" PRIu64 "\n",
+                    devinfo.timestamp_frequency, checks[c].name,
+                    checks[c].n_checked,
+                    (double) duration / checks[c].n_checked,
+                    checks[c].n_mismatches);
+
+            if (checks[c].n_mismatches)
+                ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "FAILED: gputop_fixed_scale() differs from the 64-bit division\n");
+
+    return ret;
+}
@@ -0,0 +1,1038 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Micro-benchmarks of the client hot paths, fed with synthesized OA report
+ * and tracepoint streams:
+ *
+ *   accumulate_reports      gputop_cc_oa_accumulate_reports() per format
+ *   accumulate_report_range gputop_cc_oa_accumulate_report_range() per format
+ *   counter_read            every counter of every metric set, one at a time
+ *   read_all                the same through gputop_metric_set::read_all
+ *   i915_perf_accumulate    i915 perf messages through a client context
+ *   tracepoints             perf tracepoint messages through a client context
+ *   tracepoint_print        formatting of the received tracepoint events
+ *   u32_map                 hardware id lookups, gputop_u32_map against the
+ *                           mesa hash table the client used to rely on
+ *
+ * The client context benchmarks go through gputop_client_context_handle_data()
+ * exactly as data coming from the server, after a features message for the
+ * emulated device. Each measurement is printed as one tab separated line,
+ * keeping the best of several runs, so that results can be compared from
+ * one run to the next.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gputop-client-context.h"
+#include "gputop-gens-metrics.h"
+#include "gputop-network.h"
+#include "gputop-oa-counters.h"
+#include "gputop-oa-metrics.h"
+#include "gputop-u32-map.h"
+
+#include "main/hash.h" /* For uint_key() */
+#include "util/hash_table.h"
+#include "util/macros.h"
+#include "util/ralloc.h"
+
+/* Message types of the websocket protocol, see gputop-server.c */
+enum {
+    WS_MESSAGE_PERF = 1,
+    WS_MESSAGE_PROTOBUF,
+    WS_MESSAGE_I915_PERF,
+};
+
+#define PERF_RECORD_SAMPLE 9
+
+static const struct {
+    const char *chipset;
+    int gen;
+    struct gputop_gen * (*get_metrics_cb)(const struct gputop_devinfo *devinfo);
+} chipsets[] = {
+    { "hsw", 7, gputop_oa_get_metrics_hsw },
+    { "bdw", 8, gputop_oa_get_metrics_bdw },
+    { "chv", 8, gputop_oa_get_metrics_chv },
+    { "sklgt2", 9, gputop_oa_get_metrics_sklgt2 },
+    { "sklgt3", 9, gputop_oa_get_metrics_sklgt3 },
+    { "sklgt4", 9, gputop_oa_get_metrics_sklgt4 },
+    { "kblgt2", 9, gputop_oa_get_metrics_kblgt2 },
+    { "kblgt3", 9, gputop_oa_get_metrics_kblgt3 },
+    { "bxt", 9, gputop_oa_get_metrics_bxt },
+    { "glk", 9, gputop_oa_get_metrics_glk },
+    { "cflgt2", 9, gputop_oa_get_metrics_cflgt2 },
+    { "cflgt3", 9, gputop_oa_get_metrics_cflgt3 },
+    { "cnl", 10, gputop_oa_get_metrics_cnl },
+    { "icl", 11, gputop_oa_get_metrics_icl },
+    { "lkf", 11, gputop_oa_get_metrics_lkf },
+    { "tgl", 12, gputop_oa_get_metrics_tgl },
+};
+
+static struct {
+    uint32_t n_reports;
+    uint32_t reports_per_chunk;
+    uint32_t n_events;
+    int iterations;
+    char **benchmarks;
+    int n_benchmarks;
+} options;
+
+/* The client library expects its embedder to provide these. */
+void
+gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
+{
+}
+
+void
+gputop_cr_console_log(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+/**/
+
+static uint64_t
+get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static bool
+benchmark_selected(const char *name)
+{
+    if (!options.n_benchmarks)
+        return true;
+
+    for (int i = 0; i < options.n_benchmarks; i++) {
+        if (!strcmp(options.benchmarks[i], name))
+            return true;
+    }
+
+    return false;
+}
+
+static void
+print_result(const char *benchmark, const char *variant, const char *unit,
+             uint64_t n_items, uint64_t duration_ns)
+{
+    fprintf(stdout, "%s\t%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%.3f\t%.0f\n",
+            benchmark, variant, unit, n_items, duration_ns,
+            (double) duration_ns / n_items,
+            duration_ns ? n_items * 1000000000.0 / duration_ns : 0.0);
+}
+
+/* Keeps the compiler from discarding the computations being measured. */
+static volatile double sink;
+
+/**/
+
+/* Devices the synthesized streams are made for, the topology matters for
+ * the counter equations and the frequencies for the pace of the counters.
+ */
+static void
+init_devinfo(struct gputop_devinfo *devinfo, int gen)
+{
+    memset(devinfo, 0, sizeof(*devinfo));
+
+    devinfo->gen = gen;
+    devinfo->timestamp_frequency = gen == 7 ? 12500000 : 12000000;
+    devinfo->gt_min_freq = 300000000;
+    devinfo->gt_max_freq = 1100000000;
+    devinfo->n_eu_slices = 1;
+    devinfo->n_eu_sub_slices = gen >= 11 ? 8 : 3;
+    devinfo->n_eus = devinfo->n_eu_sub_slices * 8;
+    devinfo->eu_threads_count = 7;
+    devinfo->slice_mask = 0x1;
+    devinfo->subslice_mask = gen >= 11 ? 0xff : 0x7;
+
+    gputop_devinfo_init_timebase(devinfo);
+    gputop_oa_build_equation_constants(devinfo);
+}
+
+/* Generates consecutive OA reports of a device, with counters advancing at
+ * a plausible rate for the elapsed GPU clocks and 40bit counters wrapping
+ * like the real ones.
+ */
+struct oa_synth {
+    const struct gputop_devinfo *devinfo;
+    int perf_oa_format;
+    uint32_t period_ticks;
+    uint32_t ctx_switch_reports;
+
+    uint64_t seed;
+    uint32_t n_reports;
+    uint32_t timestamp;
+    uint32_t clock;
+    uint32_t ctx_id;
+    uint64_t counters[64];
+};
+
+static void
+oa_synth_init(struct oa_synth *synth, const struct gputop_devinfo *devinfo,
+              int perf_oa_format, uint64_t period_ns)
+{
+    memset(synth, 0, sizeof(*synth));
+
+    synth->devinfo = devinfo;
+    synth->perf_oa_format = perf_oa_format;
+    synth->period_ticks = MAX2(1, gputop_time_scale_timebase(devinfo, period_ns));
+    synth->ctx_switch_reports = 256;
+    synth->seed = 0x9e3779b97f4a7c15ULL;
+    synth->timestamp = 0x1000;
+    synth->ctx_id = 1;
+
+    for (int i = 0; i < ARRAY_SIZE(synth->counters); i++)
+        synth->counters[i] = xorshift64(&synth->seed) & ((1ULL << 40) - 1);
+}
+
+static uint32_t
+oa_synth_advance(struct oa_synth *synth, uint64_t *counter,
+                 uint64_t max_increment, uint64_t mask)
+{
+    *counter = (*counter + xorshift64(&synth->seed) % (max_increment + 1)) & mask;
+    return (uint32_t) *counter;
+}
+
+static void
+oa_synth_report(struct oa_synth *synth, uint32_t *report)
+{
+    const struct gputop_devinfo *devinfo = synth->devinfo;
+    uint32_t ticks = synth->period_ticks - synth->period_ticks / 8 +
+        xorshift64(&synth->seed) % (synth->period_ticks / 4 + 1);
+    uint64_t clocks = (uint64_t) ticks *
+        (devinfo->gt_max_freq / devinfo->timestamp_frequency);
+    uint64_t eu_clocks = clocks * devinfo->n_eus;
+
+    if (++synth->n_reports % synth->ctx_switch_reports == 0)
+        synth->ctx_id = 1 + (synth->ctx_id % 4);
+
+    synth->timestamp += ticks;
+    synth->clock += clocks;
+
+    memset(report, 0, 256);
+    report[1] = synth->timestamp;
+
+    switch (synth->perf_oa_format) {
+    case I915_OA_FORMAT_A45_B8_C8:
+        report[0] = 1 << 19;
+        for (int i = 3; i < 64; i++) {
+            report[i] = oa_synth_advance(synth, &synth->counters[i],
+                                         i < 48 ? eu_clocks : clocks,
+                                         UINT32_MAX);
+        }
+        break;
+
+    case I915_OA_FORMAT_A32u40_A4u32_B8_C8: {
+        uint8_t *high = (uint8_t *) &report[40];
+
+        report[0] = (1 << 19) | (devinfo->gen == 8 ? (1 << 25) : (1 << 16));
+        report[2] = synth->ctx_id;
+        report[3] = synth->clock;
+        for (int i = 0; i < 32; i++) {
+            report[4 + i] = oa_synth_advance(synth, &synth->counters[4 + i],
+                                             eu_clocks, (1ULL << 40) - 1);
+            high[i] = synth->counters[4 + i] >> 32;
+        }
+        for (int i = 36; i < 40; i++) {
+            report[i] = oa_synth_advance(synth, &synth->counters[i],
+                                         eu_clocks, UINT32_MAX);
+        }
+        for (int i = 48; i < 64; i++) {
+            report[i] = oa_synth_advance(synth, &synth->counters[i],
+                                         clocks, UINT32_MAX);
+        }
+        break;
+    }
+
+    default:
+        unreachable("Unsupported OA format");
+    }
+}
+
+/* Fills n_records i915 perf sample records, containing only an OA report,
+ * and returns their stride.
+ */
+static uint32_t
+oa_synth_records(struct oa_synth *synth, uint8_t *records, uint32_t n_records)
+{
+    const uint32_t stride = sizeof(struct drm_i915_perf_record_header) + 256;
+
+    for (uint32_t r = 0; r < n_records; r++) {
+        struct drm_i915_perf_record_header *header =
+            (struct drm_i915_perf_record_header *) (records + r * stride);
+
+        header->type = DRM_I915_PERF_RECORD_SAMPLE;
+        header->pad = 0;
+        header->size = stride;
+        oa_synth_report(synth, (uint32_t *) (header + 1));
+    }
+
+    return stride;
+}
+
+/**/
+
+static const struct {
+    const char *name;
+    int perf_oa_format;
+    int gen;
+} formats[] = {
+    { "A32u40_A4u32_B8_C8", I915_OA_FORMAT_A32u40_A4u32_B8_C8, 9 },
+    { "A45_B8_C8", I915_OA_FORMAT_A45_B8_C8, 7 },
+};
+
+static void
+bench_accumulate(void)
+{
+    const struct gputop_i915_perf_configuration config = { .oa_reports = true };
+    uint32_t n_records = MAX2(2, options.n_reports);
+    uint8_t *records = malloc(n_records * (sizeof(struct drm_i915_perf_record_header) + 256));
+
+    for (uint32_t f = 0; f < ARRAY_SIZE(formats); f++) {
+        struct gputop_devinfo devinfo;
+        struct gputop_metric_set metric_set;
+        struct oa_synth synth;
+
+        init_devinfo(&devinfo, formats[f].gen);
+        memset(&metric_set, 0, sizeof(metric_set));
+        gputop_cc_oa_metric_set_init_format(&metric_set, formats[f].perf_oa_format);
+
+        oa_synth_init(&synth, &devinfo, formats[f].perf_oa_format, 100000);
+        uint32_t stride = oa_synth_records(&synth, records, n_records);
+
+        if (benchmark_selected("accumulate_reports")) {
+            uint64_t best = UINT64_MAX;
+
+            for (int i = 0; i < options.iterations; i++) {
+                struct gputop_cc_oa_accumulator accumulator;
+                const uint8_t *last = records + sizeof(struct drm_i915_perf_record_header);
+
+                gputop_cc_oa_accumulator_init(&accumulator, &devinfo, &metric_set, 0, last);
+
+                uint64_t start = get_time_ns();
+                for (uint32_t r = 1; r < n_records; r++) {
+                    const uint8_t *report = last + stride;
+
+                    gputop_cc_oa_accumulate_reports(&accumulator, last, report);
+                    last = report;
+                }
+                best = MIN2(best, get_time_ns() - start);
+
+                sink += accumulator.deltas[2];
+            }
+
+            print_result("accumulate_reports", formats[f].name, "pairs",
+                         n_records - 1, best);
+        }
+
+        if (benchmark_selected("accumulate_report_range")) {
+            uint64_t best = UINT64_MAX;
+
+            for (int i = 0; i < options.iterations; i++) {
+                /* Global, per context and timeline accumulators, as updated
+                 * by the client context.
+                 */
+                struct gputop_cc_oa_accumulator accumulators[3];
+                struct gputop_cc_oa_accumulator *accumulator_ptrs[3];
+                enum gputop_cc_oa_range_split split;
+
+                for (int a = 0; a < 3; a++) {
+                    gputop_cc_oa_accumulator_init(&accumulators[a], &devinfo, &metric_set, 0,
+                                                  records + sizeof(struct drm_i915_perf_record_header));
+                    accumulator_ptrs[a] = &accumulators[a];
+                }
+
+                uint64_t start = get_time_ns();
+                gputop_cc_oa_accumulate_report_range(accumulator_ptrs, 3, &config,
+                                                     (const struct drm_i915_perf_record_header *) records,
+                                                     stride, n_records, 0, &split);
+                best = MIN2(best, get_time_ns() - start);
+
+                sink += accumulators[0].deltas[2];
+            }
+
+            print_result("accumulate_report_range", formats[f].name, "reports",
+                         n_records - 1, best);
+        }
+    }
+
+    free(records);
+}
+
+/**/
+
+#define N_DELTA_VECTORS 64
+#define REPORTS_PER_DELTA_VECTOR 16
+
+static void
+bench_counter_reads(void)
+{
+    const struct gputop_i915_perf_configuration config = { .oa_reports = true };
+    const uint32_t n_records = N_DELTA_VECTORS * REPORTS_PER_DELTA_VECTOR + 1;
+    uint8_t *records = malloc(n_records * (sizeof(struct drm_i915_perf_record_header) + 256));
+    struct gputop_cc_oa_accumulator *accumulators =
+        calloc(N_DELTA_VECTORS, sizeof(*accumulators));
+    double *out = NULL;
+    int out_size = 0;
+
+    for (uint32_t c = 0; c < ARRAY_SIZE(chipsets); c++) {
+        struct gputop_devinfo devinfo;
+
+        init_devinfo(&devinfo, chipsets[c].gen);
+
+        struct gputop_gen *gen = chipsets[c].get_metrics_cb(&devinfo);
+
+        list_for_each_entry(struct gputop_metric_set, metric_set, &gen->metric_sets, link) {
+            char variant[256];
+            struct oa_synth synth;
+
+            gputop_metric_set_ensure_counters(metric_set);
+
+            snprintf(variant, sizeof(variant), "%s/%s",
+                     chipsets[c].chipset, metric_set->symbol_name);
+
+            /* Realistic delta vectors, each accumulated over a few reports. */
+            oa_synth_init(&synth, &devinfo, metric_set->perf_oa_format, 100000);
+            uint32_t stride = oa_synth_records(&synth, records, n_records);
+            for (int v = 0; v < N_DELTA_VECTORS; v++) {
+                const struct drm_i915_perf_record_header *header =
+                    (const struct drm_i915_perf_record_header *)
+                    (records + v * REPORTS_PER_DELTA_VECTOR * stride);
+                struct gputop_cc_oa_accumulator *accumulator = &accumulators[v];
+                enum gputop_cc_oa_range_split split;
+
+                gputop_cc_oa_accumulator_init(accumulator, &devinfo, metric_set, 0,
+                                              (const uint8_t *) (header + 1));
+                gputop_cc_oa_accumulate_report_range(&accumulator, 1, &config, header, stride,
+                                                     REPORTS_PER_DELTA_VECTOR + 1, 0, &split);
+            }
+
+            if (benchmark_selected("counter_read")) {
+                uint64_t best = UINT64_MAX;
+
+                for (int i = 0; i < options.iterations; i++) {
+                    double sum = 0;
+
+                    uint64_t start = get_time_ns();
+                    for (int v = 0; v < N_DELTA_VECTORS; v++) {
+                        for (int n = 0; n < metric_set->n_counters; n++) {
+                            sum += gputop_metric_set_counter_read(&devinfo,
+                                                                  &metric_set->counters[n],
+                                                                  accumulators[v].deltas);
+                        }
+                    }
+                    best = MIN2(best, get_time_ns() - start);
+
+                    sink += sum;
+                }
+
+                print_result("counter_read", variant, "counters",
+                             (uint64_t) N_DELTA_VECTORS * metric_set->n_counters, best);
+            }
+
+            if (benchmark_selected("read_all") && metric_set->read_all) {
+                uint64_t best = UINT64_MAX;
+
+                if (metric_set->n_counters > out_size) {
+                    out_size = metric_set->n_counters;
+                    out = realloc(out, out_size * sizeof(*out));
+                }
+
+                for (int i = 0; i < options.iterations; i++) {
+                    double sum = 0;
+
+                    uint64_t start = get_time_ns();
+                    for (int v = 0; v < N_DELTA_VECTORS; v++) {
+                        metric_set->read_all(&devinfo, metric_set,
+                                             accumulators[v].deltas, out);
+                        sum += out[0];
+                    }
+                    best = MIN2(best, get_time_ns() - start);
+
+                    sink += sum;
+                }
+
+                print_result("read_all", variant, "counters",
+                             (uint64_t) N_DELTA_VECTORS * metric_set->n_counters, best);
+            }
+        }
+
+        ralloc_free(gen);
+    }
+
+    free(out);
+    free(accumulators);
+    free(records);
+}
+
+/**/
+
+static void
+send_message(struct gputop_client_context *ctx, Gputop__Message *message)
+{
+    size_t len = 8 + protobuf_c_message_get_packed_size(&message->base);
+    uint8_t *data = calloc(1, len);
+
+    data[0] = WS_MESSAGE_PROTOBUF;
+    protobuf_c_message_pack(&message->base, &data[8]);
+    gputop_client_context_handle_data(ctx, data, len);
+
+    free(data);
+}
+
+/* Emulated devices for the client context, with full topologies as
+ * reported by the server.
+ */
+static const struct {
+    const char *devname;
+    uint32_t gen;
+    uint32_t max_subslices;
+} devices[] = {
+    { "hsw", 7, 3 },
+    { "sklgt2", 9, 3 },
+    { "icl", 11, 8 },
+};
+
+static void
+init_client_context(struct gputop_client_context *ctx, int device,
+                    uint32_t n_cpus, bool timestamps)
+{
+    uint8_t slices_mask[1] = { 0x1 };
+    uint8_t subslices_mask[1] = { (1 << devices[device].max_subslices) - 1 };
+    uint8_t eus_mask[8];
+
+    memset(eus_mask, 0xff, sizeof(eus_mask));
+
+    Gputop__DevTopology topology = GPUTOP__DEV_TOPOLOGY__INIT;
+    topology.max_slices = 1;
+    topology.max_subslices = devices[device].max_subslices;
+    topology.max_eus_per_subslice = 8;
+    topology.n_threads_per_eu = 7;
+    topology.slices_mask.data = slices_mask;
+    topology.slices_mask.len = sizeof(slices_mask);
+    topology.subslices_mask.data = subslices_mask;
+    topology.subslices_mask.len = sizeof(subslices_mask);
+    topology.eus_mask.data = eus_mask;
+    topology.eus_mask.len = devices[device].max_subslices;
+
+    Gputop__DevInfo devinfo = GPUTOP__DEV_INFO__INIT;
+    devinfo.gen = devices[device].gen;
+    devinfo.timestamp_frequency = devinfo.gen == 7 ? 12500000 : 12000000;
+    devinfo.gt_min_freq = 300000000;
+    devinfo.gt_max_freq = 1100000000;
+    devinfo.devname = (char *) devices[device].devname;
+    devinfo.prettyname = (char *) devices[device].devname;
+    devinfo.topology = &topology;
+
+    Gputop__Features features = GPUTOP__FEATURES__INIT;
+    features.devinfo = &devinfo;
+    features.has_i915_oa = true;
+    features.n_cpus = n_cpus;
+    features.cpu_model = (char *) "";
+    features.kernel_release = (char *) "";
+    features.kernel_build = (char *) "";
+    features.has_i915_oa_cpu_timestamps = timestamps;
+    features.has_i915_oa_gpu_timestamps = timestamps;
+
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_FEATURES;
+    message.features = &features;
+
+    memset(ctx, 0, sizeof(*ctx));
+    gputop_client_context_init(ctx);
+    gputop_client_context_reset(ctx, NULL);
+    send_message(ctx, &message);
+}
+
+static void
+fini_client_context(struct gputop_client_context *ctx)
+{
+    gputop_client_context_stop_sampling(ctx);
+    gputop_client_context_fini(ctx);
+}
+
+/* Builds the i915 perf messages for n_reports reports, split in chunks the
+ * way the server forwards them. Returns the number of chunks.
+ */
+static uint32_t
+build_i915_perf_messages(struct gputop_client_context *ctx, struct oa_synth *synth,
+                         uint32_t n_reports, uint8_t **data, size_t *data_len)
+{
+    const struct gputop_i915_perf_configuration *config = &ctx->i915_perf_config;
+    uint32_t record_size = sizeof(struct drm_i915_perf_record_header) + 256 +
+        (config->gpu_timestamps ? 8 : 0) + (config->cpu_timestamps ? 8 : 0);
+    uint32_t n_chunks = DIV_ROUND_UP(n_reports, options.reports_per_chunk);
+    uint64_t cpu_time = 1000000000ULL;
+
+    *data_len = n_chunks * 8 + n_reports * record_size;
+    *data = malloc(*data_len);
+
+    uint8_t *ptr = *data;
+    for (uint32_t r = 0; r < n_reports; r++) {
+        if (r % options.reports_per_chunk == 0) {
+            uint32_t n_chunk_reports = MIN2(options.reports_per_chunk, n_reports - r);
+
+            memset(ptr, 0, 8);
+            ptr[0] = WS_MESSAGE_I915_PERF;
+            *((uint32_t *) (ptr + 4)) = n_chunk_reports * record_size;
+            ptr += 8;
+        }
+
+        struct drm_i915_perf_record_header *header =
+            (struct drm_i915_perf_record_header *) ptr;
+        header->type = DRM_I915_PERF_RECORD_SAMPLE;
+        header->pad = 0;
+        header->size = record_size;
+
+        uint32_t *report = (uint32_t *)
+            gputop_i915_perf_record_field(config, header,
+                                          GPUTOP_I915_PERF_FIELD_OA_REPORT);
+        uint32_t last_timestamp = synth->timestamp;
+        oa_synth_report(synth, report);
+
+        cpu_time += gputop_timebase_scale_ns(synth->devinfo,
+                                             synth->timestamp - last_timestamp);
+        if (config->gpu_timestamps) {
+            *((uint64_t *) gputop_i915_perf_record_field(config, header,
+                                                         GPUTOP_I915_PERF_FIELD_GPU_TIMESTAMP)) =
+                synth->timestamp;
+        }
+        if (config->cpu_timestamps) {
+            *((uint64_t *) gputop_i915_perf_record_field(config, header,
+                                                         GPUTOP_I915_PERF_FIELD_CPU_TIMESTAMP)) =
+                cpu_time;
+        }
+
+        ptr += record_size;
+    }
+
+    return n_chunks;
+}
+
+static void
+unreachable_buffer_destroy(gputop_buffer_t *buffer)
+{
+    unreachable("Buffers are owned by the benchmark");
+}
+
+static void
+bench_i915_perf_accumulate(void)
+{
+    for (uint32_t d = 0; d < ARRAY_SIZE(devices); d++) {
+        for (int timestamps = 0; timestamps < 2; timestamps++) {
+            struct gputop_client_context ctx;
+            struct oa_synth synth;
+            uint8_t *data;
+            size_t data_len;
+            char variant[64];
+
+            /* Timestamped records only exist on Gen8+ */
+            if (timestamps && devices[d].gen < 8)
+                continue;
+
+            init_client_context(&ctx, d, 1, timestamps);
+
+            ctx.metric_set =
+                gputop_client_context_symbol_to_metric_set(&ctx, "RenderBasic");
+            if (!ctx.metric_set) {
+                ctx.metric_set = list_first_entry(&ctx.gen_metrics->metric_sets,
+                                                  struct gputop_metric_set, link);
+            }
+            gputop_metric_set_ensure_counters(ctx.metric_set);
+
+            /* 10us sampling, with the default aggregation period of the
+             * client context.
+             */
+            oa_synth_init(&synth, &ctx.devinfo, ctx.metric_set->perf_oa_format, 10000);
+            uint32_t n_chunks =
+                build_i915_perf_messages(&ctx, &synth, options.n_reports,
+                                         &data, &data_len);
+
+            /* Messages as received by the network layer, for the chunks
+             * to reference in place.
+             */
+            gputop_buffer_t *buffers = calloc(n_chunks, sizeof(*buffers));
+            uint8_t *ptr = data;
+            for (uint32_t c = 0; c < n_chunks; c++) {
+                buffers[c].refcount = 1;
+                buffers[c].data = ptr;
+                buffers[c].len = 8 + *((uint32_t *) (ptr + 4));
+                buffers[c].destroy = unreachable_buffer_destroy;
+                ptr += buffers[c].len;
+            }
+
+            for (int zero_copy = 0; zero_copy < 2; zero_copy++) {
+                uint64_t best = UINT64_MAX;
+
+                for (int i = 0; i < options.iterations; i++) {
+                    /* A new stream every run, starting from empty samples. */
+                    gputop_client_context_start_sampling(&ctx);
+
+                    uint64_t start = get_time_ns();
+                    for (uint32_t c = 0; c < n_chunks; c++) {
+                        uint8_t *message = (uint8_t *) buffers[c].data;
+
+                        *((uint32_t *) (message + 4)) = ctx.oa_stream.id;
+                        if (zero_copy)
+                            gputop_client_context_handle_buffer(&ctx, &buffers[c]);
+                        else
+                            gputop_client_context_handle_data(&ctx, message, buffers[c].len);
+                    }
+                    best = MIN2(best, get_time_ns() - start);
+
+                    sink += gputop_samples_ring_length(&ctx.graphs);
+                }
+
+                snprintf(variant, sizeof(variant), "%s/%s%s%s",
+                         devices[d].devname, ctx.metric_set->symbol_name,
+                         timestamps ? "+timestamps" : "",
+                         zero_copy ? "+zero-copy" : "");
+                print_result("i915_perf_accumulate", variant, "reports",
+                             options.n_reports, best);
+                print_result("i915_perf_accumulate", variant, "chunks",
+                             n_chunks, best);
+                print_result("i915_perf_accumulate", variant, "bytes",
+                             data_len, best);
+            }
+
+            /* Drops the chunks still referencing the buffers. */
+            fini_client_context(&ctx);
+            free(buffers);
+            free(data);
+        }
+    }
+}
+
+/**/
+
+/* Layout of i915/i915_request_add on recent kernels */
+static const char i915_request_add_format[] =
+    "name: i915_request_add\n"
+    "ID: 1789\n"
+    "format:\n"
+    "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+    "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+    "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+    "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "\tfield:u32 dev;\toffset:8;\tsize:4;\tsigned:0;\n"
+    "\tfield:u32 hw_id;\toffset:12;\tsize:4;\tsigned:0;\n"
+    "\tfield:u64 ctx;\toffset:16;\tsize:8;\tsigned:0;\n"
+    "\tfield:u16 class;\toffset:24;\tsize:2;\tsigned:0;\n"
+    "\tfield:u16 instance;\toffset:26;\tsize:2;\tsigned:0;\n"
+    "\tfield:u32 seqno;\toffset:28;\tsize:4;\tsigned:0;\n"
+    "\n"
+    "print fmt: \"dev=%u, engine=%u:%u, hw_id=%u, ctx=%llu, seqno=%u\", "
+    "REC->dev, REC->class, REC->instance, REC->hw_id, REC->ctx, REC->seqno\n";
+
+#define TRACEPOINT_RAW_SIZE 36 /* 32 bytes of fields, padded by perf */
+#define TRACEPOINT_CPUS 4
+#define TRACEPOINT_BATCH 64
+#define TRACEPOINT_INTERVAL_NS 100000
+
+static void
+bench_tracepoints(void)
+{
+    struct gputop_client_context ctx;
+
+    init_client_context(&ctx, 1, TRACEPOINT_CPUS, false);
+
+    struct gputop_perf_tracepoint *tp =
+        gputop_client_context_add_tracepoint(&ctx, "i915/i915_request_add");
+
+    Gputop__TracepointInfo info = GPUTOP__TRACEPOINT_INFO__INIT;
+    info.event_id = 1789;
+    info.sample_format = (char *) i915_request_add_format;
+
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    message.reply_uuid = tp->uuid;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_TRACEPOINT_INFO;
+    message.tracepoint_info = &info;
+    send_message(&ctx, &message);
+
+    /* Each CPU forwards its events in batches covering the same span of
+     * time, so every batch has to be merged with the events of the other
+     * CPUs already inserted.
+     */
+    const uint32_t record_size =
+        ALIGN_POT(sizeof(struct gputop_perf_data_tracepoint) + TRACEPOINT_RAW_SIZE, 8);
+    const uint32_t batch_len = 8 + TRACEPOINT_BATCH * record_size;
+    uint32_t n_batches = DIV_ROUND_UP(options.n_events, TRACEPOINT_BATCH);
+    uint8_t *data = calloc(n_batches, batch_len);
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    uint64_t time = 1000000000ULL;
+    uint32_t seqno = 0;
+
+    for (uint32_t b = 0; b < n_batches; b++) {
+        uint8_t *batch = data + b * batch_len;
+        uint32_t cpu = b % TRACEPOINT_CPUS;
+
+        batch[0] = WS_MESSAGE_PERF;
+        *((uint32_t *) (batch + 4)) = cpu;
+
+        for (uint32_t e = 0; e < TRACEPOINT_BATCH; e++) {
+            struct gputop_perf_data_tracepoint *point =
+                (struct gputop_perf_data_tracepoint *) (batch + 8 + e * record_size);
+
+            point->header.type = PERF_RECORD_SAMPLE;
+            point->header.misc = 0;
+            point->header.size = record_size;
+            point->time = time + (uint64_t) e * TRACEPOINT_CPUS * TRACEPOINT_INTERVAL_NS +
+                cpu * TRACEPOINT_INTERVAL_NS + xorshift64(&seed) % TRACEPOINT_INTERVAL_NS;
+            point->data_size = TRACEPOINT_RAW_SIZE;
+
+            uint32_t process = xorshift64(&seed) % 8;
+            *((uint16_t *) &point->data[0]) = 1789;
+            *((int32_t *) &point->data[4]) = 1000 + process;
+            *((uint32_t *) &point->data[12]) = 1 + process;
+            *((uint32_t *) &point->data[28]) = seqno++;
+        }
+
+        if (cpu == TRACEPOINT_CPUS - 1)
+            time += (uint64_t) TRACEPOINT_BATCH * TRACEPOINT_CPUS * TRACEPOINT_INTERVAL_NS;
+    }
+
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < options.iterations; i++) {
+        uint32_t stream_ids[TRACEPOINT_CPUS];
+
+        /* New streams every run, starting from an empty timeline. */
+        gputop_client_context_start_sampling(&ctx);
+        list_for_each_entry(struct gputop_perf_tracepoint_stream, stream, &tp->streams, link)
+            stream_ids[stream->cpu] = stream->base.id;
+
+        uint64_t start = get_time_ns();
+        for (uint32_t b = 0; b < n_batches; b++) {
+            uint8_t *batch = data + b * batch_len;
+            uint32_t cpu = b % TRACEPOINT_CPUS;
+
+            *((uint32_t *) (batch + 4)) = stream_ids[cpu];
+            gputop_client_context_handle_data(&ctx, batch, batch_len);
+            *((uint32_t *) (batch + 4)) = cpu;
+        }
+        sink += gputop_client_context_merge_tracepoints_data(&ctx);
+        best = MIN2(best, get_time_ns() - start);
+    }
+
+    if (benchmark_selected("tracepoints")) {
+        print_result("tracepoints", "i915/i915_request_add", "events",
+                     (uint64_t) n_batches * TRACEPOINT_BATCH, best);
+    }
+
+    if (benchmark_selected("tracepoint_print")) {
+        uint32_t n_data = gputop_client_context_merge_tracepoints_data(&ctx);
+        char desc[200];
+
+        best = UINT64_MAX;
+        for (int i = 0; i < options.iterations; i++) {
+            uint64_t start = get_time_ns();
+            for (uint32_t d = 0; d < n_data; d++) {
+                gputop_client_context_print_tracepoint_data(
+                    &ctx, desc, sizeof(desc),
+                    gputop_client_context_tracepoint_data(&ctx, d), true);
+                sink += desc[0];
+            }
+            best = MIN2(best, get_time_ns() - start);
+        }
+
+        print_result("tracepoint_print", "i915/i915_request_add", "events",
+                     n_data, best);
+    }
+
+    free(data);
+    fini_client_context(&ctx);
+}
+
+/**/
+
+static void
+bench_u32_map(void)
+{
+    static const uint32_t n_keys[] = { 8, 64, 1024, 16384 };
+    const uint32_t n_lookups = 1 << 20;
+    uint32_t *lookups = malloc(n_lookups * sizeof(lookups[0]));
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+
+    for (uint32_t k = 0; k < ARRAY_SIZE(n_keys); k++) {
+        uint32_t *keys = malloc(n_keys[k] * sizeof(keys[0]));
+        struct gputop_u32_map map;
+        struct hash_table *table =
+            _mesa_hash_table_create(NULL, _mesa_hash_pointer, _mesa_key_pointer_equal);
+        char variant[64];
+
+        /* Same setup as the client context used to have for hardware ids. */
+        _mesa_hash_table_set_deleted_key(table, uint_key(UINT32_MAX));
+        _mesa_hash_table_set_freed_key(table, uint_key(UINT32_MAX - 1));
+        gputop_u32_map_init(&map);
+
+        for (uint32_t i = 0; i < n_keys[k]; i++) {
+            keys[i] = xorshift64(&seed) % (UINT32_MAX - 2);
+            gputop_u32_map_insert(&map, keys[i], &keys[i]);
+            _mesa_hash_table_insert(table, uint_key(keys[i]), &keys[i]);
+        }
+        for (uint32_t i = 0; i < n_lookups; i++)
+            lookups[i] = keys[xorshift64(&seed) % n_keys[k]];
+
+        uint64_t best = UINT64_MAX;
+        for (int i = 0; i < options.iterations; i++) {
+            uint64_t start = get_time_ns();
+            for (uint32_t l = 0; l < n_lookups; l++)
+                sink += *((uint32_t *) gputop_u32_map_search(&map, lookups[l]));
+            best = MIN2(best, get_time_ns() - start);
+        }
+        snprintf(variant, sizeof(variant), "gputop_u32_map/%u", n_keys[k]);
+        print_result("u32_map", variant, "lookups", n_lookups, best);
+
+        best = UINT64_MAX;
+        for (int i = 0; i < options.iterations; i++) {
+            uint64_t start = get_time_ns();
+            for (uint32_t l = 0; l < n_lookups; l++) {
+                struct hash_entry *entry =
+                    _mesa_hash_table_search(table, uint_key(lookups[l]));
+                sink += *((uint32_t *) entry->data);
+            }
+            best = MIN2(best, get_time_ns() - start);
+        }
+        snprintf(variant, sizeof(variant), "mesa_hash_table/%u", n_keys[k]);
+        print_result("u32_map", variant, "lookups", n_lookups, best);
+
+        gputop_u32_map_fini(&map);
+        _mesa_hash_table_destroy(table, NULL);
+        free(keys);
+    }
+
+    free(lookups);
+}
+
+/**/
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [benchmark...]\n"
+            "\n"
+            "  -n, --reports=N        OA reports per stream (default 100000)\n"
+            "  -c, --chunk=N          OA reports per i915 perf message (default 64)\n"
+            "  -e, --events=N         Tracepoint events (default 100000)\n"
+            "  -i, --iterations=N     Runs per benchmark, the best is kept (default 5)\n"
+            "  -h, --help             Display this help\n"
+            "\n"
+            "Benchmarks: accumulate_reports, accumulate_report_range, counter_read,\n"
+            "            read_all, i915_perf_accumulate, tracepoints,\n"
+            "            tracepoint_print, u32_map (default all)\n",
+            name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct option long_options[] = {
+        { "reports", required_argument, 0, 'n' },
+        { "chunk", required_argument, 0, 'c' },
+        { "events", required_argument, 0, 'e' },
+        { "iterations", required_argument, 0, 'i' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    int opt;
+
+    options.n_reports = 100000;
+    options.reports_per_chunk = 64;
+    options.n_events = 100000;
+    options.iterations = 5;
+
+    /* Accumulations are timed in the thread handing the messages over. */
+    unsetenv("GPUTOP_INGEST_THREAD");
+
+    while ((opt = getopt_long(argc, argv, "n:c:e:i:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            options.n_reports = MAX2(2, strtoul(optarg, NULL, 0));
+            break;
+        case 'c':
+            options.reports_per_chunk = MAX2(1, strtoul(optarg, NULL, 0));
+            break;
+        case 'e':
+            options.n_events = MAX2(1, strtoul(optarg, NULL, 0));
+            break;
+        case 'i':
+            options.iterations = MAX2(1, atoi(optarg));
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    options.benchmarks = &argv[optind];
+    options.n_benchmarks = argc - optind;
+
+    fprintf(stdout, "# benchmark\tvariant\tunit\titems\tbest_ns\tns_per_item\titems_per_s\n");
+
+    if (benchmark_selected("accumulate_reports") ||
+        benchmark_selected("accumulate_report_range"))
+        bench_accumulate();
+    if (benchmark_selected("counter_read") ||
+        benchmark_selected("read_all"))
+        bench_counter_reads();
+    if (benchmark_selected("i915_perf_accumulate"))
+        bench_i915_perf_accumulate();
+    if (benchmark_selected("tracepoints") ||
+        benchmark_selected("tracepoint_print"))
+        bench_tracepoints();
+    if (benchmark_selected("u32_map"))
+        bench_u32_map();
+
+    return EXIT_SUCCESS;
+}
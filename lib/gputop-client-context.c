@@ -4,7 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef EMSCRIPTEN
+#include <pthread.h>
+#endif
+
+#ifndef GPUTOP_CLIENT_XML_METRICS
 #include "gputop-gens-metrics.h"
+#endif
+#include "gputop-oa-bytecode.h"
 
 #include "gputop-log.h"
 
@@ -13,7 +20,7 @@
 
 static void i915_perf_empty_samples(struct gputop_client_context *ctx);
 static void clear_perf_tracepoints_data(struct gputop_client_context *ctx);
-static void delete_process_entry(struct hash_entry *entry);
+static void clear_process_infos(struct gputop_client_context *ctx);
 
 int
 gputop_client_pretty_print_value(gputop_counter_units_t unit,
@@ -67,7 +74,7 @@ double gputop_client_context_max_value(struct gputop_client_context *ctx,
                                        const struct gputop_metric_set_counter *counter,
                                        uint64_t ns_time)
 {
-    if (!counter->max_uint64 && !counter->max_float)
+    if (!gputop_metric_set_counter_has_max(counter))
         return 0.0f;
 
     uint32_t counters0[64] = { 0, 1} ;
@@ -79,25 +86,8 @@ double gputop_client_context_max_value(struct gputop_client_context *ctx,
     gputop_cc_oa_accumulate_reports(&dummy_accumulator,
                                     (uint8_t *) counters0, (uint8_t *) counters1);
 
-    double value;
-
-    switch (counter->data_type) {
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-        value = counter->max_uint64(&ctx->devinfo,
-                                    counter->metric_set,
-                                    dummy_accumulator.deltas);
-        break;
-    case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-        value = counter->max_float(&ctx->devinfo,
-                                   counter->metric_set,
-                                   dummy_accumulator.deltas);
-        break;
-    }
-
-    return value;
+    return gputop_metric_set_counter_max(&ctx->devinfo, counter,
+                                         dummy_accumulator.deltas);
 }
 
 int
@@ -142,16 +132,15 @@ send_pb_message(struct gputop_client_context *ctx, ProtobufCMessage *pb_message)
 static struct gputop_process_info *
 get_process_info(struct gputop_client_context *ctx, uint32_t pid)
 {
-    struct hash_entry *entry =
-        pid == 0 ? NULL :
-        _mesa_hash_table_search(ctx->pid_to_process_table, uint_key(pid));
-    if (entry || pid == 0)
-        return entry ? ((struct gputop_process_info *) entry->data) : NULL;
+    struct gputop_process_info *info = pid == 0 ? NULL :
+        (struct gputop_process_info *) gputop_u32_map_search(&ctx->pid_to_process_map, pid);
+    if (info || pid == 0)
+        return info;
 
-    struct gputop_process_info *info = (struct gputop_process_info *) calloc(1, sizeof(*info));
+    info = gputop_pool_alloc_type(&ctx->process_infos_pool, struct gputop_process_info);
     info->pid = pid;
     snprintf(info->cmd, sizeof(info->cmd), "<unknown>");
-    _mesa_hash_table_insert(ctx->pid_to_process_table, uint_key(pid), info);
+    gputop_u32_map_insert(&ctx->pid_to_process_map, pid, info);
 
     list_addtail(&info->link, &ctx->process_infos);
 
@@ -178,29 +167,152 @@ update_hw_contexts_process_info(struct gputop_client_context *ctx,
 
 /**/
 
+/* Chunks are bump allocated from large slabs rather than individually
+ * malloc()ed. They expire mostly in the order they arrived as the visible
+ * timeline slides, so a slab usually empties shortly after the next one is
+ * started. Empty slabs are kept around to be reused.
+ */
+#define I915_PERF_SLAB_SIZE (256 * 1024)
+#define I915_PERF_MAX_FREE_SLABS 8
+
+struct gputop_i915_perf_slab {
+    struct list_head link;
+
+    uint32_t size;
+    uint32_t used;
+    uint32_t n_chunks;
+
+    uint8_t data[] __attribute__((aligned(8)));
+};
+
 static void
-put_i915_perf_chunk(struct gputop_i915_perf_chunk *chunk)
+release_i915_perf_slab(struct gputop_client_context *ctx,
+                       struct gputop_i915_perf_slab *slab)
+{
+    assert(slab->n_chunks == 0);
+
+    list_del(&slab->link);
+    ctx->i915_perf_chunk_stats.n_slabs--;
+
+    /* Slabs made for a single oversized chunk go back to the heap. */
+    if (slab->size != I915_PERF_SLAB_SIZE ||
+        ctx->i915_perf_chunk_stats.n_free_slabs >= I915_PERF_MAX_FREE_SLABS) {
+        ctx->i915_perf_chunk_stats.slab_bytes -= slab->size;
+        free(slab);
+        return;
+    }
+
+    slab->used = 0;
+    list_add(&slab->link, &ctx->i915_perf_free_slabs);
+    ctx->i915_perf_chunk_stats.n_free_slabs++;
+}
+
+static struct gputop_i915_perf_slab *
+get_i915_perf_slab(struct gputop_client_context *ctx, uint32_t size)
+{
+    struct gputop_i915_perf_slab *slab;
+
+    if (size <= I915_PERF_SLAB_SIZE && !list_empty(&ctx->i915_perf_free_slabs)) {
+        slab = list_first_entry(&ctx->i915_perf_free_slabs,
+                                struct gputop_i915_perf_slab, link);
+        list_del(&slab->link);
+        ctx->i915_perf_chunk_stats.n_free_slabs--;
+    } else {
+        size = MAX2(size, I915_PERF_SLAB_SIZE);
+        slab = (struct gputop_i915_perf_slab *) malloc(sizeof(*slab) + size);
+        slab->size = size;
+        slab->used = 0;
+        slab->n_chunks = 0;
+        ctx->i915_perf_chunk_stats.slab_bytes += size;
+    }
+
+    list_addtail(&slab->link, &ctx->i915_perf_slabs);
+    ctx->i915_perf_chunk_stats.n_slabs++;
+
+    return slab;
+}
+
+static void
+put_i915_perf_chunk(struct gputop_client_context *ctx,
+                    struct gputop_i915_perf_chunk *chunk)
 {
     if (!chunk || --chunk->refcount)
         return;
 
+    struct gputop_i915_perf_slab *slab = chunk->slab;
+
     list_del(&chunk->link);
-    free(chunk);
+    ctx->i915_perf_chunk_stats.bytes_live -= chunk->length;
+    if (chunk->buffer)
+        gputop_buffer_unref(chunk->buffer);
+
+    if (--slab->n_chunks)
+        return;
+
+    /* The slab currently allocated from just starts over. */
+    if (slab == list_last_entry(&ctx->i915_perf_slabs,
+                                struct gputop_i915_perf_slab, link))
+        slab->used = 0;
+    else
+        release_i915_perf_slab(ctx, slab);
 }
 
+/* The next report received isn't to be accumulated against the last one,
+ * the records in between having been lost or not sent.
+ */
+static void
+forget_last_i915_perf_report(struct gputop_client_context *ctx)
+{
+    if (ctx->last_chunk) {
+        put_i915_perf_chunk(ctx, ctx->last_chunk);
+        ctx->last_chunk = NULL;
+    }
+    ctx->last_header = NULL;
+    ctx->last_hw_id = GPUTOP_OA_INVALID_CTX_ID;
+}
+
+/* Data received in a buffer is referenced in place, only the chunk
+ * itself is allocated then.
+ */
 static struct gputop_i915_perf_chunk *
 get_i915_perf_chunk(struct gputop_client_context *ctx,
-                    const uint8_t *data, size_t len)
+                    gputop_buffer_t *buffer, const uint8_t *data, size_t len)
 {
+    uint32_t size = ALIGN_POT(sizeof(struct gputop_i915_perf_chunk) +
+                              (buffer ? 0 : len), 8);
+    struct gputop_i915_perf_slab *slab = list_empty(&ctx->i915_perf_slabs) ? NULL :
+        list_last_entry(&ctx->i915_perf_slabs, struct gputop_i915_perf_slab, link);
+
+    if (!slab || (slab->size - slab->used) < size) {
+        if (slab && slab->n_chunks == 0)
+            release_i915_perf_slab(ctx, slab);
+        slab = get_i915_perf_slab(ctx, size);
+    }
+
     struct gputop_i915_perf_chunk *chunk =
-        (struct gputop_i915_perf_chunk *) malloc(len + sizeof(*chunk));
+        (struct gputop_i915_perf_chunk *) (slab->data + slab->used);
+    slab->used += size;
+    slab->n_chunks++;
 
-    memcpy(chunk->data, data, len);
+    if (buffer) {
+        chunk->buffer = gputop_buffer_ref(buffer);
+        chunk->data = data;
+    } else {
+        chunk->buffer = NULL;
+        chunk->data = (const uint8_t *) (chunk + 1);
+        memcpy(chunk + 1, data, len);
+    }
     chunk->length = len;
+    chunk->slab = slab;
 
     chunk->refcount = 1;
     list_addtail(&chunk->link, &ctx->i915_perf_chunks);
 
+    ctx->i915_perf_chunk_stats.bytes_live += len;
+    ctx->i915_perf_chunk_stats.bytes_high_water =
+        MAX2(ctx->i915_perf_chunk_stats.bytes_high_water,
+             ctx->i915_perf_chunk_stats.bytes_live);
+
     return chunk;
 }
 
@@ -235,6 +347,30 @@ i915_perf_timestamp(struct gputop_client_context *ctx,
     return ts;
 }
 
+/* OA timestamp of a report extended to 64bits, counting the wrap-arounds
+ * of the 32bit GT timestamp since the stream was opened. Reports are
+ * assumed to be less than half a wrap-around away from the most recent
+ * one, so slightly older reports are extended into the right epoch.
+ */
+static uint64_t
+i915_perf_gt_timestamp(struct gputop_client_context *ctx,
+                       const struct drm_i915_perf_record_header *header)
+{
+    uint32_t ts = gputop_i915_perf_record_timestamp(&ctx->i915_perf_config, header);
+
+    if (!ctx->has_gt_timestamp) {
+        ctx->last_gt_timestamp = ts;
+        ctx->has_gt_timestamp = true;
+        return ts;
+    }
+
+    int32_t delta = ts - (uint32_t) ctx->last_gt_timestamp;
+    uint64_t gt_ts = ctx->last_gt_timestamp + delta;
+    ctx->last_gt_timestamp = MAX2(ctx->last_gt_timestamp, gt_ts);
+
+    return gt_ts;
+}
+
 /**/
 
 static void
@@ -243,6 +379,13 @@ open_stream(struct gputop_stream *stream,
             Gputop__OpenStream *pb_open_stream)
 {
     stream->id = pb_open_stream->id = ctx->stream_id++;
+    stream->fill = 0;
+    stream->ring_overruns = 0;
+    stream->ring_lost_bytes = 0;
+    stream->wakeups_per_sec = 0;
+    stream->bytes_per_wakeup = 0;
+    stream->reads_per_sec = 0;
+    stream->bytes_per_read = 0;
     list_add(&stream->link, &ctx->streams);
 
     Gputop__Request request = GPUTOP__REQUEST__INIT;
@@ -301,7 +444,6 @@ gputop_client_context_add_tracepoint(struct gputop_client_context *ctx, const ch
     tp->hw_id_field = tp->process_field = -1;
     tp->idx = list_length(&ctx->perf_tracepoints);
     list_inithead(&tp->streams);
-    list_inithead(&tp->data);
 
     snprintf(tp->name, sizeof(tp->name), "%s", name);
     generate_uuid(ctx, tp->uuid, sizeof(tp->uuid), tp);
@@ -338,58 +480,240 @@ gputop_client_context_print_tracepoint_data(struct gputop_client_context *ctx,
     buf += l;
     len -= l;
 
-    for (int f = 0; f < tp->n_fields; f++) {
-        const char *name = tp->fields[f].name;
+    for (int f = 0; f < tp->n_fields && len > 1; f++) {
+        const struct gputop_perf_tracepoint_field *field = &tp->fields[f];
 
-        if (!strcmp("common_type", name) ||
-            !strcmp("common_flags", name) ||
-            !strcmp("common_preempt_count", name))
+        if (!field->print)
             continue;
 
-        void *value_ptr = &data->data.data[tp->fields[f].offset];
-        l = 0;
-        if (!strcmp("common_pid", name)) {
-            uint32_t pid = *((uint32_t *) value_ptr);
-            struct hash_entry *entry =
-                _mesa_hash_table_search(ctx->pid_to_process_table, uint_key(pid));
-            l = snprintf(buf, len, "\npid = %u(%s)", pid,
-                         entry ? ((struct gputop_process_info *)entry->data)->cmd : "<unknown>");
-        } else {
-            switch (tp->fields[f].size) {
-            case 1:
-                if (tp->fields[f].is_signed)
-                    l = snprintf(buf, len, "\n%s = %hhd", name, *((int8_t *) value_ptr));
-                else
-                    l = snprintf(buf, len, "\n%s = %hhu", name, *((uint8_t *) value_ptr));
-                break;
-            case 2:
-                if (tp->fields[f].is_signed)
-                    l = snprintf(buf, len, "\n%s = %hd", name, *((int16_t *) value_ptr));
-                else
-                    l = snprintf(buf, len, "\n%s = %hu", name, *((uint16_t *) value_ptr));
-                break;
-            case 4:
-                if (tp->fields[f].is_signed)
-                    l = snprintf(buf, len, "\n%s = %d", name, *((int32_t *) value_ptr));
-                else
-                    l = snprintf(buf, len, "\n%s = %u", name, *((uint32_t *) value_ptr));
-                break;
-            case 8:
-                if (tp->fields[f].is_signed)
-                    l = snprintf(buf, len, "\n%s = %" PRIi64, name, *((int64_t *) value_ptr));
-                else
-                    l = snprintf(buf, len, "\n%s = %" PRIu64, name, *((uint64_t *) value_ptr));
-                break;
-            }
-        }
-
+        l = field->print(ctx, field, &data->data, buf, len);
         if (l > 0) {
+            l = MIN2((size_t) l, len - 1);
             buf += l;
             len -= l;
         }
     }
 }
 
+/* Field formatting functions, one is picked for each field of a
+ * tracepoint when its format is parsed.
+ */
+
+/* Most fields are integers, snprintf() would dominate their formatting. */
+static int
+print_tracepoint_integer(const struct gputop_perf_tracepoint_field *field,
+                         uint64_t value, bool negative,
+                         char *buf, size_t len)
+{
+    char digits[21];
+    int n_digits = 0;
+
+    do {
+        digits[sizeof(digits) - ++n_digits] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    if (negative)
+        digits[sizeof(digits) - ++n_digits] = '-';
+
+    const char *number = &digits[sizeof(digits) - n_digits];
+    int l = field->label_len + n_digits;
+    if ((size_t) l >= len)
+        return snprintf(buf, len, "%s%.*s", field->label, n_digits, number);
+
+    memcpy(buf, field->label, field->label_len);
+    memcpy(buf + field->label_len, number, n_digits);
+    buf[l] = '\0';
+
+    return l;
+}
+
+#define TRACEPOINT_UINT_PRINTER(_name, _type)                           \
+    static int                                                          \
+    print_tracepoint_##_name(struct gputop_client_context *ctx,        \
+                             const struct gputop_perf_tracepoint_field *field, \
+                             const struct gputop_perf_data_tracepoint *point, \
+                             char *buf, size_t len)                     \
+    {                                                                   \
+        _type value = *((const _type *) &point->data[field->offset]);   \
+        return print_tracepoint_integer(field, value, false, buf, len); \
+    }
+
+#define TRACEPOINT_SINT_PRINTER(_name, _type)                           \
+    static int                                                          \
+    print_tracepoint_##_name(struct gputop_client_context *ctx,        \
+                             const struct gputop_perf_tracepoint_field *field, \
+                             const struct gputop_perf_data_tracepoint *point, \
+                             char *buf, size_t len)                     \
+    {                                                                   \
+        _type value = *((const _type *) &point->data[field->offset]);   \
+        return print_tracepoint_integer(field,                          \
+                                        value < 0 ? 0 - (uint64_t) value : value, \
+                                        value < 0, buf, len);           \
+    }
+
+TRACEPOINT_UINT_PRINTER(u8, uint8_t)
+TRACEPOINT_SINT_PRINTER(s8, int8_t)
+TRACEPOINT_UINT_PRINTER(u16, uint16_t)
+TRACEPOINT_SINT_PRINTER(s16, int16_t)
+TRACEPOINT_UINT_PRINTER(u32, uint32_t)
+TRACEPOINT_SINT_PRINTER(s32, int32_t)
+TRACEPOINT_UINT_PRINTER(u64, uint64_t)
+TRACEPOINT_SINT_PRINTER(s64, int64_t)
+
+static int
+print_tracepoint_pid(struct gputop_client_context *ctx,
+                     const struct gputop_perf_tracepoint_field *field,
+                     const struct gputop_perf_data_tracepoint *point,
+                     char *buf, size_t len)
+{
+    uint32_t pid = *((const uint32_t *) &point->data[field->offset]);
+    struct gputop_process_info *process = (struct gputop_process_info *)
+        gputop_u32_map_search(&ctx->pid_to_process_map, pid);
+    int l = print_tracepoint_integer(field, pid, false, buf, len);
+
+    if ((size_t) l < len)
+        l += snprintf(buf + l, len - l, "(%s)", process ? process->cmd : "<unknown>");
+
+    return l;
+}
+
+static int
+print_tracepoint_bytes(const char *name, const uint8_t *data, uint32_t length,
+                       char *buf, size_t len)
+{
+    const uint32_t max_bytes = 16;
+    int l = snprintf(buf, len, "\n%s =", name);
+
+    for (uint32_t i = 0; i < MIN2(length, max_bytes) && (size_t) l < len; i++)
+        l += snprintf(buf + l, len - l, " %02x", data[i]);
+    if (length > max_bytes && (size_t) l < len)
+        l += snprintf(buf + l, len - l, " ...");
+
+    return l;
+}
+
+static int
+print_tracepoint_array(struct gputop_client_context *ctx,
+                       const struct gputop_perf_tracepoint_field *field,
+                       const struct gputop_perf_data_tracepoint *point,
+                       char *buf, size_t len)
+{
+    return print_tracepoint_bytes(field->name, &point->data[field->offset],
+                                  field->size, buf, len);
+}
+
+static int
+print_tracepoint_string(struct gputop_client_context *ctx,
+                        const struct gputop_perf_tracepoint_field *field,
+                        const struct gputop_perf_data_tracepoint *point,
+                        char *buf, size_t len)
+{
+    return snprintf(buf, len, "\n%s = %.*s", field->name, field->size,
+                    (const char *) &point->data[field->offset]);
+}
+
+/* __data_loc fields hold the offset (low 16 bits) and length (high 16
+ * bits) of their content within the record's raw data.
+ */
+static const uint8_t *
+tracepoint_data_loc(const struct gputop_perf_tracepoint_field *field,
+                    const struct gputop_perf_data_tracepoint *point,
+                    uint32_t *length)
+{
+    uint32_t loc = *((const uint32_t *) &point->data[field->offset]);
+    uint32_t offset = loc & 0xffff;
+
+    *length = loc >> 16;
+    if ((offset + *length) > point->data_size)
+        return NULL;
+
+    return &point->data[offset];
+}
+
+static int
+print_tracepoint_data_loc_array(struct gputop_client_context *ctx,
+                                const struct gputop_perf_tracepoint_field *field,
+                                const struct gputop_perf_data_tracepoint *point,
+                                char *buf, size_t len)
+{
+    uint32_t length;
+    const uint8_t *data = tracepoint_data_loc(field, point, &length);
+
+    if (!data)
+        return snprintf(buf, len, "\n%s = <invalid>", field->name);
+
+    return print_tracepoint_bytes(field->name, data, length, buf, len);
+}
+
+static int
+print_tracepoint_data_loc_string(struct gputop_client_context *ctx,
+                                 const struct gputop_perf_tracepoint_field *field,
+                                 const struct gputop_perf_data_tracepoint *point,
+                                 char *buf, size_t len)
+{
+    uint32_t length;
+    const uint8_t *data = tracepoint_data_loc(field, point, &length);
+
+    if (!data)
+        return snprintf(buf, len, "\n%s = <invalid>", field->name);
+
+    return snprintf(buf, len, "\n%s = %.*s", field->name, length, (const char *) data);
+}
+
+/* Picks the formatting function of a field from its declaration, for
+ * example "unsigned int hw_id", "char comm[16]" or "__data_loc char[] name".
+ */
+static void
+compile_tracepoint_field(struct gputop_perf_tracepoint_field *field,
+                         const char *declaration)
+{
+    const char *name = strrchr(declaration, ' ');
+    name = name ? (name + 1) : declaration;
+
+    snprintf(field->name, sizeof(field->name), "%s", name);
+    char *subscript = strchr(field->name, '[');
+    bool is_array = subscript != NULL;
+    if (subscript)
+        *subscript = '\0';
+    field->label_len = snprintf(field->label, sizeof(field->label), "\n%s = ",
+                                !strcmp(field->name, "common_pid") ? "pid" : field->name);
+
+    bool is_data_loc = !strncmp(declaration, "__data_loc", strlen("__data_loc"));
+    const char *type_char = strstr(declaration, "char");
+    bool is_char = type_char && type_char < name;
+
+    if (!strcmp(field->name, "common_type") ||
+        !strcmp(field->name, "common_flags") ||
+        !strcmp(field->name, "common_preempt_count")) {
+        field->print = NULL;
+    } else if (!strcmp(field->name, "common_pid")) {
+        field->print = print_tracepoint_pid;
+    } else if (is_data_loc) {
+        field->print = is_char ?
+            print_tracepoint_data_loc_string : print_tracepoint_data_loc_array;
+    } else if (is_array) {
+        field->print = is_char ? print_tracepoint_string : print_tracepoint_array;
+    } else {
+        switch (field->size) {
+        case 1:
+            field->print = field->is_signed ? print_tracepoint_s8 : print_tracepoint_u8;
+            break;
+        case 2:
+            field->print = field->is_signed ? print_tracepoint_s16 : print_tracepoint_u16;
+            break;
+        case 4:
+            field->print = field->is_signed ? print_tracepoint_s32 : print_tracepoint_u32;
+            break;
+        case 8:
+            field->print = field->is_signed ? print_tracepoint_s64 : print_tracepoint_u64;
+            break;
+        default:
+            field->print = print_tracepoint_array;
+            break;
+        }
+    }
+}
+
 union value {
     char *string;
     int integer;
@@ -400,8 +724,29 @@ struct parser_ctx {
     char *buffer;
     size_t len;
     int pos;
+
+    /* Field being parsed. */
+    struct gputop_perf_tracepoint_field field;
+    char *declaration;
 };
 
+static void
+add_tracepoint_field(struct parser_ctx *ctx)
+{
+    struct gputop_perf_tracepoint *tp = ctx->tp;
+
+    if (ctx->declaration) {
+        tp->fields = (struct gputop_perf_tracepoint_field *)
+            realloc(tp->fields, (tp->n_fields + 1) * sizeof(tp->fields[0]));
+        compile_tracepoint_field(&ctx->field, ctx->declaration);
+        tp->fields[tp->n_fields++] = ctx->field;
+    }
+
+    free(ctx->declaration);
+    ctx->declaration = NULL;
+    memset(&ctx->field, 0, sizeof(ctx->field));
+}
+
 #define YY_CTX_LOCAL
 #define YY_CTX_MEMBERS struct parser_ctx ctx;
 #define YYSTYPE union value
@@ -447,70 +792,110 @@ update_tracepoint(struct gputop_perf_tracepoint *tp,
         }
     } else
         tp->n_fields = 0;
+    free(ctx.ctx.declaration);
     yyrelease(&ctx);
 }
 
+/* Tracepoint records are appended to a buffer per tracepoint and CPU, in
+ * which perf delivers them already ordered by time. They are only merged
+ * into the global view of all records sorted by time once that view is
+ * looked at (or once too many records are pending), with a k-way merge of
+ * the buffers' new records.
+ */
+#define TRACEPOINT_BLOCK_SIZE (16 * 1024)
+#define TRACEPOINTS_MAX_PENDING 4096
+
+struct gputop_perf_tracepoint_block {
+    struct list_head link;
+
+    uint32_t size;
+    uint32_t used;
+    uint64_t last_time;
+
+    uint8_t data[] __attribute__((aligned(8)));
+};
+
+static struct gputop_perf_tracepoint_buffer *
+get_tracepoint_buffer(struct gputop_perf_tracepoint *tp, int cpu)
+{
+    if (cpu >= tp->n_buffers) {
+        tp->buffers = (struct gputop_perf_tracepoint_buffer **)
+            realloc(tp->buffers, (cpu + 1) * sizeof(tp->buffers[0]));
+        for (int i = tp->n_buffers; i <= cpu; i++)
+            tp->buffers[i] = NULL;
+        tp->n_buffers = cpu + 1;
+    }
+
+    if (!tp->buffers[cpu]) {
+        struct gputop_perf_tracepoint_buffer *buffer =
+            (struct gputop_perf_tracepoint_buffer *) calloc(1, sizeof(*buffer));
+        list_inithead(&buffer->blocks);
+        tp->buffers[cpu] = buffer;
+    }
+
+    return tp->buffers[cpu];
+}
+
+static void
+free_tracepoint_buffers(struct gputop_perf_tracepoint *tp)
+{
+    for (int i = 0; i < tp->n_buffers; i++) {
+        if (!tp->buffers[i])
+            continue;
+        list_for_each_entry_safe(struct gputop_perf_tracepoint_block, block,
+                                 &tp->buffers[i]->blocks, link)
+            free(block);
+        free(tp->buffers[i]);
+    }
+    free(tp->buffers);
+    tp->buffers = NULL;
+    tp->n_buffers = 0;
+}
+
 static void
 add_tracepoint_stream_data(struct gputop_client_context *ctx,
                            struct gputop_perf_tracepoint_stream *stream,
                            const uint8_t *data, size_t len)
 {
     struct gputop_perf_tracepoint *tp = stream->tp;
+    struct gputop_perf_tracepoint_buffer *buffer =
+        get_tracepoint_buffer(tp, stream->cpu);
+    uint32_t size = ALIGN_POT(sizeof(struct gputop_perf_tracepoint_data) -
+                              sizeof(struct gputop_perf_data_tracepoint) + len, 8);
+    struct gputop_perf_tracepoint_block *block = list_empty(&buffer->blocks) ? NULL :
+        list_last_entry(&buffer->blocks, struct gputop_perf_tracepoint_block, link);
+
+    if (!block || (block->size - block->used) < size) {
+        uint32_t block_size = MAX2(size, TRACEPOINT_BLOCK_SIZE);
+        block = (struct gputop_perf_tracepoint_block *) malloc(sizeof(*block) + block_size);
+        block->size = block_size;
+        block->used = 0;
+        list_addtail(&block->link, &buffer->blocks);
+    }
+
     struct gputop_perf_tracepoint_data *tp_data =
-        (struct gputop_perf_tracepoint_data *) malloc(sizeof(*tp_data) - sizeof(tp_data->data) + len);
+        (struct gputop_perf_tracepoint_data *) (block->data + block->used);
+    block->used += size;
     tp_data->tp = tp;
     tp_data->cpu = stream->cpu;
+    tp_data->size = size;
     memcpy(&tp_data->data, data, len);
+    block->last_time = tp_data->data.time;
 
-    /* Reunify the per cpu data into one global stream of tracepoints sorted
-     * by time. */
-    struct gputop_perf_tracepoint_data *tp_end_data =
-        list_empty(&ctx->perf_tracepoints_data) ?
-        NULL : list_last_entry(&ctx->perf_tracepoints_data,
-                               struct gputop_perf_tracepoint_data, link);
-    while (tp_end_data && tp_end_data->data.time > tp_data->data.time) {
-        tp_end_data = (tp_end_data->link.prev == &ctx->perf_tracepoints_data) ? NULL :
-            LIST_ENTRY(struct gputop_perf_tracepoint_data, tp_end_data->link.prev, link);
-    }
-    list_add(&tp_data->link, tp_end_data ? &tp_end_data->link : &ctx->perf_tracepoints_data);
-
-    /* Also reunify the per cpu data into the stream of tracepoints sorted by
-     * time. */
-    tp_end_data = list_empty(&tp->data) ?
-        NULL : list_last_entry(&tp->data, struct gputop_perf_tracepoint_data, tp_link);
-    while (tp_end_data && tp_end_data->data.time > tp_data->data.time) {
-        tp_end_data = (tp_end_data->tp_link.prev == &tp->data) ? NULL :
-            LIST_ENTRY(struct gputop_perf_tracepoint_data, tp_end_data->tp_link.prev, tp_link);
-    }
-    list_add(&tp_data->tp_link, tp_end_data ? &tp_end_data->tp_link : &tp->data);
-
-    /* Remove tracepoints outside the sampling window. */
-    const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
-    struct gputop_perf_tracepoint_data *tp_start_data =
-        list_first_entry(&ctx->perf_tracepoints_data, struct gputop_perf_tracepoint_data, link);
-    tp_end_data =
-        list_last_entry(&ctx->perf_tracepoints_data, struct gputop_perf_tracepoint_data, link);
-
-    while ((tp_end_data->data.time - tp_start_data->data.time) > max_length) {
-        list_del(&tp_start_data->link);
-        list_del(&tp_start_data->tp_link);
-        free(tp_start_data);
-        tp_start_data = list_first_entry(&ctx->perf_tracepoints_data,
-                                         struct gputop_perf_tracepoint_data, link);
-    }
+    ctx->n_perf_tracepoints_pending++;
 
     if (tp->process_field >= 0) {
         uint32_t pid = *((uint32_t *)&tp_data->data.data[tp->fields[tp->process_field].offset]);
         struct gputop_process_info *process = get_process_info(ctx, pid);
 
-        if (process && tp->hw_id_field >= 0) {
-            uint32_t hw_id = *((uint32_t *)&tp_data->data.data[tp->fields[tp->hw_id_field].offset]);
-            _mesa_hash_table_insert(ctx->hw_id_to_process_table, uint_key(hw_id), process);
+        uint32_t hw_id = tp->hw_id_field < 0 ? GPUTOP_OA_INVALID_CTX_ID :
+            *((uint32_t *)&tp_data->data.data[tp->fields[tp->hw_id_field].offset]);
+        if (process && hw_id < GPUTOP_U32_MAP_DELETED_KEY) {
+            gputop_u32_map_insert(&ctx->hw_id_to_process_map, hw_id, process);
 
-            struct hash_entry *entry =
-                _mesa_hash_table_search(ctx->hw_contexts_table, uint_key(hw_id));
-            if (entry) {
-                struct gputop_hw_context *context = (struct gputop_hw_context *) entry->data;
+            struct gputop_hw_context *context = (struct gputop_hw_context *)
+                gputop_u32_map_search(&ctx->hw_contexts_map, hw_id);
+            if (context) {
                 if (context->process != process) {
                     context->process = process;
                     if (process->cmd_line[0] != '\0')
@@ -544,8 +929,8 @@ open_perf_tracepoint(struct gputop_client_context *ctx, struct gputop_perf_trace
     pb_tp_config.id = tp->event_id;
 
     Gputop__OpenStream pb_stream = GPUTOP__OPEN_STREAM__INIT;
-    pb_stream.overwrite = false;
-    pb_stream.live_updates = true;
+    pb_stream.overwrite = ctx->flight_recorder;
+    pb_stream.live_updates = !ctx->flight_recorder;
     pb_stream.type_case = GPUTOP__OPEN_STREAM__TYPE_TRACEPOINT;
     pb_stream.tracepoint = &pb_tp_config;
 
@@ -564,13 +949,225 @@ open_perf_tracepoint(struct gputop_client_context *ctx, struct gputop_perf_trace
     }
 }
 
+struct tracepoint_merge_cursor {
+    struct gputop_perf_tracepoint_buffer *buffer;
+    struct gputop_perf_tracepoint_block *block;
+    uint32_t offset;
+};
+
+static inline struct gputop_perf_tracepoint_data *
+tracepoint_cursor_data(const struct tracepoint_merge_cursor *cursor)
+{
+    return (struct gputop_perf_tracepoint_data *) (cursor->block->data + cursor->offset);
+}
+
+/* Steps over exhausted blocks. Returns false once the end of the buffer
+ * is reached, recording where the next merge has to resume.
+ */
+static bool
+tracepoint_cursor_settle(struct tracepoint_merge_cursor *cursor)
+{
+    while (cursor->offset >= cursor->block->used) {
+        if (cursor->block->link.next == &cursor->buffer->blocks) {
+            cursor->buffer->merge_block = cursor->block;
+            cursor->buffer->merge_offset = cursor->offset;
+            return false;
+        }
+        cursor->block = LIST_ENTRY(struct gputop_perf_tracepoint_block,
+                                   cursor->block->link.next, link);
+        cursor->offset = 0;
+    }
+
+    return true;
+}
+
+static void
+tracepoint_heap_sift_down(struct tracepoint_merge_cursor *heap, int n_heap, int i)
+{
+    while (true) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+
+        if (l < n_heap &&
+            tracepoint_cursor_data(&heap[l])->data.time <
+            tracepoint_cursor_data(&heap[min])->data.time)
+            min = l;
+        if (r < n_heap &&
+            tracepoint_cursor_data(&heap[r])->data.time <
+            tracepoint_cursor_data(&heap[min])->data.time)
+            min = r;
+        if (min == i)
+            return;
+
+        struct tracepoint_merge_cursor tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+static void
+reserve_perf_tracepoints_data(struct gputop_client_context *ctx, uint32_t n)
+{
+    uint32_t len = ctx->n_perf_tracepoints_data;
+
+    if ((ctx->perf_tracepoints_data_first + len + n) <= ctx->perf_tracepoints_data_size)
+        return;
+
+    memmove(ctx->perf_tracepoints_data,
+            ctx->perf_tracepoints_data + ctx->perf_tracepoints_data_first,
+            len * sizeof(ctx->perf_tracepoints_data[0]));
+    ctx->perf_tracepoints_data_first = 0;
+
+    /* Keep enough headroom for the trimmed prefix to be compacted away
+     * only once in a while.
+     */
+    if ((len + n) > ctx->perf_tracepoints_data_size / 2) {
+        ctx->perf_tracepoints_data_size = MAX2(2 * (len + n), 1024);
+        ctx->perf_tracepoints_data = (struct gputop_perf_tracepoint_data **)
+            realloc(ctx->perf_tracepoints_data,
+                    ctx->perf_tracepoints_data_size * sizeof(ctx->perf_tracepoints_data[0]));
+    }
+}
+
+/* Drops the records outside the visible timeline and the blocks only
+ * holding such records. Every buffer must be fully merged.
+ */
+static void
+trim_perf_tracepoints_data(struct gputop_client_context *ctx)
+{
+    if (ctx->n_perf_tracepoints_data == 0)
+        return;
+
+    const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
+    uint64_t end_time = gputop_client_context_tracepoint_data(
+        ctx, ctx->n_perf_tracepoints_data - 1)->data.time;
+    if (end_time <= max_length)
+        return;
+    uint64_t cutoff = end_time - max_length;
+
+    while (gputop_client_context_tracepoint_data(ctx, 0)->data.time < cutoff) {
+        ctx->perf_tracepoints_data_first++;
+        ctx->n_perf_tracepoints_data--;
+    }
+
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
+        for (int i = 0; i < tp->n_buffers; i++) {
+            struct gputop_perf_tracepoint_buffer *buffer = tp->buffers[i];
+            if (!buffer)
+                continue;
+
+            list_for_each_entry_safe(struct gputop_perf_tracepoint_block, block,
+                                     &buffer->blocks, link) {
+                if (block->last_time >= cutoff)
+                    break;
+                if (block == buffer->merge_block) {
+                    buffer->merge_block = NULL;
+                    buffer->merge_offset = 0;
+                }
+                list_del(&block->link);
+                free(block);
+            }
+        }
+    }
+}
+
+uint32_t
+gputop_client_context_merge_tracepoints_data(struct gputop_client_context *ctx)
+{
+    uint32_t n_pending = ctx->n_perf_tracepoints_pending;
+
+    if (n_pending == 0)
+        return ctx->n_perf_tracepoints_data;
+
+    int n_heap = 0, max_heap = 0;
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link)
+        max_heap += tp->n_buffers;
+
+    struct tracepoint_merge_cursor *heap = (struct tracepoint_merge_cursor *)
+        malloc(max_heap * sizeof(heap[0]));
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
+        for (int i = 0; i < tp->n_buffers; i++) {
+            struct gputop_perf_tracepoint_buffer *buffer = tp->buffers[i];
+            if (!buffer || list_empty(&buffer->blocks))
+                continue;
+
+            struct tracepoint_merge_cursor *cursor = &heap[n_heap];
+            cursor->buffer = buffer;
+            if (buffer->merge_block) {
+                cursor->block = buffer->merge_block;
+                cursor->offset = buffer->merge_offset;
+            } else {
+                cursor->block = list_first_entry(&buffer->blocks,
+                                                 struct gputop_perf_tracepoint_block, link);
+                cursor->offset = 0;
+            }
+            if (tracepoint_cursor_settle(cursor))
+                n_heap++;
+        }
+    }
+    for (int i = n_heap / 2 - 1; i >= 0; i--)
+        tracepoint_heap_sift_down(heap, n_heap, i);
+
+    struct gputop_perf_tracepoint_data **pending =
+        (struct gputop_perf_tracepoint_data **) malloc(n_pending * sizeof(pending[0]));
+    uint32_t n_merged = 0;
+    while (n_heap > 0) {
+        struct gputop_perf_tracepoint_data *tp_data = tracepoint_cursor_data(&heap[0]);
+
+        pending[n_merged++] = tp_data;
+        heap[0].offset += tp_data->size;
+        if (!tracepoint_cursor_settle(&heap[0]))
+            heap[0] = heap[--n_heap];
+        tracepoint_heap_sift_down(heap, n_heap, 0);
+    }
+    assert(n_merged == n_pending);
+    free(heap);
+
+    /* New records mostly land after the ones already merged, only the
+     * overlapping tail of the view has to be merged with them.
+     */
+    reserve_perf_tracepoints_data(ctx, n_pending);
+    struct gputop_perf_tracepoint_data **view =
+        ctx->perf_tracepoints_data + ctx->perf_tracepoints_data_first;
+    int64_t i = (int64_t) ctx->n_perf_tracepoints_data - 1;
+    int64_t j = (int64_t) n_pending - 1;
+    int64_t k = i + n_pending;
+    while (j >= 0) {
+        if (i >= 0 && view[i]->data.time > pending[j]->data.time)
+            view[k--] = view[i--];
+        else
+            view[k--] = pending[j--];
+    }
+    free(pending);
+
+    ctx->n_perf_tracepoints_data += n_pending;
+    ctx->n_perf_tracepoints_pending = 0;
+
+    trim_perf_tracepoints_data(ctx);
+
+    return ctx->n_perf_tracepoints_data;
+}
+
 void
 gputop_client_context_remove_tracepoint(struct gputop_client_context *ctx,
                                         struct gputop_perf_tracepoint *tp)
 {
     close_perf_tracepoint(ctx, tp);
+
+    gputop_client_context_merge_tracepoints_data(ctx);
+    uint32_t n_data = 0;
+    for (uint32_t i = 0; i < ctx->n_perf_tracepoints_data; i++) {
+        struct gputop_perf_tracepoint_data *tp_data =
+            gputop_client_context_tracepoint_data(ctx, i);
+        if (tp_data->tp != tp)
+            ctx->perf_tracepoints_data[ctx->perf_tracepoints_data_first + n_data++] = tp_data;
+    }
+    ctx->n_perf_tracepoints_data = n_data;
+    free_tracepoint_buffers(tp);
+
     if (tp->format)
         free(tp->format);
+    free(tp->fields);
     list_del(&tp->link);
     free(tp);
 
@@ -584,39 +1181,180 @@ gputop_client_context_remove_tracepoint(struct gputop_client_context *ctx,
 double
 gputop_client_context_calc_busyness(struct gputop_client_context *ctx)
 {
-    double total = 0.0f;
+    return ctx->busyness;
+}
+
+/**/
+
+uint32_t
+gputop_samples_ring_push(struct gputop_samples_ring *ring,
+                         struct gputop_accumulated_samples *samples)
+{
+    if (!ring->samples || ring->len > ring->mask) {
+        uint32_t size = ring->samples ? 2 * (ring->mask + 1) : 64;
+        struct gputop_accumulated_samples **new_samples =
+            (struct gputop_accumulated_samples **) malloc(size * sizeof(new_samples[0]));
+        double *new_columns = ring->n_columns ?
+            (double *) malloc(size * ring->n_columns * sizeof(new_columns[0])) : NULL;
+
+        for (uint32_t i = 0; i < ring->len; i++) {
+            new_samples[i] = gputop_samples_ring_get(ring, i);
+            for (uint32_t c = 0; c < ring->n_columns; c++)
+                new_columns[c * size + i] = gputop_samples_ring_value(ring, c, i);
+        }
+
+        free(ring->samples);
+        free(ring->columns);
+        ring->samples = new_samples;
+        ring->columns = new_columns;
+        ring->mask = size - 1;
+        ring->first = 0;
+    }
+
+    uint32_t slot = (ring->first + ring->len++) & ring->mask;
+    ring->samples[slot] = samples;
+
+    return slot;
+}
+
+struct gputop_accumulated_samples *
+gputop_samples_ring_shift(struct gputop_samples_ring *ring)
+{
+    if (!ring->len)
+        return NULL;
+
+    struct gputop_accumulated_samples *samples = ring->samples[ring->first];
+    ring->first = (ring->first + 1) & ring->mask;
+    ring->len--;
 
-    list_for_each_entry(struct gputop_hw_context, context, &ctx->hw_contexts, link)
-        total += context->usage_percent;
+    return samples;
+}
 
-    return total;
+void
+gputop_samples_ring_fini(struct gputop_samples_ring *ring)
+{
+    free(ring->samples);
+    free(ring->columns);
+    memset(ring, 0, sizeof(*ring));
+}
+
+void
+gputop_samples_ring_set_columns(struct gputop_samples_ring *ring,
+                                uint32_t n_columns)
+{
+    free(ring->columns);
+    ring->columns = NULL;
+    ring->n_columns = n_columns;
+
+    if (ring->samples && n_columns) {
+        ring->columns = (double *) calloc((ring->mask + 1) * n_columns,
+                                          sizeof(ring->columns[0]));
+    }
+}
+
+uint32_t
+gputop_samples_ring_search(const struct gputop_samples_ring *ring,
+                           uint64_t timestamp)
+{
+    uint32_t low = 0, high = ring->len;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (gputop_samples_ring_get(ring, mid)->timestamp_end < timestamp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+uint32_t
+gputop_samples_ring_search_gt(const struct gputop_samples_ring *ring,
+                              uint64_t gt_timestamp)
+{
+    uint32_t low = 0, high = ring->len;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (gputop_samples_ring_get(ring, mid)->gt_timestamp_end < gt_timestamp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/* The samples of a context being contiguous in time, the time in a range
+ * is the difference of the running sums of the samples at its ends, minus
+ * the parts of these samples outside the range.
+ */
+uint64_t
+gputop_hw_context_time_spent(const struct gputop_hw_context *context,
+                             uint64_t start, uint64_t end)
+{
+    const struct gputop_samples_ring *timelines = &context->timelines;
+    uint32_t first = gputop_samples_ring_search(timelines, start);
+    uint32_t last = gputop_samples_ring_search(timelines, end);
+
+    if (last < gputop_samples_ring_length(timelines) &&
+        gputop_samples_ring_get(timelines, last)->timestamp_start < end)
+        last++;
+    if (first >= last)
+        return 0;
+
+    const struct gputop_accumulated_samples *first_samples =
+        gputop_samples_ring_get(timelines, first);
+    const struct gputop_accumulated_samples *last_samples =
+        gputop_samples_ring_get(timelines, last - 1);
+    uint64_t time = last_samples->context_time - first_samples->context_time +
+        (first_samples->timestamp_end - first_samples->timestamp_start);
+
+    if (first_samples->timestamp_start < start)
+        time -= start - first_samples->timestamp_start;
+    if (last_samples->timestamp_end > end)
+        time -= last_samples->timestamp_end - end;
+
+    return time;
+}
+
+uint64_t
+gputop_client_context_extend_gt_timestamp(struct gputop_client_context *ctx,
+                                          uint32_t gt_timestamp)
+{
+    uint32_t back = (uint32_t) ctx->last_gt_timestamp - gt_timestamp;
+
+    /* Before the first report */
+    if (!ctx->has_gt_timestamp || back > ctx->last_gt_timestamp)
+        return 0ULL;
+
+    return ctx->last_gt_timestamp - back;
 }
 
 uint64_t
 gputop_client_context_convert_gt_timestamp(struct gputop_client_context *ctx,
                                            uint32_t gt_timestamp)
 {
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
-        uint32_t start_gt_ts =
-            gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->start_report.header);
-        uint32_t end_gt_ts =
-            gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->end_report.header);
+    uint64_t gt_ts = gputop_client_context_extend_gt_timestamp(ctx, gt_timestamp);
+    uint32_t idx = gputop_samples_ring_search_gt(&ctx->timelines, gt_ts);
 
-        if (end_gt_ts < gt_timestamp)
-            continue;
-        if (start_gt_ts > gt_timestamp)
-            return 0ULL;
+    if (idx >= gputop_samples_ring_length(&ctx->timelines))
+        return 0ULL;
 
-        uint32_t gt_delta = gt_timestamp - start_gt_ts;
-        uint64_t delta = gt_delta * (samples->timestamp_end - samples->timestamp_start) /
-            (end_gt_ts - start_gt_ts);
+    struct gputop_accumulated_samples *samples =
+        gputop_samples_ring_get(&ctx->timelines, idx);
+    if (samples->gt_timestamp_start > gt_ts ||
+        samples->gt_timestamp_end == samples->gt_timestamp_start)
+        return 0ULL;
 
-        return samples->timestamp_start + delta;
-    }
+    uint64_t delta = (gt_ts - samples->gt_timestamp_start) *
+        (samples->timestamp_end - samples->timestamp_start) /
+        (samples->gt_timestamp_end - samples->gt_timestamp_start);
 
-    return 0ULL;
+    return samples->timestamp_start + delta;
 }
 
 static struct gputop_accumulated_samples *
@@ -634,10 +1372,9 @@ hw_context_update_process(struct gputop_client_context *ctx,
     if (context->process)
         return;
 
-    struct hash_entry *process_entry =
-        _mesa_hash_table_search(ctx->hw_id_to_process_table, uint_key(context->hw_id));
-    if (process_entry) {
-        context->process = (struct gputop_process_info *) process_entry->data;
+    context->process = (struct gputop_process_info *)
+        gputop_u32_map_search(&ctx->hw_id_to_process_map, context->hw_id);
+    if (context->process) {
         snprintf(context->name, sizeof(context->name),
                  "%s id=%u", context->process->cmd, context->hw_id);
     }
@@ -646,12 +1383,9 @@ hw_context_update_process(struct gputop_client_context *ctx,
 static struct gputop_hw_context *
 get_hw_context(struct gputop_client_context *ctx, uint32_t hw_id)
 {
-    struct hash_entry *hw_entry =
-        _mesa_hash_table_search(ctx->hw_contexts_table, uint_key(hw_id));
-
-    struct gputop_hw_context *new_context;
-    if (hw_entry) {
-        new_context = (struct gputop_hw_context *) hw_entry->data;
+    struct gputop_hw_context *new_context = (struct gputop_hw_context *)
+        gputop_u32_map_search(&ctx->hw_contexts_map, hw_id);
+    if (new_context) {
         new_context->n_samples++;
 
         hw_context_update_process(ctx, new_context);
@@ -659,12 +1393,13 @@ get_hw_context(struct gputop_client_context *ctx, uint32_t hw_id)
         return new_context;
     }
 
-    new_context = (struct gputop_hw_context *) calloc(1, sizeof(*new_context));
+    new_context = gputop_pool_alloc_type(&ctx->hw_contexts_pool, struct gputop_hw_context);
     snprintf(new_context->name, sizeof(new_context->name), "<unknown> id=%u", hw_id);
     new_context->hw_id = hw_id;
-    new_context->timeline_row = _mesa_hash_table_num_entries(ctx->hw_contexts_table);
+    new_context->timeline_row = ctx->n_free_timeline_rows > 0 ?
+        ctx->free_timeline_rows[--ctx->n_free_timeline_rows] :
+        ctx->n_timeline_rows++;
     new_context->n_samples = 1;
-    list_inithead(&new_context->graphs);
 
     hw_context_update_process(ctx, new_context);
 
@@ -674,7 +1409,7 @@ get_hw_context(struct gputop_client_context *ctx, uint32_t hw_id)
                                ctx->current_graph_samples->start_report.header,
                                GPUTOP_OA_INVALID_CTX_ID);
 
-    _mesa_hash_table_insert(ctx->hw_contexts_table, uint_key(hw_id), new_context);
+    gputop_u32_map_insert(&ctx->hw_contexts_map, hw_id, new_context);
 
     list_addtail(&new_context->link, &ctx->hw_contexts);
 
@@ -687,24 +1422,71 @@ put_hw_context(struct gputop_client_context *ctx, struct gputop_hw_context *old_
     if (!old_context || --old_context->n_samples)
         return;
 
-    struct hash_entry *entry =
-        _mesa_hash_table_search(ctx->hw_contexts_table, uint_key(old_context->hw_id));
-    _mesa_hash_table_remove(ctx->hw_contexts_table, entry);
+    gputop_u32_map_remove(&ctx->hw_contexts_map, old_context->hw_id);
 
-    list_for_each_entry_safe(struct gputop_accumulated_samples, samples,
-                             &old_context->graphs, link) {
+    struct gputop_accumulated_samples *samples;
+    while ((samples = gputop_samples_ring_shift(&old_context->graphs)))
         put_accumulated_sample(ctx, samples);
-    }
+    gputop_samples_ring_fini(&old_context->graphs);
     if (old_context->current_graph_samples)
         put_accumulated_sample(ctx, old_context->current_graph_samples);
+    assert(gputop_samples_ring_length(&old_context->timelines) == 0);
+    gputop_samples_ring_fini(&old_context->timelines);
+
+    ctx->busyness -= old_context->usage_percent;
 
     list_del(&old_context->link);
-    free(old_context);
 
-    uint32_t i = 0;
-    list_for_each_entry(struct gputop_hw_context, context, &ctx->hw_contexts, link)
-        context->timeline_row = i++;
-    assert(i == _mesa_hash_table_num_entries(ctx->hw_contexts_table));
+    if (list_empty(&ctx->hw_contexts)) {
+        ctx->busyness = 0.0;
+        ctx->n_timeline_rows = 0;
+        ctx->n_free_timeline_rows = 0;
+    } else {
+        if (ctx->n_free_timeline_rows == ctx->free_timeline_rows_size) {
+            ctx->free_timeline_rows_size = MAX2(2 * ctx->free_timeline_rows_size, 16);
+            ctx->free_timeline_rows = (uint32_t *)
+                realloc(ctx->free_timeline_rows,
+                        ctx->free_timeline_rows_size * sizeof(ctx->free_timeline_rows[0]));
+        }
+        ctx->free_timeline_rows[ctx->n_free_timeline_rows++] = old_context->timeline_row;
+    }
+
+    gputop_pool_free(&ctx->hw_contexts_pool, old_context);
+}
+
+/* Appends closed samples to a graphs ring along with the value of each
+ * counter of the current metric set, so that plotting the series doesn't
+ * need to evaluate the counters again every frame.
+ */
+static void
+graphs_push_samples(struct gputop_client_context *ctx,
+                    struct gputop_samples_ring *graphs,
+                    struct gputop_accumulated_samples *samples)
+{
+    const struct gputop_metric_set *metric_set = ctx->metric_set;
+
+    gputop_metric_set_ensure_counters(metric_set);
+    if (graphs->n_columns != (uint32_t) metric_set->n_counters)
+        gputop_samples_ring_set_columns(graphs, metric_set->n_counters);
+
+    uint32_t slot = gputop_samples_ring_push(graphs, samples);
+    uint32_t stride = graphs->mask + 1;
+    double *column = graphs->columns + slot;
+
+    /* Both the generated and the bytecode metric sets provide read_all. */
+    assert(metric_set->read_all);
+
+    if (ctx->n_counter_values < metric_set->n_counters) {
+        ctx->n_counter_values = metric_set->n_counters;
+        ctx->counter_values = (double *)
+            realloc(ctx->counter_values,
+                    ctx->n_counter_values * sizeof(ctx->counter_values[0]));
+    }
+
+    metric_set->read_all(&ctx->devinfo, metric_set,
+                         samples->accumulator.deltas, ctx->counter_values);
+    for (int c = 0; c < metric_set->n_counters; c++)
+        column[c * stride] = ctx->counter_values[c];
 }
 
 static void
@@ -734,24 +1516,22 @@ hw_context_record_for_time(struct gputop_client_context *ctx,
                                       GPUTOP_I915_PERF_FIELD_CPU_TIMESTAMP);
     samples->timestamp_end =
         cpu_timestamp ? (*cpu_timestamp) : samples->accumulator.last_timestamp;
+    samples->gt_timestamp_end = i915_perf_gt_timestamp(ctx, header);
 
     uint64_t usage_ns =
         gputop_timebase_scale_ns(&ctx->devinfo,
                                  samples->accumulator.clock.clock_count);
-    context->usage_percent = (double) usage_ns / ctx->oa_aggregation_period_ns;
+    double usage_percent = (double) usage_ns / ctx->oa_aggregation_period_ns;
+    ctx->busyness += usage_percent - context->usage_percent;
+    context->usage_percent = usage_percent;
 
     /* Remove excess of samples */
     uint32_t max_graphs =
         (ctx->oa_visible_timeline_s * 1000000000.0f) / ctx->oa_aggregation_period_ns;
-    while (context->n_graphs > max_graphs) {
-        struct gputop_accumulated_samples *ex_samples =
-            list_first_entry(&context->graphs, struct gputop_accumulated_samples, link);
-        put_accumulated_sample(ctx, ex_samples);
-        context->n_graphs--;
-    }
+    while (gputop_samples_ring_length(&context->graphs) > max_graphs)
+        put_accumulated_sample(ctx, gputop_samples_ring_shift(&context->graphs));
 
-    list_addtail(&samples->link, &context->graphs);
-    context->n_graphs++;
+    graphs_push_samples(ctx, &context->graphs, samples);
 }
 
 static struct gputop_accumulated_samples *
@@ -785,6 +1565,7 @@ get_accumulated_sample(struct gputop_client_context *ctx,
     samples->start_report.header = header;
 
     samples->timestamp_start = i915_perf_timestamp(ctx, header);
+    samples->gt_timestamp_start = i915_perf_gt_timestamp(ctx, header);
 
     return samples;
 }
@@ -793,8 +1574,8 @@ static void
 put_accumulated_sample(struct gputop_client_context *ctx,
                        struct gputop_accumulated_samples *samples)
 {
-    put_i915_perf_chunk(samples->start_report.chunk);
-    put_i915_perf_chunk(samples->end_report.chunk);
+    put_i915_perf_chunk(ctx, samples->start_report.chunk);
+    put_i915_perf_chunk(ctx, samples->end_report.chunk);
     put_hw_context(ctx, samples->context);
     list_del(&samples->link);
     list_add(&samples->link, &ctx->free_samples);
@@ -826,39 +1607,15 @@ gputop_accumulated_samples_print(struct gputop_client_context *ctx,
                                                                           GPUTOP_I915_PERF_FIELD_OA_REPORT),
                                             (const uint8_t *) report);
 
-            switch (ctx->metric_set->perf_oa_format) {
-            case I915_OA_FORMAT_A32u40_A4u32_B8_C8:
-                fprintf(stderr, "TS=%lx %s\n", acc.deltas[0],
-                        gputop_i915_perf_record_reason(&ctx->i915_perf_config,
-                                                       &ctx->devinfo,
-                                                       iter.header));
-                fprintf(stderr, "CLK=%lx\n", acc.deltas[1]);
-
-                /* /\* 32x 40bit A counters... *\/ */
-                /* for (i = 0; i < 32; i++) */
-                /*     fprintf(stderr, "A%i=%lx\n", i, acc.deltas[i + 2]); */
-
-                /* /\* 4x 32bit A counters... *\/ */
-                /* for (i = 0; i < 4; i++) */
-                /*     fprintf(stderr, "A%i=%lx\n", i, acc.deltas[i + 2 + 32]); */
-
-                /* /\* 8x 32bit B counters + 8x 32bit C counters... *\/ */
-                /* for (i = 0; i < 16; i++) */
-                /*     fprintf(stderr, "B/C%i=%lx\n", i, acc.deltas[i + 2 + 32 + 4]); */
-                fprintf(stderr, "B/C%i=%x B/C%i=%x\n",
-                        8, report[48],
-                        9, report[49]);
-                break;
-
-            case I915_OA_FORMAT_A45_B8_C8:
-                fprintf(stderr, "TS=%lx\n", acc.deltas[0]);
-
-                /* for (i = 0; i < 61; i++) */
-                /*     fprintf(stderr, "A%i=%lx\n", i, acc.deltas[i + 1]); */
-                break;
-            default:
-                assert(0);
-            }
+            fprintf(stderr, "TS=%lx %s\n", acc.deltas[acc.format->gpu_time_offset],
+                    gputop_i915_perf_record_reason(&ctx->i915_perf_config,
+                                                   &ctx->devinfo,
+                                                   iter.header));
+            if (acc.format->gpu_clock_offset >= 0)
+                fprintf(stderr, "CLK=%lx\n", acc.deltas[acc.format->gpu_clock_offset]);
+
+            /* for (i = 0; i < acc.format->n_deltas; i++) */
+            /*     fprintf(stderr, "D%i=%lx\n", i, acc.deltas[i]); */
         }
 
         last = iter.header;
@@ -870,23 +1627,8 @@ gputop_client_context_read_counter_value(struct gputop_client_context *ctx,
                                          struct gputop_accumulated_samples *sample,
                                          const struct gputop_metric_set_counter *counter)
 {
-    switch (counter->data_type) {
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-        return counter->oa_counter_read_uint64(&ctx->devinfo,
-                                               ctx->metric_set,
-                                               sample->accumulator.deltas);
-        break;
-    case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-        return counter->oa_counter_read_float(&ctx->devinfo,
-                                              ctx->metric_set,
-                                              sample->accumulator.deltas);
-        break;
-    }
-
-    return 0.0f;
+    return gputop_metric_set_counter_read(&ctx->devinfo, counter,
+                                          sample->accumulator.deltas);
 }
 
 static void
@@ -902,19 +1644,28 @@ i915_perf_record_for_time(struct gputop_client_context *ctx,
 
     /* Put end timestamp */
     samples->timestamp_end = i915_perf_timestamp(ctx, header);
+    samples->gt_timestamp_end = i915_perf_gt_timestamp(ctx, header);
 
     /* Remove excess of samples */
     uint32_t max_graphs =
         (ctx->oa_visible_timeline_s * 1000000000.0f) / ctx->oa_aggregation_period_ns;
-    while (ctx->n_graphs > max_graphs) {
-        struct gputop_accumulated_samples *ex_samples =
-            list_first_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
-        put_accumulated_sample(ctx, ex_samples);
-        ctx->n_graphs--;
-    }
+    while (gputop_samples_ring_length(&ctx->graphs) > max_graphs)
+        put_accumulated_sample(ctx, gputop_samples_ring_shift(&ctx->graphs));
 
-    list_addtail(&samples->link, &ctx->graphs);
-    ctx->n_graphs++;
+    graphs_push_samples(ctx, &ctx->graphs, samples);
+}
+
+/* Drops the oldest timeline samples, from its context's series too. */
+static void
+timelines_shift(struct gputop_client_context *ctx)
+{
+    struct gputop_accumulated_samples *samples =
+        gputop_samples_ring_shift(&ctx->timelines);
+    struct gputop_hw_context *context = samples->context;
+
+    gputop_samples_ring_shift(&context->timelines);
+    hw_context_add_time(context, samples, false);
+    put_accumulated_sample(ctx, samples);
 }
 
 static void
@@ -930,31 +1681,82 @@ i915_perf_record_for_hw_id(struct gputop_client_context *ctx,
 
     /* Put end timestamp */
     samples->timestamp_end = i915_perf_timestamp(ctx, header);
+    samples->gt_timestamp_end = i915_perf_gt_timestamp(ctx, header);
 
     /* Remove excess of samples */
     uint64_t aggregation_period_ns = ctx->oa_visible_timeline_s * 1000000000UL;
-    struct gputop_accumulated_samples *first_samples =
-        list_first_entry(&ctx->timelines, struct gputop_accumulated_samples, link);
-    while (!list_empty(&ctx->timelines) &&
-           (samples->timestamp_end - first_samples->timestamp_start) > aggregation_period_ns) {
-        hw_context_add_time(first_samples->context, first_samples, false);
-        put_accumulated_sample(ctx, first_samples);
-        ctx->n_timelines--;
-        first_samples = list_first_entry(&ctx->timelines,
-                                         struct gputop_accumulated_samples, link);
-    }
+    struct gputop_accumulated_samples *first_samples;
+    while ((first_samples = gputop_samples_ring_first(&ctx->timelines)) &&
+           (samples->timestamp_end - first_samples->timestamp_start) > aggregation_period_ns)
+        timelines_shift(ctx);
+
+    struct gputop_hw_context *context = samples->context;
+    gputop_samples_ring_push(&ctx->timelines, samples);
+    gputop_samples_ring_push(&context->timelines, samples);
+
+    hw_context_add_time(context, samples, true);
+    context->timelines_time += samples->timestamp_end - samples->timestamp_start;
+    samples->context_time = context->timelines_time;
+}
 
-    list_addtail(&samples->link, &ctx->timelines);
-    ctx->n_timelines++;
+/* Fold as many of the sample records following header as possible into the
+ * current accumulators in one go, stopping on any record that requires
+ * i915_perf_accumulate() to close or open samples. Returns the last record
+ * folded, whose delta with the previous record is already accumulated, or
+ * NULL if nothing could be folded.
+ */
+static const struct drm_i915_perf_record_header *
+i915_perf_fold_records(struct gputop_client_context *ctx,
+                       struct gputop_i915_perf_chunk *chunk,
+                       const struct drm_i915_perf_record_header *header)
+{
+    struct gputop_cc_oa_accumulator *accumulators[3];
+    int n_accumulators = 0;
+
+    if (!ctx->current_graph_samples)
+        return NULL;
+    if (ctx->last_hw_id != GPUTOP_OA_INVALID_CTX_ID) {
+        if (!ctx->current_timeline_samples)
+            return NULL;
+
+        struct gputop_hw_context *context = ctx->current_timeline_samples->context;
+        accumulators[n_accumulators++] = &ctx->current_timeline_samples->accumulator;
+        accumulators[n_accumulators++] = &context->current_graph_samples->accumulator;
+    }
+    accumulators[n_accumulators++] = &ctx->current_graph_samples->accumulator;
+
+    uint32_t n_records =
+        ((chunk->data + chunk->length) - (const uint8_t *) header) / header->size;
+    enum gputop_cc_oa_range_split split;
+    uint32_t last =
+        gputop_cc_oa_accumulate_report_range_parallel(ctx->oa_worker_pool,
+                                                      accumulators, n_accumulators,
+                                                      &ctx->i915_perf_config,
+                                                      header, header->size, n_records,
+                                                      GPUTOP_CC_OA_RANGE_SPLIT_CTX_ID |
+                                                      GPUTOP_CC_OA_RANGE_SPLIT_PERIOD,
+                                                      &split);
+
+    /* Records in the middle of the range don't change any sample, only
+     * the running timestamp needs to follow them.
+     */
+    for (uint32_t i = 1; i < last; i++) {
+        header = (const struct drm_i915_perf_record_header *)
+            (((const uint8_t *) header) + header->size);
+        ctx->last_oa_timestamp = i915_perf_timestamp(ctx, header);
+        ctx->last_header = header;
+    }
 
-    hw_context_add_time(samples->context, samples, true);
+    return last > 0 ?
+        (const struct drm_i915_perf_record_header *)
+        (((const uint8_t *) header) + header->size) : NULL;
 }
 
 static void
 i915_perf_accumulate(struct gputop_client_context *ctx,
                      struct gputop_i915_perf_chunk *chunk)
 {
-    const struct drm_i915_perf_record_header *header;
+    const struct drm_i915_perf_record_header *header, *folded = NULL;
     const uint8_t *last = ctx->last_header ?
         ((const uint8_t *) gputop_i915_perf_record_field(&ctx->i915_perf_config,
                                                          ctx->last_header,
@@ -980,6 +1782,10 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
                 gputop_i915_perf_record_field(&ctx->i915_perf_config, header,
                                               GPUTOP_I915_PERF_FIELD_OA_REPORT);
             uint32_t hw_id = gputop_cc_oa_report_get_ctx_id(&ctx->devinfo, samples);
+            /* Whether the delta with the previous report was already
+             * accumulated by i915_perf_fold_records().
+             */
+            bool accumulated = header == folded;
 
             if (!ctx->current_graph_samples) {
                 /* Global accumulator */
@@ -1007,7 +1813,8 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
 
                     /* Accumulate for the timeline on the currently running context. */
                     accumulator = &ctx->current_timeline_samples->accumulator;
-                    if (gputop_cc_oa_accumulate_reports(accumulator, last, samples)) {
+                    if (accumulated ||
+                        gputop_cc_oa_accumulate_reports(accumulator, last, samples)) {
                         uint64_t elapsed =
                             accumulator->last_timestamp - accumulator->first_timestamp;
 
@@ -1020,13 +1827,15 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
                     /* Accumulate for the running context over the
                      * accumulation period. */
                     accumulator = &context->current_graph_samples->accumulator;
-                    gputop_cc_oa_accumulate_reports(accumulator, last, samples);
+                    if (!accumulated)
+                        gputop_cc_oa_accumulate_reports(accumulator, last, samples);
                 }
 
                 /* Accumulate globally over the accumulation period. */
                 accumulator =
                     &ctx->current_graph_samples->accumulator;
-                if (gputop_cc_oa_accumulate_reports(accumulator, last, samples)) {
+                if (accumulated ||
+                    gputop_cc_oa_accumulate_reports(accumulator, last, samples)) {
                     uint64_t elapsed =
                         accumulator->last_timestamp - accumulator->first_timestamp;
 
@@ -1048,8 +1857,22 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
             last = samples;
             ctx->last_hw_id = hw_id;
             ctx->last_header = header;
-            if (ctx->last_chunk) put_i915_perf_chunk(ctx->last_chunk);
+            if (ctx->last_chunk) put_i915_perf_chunk(ctx, ctx->last_chunk);
             ctx->last_chunk = ref_i915_perf_chunk(chunk);
+
+            /* Skip over the records that don't need any processing beyond
+             * accumulating their deltas.
+             */
+            folded = i915_perf_fold_records(ctx, chunk, header);
+            if (folded) {
+                /* Resume the loop on the last folded record, with the
+                 * record before it as the previous report.
+                 */
+                header = ctx->last_header;
+                last = (const uint8_t *)
+                    gputop_i915_perf_record_field(&ctx->i915_perf_config, header,
+                                                  GPUTOP_I915_PERF_FIELD_OA_REPORT);
+            }
             break;
         }
 
@@ -1145,6 +1968,31 @@ build_equations_variables(struct gputop_devinfo *devinfo)
 
 
     devinfo->eu_threads_count = devinfo->n_eus * topology->n_threads_per_eu;
+
+#ifndef GPUTOP_CLIENT_XML_METRICS
+    /* Precompute the terms of the counter equations only depending on the
+     * variables above.
+     */
+    gputop_oa_build_equation_constants(devinfo);
+#endif
+}
+
+/* Built without the generated metric sets, the client only loads them from
+ * the XML files */
+#ifndef GPUTOP_CLIENT_XML_METRICS
+#define GEN_METRICS(chipset) gputop_oa_get_metrics_##chipset
+#else
+#define GEN_METRICS(chipset) NULL
+#endif
+
+static struct gputop_gen *
+load_xml_metrics(const struct gputop_devinfo *devinfo,
+                 const char *xml_dir, const char *chipset)
+{
+    char filename[1024];
+
+    snprintf(filename, sizeof(filename), "%s/oa-%s.xml", xml_dir, chipset);
+    return gputop_oa_bytecode_load_gen(devinfo, filename);
 }
 
 static void
@@ -1153,30 +2001,32 @@ register_platform_metrics(struct gputop_client_context *ctx,
 {
     static const struct {
         const char *devname;
+        const char *chipset; /* of the data/oa-<chipset>.xml file */
         struct gputop_gen * (*get_metrics_cb)(const struct gputop_devinfo *devinfo);
     } devname_to_metric_func[] = {
-        { "hsw", gputop_oa_get_metrics_hsw },
-        { "bdw", gputop_oa_get_metrics_bdw },
-        { "chv", gputop_oa_get_metrics_chv },
-        { "sklgt2", gputop_oa_get_metrics_sklgt2 },
-        { "sklgt3", gputop_oa_get_metrics_sklgt3 },
-        { "sklgt4", gputop_oa_get_metrics_sklgt4 },
-        { "kblgt2", gputop_oa_get_metrics_kblgt2 },
-        { "kblgt3", gputop_oa_get_metrics_kblgt3 },
-        { "bxt", gputop_oa_get_metrics_bxt },
-        { "glk", gputop_oa_get_metrics_glk },
-        { "cflgt2", gputop_oa_get_metrics_cflgt2 },
-        { "cflgt3", gputop_oa_get_metrics_cflgt3 },
-        { "cnl", gputop_oa_get_metrics_cnl },
-        { "icl", gputop_oa_get_metrics_icl },
-        { "ehl", gputop_oa_get_metrics_lkf },
-        { "tgl", gputop_oa_get_metrics_tgl },
+        { "hsw", "hsw", GEN_METRICS(hsw) },
+        { "bdw", "bdw", GEN_METRICS(bdw) },
+        { "chv", "chv", GEN_METRICS(chv) },
+        { "sklgt2", "sklgt2", GEN_METRICS(sklgt2) },
+        { "sklgt3", "sklgt3", GEN_METRICS(sklgt3) },
+        { "sklgt4", "sklgt4", GEN_METRICS(sklgt4) },
+        { "kblgt2", "kblgt2", GEN_METRICS(kblgt2) },
+        { "kblgt3", "kblgt3", GEN_METRICS(kblgt3) },
+        { "bxt", "bxt", GEN_METRICS(bxt) },
+        { "glk", "glk", GEN_METRICS(glk) },
+        { "cflgt2", "cflgt2", GEN_METRICS(cflgt2) },
+        { "cflgt3", "cflgt3", GEN_METRICS(cflgt3) },
+        { "cnl", "cnl", GEN_METRICS(cnl) },
+        { "icl", "icl", GEN_METRICS(icl) },
+        { "ehl", "lkf", GEN_METRICS(lkf) },
+        { "tgl", "tgl", GEN_METRICS(tgl) },
     };
 
     struct gputop_devinfo *devinfo = &ctx->devinfo;
     snprintf(devinfo->devname, sizeof(devinfo->devname), "%s", pb_devinfo->devname);
     snprintf(devinfo->prettyname, sizeof(devinfo->prettyname), "%s", pb_devinfo->prettyname);
     devinfo->timestamp_frequency = pb_devinfo->timestamp_frequency;
+    gputop_devinfo_init_timebase(devinfo);
     devinfo->devid = pb_devinfo->devid;
     devinfo->gen = pb_devinfo->gen;
     devinfo->gt_min_freq = pb_devinfo->gt_min_freq;
@@ -1206,14 +2056,43 @@ register_platform_metrics(struct gputop_client_context *ctx,
 
     build_equations_variables(devinfo);
 
+    /* GPUTOP_METRICS_XML_DIR points to a directory of oa-<chipset>.xml
+     * files to load the metrics of the device from at runtime, instead of
+     * using the ones built into gputop-gens-metrics.c.
+     */
+    const char *xml_dir = getenv("GPUTOP_METRICS_XML_DIR");
+#ifdef GPUTOP_CLIENT_XML_METRICS
+    if (!xml_dir)
+        xml_dir = GPUTOP_METRICS_XML_DEFAULT_DIR;
+#endif
+
     for (uint32_t i = 0; i < ARRAY_SIZE(devname_to_metric_func); i++) {
         if (!strcmp(devinfo->devname, devname_to_metric_func[i].devname)) {
-            ctx->gen_metrics = devname_to_metric_func[i].get_metrics_cb(devinfo);
+            if (xml_dir) {
+                ctx->gen_metrics = load_xml_metrics(devinfo, xml_dir,
+                                                    devname_to_metric_func[i].chipset);
+                if (ctx->gen_metrics)
+                    return;
+            }
+#ifdef GPUTOP_CLIENT_XML_METRICS
+            /* Not installed, running from the build directory */
+            ctx->gen_metrics = load_xml_metrics(devinfo, GPUTOP_METRICS_XML_SOURCE_DIR,
+                                                devname_to_metric_func[i].chipset);
+            if (ctx->gen_metrics)
+                return;
+#endif
+            if (devname_to_metric_func[i].get_metrics_cb)
+                ctx->gen_metrics = devname_to_metric_func[i].get_metrics_cb(devinfo);
+            else
+                gputop_cr_console_log("Failed to load metrics of %s from %s",
+                                      devinfo->devname, xml_dir);
             return;
         }
     }
 }
 
+#undef GEN_METRICS
+
 /**/
 
 static void
@@ -1250,8 +2129,8 @@ open_i915_perf_stream(struct gputop_client_context *ctx)
     oa_stream.gpu_timestamps = ctx->i915_perf_config.gpu_timestamps;
 
     Gputop__OpenStream stream = GPUTOP__OPEN_STREAM__INIT;
-    stream.overwrite = false;
-    stream.live_updates = true;
+    stream.overwrite = ctx->flight_recorder;
+    stream.live_updates = !ctx->flight_recorder;
     stream.type_case = GPUTOP__OPEN_STREAM__TYPE_OA_STREAM;
     stream.oa_stream = &oa_stream;
 
@@ -1281,10 +2160,8 @@ static void
 open_perf_tracepoints_streams(struct gputop_client_context *ctx)
 {
     clear_perf_tracepoints_data(ctx);
-    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
-        assert(list_length(&tp->data) == 0);
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link)
         open_perf_tracepoint(ctx, tp);
-    }
 }
 
 static void
@@ -1384,27 +2261,74 @@ gputop_client_context_stop_sampling(struct gputop_client_context *ctx)
     if (!ctx->is_sampling)
         return;
 
+    gputop_client_context_lock(ctx);
+
     close_i915_perf_stream(ctx);
     close_perf_events_streams(ctx);
     close_perf_tracepoints_streams(ctx);
 
     ctx->is_sampling = false;
+
+    gputop_client_context_unlock(ctx);
 }
 
 void
 gputop_client_context_start_sampling(struct gputop_client_context *ctx)
 {
+    gputop_client_context_lock(ctx);
+
     if (ctx->is_sampling)
         gputop_client_context_stop_sampling(ctx);
 
-    _mesa_hash_table_clear(ctx->pid_to_process_table, delete_process_entry);
-    _mesa_hash_table_clear(ctx->hw_id_to_process_table, NULL);
+    clear_process_infos(ctx);
 
     open_i915_perf_stream(ctx);
     open_perf_events_streams(ctx);
     open_perf_tracepoints_streams(ctx);
 
     ctx->is_sampling = true;
+
+    gputop_client_context_unlock(ctx);
+}
+
+void
+gputop_client_context_snapshot_stream(struct gputop_client_context *ctx,
+                                      struct gputop_stream *stream)
+{
+    char uuid[20];
+
+    if (!is_stream_opened(stream))
+        return;
+
+    /* The snapshot starts after the last one sent, or at the oldest
+     * report left if the recorder wrapped in between. */
+    if (stream == &ctx->oa_stream)
+        forget_last_i915_perf_report(ctx);
+
+    generate_uuid(ctx, uuid, sizeof(uuid), stream);
+
+    Gputop__Request request = GPUTOP__REQUEST__INIT;
+    request.uuid = uuid;
+    request.req_case = GPUTOP__REQUEST__REQ_SNAPSHOT_STREAM;
+    request.snapshot_stream = stream->id;
+    send_pb_message(ctx, &request.base);
+}
+
+void
+gputop_client_context_snapshot_sampling(struct gputop_client_context *ctx)
+{
+    gputop_client_context_lock(ctx);
+
+    if (ctx->is_sampling && ctx->flight_recorder) {
+        gputop_client_context_snapshot_stream(ctx, &ctx->oa_stream);
+
+        list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
+            list_for_each_entry(struct gputop_perf_tracepoint_stream, stream, &tp->streams, link)
+                gputop_client_context_snapshot_stream(ctx, &stream->base);
+        }
+    }
+
+    gputop_client_context_unlock(ctx);
 }
 
 
@@ -1432,16 +2356,22 @@ handle_perf_data(struct gputop_client_context *ctx,
         add_tracepoint_stream_data(ctx, stream, data, point->header.size);
         data += point->header.size;
     }
+
+    /* Bound the memory held when nothing looks at the records. */
+    if (ctx->n_perf_tracepoints_pending >= TRACEPOINTS_MAX_PENDING)
+        gputop_client_context_merge_tracepoints_data(ctx);
 }
 
 static void
 handle_i915_perf_data(struct gputop_client_context *ctx,
-                      uint32_t stream_id, const uint8_t *data, size_t len)
+                      uint32_t stream_id, gputop_buffer_t *buffer,
+                      const uint8_t *data, size_t len)
 {
     if (stream_id == ctx->oa_stream.id) {
-        struct gputop_i915_perf_chunk *chunk = get_i915_perf_chunk(ctx, data, len);
+        struct gputop_i915_perf_chunk *chunk =
+            get_i915_perf_chunk(ctx, buffer, data, len);
         i915_perf_accumulate(ctx, chunk);
-        put_i915_perf_chunk(chunk);
+        put_i915_perf_chunk(ctx, chunk);
     } else
         gputop_cr_console_log("discard wrong oa stream id=%i/%i",
                               stream_id, ctx->oa_stream.id);
@@ -1512,17 +2442,44 @@ handle_protobuf_message(struct gputop_client_context *ctx,
         break;
     }
     case GPUTOP__MESSAGE__CMD_FILL_NOTIFY: {
-        struct gputop_stream *stream = find_stream(ctx, message->fill_notify->stream_id);
-        if (stream)
-            stream->fill = message->fill_notify->fill_percentage;
+        Gputop__BufferFillNotify *notify = message->fill_notify;
+        struct gputop_stream *stream = find_stream(ctx, notify->stream_id);
+        if (!stream)
+            break;
+
+        stream->fill = notify->fill_percentage;
+
+        if (notify->has_ring_overruns &&
+            notify->ring_overruns != stream->ring_overruns) {
+            gputop_cr_console_log("i915_oa: server ring overrun - %u bytes of records lost",
+                                  (unsigned) (notify->ring_lost_bytes -
+                                              stream->ring_lost_bytes));
+
+            /* The notification comes ahead of the records following the
+             * gap, which mustn't be accumulated against the last report
+             * before it. */
+            if (stream == &ctx->oa_stream)
+                forget_last_i915_perf_report(ctx);
+
+            stream->ring_overruns = notify->ring_overruns;
+            stream->ring_lost_bytes = notify->ring_lost_bytes;
+        }
+        break;
+    }
+    case GPUTOP__MESSAGE__CMD_STREAM_STATS: {
+        struct gputop_stream *stream = find_stream(ctx, message->stream_stats->stream_id);
+        if (stream) {
+            stream->wakeups_per_sec = message->stream_stats->wakeups_per_sec;
+            stream->bytes_per_wakeup = message->stream_stats->bytes_per_wakeup;
+            stream->reads_per_sec = message->stream_stats->reads_per_sec;
+            stream->bytes_per_read = message->stream_stats->bytes_per_read;
+        }
         break;
     }
     case GPUTOP__MESSAGE__CMD_PROCESS_INFO: {
-        struct hash_entry *entry =
-            _mesa_hash_table_search(ctx->pid_to_process_table,
-                                    uint_key(message->process_info->pid));
-        if (entry) {
-            struct gputop_process_info *info = (struct gputop_process_info *) entry->data;
+        struct gputop_process_info *info = (struct gputop_process_info *)
+            gputop_u32_map_search(&ctx->pid_to_process_map, message->process_info->pid);
+        if (info) {
             snprintf(info->cmd, sizeof(info->cmd), "%s", message->process_info->comm);
             snprintf(info->cmd_line, sizeof(info->cmd_line), "%s", message->process_info->cmd_line);
 
@@ -1556,8 +2513,263 @@ handle_protobuf_message(struct gputop_client_context *ctx,
         gputop__message__free_unpacked(message, NULL);
 }
 
-void gputop_client_context_handle_data(struct gputop_client_context *ctx,
-                                       const void *payload, size_t payload_len)
+/**/
+
+#ifndef EMSCRIPTEN
+/* With GPUTOP_INGEST_THREAD set, i915 perf messages are accumulated on a
+ * dedicated thread so that slow accumulations don't hold up the thread
+ * receiving from the network. Messages are handed over through a bounded
+ * single producer/single consumer ring of buffer references, the mutex and
+ * conditions are only used to sleep while the ring is empty or full.
+ *
+ * All the other accesses to the client context are serialized with the
+ * accumulation thread by ctx_lock, see gputop_client_context_lock().
+ * Protobuf messages can act on the state left by the i915 perf data
+ * received before them (e.g. FILL_NOTIFY discarding the partial reports),
+ * they are only handled once the queue is drained.
+ */
+#define INGEST_QUEUE_LENGTH 256 /* power of two */
+
+struct gputop_ingest_thread {
+    pthread_t thread;
+    pthread_mutex_t ctx_lock; /* recursive */
+
+    pthread_mutex_t wait_lock;
+    pthread_cond_t not_empty_cond;
+    pthread_cond_t not_full_cond;
+    pthread_cond_t drained_cond;
+    bool consumer_waiting;
+    bool producer_waiting;
+    bool drain_waiting;
+    bool quit;
+
+    uint32_t head; /* next entry written, only written by the producer */
+    uint32_t tail; /* next entry read, only written by the consumer */
+    uint32_t handled; /* entries handled so far, only written by the consumer */
+    uint32_t discard; /* entries before this one are dropped, under ctx_lock */
+    gputop_buffer_t *queue[INGEST_QUEUE_LENGTH];
+};
+
+static void
+ingest_queue_push(struct gputop_ingest_thread *ingest, gputop_buffer_t *buffer)
+{
+    uint32_t head = ingest->head;
+
+    if (head - __atomic_load_n(&ingest->tail, __ATOMIC_ACQUIRE) == INGEST_QUEUE_LENGTH) {
+        pthread_mutex_lock(&ingest->wait_lock);
+        __atomic_store_n(&ingest->producer_waiting, true, __ATOMIC_SEQ_CST);
+        while (head - __atomic_load_n(&ingest->tail, __ATOMIC_SEQ_CST) == INGEST_QUEUE_LENGTH)
+            pthread_cond_wait(&ingest->not_full_cond, &ingest->wait_lock);
+        __atomic_store_n(&ingest->producer_waiting, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ingest->wait_lock);
+    }
+
+    ingest->queue[head & (INGEST_QUEUE_LENGTH - 1)] = buffer;
+    __atomic_store_n(&ingest->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ingest->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ingest->wait_lock);
+        pthread_cond_signal(&ingest->not_empty_cond);
+        pthread_mutex_unlock(&ingest->wait_lock);
+    }
+}
+
+/* Returns NULL once the thread is asked to quit. */
+static gputop_buffer_t *
+ingest_queue_pop(struct gputop_ingest_thread *ingest, uint32_t *index)
+{
+    uint32_t tail = ingest->tail;
+
+    if (__atomic_load_n(&ingest->head, __ATOMIC_ACQUIRE) == tail) {
+        pthread_mutex_lock(&ingest->wait_lock);
+        __atomic_store_n(&ingest->consumer_waiting, true, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&ingest->head, __ATOMIC_SEQ_CST) == tail && !ingest->quit)
+            pthread_cond_wait(&ingest->not_empty_cond, &ingest->wait_lock);
+        __atomic_store_n(&ingest->consumer_waiting, false, __ATOMIC_RELAXED);
+        bool quit = ingest->quit;
+        pthread_mutex_unlock(&ingest->wait_lock);
+
+        if (quit)
+            return NULL;
+    }
+
+    gputop_buffer_t *buffer = ingest->queue[tail & (INGEST_QUEUE_LENGTH - 1)];
+    *index = tail;
+    __atomic_store_n(&ingest->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ingest->producer_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ingest->wait_lock);
+        pthread_cond_signal(&ingest->not_full_cond);
+        pthread_mutex_unlock(&ingest->wait_lock);
+    }
+
+    return buffer;
+}
+
+/* Waits for the consumer to be done with all the entries pushed so far,
+ * called by the producer without the context locked.
+ */
+static void
+ingest_queue_drain(struct gputop_ingest_thread *ingest)
+{
+    uint32_t head = ingest->head;
+
+    if (__atomic_load_n(&ingest->handled, __ATOMIC_ACQUIRE) == head)
+        return;
+
+    pthread_mutex_lock(&ingest->wait_lock);
+    __atomic_store_n(&ingest->drain_waiting, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ingest->handled, __ATOMIC_SEQ_CST) != head)
+        pthread_cond_wait(&ingest->drained_cond, &ingest->wait_lock);
+    __atomic_store_n(&ingest->drain_waiting, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ingest->wait_lock);
+}
+
+static void handle_i915_perf_message(struct gputop_client_context *ctx,
+                                     gputop_buffer_t *buffer);
+
+static void *
+ingest_thread_main(void *data)
+{
+    struct gputop_client_context *ctx = (struct gputop_client_context *) data;
+    struct gputop_ingest_thread *ingest = ctx->ingest_thread;
+    gputop_buffer_t *buffer;
+    uint32_t index;
+
+    while ((buffer = ingest_queue_pop(ingest, &index))) {
+        pthread_mutex_lock(&ingest->ctx_lock);
+        if ((int32_t) (index - ingest->discard) >= 0)
+            handle_i915_perf_message(ctx, buffer);
+        pthread_mutex_unlock(&ingest->ctx_lock);
+
+        gputop_buffer_unref(buffer);
+
+        __atomic_store_n(&ingest->handled, index + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ingest->drain_waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&ingest->wait_lock);
+            pthread_cond_signal(&ingest->drained_cond);
+            pthread_mutex_unlock(&ingest->wait_lock);
+        }
+    }
+
+    return NULL;
+}
+
+static struct gputop_ingest_thread *
+ingest_thread_new(struct gputop_client_context *ctx)
+{
+    struct gputop_ingest_thread *ingest =
+        (struct gputop_ingest_thread *) calloc(1, sizeof(*ingest));
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ingest->ctx_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_mutex_init(&ingest->wait_lock, NULL);
+    pthread_cond_init(&ingest->not_empty_cond, NULL);
+    pthread_cond_init(&ingest->not_full_cond, NULL);
+    pthread_cond_init(&ingest->drained_cond, NULL);
+
+    ctx->ingest_thread = ingest;
+    if (pthread_create(&ingest->thread, NULL, ingest_thread_main, ctx) != 0) {
+        dbg("failed to start ingest thread\n");
+        ctx->ingest_thread = NULL;
+        pthread_cond_destroy(&ingest->drained_cond);
+        pthread_cond_destroy(&ingest->not_full_cond);
+        pthread_cond_destroy(&ingest->not_empty_cond);
+        pthread_mutex_destroy(&ingest->wait_lock);
+        pthread_mutex_destroy(&ingest->ctx_lock);
+        free(ingest);
+        return NULL;
+    }
+
+    return ingest;
+}
+
+/* Stops the ingest thread once it has handled the messages queued so far
+ * and frees it, called without the context locked.
+ */
+static void
+ingest_thread_destroy(struct gputop_client_context *ctx)
+{
+    struct gputop_ingest_thread *ingest = ctx->ingest_thread;
+
+    if (!ingest)
+        return;
+
+    pthread_mutex_lock(&ingest->wait_lock);
+    ingest->quit = true;
+    pthread_cond_signal(&ingest->not_empty_cond);
+    pthread_mutex_unlock(&ingest->wait_lock);
+
+    pthread_join(ingest->thread, NULL);
+    ctx->ingest_thread = NULL;
+
+    for (uint32_t i = ingest->tail; i != ingest->head; i++)
+        gputop_buffer_unref(ingest->queue[i & (INGEST_QUEUE_LENGTH - 1)]);
+
+    pthread_cond_destroy(&ingest->drained_cond);
+    pthread_cond_destroy(&ingest->not_full_cond);
+    pthread_cond_destroy(&ingest->not_empty_cond);
+    pthread_mutex_destroy(&ingest->wait_lock);
+    pthread_mutex_destroy(&ingest->ctx_lock);
+    free(ingest);
+}
+
+/* Drops the messages queued so far, called with the context locked. */
+static void
+ingest_queue_discard(struct gputop_client_context *ctx)
+{
+    if (ctx->ingest_thread)
+        ctx->ingest_thread->discard = ctx->ingest_thread->head;
+}
+#else
+static void
+ingest_thread_destroy(struct gputop_client_context *ctx)
+{
+}
+
+static void
+ingest_queue_discard(struct gputop_client_context *ctx)
+{
+}
+#endif
+
+void
+gputop_client_context_lock(struct gputop_client_context *ctx)
+{
+#ifndef EMSCRIPTEN
+    if (ctx->ingest_thread)
+        pthread_mutex_lock(&ctx->ingest_thread->ctx_lock);
+#endif
+}
+
+void
+gputop_client_context_unlock(struct gputop_client_context *ctx)
+{
+#ifndef EMSCRIPTEN
+    if (ctx->ingest_thread)
+        pthread_mutex_unlock(&ctx->ingest_thread->ctx_lock);
+#endif
+}
+
+#ifndef EMSCRIPTEN
+static void
+handle_i915_perf_message(struct gputop_client_context *ctx,
+                         gputop_buffer_t *buffer)
+{
+    const uint32_t *stream_id = (const uint32_t *) (buffer->data + 4);
+
+    handle_i915_perf_data(ctx, *stream_id, buffer,
+                          buffer->data + 8, buffer->len - 8);
+}
+#endif
+
+static void
+handle_message(struct gputop_client_context *ctx, gputop_buffer_t *buffer,
+               const void *payload, size_t payload_len)
 {
     const uint8_t *msg_type = (const uint8_t *) payload;
     const uint8_t *data = (const uint8_t *) payload + 8;
@@ -1576,7 +2788,7 @@ void gputop_client_context_handle_data(struct gputop_client_context *ctx,
     case 3: {
         const uint32_t *stream_id =
             (const uint32_t *) ((const uint8_t *) payload + 4);
-        handle_i915_perf_data(ctx, *stream_id, data, len);
+        handle_i915_perf_data(ctx, *stream_id, buffer, data, len);
         break;
     }
     default:
@@ -1585,35 +2797,74 @@ void gputop_client_context_handle_data(struct gputop_client_context *ctx,
     }
 }
 
+void gputop_client_context_handle_data(struct gputop_client_context *ctx,
+                                       const void *payload, size_t payload_len)
+{
+#ifndef EMSCRIPTEN
+    if (ctx->ingest_thread && *((const uint8_t *) payload) == 3) {
+        gputop_buffer_t *buffer = gputop_buffer_new(payload_len);
+
+        if (buffer) {
+            memcpy((uint8_t *) buffer->data, payload, payload_len);
+            ingest_queue_push(ctx->ingest_thread, buffer);
+            return;
+        }
+
+        /* Without a copy to queue, the data is handled in place after
+         * what's already queued. */
+        ingest_queue_drain(ctx->ingest_thread);
+    }
+    if (ctx->ingest_thread && *((const uint8_t *) payload) == 2)
+        ingest_queue_drain(ctx->ingest_thread);
+#endif
+
+    gputop_client_context_lock(ctx);
+    handle_message(ctx, NULL, payload, payload_len);
+    gputop_client_context_unlock(ctx);
+}
+
+void gputop_client_context_handle_buffer(struct gputop_client_context *ctx,
+                                         gputop_buffer_t *buffer)
+{
+#ifndef EMSCRIPTEN
+    if (ctx->ingest_thread && buffer->data[0] == 3) {
+        ingest_queue_push(ctx->ingest_thread, gputop_buffer_ref(buffer));
+        return;
+    }
+    if (ctx->ingest_thread && buffer->data[0] == 2)
+        ingest_queue_drain(ctx->ingest_thread);
+#endif
+
+    gputop_client_context_lock(ctx);
+    handle_message(ctx, buffer, buffer->data, buffer->len);
+    gputop_client_context_unlock(ctx);
+}
+
 static void
 i915_perf_empty_samples(struct gputop_client_context *ctx)
 {
-    list_for_each_entry_safe(struct gputop_accumulated_samples, samples,
-                             &ctx->timelines, link) {
-        put_accumulated_sample(ctx, samples);
-    }
+    struct gputop_accumulated_samples *samples;
+    while (gputop_samples_ring_length(&ctx->timelines) > 0)
+        timelines_shift(ctx);
     if (ctx->current_timeline_samples) {
         put_accumulated_sample(ctx, ctx->current_timeline_samples);
         ctx->current_timeline_samples = NULL;
     }
-    _mesa_hash_table_clear(ctx->hw_contexts_table, NULL);
+    gputop_u32_map_clear(&ctx->hw_contexts_map);
 
-    ctx->n_timelines = 0;
     ctx->last_hw_id = GPUTOP_OA_INVALID_CTX_ID;
+    ctx->last_gt_timestamp = 0;
+    ctx->has_gt_timestamp = false;
 
-    list_for_each_entry_safe(struct gputop_accumulated_samples, samples,
-                             &ctx->graphs, link) {
+    while ((samples = gputop_samples_ring_shift(&ctx->graphs)))
         put_accumulated_sample(ctx, samples);
-    }
     if (ctx->current_graph_samples) {
         put_accumulated_sample(ctx, ctx->current_graph_samples);
         ctx->current_graph_samples = NULL;
     }
-    assert(list_empty(&ctx->graphs));
-    ctx->n_graphs = 0;
 
     if (ctx->last_chunk) {
-        put_i915_perf_chunk(ctx->last_chunk);
+        put_i915_perf_chunk(ctx, ctx->last_chunk);
         ctx->last_chunk = NULL;
     }
     ctx->last_header = NULL;
@@ -1624,26 +2875,33 @@ i915_perf_empty_samples(struct gputop_client_context *ctx)
     ctx->last_oa_timestamp = ctx->oa_visible_timeline_s * 1000000000ULL;
 
     assert(list_empty(&ctx->i915_perf_chunks));
+    list_for_each_entry_safe(struct gputop_i915_perf_slab, slab,
+                             &ctx->i915_perf_slabs, link) {
+        release_i915_perf_slab(ctx, slab);
+    }
+    ctx->i915_perf_chunk_stats.bytes_high_water = 0;
 }
 
 static void
-delete_process_entry(struct hash_entry *entry)
+clear_process_infos(struct gputop_client_context *ctx)
 {
-    struct gputop_process_info *info = entry->data;
-
-    list_del(&info->link);
-    free(info);
+    list_for_each_entry_safe(struct gputop_process_info, info, &ctx->process_infos, link) {
+        list_del(&info->link);
+        gputop_pool_free(&ctx->process_infos_pool, info);
+    }
+    gputop_u32_map_clear(&ctx->pid_to_process_map);
+    gputop_u32_map_clear(&ctx->hw_id_to_process_map);
 }
 
 static void
 clear_perf_tracepoints_data(struct gputop_client_context *ctx)
 {
-    list_for_each_entry_safe(struct gputop_perf_tracepoint_data, data,
-                             &ctx->perf_tracepoints_data, link) {
-        list_del(&data->link);
-        list_del(&data->tp_link);
-        free(data);
-    }
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link)
+        free_tracepoint_buffers(tp);
+
+    ctx->perf_tracepoints_data_first = 0;
+    ctx->n_perf_tracepoints_data = 0;
+    ctx->n_perf_tracepoints_pending = 0;
 }
 
 void
@@ -1667,19 +2925,30 @@ gputop_client_context_init(struct gputop_client_context *ctx)
 
     list_inithead(&ctx->streams);
 
-    ctx->hw_contexts_table =
-        _mesa_hash_table_create(NULL, _mesa_hash_pointer, _mesa_key_pointer_equal);
-    _mesa_hash_table_set_deleted_key(ctx->hw_contexts_table, uint_key(UINT32_MAX));
-    _mesa_hash_table_set_freed_key(ctx->hw_contexts_table, uint_key(UINT32_MAX - 1));
+    gputop_u32_map_init(&ctx->hw_contexts_map);
+    gputop_pool_init_type(&ctx->hw_contexts_pool, struct gputop_hw_context, 16);
     list_inithead(&ctx->hw_contexts);
-
-    list_inithead(&ctx->graphs);
-    list_inithead(&ctx->timelines);
+    ctx->busyness = 0.0;
+    ctx->n_timeline_rows = 0;
+    ctx->free_timeline_rows = NULL;
+    ctx->n_free_timeline_rows = 0;
+    ctx->free_timeline_rows_size = 0;
+
+    memset(&ctx->graphs, 0, sizeof(ctx->graphs));
+    memset(&ctx->timelines, 0, sizeof(ctx->timelines));
+    ctx->counter_values = NULL;
+    ctx->n_counter_values = 0;
     list_inithead(&ctx->free_samples);
     list_inithead(&ctx->i915_perf_chunks);
+    list_inithead(&ctx->i915_perf_slabs);
+    list_inithead(&ctx->i915_perf_free_slabs);
 
     list_inithead(&ctx->perf_tracepoints);
-    list_inithead(&ctx->perf_tracepoints_data);
+    ctx->perf_tracepoints_data = NULL;
+    ctx->perf_tracepoints_data_size = 0;
+    ctx->perf_tracepoints_data_first = 0;
+    ctx->n_perf_tracepoints_data = 0;
+    ctx->n_perf_tracepoints_pending = 0;
     ctx->perf_tracepoints_name_table =
         _mesa_hash_table_create(NULL, _mesa_hash_string, _mesa_key_string_equal);
     ctx->perf_tracepoints_uuid_table =
@@ -1687,30 +2956,42 @@ gputop_client_context_init(struct gputop_client_context *ctx)
     ctx->perf_tracepoints_stream_table =
         _mesa_hash_table_create(NULL, _mesa_hash_pointer, _mesa_key_pointer_equal);
 
-    ctx->pid_to_process_table =
-        _mesa_hash_table_create(NULL, _mesa_hash_pointer, _mesa_key_pointer_equal);
-    ctx->hw_id_to_process_table =
-        _mesa_hash_table_create(NULL, _mesa_hash_pointer, _mesa_key_pointer_equal);
-    _mesa_hash_table_set_deleted_key(ctx->pid_to_process_table, uint_key(UINT32_MAX));
-    _mesa_hash_table_set_freed_key(ctx->pid_to_process_table, uint_key(UINT32_MAX - 1));
-    _mesa_hash_table_set_deleted_key(ctx->hw_id_to_process_table, uint_key(UINT32_MAX));
-    _mesa_hash_table_set_freed_key(ctx->hw_id_to_process_table, uint_key(UINT32_MAX - 1));
+    gputop_u32_map_init(&ctx->pid_to_process_map);
+    gputop_u32_map_init(&ctx->hw_id_to_process_map);
+    gputop_pool_init_type(&ctx->process_infos_pool, struct gputop_process_info, 64);
     list_inithead(&ctx->process_infos);
 
     ctx->i915_perf_config.oa_reports = true;
+
+    const char *n_threads = getenv("GPUTOP_OA_ACCUMULATE_THREADS");
+    if (n_threads)
+        ctx->oa_worker_pool = gputop_cc_oa_worker_pool_new(atoi(n_threads));
+
+#ifndef EMSCRIPTEN
+    const char *ingest_thread = getenv("GPUTOP_INGEST_THREAD");
+    if (ingest_thread && atoi(ingest_thread))
+        ingest_thread_new(ctx);
+#endif
 }
 
 void
 gputop_client_context_reset(struct gputop_client_context *ctx,
                             gputop_connection_t *connection)
 {
+    gputop_client_context_lock(ctx);
+
+    /* Stream ids start over, data queued for the accumulation thread
+     * could be mistaken for the new streams'.
+     */
+    ingest_queue_discard(ctx);
+
     if (is_stream_opened(&ctx->cpu_stats_stream))
         list_inithead(&ctx->streams); /* Nuclear option... */
 
     /**/
     i915_perf_empty_samples(ctx);
     clear_perf_tracepoints_data(ctx);
-    assert(list_length(&ctx->perf_tracepoints_data) == 0);
+    assert(ctx->n_perf_tracepoints_data == 0);
 
     /**/
     if (ctx->features) {
@@ -1739,8 +3020,7 @@ gputop_client_context_reset(struct gputop_client_context *ctx,
     assert(list_length(&ctx->perf_tracepoints) == 0);
 
     /**/
-    _mesa_hash_table_clear(ctx->pid_to_process_table, delete_process_entry);
-    _mesa_hash_table_clear(ctx->hw_id_to_process_table, NULL);
+    clear_process_infos(ctx);
 
     gputop_client_context_clear_logs(ctx);
 
@@ -1751,4 +3031,17 @@ gputop_client_context_reset(struct gputop_client_context *ctx,
         request_features(ctx);
         open_cpu_stats_stream(ctx);
     }
+
+    gputop_client_context_unlock(ctx);
+}
+
+void
+gputop_client_context_fini(struct gputop_client_context *ctx)
+{
+    ingest_thread_destroy(ctx);
+
+    gputop_client_context_reset(ctx, NULL);
+
+    gputop_cc_oa_worker_pool_destroy(ctx->oa_worker_pool);
+    ctx->oa_worker_pool = NULL;
 }
@@ -34,6 +34,8 @@
 #include "gputop-network.h"
 #include "gputop-oa-counters.h"
 #include "gputop-oa-metrics.h"
+#include "gputop-pool.h"
+#include "gputop-u32-map.h"
 
 #include "gputop.pb-c.h"
 
@@ -41,20 +43,50 @@
 extern "C" {
 #endif
 
+struct gputop_i915_perf_slab;
+
 /* A chunk of data coming from the i915 perf driver (contains a sequence of
  * struct drm_i915_perf_record_header fields).
  */
 struct gputop_i915_perf_chunk {
     struct list_head link;
 
+    struct gputop_i915_perf_slab *slab; /* the chunk is allocated from */
     uint32_t refcount;
 
+    /* Received buffer data points into, NULL when the data was copied
+     * right after the chunk.
+     */
+    gputop_buffer_t *buffer;
+
     uint32_t length;
-    uint8_t data[];
+    const uint8_t *data;
 };
 
+struct gputop_client_context;
 struct gputop_accumulated_samples;
 struct gputop_process_info;
+struct gputop_ingest_thread;
+struct gputop_perf_tracepoint_block;
+
+/* Series of accumulated samples ordered by time, oldest first. Samples are
+ * pushed at the end and evicted from the front, the storage is a
+ * power-of-two array of pointers so that frame walks and lookups by index
+ * don't chase list links.
+ *
+ * Rings can also carry n_columns values per samples, stored column by
+ * column at the same positions as the samples, used to keep the counter
+ * values of closed samples.
+ */
+struct gputop_samples_ring {
+    struct gputop_accumulated_samples **samples;
+    uint32_t mask; /* allocated length - 1 */
+    uint32_t first;
+    uint32_t len;
+
+    double *columns;
+    uint32_t n_columns;
+};
 
 struct gputop_hw_context {
     char name[300];
@@ -69,8 +101,11 @@ struct gputop_hw_context {
     struct gputop_process_info *process;
 
     struct gputop_accumulated_samples *current_graph_samples;
-    struct list_head graphs; /* list of gputop_accumulated_samples */
-    uint32_t n_graphs;
+    struct gputop_samples_ring graphs; /* with one column per counter of metric_set */
+
+    /* This context's part of gputop_client_context.timelines. */
+    struct gputop_samples_ring timelines;
+    uint64_t timelines_time; /* time of all the samples ever pushed */
 
     /* UI state */
     uint64_t visible_time_spent;
@@ -92,6 +127,17 @@ struct gputop_accumulated_samples {
     uint64_t timestamp_start;
     uint64_t timestamp_end;
 
+    /* Running sum of the durations of the context's timeline samples up
+     * to this one (gputop_hw_context.timelines_time once pushed).
+     */
+    uint64_t context_time;
+
+    /* OA timestamps of the start/end reports, extended to 64bits across
+     * wrap-arounds (see gputop_client_context_extend_gt_timestamp()).
+     */
+    uint64_t gt_timestamp_start;
+    uint64_t gt_timestamp_end;
+
     struct {
         struct gputop_i915_perf_chunk *chunk;
         const struct drm_i915_perf_record_header *header;
@@ -111,6 +157,17 @@ struct gputop_stream {
 
     int id;
     float fill;
+
+    /* Records the server lost before forwarding them (i915 perf) */
+    uint32_t ring_overruns;
+    uint64_t ring_lost_bytes;
+
+    /* How often the server is woken up for the stream's data and reads
+     * it */
+    float wakeups_per_sec;
+    uint32_t bytes_per_wakeup;
+    float reads_per_sec;
+    uint32_t bytes_per_read;
 };
 
 struct gputop_perf_event {
@@ -154,10 +211,43 @@ struct gputop_perf_data_tracepoint {
     uint8_t  data[];
 };
 
+/* Records of a tracepoint on one CPU, in the order perf delivers them,
+ * which is by time. Records are appended to blocks that are freed as a
+ * whole once all their records left the visible window.
+ */
+struct gputop_perf_tracepoint_buffer {
+    struct list_head blocks;
+
+    /* First record not merged into gputop_client_context.perf_tracepoints_data
+     * (NULL block for the start of the first block).
+     */
+    struct gputop_perf_tracepoint_block *merge_block;
+    uint32_t merge_offset;
+};
+
+/* A field of a tracepoint's format, compiled when the format is parsed
+ * into the function formatting its values.
+ */
+struct gputop_perf_tracepoint_field {
+    char name[80];
+    char label[88]; /* "\n<name> = " */
+    int label_len;
+    int offset;
+    int size;
+    bool is_signed;
+
+    /* NULL for the fields not worth printing (common_type etc...). */
+    int (*print)(struct gputop_client_context *ctx,
+                 const struct gputop_perf_tracepoint_field *field,
+                 const struct gputop_perf_data_tracepoint *point,
+                 char *buf, size_t len);
+};
+
 struct gputop_perf_tracepoint {
     struct list_head link; /* global list (gputop_client_context.perf_tracepoints)*/
 
-    struct list_head data; /* list of gputop_perf_tracepoint_data */
+    struct gputop_perf_tracepoint_buffer **buffers; /* indexed by CPU */
+    int n_buffers;
 
     char name[128];
     uint32_t event_id;
@@ -166,12 +256,7 @@ struct gputop_perf_tracepoint {
 
     char uuid[20];
 
-    struct {
-        bool is_signed;
-        int offset;
-        int size;
-        char name[80];
-    } fields[20];
+    struct gputop_perf_tracepoint_field *fields;
     int n_fields;
 
     int process_field;
@@ -190,12 +275,10 @@ struct gputop_perf_tracepoint_stream {
 };
 
 struct gputop_perf_tracepoint_data {
-    struct list_head link; /* global list (gputop_client_context.perf_tracepoints_data) */
-    struct list_head tp_link; /* per tracepoint list (gputop_perf_tracepoint.data) */
-
     struct gputop_perf_tracepoint *tp;
 
     int cpu;
+    uint32_t size; /* space taken in its block */
     struct gputop_perf_data_tracepoint data;
 };
 
@@ -207,8 +290,6 @@ struct gputop_process_info {
     uint32_t pid;
 };
 
-struct gputop_client_context;
-
 typedef void (*gputop_accumulate_cb)(struct gputop_client_context *ctx,
                                      struct gputop_hw_context *context);
 
@@ -245,43 +326,94 @@ struct gputop_client_context {
     struct list_head free_samples;
     struct list_head i915_perf_chunks;
 
+    /* Slabs the chunks are allocated from, in allocation order, and
+     * released slabs kept for reuse.
+     */
+    struct list_head i915_perf_slabs;
+    struct list_head i915_perf_free_slabs;
+    struct {
+        uint64_t bytes_live; /* data of the chunks still referenced */
+        uint64_t bytes_high_water; /* maximum of bytes_live */
+        uint64_t slab_bytes; /* allocated for slabs, including free ones */
+        uint32_t n_slabs; /* holding live chunks */
+        uint32_t n_free_slabs;
+    } i915_perf_chunk_stats; /* RO */
+
     uint64_t last_oa_timestamp;
 
     /**/
     struct gputop_accumulated_samples *current_graph_samples;
-    struct list_head graphs;
-    int n_graphs;
+    struct gputop_samples_ring graphs; /* with one column per counter of metric_set */
+    double *counter_values; /* scratch row for metric_set->read_all() */
+    uint32_t n_counter_values;
     float oa_visible_timeline_s; /* RW */
     uint64_t oa_aggregation_period_ns; /* RW (when not sampling) */
     uint64_t oa_sampling_period_ns; /* RW (when not sampling), always <= oa_aggregation_period_ns */
 
+    /* Whether the server keeps the OA reports and tracepoints in its
+     * rings, only sending them on gputop_client_context_snapshot_sampling()
+     * instead of as they come. RW (when not sampling) */
+    bool flight_recorder;
+
     gputop_accumulate_cb accumulate_cb; /* RW */
 
     bool warn_report_loss; /* RW */
 
+    /* Threads folding long ranges of reports in parallel, set from
+     * GPUTOP_OA_ACCUMULATE_THREADS (NULL accumulates serially).
+     */
+    struct gputop_cc_oa_worker_pool *oa_worker_pool;
+
+    /* Thread accumulating the i915 perf messages, set from
+     * GPUTOP_INGEST_THREAD (NULL accumulates in the thread handing the
+     * messages to the context). When set, accumulate_cb is called from that
+     * thread and readers of the context must hold the context lock.
+     */
+    struct gputop_ingest_thread *ingest_thread;
+
     /**/
     struct gputop_accumulated_samples *current_timeline_samples;
-    struct list_head timelines;
-    int n_timelines;
+    struct gputop_samples_ring timelines;
     uint32_t last_hw_id;
+    uint64_t last_gt_timestamp; /* most recent extended GT timestamp */
+    bool has_gt_timestamp; /* whether last_gt_timestamp is set */
 
-    struct hash_table *hw_contexts_table;
+    struct gputop_u32_map hw_contexts_map;
+    struct gputop_pool hw_contexts_pool;
     struct list_head hw_contexts;
+    double busyness; /* sum of the contexts' usage_percent */
+
+    /* Contexts keep their timeline row for their whole life, the rows of
+     * the contexts gone are handed out again first.
+     */
+    uint32_t n_timeline_rows;
+    uint32_t *free_timeline_rows;
+    uint32_t n_free_timeline_rows;
+    uint32_t free_timeline_rows_size;
 
     /**/
     struct hash_table *perf_tracepoints_uuid_table;
     struct hash_table *perf_tracepoints_name_table;
     struct hash_table *perf_tracepoints_stream_table;
     struct list_head perf_tracepoints;
-    struct list_head perf_tracepoints_data;
+
+    /* Records of all the tracepoint buffers ordered by time, merged lazily
+     * by gputop_client_context_merge_tracepoints_data().
+     */
+    struct gputop_perf_tracepoint_data **perf_tracepoints_data;
+    uint32_t perf_tracepoints_data_first;
+    uint32_t n_perf_tracepoints_data;
+    uint32_t perf_tracepoints_data_size;
+    uint32_t n_perf_tracepoints_pending;
 
     /**/
     struct hash_table *perf_events_stream_table;
     struct list_head perf_events;
 
     /**/
-    struct hash_table *pid_to_process_table;
-    struct hash_table *hw_id_to_process_table;
+    struct gputop_u32_map pid_to_process_map;
+    struct gputop_u32_map hw_id_to_process_map;
+    struct gputop_pool process_infos_pool;
     struct list_head process_infos;
 
     /**/
@@ -309,9 +441,24 @@ int gputop_client_context_pretty_print_max(struct gputop_client_context *ctx,
 void gputop_client_context_init(struct gputop_client_context *ctx);
 void gputop_client_context_reset(struct gputop_client_context *ctx,
                                  gputop_connection_t *connection);
+/* Stops the threads started by gputop_client_context_init() and drops the
+ * accumulated data.
+ */
+void gputop_client_context_fini(struct gputop_client_context *ctx);
 
 void gputop_client_context_handle_data(struct gputop_client_context *ctx,
                                        const void *payload, size_t payload_len);
+/* Same as gputop_client_context_handle_data(), referencing the i915 perf
+ * data in place instead of copying it.
+ */
+void gputop_client_context_handle_buffer(struct gputop_client_context *ctx,
+                                         gputop_buffer_t *buffer);
+
+/* Serialize accesses to the context with its ingest thread, no-ops when
+ * there is none. The lock is recursive.
+ */
+void gputop_client_context_lock(struct gputop_client_context *ctx);
+void gputop_client_context_unlock(struct gputop_client_context *ctx);
 
 void gputop_client_context_update_cpu_stream(struct gputop_client_context *ctx,
                                              int sampling_period_ms);
@@ -319,6 +466,16 @@ void gputop_client_context_update_cpu_stream(struct gputop_client_context *ctx,
 void gputop_client_context_stop_sampling(struct gputop_client_context *ctx);
 void gputop_client_context_start_sampling(struct gputop_client_context *ctx);
 
+/* Requests the data recorded so far by a stream opened in flight
+ * recorder mode, the server acknowledges once it has all been sent.
+ */
+void gputop_client_context_snapshot_stream(struct gputop_client_context *ctx,
+                                           struct gputop_stream *stream);
+/* Snapshots the i915 perf and tracepoint streams of the current sampling
+ * session, see flight_recorder.
+ */
+void gputop_client_context_snapshot_sampling(struct gputop_client_context *ctx);
+
 void gputop_client_context_clear_logs(struct gputop_client_context *ctx);
 
 const struct gputop_metric_set *
@@ -334,6 +491,17 @@ gputop_client_context_add_tracepoint(struct gputop_client_context *ctx,
 void gputop_client_context_remove_tracepoint(struct gputop_client_context *ctx,
                                              struct gputop_perf_tracepoint *tp);
 
+/* Merges the records received since the last call into
+ * perf_tracepoints_data and returns its length.
+ */
+uint32_t gputop_client_context_merge_tracepoints_data(struct gputop_client_context *ctx);
+
+static inline struct gputop_perf_tracepoint_data *
+gputop_client_context_tracepoint_data(struct gputop_client_context *ctx, uint32_t idx)
+{
+    return ctx->perf_tracepoints_data[ctx->perf_tracepoints_data_first + idx];
+}
+
 void gputop_client_context_print_tracepoint_data(struct gputop_client_context *ctx,
                                                  char *buf, size_t len,
                                                  struct gputop_perf_tracepoint_data *data,
@@ -343,14 +511,83 @@ double gputop_client_context_read_counter_value(struct gputop_client_context *ct
                                                 struct gputop_accumulated_samples *sample,
                                                 const struct gputop_metric_set_counter *counter);
 
+/* Extends a 32bit GT timestamp to 64bits, placing it at its most recent
+ * occurrence at or before the last report received.
+ */
+uint64_t gputop_client_context_extend_gt_timestamp(struct gputop_client_context *ctx,
+                                                   uint32_t gt_timestamp);
+
 uint64_t gputop_client_context_convert_gt_timestamp(struct gputop_client_context *ctx,
                                                     uint32_t gt_timestamp);
 
 double gputop_client_context_calc_busyness(struct gputop_client_context *ctx);
 
+/* Time spent running a context between 2 timestamps of the timeline. */
+uint64_t gputop_hw_context_time_spent(const struct gputop_hw_context *context,
+                                      uint64_t start, uint64_t end);
+
 void gputop_accumulated_samples_print(struct gputop_client_context *ctx,
                                       struct gputop_accumulated_samples *sample);
 
+static inline uint32_t
+gputop_samples_ring_length(const struct gputop_samples_ring *ring)
+{
+    return ring->len;
+}
+
+/* Samples at position idx, 0 being the oldest. */
+static inline struct gputop_accumulated_samples *
+gputop_samples_ring_get(const struct gputop_samples_ring *ring, uint32_t idx)
+{
+    return ring->samples[(ring->first + idx) & ring->mask];
+}
+
+static inline struct gputop_accumulated_samples *
+gputop_samples_ring_first(const struct gputop_samples_ring *ring)
+{
+    return ring->len ? gputop_samples_ring_get(ring, 0) : NULL;
+}
+
+static inline struct gputop_accumulated_samples *
+gputop_samples_ring_last(const struct gputop_samples_ring *ring)
+{
+    return ring->len ? gputop_samples_ring_get(ring, ring->len - 1) : NULL;
+}
+
+/* Value of column for the samples at position idx. */
+static inline double
+gputop_samples_ring_value(const struct gputop_samples_ring *ring,
+                          uint32_t column, uint32_t idx)
+{
+    return ring->columns[column * (ring->mask + 1) +
+                         ((ring->first + idx) & ring->mask)];
+}
+
+/* Returns the slot of the pushed samples in the storage, its value for a
+ * column lives at columns[column * (mask + 1) + slot].
+ */
+uint32_t gputop_samples_ring_push(struct gputop_samples_ring *ring,
+                                  struct gputop_accumulated_samples *samples);
+struct gputop_accumulated_samples *
+gputop_samples_ring_shift(struct gputop_samples_ring *ring);
+void gputop_samples_ring_fini(struct gputop_samples_ring *ring);
+
+/* Reallocates the columns, values of the samples already in the ring are
+ * reset to 0.
+ */
+void gputop_samples_ring_set_columns(struct gputop_samples_ring *ring,
+                                     uint32_t n_columns);
+
+/* Index of the first samples ending at or after timestamp, or the length of
+ * the ring if there is none.
+ */
+uint32_t gputop_samples_ring_search(const struct gputop_samples_ring *ring,
+                                    uint64_t timestamp);
+
+/* Same as gputop_samples_ring_search() for an extended GT timestamp. */
+uint32_t gputop_samples_ring_search_gt(const struct gputop_samples_ring *ring,
+                                       uint64_t gt_timestamp);
+
 /* Iterator for reports accumulated into gputop_accumulated_samples. */
 struct gputop_record_iterator {
     const struct gputop_accumulated_samples *sample;
@@ -26,6 +26,7 @@
 #define __GPUTOP_NETWORK_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
@@ -45,12 +46,77 @@ typedef void (*gputop_on_close_cb_t)(gputop_connection_t *conn,
                                      const char *error,
                                      void *user_data);
 
+/* A received message. Receivers can hold a reference to keep the data
+ * around instead of copying it.
+ */
+typedef struct _gputop_buffer_t gputop_buffer_t;
+
+struct _gputop_buffer_t {
+    int refcount;
+
+    const uint8_t *data;
+    size_t len;
+
+    void (*destroy)(gputop_buffer_t *buffer);
+};
+
+typedef void (*gputop_on_buffer_cb_t)(gputop_connection_t *conn,
+                                      gputop_buffer_t *buffer,
+                                      void *user_data);
+
+static inline void
+gputop_buffer_free(gputop_buffer_t *buffer)
+{
+    free(buffer);
+}
+
+/* A buffer holding len bytes of data right after its header, NULL if it
+ * can't be allocated.
+ */
+static inline gputop_buffer_t *
+gputop_buffer_new(size_t len)
+{
+    gputop_buffer_t *buffer = (gputop_buffer_t *) malloc(sizeof(*buffer) + len);
+
+    if (!buffer)
+        return NULL;
+
+    buffer->refcount = 1;
+    buffer->data = (const uint8_t *) (buffer + 1);
+    buffer->len = len;
+    buffer->destroy = gputop_buffer_free;
+
+    return buffer;
+}
+
+/* References can be taken and released from any thread. */
+static inline gputop_buffer_t *
+gputop_buffer_ref(gputop_buffer_t *buffer)
+{
+    __atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+static inline void
+gputop_buffer_unref(gputop_buffer_t *buffer)
+{
+    if (__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        buffer->destroy(buffer);
+}
+
 gputop_connection_t *gputop_connect(const char *host, int port,
                                     gputop_on_ready_cb_t ready_cb,
                                     gputop_on_data_cb_t data_cb,
                                     gputop_on_close_cb_t close_cb,
                                     void *user_data);
 
+/* Deliver the received messages to buffer_cb rather than to the data
+ * callback given to gputop_connect(). The buffer is only guaranteed to
+ * live for the duration of the callback unless a reference is taken.
+ */
+void gputop_connection_set_buffer_cb(gputop_connection_t *conn,
+                                     gputop_on_buffer_cb_t buffer_cb);
+
 void gputop_connection_send(gputop_connection_t *conn,
                             const void *data, size_t len);
 
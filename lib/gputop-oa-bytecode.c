@@ -0,0 +1,1612 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "gputop-oa-bytecode.h"
+#include "gputop-oa-counters.h"
+#include "gputop-log.h"
+
+#include "util/hash_table.h"
+#include "util/macros.h"
+#include "util/ralloc.h"
+
+/* Number of reports each instruction is evaluated over at a time */
+#define OA_BC_TILE 64
+
+/**/
+
+/* Minimal reader for the oa-*.xml files, only looking at the tags and
+ * their attributes. The buffer is modified in place to terminate and
+ * unescape the attribute values.
+ */
+
+#define OA_XML_MAX_ATTRS 32
+
+struct oa_xml_tag {
+    char name[32];
+    bool closing;
+    bool self_closing;
+
+    int n_attrs;
+    struct {
+        const char *name;
+        const char *value;
+    } attrs[OA_XML_MAX_ATTRS];
+};
+
+static bool
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static char *
+oa_xml_encode_utf8(char *out, uint32_t c)
+{
+    if (c < 0x80) {
+        *out++ = c;
+    } else if (c < 0x800) {
+        *out++ = 0xc0 | (c >> 6);
+        *out++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *out++ = 0xe0 | (c >> 12);
+        *out++ = 0x80 | ((c >> 6) & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    } else {
+        *out++ = 0xf0 | (c >> 18);
+        *out++ = 0x80 | ((c >> 12) & 0x3f);
+        *out++ = 0x80 | ((c >> 6) & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    }
+    return out;
+}
+
+static void
+oa_xml_unescape(char *str)
+{
+    static const struct {
+        const char *entity;
+        char c;
+    } entities[] = {
+        { "&lt;", '<' },
+        { "&gt;", '>' },
+        { "&amp;", '&' },
+        { "&quot;", '"' },
+        { "&apos;", '\'' },
+    };
+    char *out = str;
+
+    while (*str) {
+        if (*str != '&') {
+            *out++ = *str++;
+            continue;
+        }
+
+        if (str[1] == '#') {
+            char *end;
+            uint32_t c = str[2] == 'x' ? strtoul(str + 3, &end, 16) :
+                                         strtoul(str + 2, &end, 10);
+            if (*end == ';' && c > 0 && c < 0x110000) {
+                out = oa_xml_encode_utf8(out, c);
+                str = end + 1;
+                continue;
+            }
+        } else {
+            unsigned i;
+            for (i = 0; i < ARRAY_SIZE(entities); i++) {
+                size_t len = strlen(entities[i].entity);
+                if (!strncmp(str, entities[i].entity, len)) {
+                    *out++ = entities[i].c;
+                    str += len;
+                    break;
+                }
+            }
+            if (i < ARRAY_SIZE(entities))
+                continue;
+        }
+
+        *out++ = *str++;
+    }
+    *out = '\0';
+}
+
+/* Parses the next tag after *cursor, skipping text, comments and
+ * declarations. Returns false at the end of the buffer or on malformed
+ * input.
+ */
+static bool
+oa_xml_next_tag(char **cursor, struct oa_xml_tag *tag)
+{
+    char *p = *cursor;
+
+    for (;;) {
+        p = strchr(p, '<');
+        if (!p)
+            return false;
+
+        if (!strncmp(p, "<!--", 4)) {
+            p = strstr(p + 4, "-->");
+            if (!p)
+                return false;
+            p += 3;
+        } else if (p[1] == '?' || p[1] == '!') {
+            p = strchr(p, '>');
+            if (!p)
+                return false;
+            p++;
+        } else
+            break;
+    }
+
+    p++;
+    tag->closing = *p == '/';
+    if (tag->closing)
+        p++;
+    tag->self_closing = false;
+    tag->n_attrs = 0;
+
+    size_t len = 0;
+    while (*p && !is_space(*p) && *p != '>' && *p != '/') {
+        if (len < sizeof(tag->name) - 1)
+            tag->name[len++] = *p;
+        p++;
+    }
+    tag->name[len] = '\0';
+
+    for (;;) {
+        while (is_space(*p))
+            p++;
+
+        if (*p == '>') {
+            p++;
+            break;
+        }
+        if (p[0] == '/' && p[1] == '>') {
+            tag->self_closing = true;
+            p += 2;
+            break;
+        }
+        if (!*p)
+            return false;
+
+        char *name = p;
+        while (*p && !is_space(*p) && *p != '=')
+            p++;
+        char *name_end = p;
+        while (is_space(*p))
+            p++;
+        if (*p != '=')
+            return false;
+        p++;
+        *name_end = '\0';
+        while (is_space(*p))
+            p++;
+
+        char quote = *p;
+        if (quote != '"' && quote != '\'')
+            return false;
+        char *value = ++p;
+        p = strchr(p, quote);
+        if (!p)
+            return false;
+        *p++ = '\0';
+        oa_xml_unescape(value);
+
+        if (tag->n_attrs < OA_XML_MAX_ATTRS) {
+            tag->attrs[tag->n_attrs].name = name;
+            tag->attrs[tag->n_attrs].value = value;
+            tag->n_attrs++;
+        }
+    }
+
+    *cursor = p;
+    return true;
+}
+
+static const char *
+oa_xml_attr(const struct oa_xml_tag *tag, const char *name)
+{
+    for (int i = 0; i < tag->n_attrs; i++) {
+        if (!strcmp(tag->attrs[i].name, name))
+            return tag->attrs[i].value;
+    }
+    return NULL;
+}
+
+/**/
+
+/* Constants are folded following the C arithmetic of the generated
+ * equations, so that both engines compute the same values.
+ */
+
+enum oa_bc_type {
+    OA_BC_INT,
+    OA_BC_BOOL,
+    OA_BC_UINT32,
+    OA_BC_UINT64,
+    OA_BC_DOUBLE,
+};
+
+struct oa_bc_value {
+    enum oa_bc_type type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double f;
+    };
+};
+
+enum oa_bc_op {
+    OA_BC_OP_ADD,
+    OA_BC_OP_SUB,
+    OA_BC_OP_MUL,
+    OA_BC_OP_DIV,
+    OA_BC_OP_MIN,
+    OA_BC_OP_MAX,
+    OA_BC_OP_SHL,
+    OA_BC_OP_SHR,
+    OA_BC_OP_AND,
+};
+
+static enum oa_bc_type
+oa_bc_arith_type(enum oa_bc_type a, enum oa_bc_type b)
+{
+    if (a == OA_BC_DOUBLE || b == OA_BC_DOUBLE)
+        return OA_BC_DOUBLE;
+    if (a == OA_BC_UINT64 || b == OA_BC_UINT64)
+        return OA_BC_UINT64;
+    if (a == OA_BC_UINT32 || b == OA_BC_UINT32)
+        return OA_BC_UINT32;
+    return OA_BC_INT;
+}
+
+static struct oa_bc_value
+oa_bc_convert(struct oa_bc_value v, enum oa_bc_type type)
+{
+    struct oa_bc_value ret = { .type = type };
+
+    switch (type) {
+    case OA_BC_DOUBLE:
+        ret.f = v.type == OA_BC_DOUBLE ? v.f :
+                v.type == OA_BC_INT ? (double) v.i : (double) v.u;
+        break;
+    case OA_BC_UINT64:
+        ret.u = v.type == OA_BC_DOUBLE ? (uint64_t) v.f :
+                v.type == OA_BC_INT ? (uint64_t) v.i : v.u;
+        break;
+    case OA_BC_UINT32:
+        ret.u = (uint32_t) oa_bc_convert(v, OA_BC_UINT64).u;
+        break;
+    case OA_BC_INT:
+        ret.i = v.type == OA_BC_DOUBLE ? (int32_t) v.f :
+                (int32_t) oa_bc_convert(v, OA_BC_UINT64).u;
+        break;
+    case OA_BC_BOOL:
+        ret.u = v.type == OA_BC_DOUBLE ? v.f != 0 : v.u != 0;
+        break;
+    }
+
+    return ret;
+}
+
+static struct oa_bc_value
+oa_bc_fold(enum oa_bc_op op, struct oa_bc_value a, struct oa_bc_value b)
+{
+    enum oa_bc_type type;
+
+    if (op == OA_BC_OP_SHL || op == OA_BC_OP_SHR) {
+        type = a.type == OA_BC_BOOL ? OA_BC_INT : a.type;
+        a = oa_bc_convert(a, type);
+        unsigned shift = oa_bc_convert(b, OA_BC_UINT64).u & 63;
+        if (type == OA_BC_INT) {
+            a.i = op == OA_BC_OP_SHL ? (int32_t) ((uint32_t) a.i << shift) :
+                                       (int32_t) a.i >> shift;
+        } else {
+            a.u = op == OA_BC_OP_SHL ? a.u << shift : a.u >> shift;
+            a = oa_bc_convert(a, type);
+        }
+        return a;
+    }
+
+    type = oa_bc_arith_type(a.type, b.type);
+    a = oa_bc_convert(a, type);
+    b = oa_bc_convert(b, type);
+
+    struct oa_bc_value ret = { .type = type };
+    switch (type) {
+    case OA_BC_DOUBLE:
+        switch (op) {
+        case OA_BC_OP_ADD: ret.f = a.f + b.f; break;
+        case OA_BC_OP_SUB: ret.f = a.f - b.f; break;
+        case OA_BC_OP_MUL: ret.f = a.f * b.f; break;
+        case OA_BC_OP_DIV: ret.f = b.f ? a.f / b.f : 0; break;
+        case OA_BC_OP_MIN: ret.f = MIN2(a.f, b.f); break;
+        case OA_BC_OP_MAX: ret.f = MAX2(a.f, b.f); break;
+        default: unreachable("Invalid double op");
+        }
+        break;
+    case OA_BC_INT:
+        /* Signed overflow is undefined, go with the usual wrapping */
+        a.u = a.i;
+        b.u = b.i;
+        /* fallthrough */
+    default:
+        switch (op) {
+        case OA_BC_OP_ADD: ret.u = a.u + b.u; break;
+        case OA_BC_OP_SUB: ret.u = a.u - b.u; break;
+        case OA_BC_OP_MUL: ret.u = a.u * b.u; break;
+        case OA_BC_OP_DIV: ret.u = b.u ? a.u / b.u : 0; break;
+        case OA_BC_OP_MIN: ret.u = type == OA_BC_INT ? (uint64_t) MIN2(a.i, b.i) : MIN2(a.u, b.u); break;
+        case OA_BC_OP_MAX: ret.u = type == OA_BC_INT ? (uint64_t) MAX2(a.i, b.i) : MAX2(a.u, b.u); break;
+        case OA_BC_OP_AND: ret.u = a.u & b.u; break;
+        default: unreachable("Invalid integer op");
+        }
+        if (type == OA_BC_INT) {
+            ret.type = OA_BC_UINT64;
+            ret = oa_bc_convert(ret, OA_BC_INT);
+        } else
+            ret = oa_bc_convert(ret, type);
+        break;
+    }
+
+    return ret;
+}
+
+/**/
+
+enum oa_bc_opcode {
+    OA_BC_END,
+    OA_BC_UADD,
+    OA_BC_USUB,
+    OA_BC_UMUL,
+    OA_BC_UMUL_IMM,     /* src0 * imm */
+    OA_BC_UDIV,
+    OA_BC_UDIV_INV,     /* src0 / divisors[imm] */
+    OA_BC_UMIN,
+    OA_BC_SHL,
+    OA_BC_SHR,
+    OA_BC_AND,
+    OA_BC_FADD,
+    OA_BC_FSUB,
+    OA_BC_FMUL,
+    OA_BC_FDIV,
+    OA_BC_FDIV_U,       /* (double) src0 / (double) src1, both uint64 */
+    OA_BC_FMIN,
+    OA_BC_FMAX,
+    OA_BC_U2F,
+    OA_BC_F2U,
+    OA_BC_STORE_U,      /* out[imm] = (double) src0 */
+    OA_BC_STORE_F,      /* out[imm] = src0 */
+    OA_BC_N_OPCODES,
+};
+
+union oa_bc_lane {
+    uint64_t u;
+    double f;
+};
+
+struct oa_bc_insn {
+    uint16_t opcode;
+    uint16_t dst;
+    uint16_t src0;
+    uint16_t src1;
+    uint64_t imm;
+};
+
+/* Rows are the operands of the instructions, each holding one value per
+ * report of a tile: first the delta rows read by the equations, then the
+ * constant rows and finally the registers.
+ */
+struct gputop_oa_bytecode {
+    struct oa_bc_insn *insns;
+    uint32_t n_insns;
+
+    uint32_t n_rows;
+    uint32_t n_reads;
+    uint16_t *read_deltas;      /* delta index of each read row */
+    uint32_t n_constants;
+    union oa_bc_lane *constants; /* n_constants * OA_BC_TILE */
+    uint32_t n_registers;
+
+    struct gputop_udiv_invariant *divisors;
+    uint32_t n_divisors;
+};
+
+/**/
+
+/* Equations are compiled through a DAG of nodes, hash-consed for common
+ * subexpressions elimination across all the counters of a program.
+ */
+
+enum oa_bc_node_kind {
+    OA_BC_NODE_CONST,
+    OA_BC_NODE_READ,
+    OA_BC_NODE_INSN,
+};
+
+struct oa_bc_node_key {
+    enum oa_bc_node_kind kind;
+    enum oa_bc_type type;
+    enum oa_bc_opcode opcode;
+    int src0, src1;
+    uint64_t imm;
+};
+
+struct oa_bc_node {
+    struct oa_bc_node_key key;
+    struct oa_bc_value value;   /* OA_BC_NODE_CONST */
+
+    /* Emission state */
+    bool live;
+    int row;
+    int last_use;
+};
+
+struct oa_bc_output {
+    int node;
+    bool is_float;
+};
+
+struct oa_xml_counter;
+
+struct oa_bc_compiler {
+    void *mem_ctx;
+    const struct gputop_devinfo *devinfo;
+    const struct gputop_metric_set *metric_set;
+
+    struct oa_xml_counter *counters;
+    int n_counters;
+    int *value_nodes; /* per counter, -1 if not compiled yet, -2 while compiling */
+
+    struct oa_bc_node *nodes;
+    int n_nodes;
+    int size_nodes;
+    struct hash_table *node_map;
+
+    struct oa_bc_output *outputs;
+    int n_outputs;
+    int size_outputs;
+
+    const char *error;
+};
+
+struct oa_xml_counter {
+    const char *name;
+    const char *symbol_name;
+    const char *description;
+    const char *data_type;
+    const char *semantic_type;
+    const char *units;
+    const char *equation;
+    const char *max_equation;
+    const char *availability;
+    const char *mdapi_group;
+};
+
+static uint32_t
+oa_bc_node_key_hash(const void *key)
+{
+    return _mesa_hash_data(key, sizeof(struct oa_bc_node_key));
+}
+
+static bool
+oa_bc_node_key_equal(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(struct oa_bc_node_key)) == 0;
+}
+
+static int
+oa_bc_node(struct oa_bc_compiler *compiler,
+           enum oa_bc_node_kind kind, enum oa_bc_type type,
+           enum oa_bc_opcode opcode, int src0, int src1, uint64_t imm)
+{
+    struct oa_bc_node_key *key = rzalloc(compiler->mem_ctx, struct oa_bc_node_key);
+
+    key->kind = kind;
+    key->type = type;
+    key->opcode = opcode;
+    key->src0 = src0;
+    key->src1 = src1;
+    key->imm = imm;
+
+    struct hash_entry *entry = _mesa_hash_table_search(compiler->node_map, key);
+    if (entry) {
+        ralloc_free(key);
+        return (intptr_t) entry->data;
+    }
+
+    if (compiler->n_nodes == compiler->size_nodes) {
+        compiler->size_nodes = MAX2(64, compiler->size_nodes * 2);
+        compiler->nodes = reralloc(compiler->mem_ctx, compiler->nodes,
+                                   struct oa_bc_node, compiler->size_nodes);
+    }
+
+    int index = compiler->n_nodes++;
+    struct oa_bc_node *node = &compiler->nodes[index];
+    memset(node, 0, sizeof(*node));
+    node->key = *key;
+    node->row = -1;
+    node->last_use = -1;
+
+    _mesa_hash_table_insert(compiler->node_map, key, (void *)(intptr_t) index);
+
+    return index;
+}
+
+static int
+oa_bc_const(struct oa_bc_compiler *compiler, struct oa_bc_value value)
+{
+    uint64_t bits = value.u;
+    int index = oa_bc_node(compiler, OA_BC_NODE_CONST, value.type, OA_BC_END, -1, -1, bits);
+
+    compiler->nodes[index].value = value;
+    return index;
+}
+
+static int
+oa_bc_const_u64(struct oa_bc_compiler *compiler, uint64_t u)
+{
+    struct oa_bc_value value = { .type = OA_BC_UINT64, .u = u };
+    return oa_bc_const(compiler, value);
+}
+
+static bool
+oa_bc_is_const(struct oa_bc_compiler *compiler, int node)
+{
+    return compiler->nodes[node].key.kind == OA_BC_NODE_CONST;
+}
+
+static enum oa_bc_type
+oa_bc_type(struct oa_bc_compiler *compiler, int node)
+{
+    return compiler->nodes[node].key.type;
+}
+
+static int
+oa_bc_insn(struct oa_bc_compiler *compiler, enum oa_bc_type type,
+           enum oa_bc_opcode opcode, int src0, int src1, uint64_t imm)
+{
+    return oa_bc_node(compiler, OA_BC_NODE_INSN, type, opcode, src0, src1, imm);
+}
+
+static int
+oa_bc_convert_node(struct oa_bc_compiler *compiler, int node, enum oa_bc_type type)
+{
+    enum oa_bc_type from = oa_bc_type(compiler, node);
+
+    if (from == type)
+        return node;
+    if (oa_bc_is_const(compiler, node))
+        return oa_bc_const(compiler, oa_bc_convert(compiler->nodes[node].value, type));
+
+    /* Only constants have types other than uint64/double */
+    assert(type == OA_BC_UINT64 || type == OA_BC_DOUBLE);
+    return oa_bc_insn(compiler, type,
+                      type == OA_BC_DOUBLE ? OA_BC_U2F : OA_BC_F2U,
+                      node, -1, 0);
+}
+
+/* Builds a binary op, evaluated in the type C would use for its operands
+ * and converted to the type of the generated temporary.
+ */
+static int
+oa_bc_binop(struct oa_bc_compiler *compiler, enum oa_bc_type type,
+            enum oa_bc_op op, int a, int b)
+{
+    if (oa_bc_is_const(compiler, a) && oa_bc_is_const(compiler, b)) {
+        struct oa_bc_value value = oa_bc_fold(op, compiler->nodes[a].value,
+                                              compiler->nodes[b].value);
+        return oa_bc_const(compiler, oa_bc_convert(value, type));
+    }
+
+    enum oa_bc_type op_type = oa_bc_arith_type(oa_bc_type(compiler, a),
+                                               oa_bc_type(compiler, b));
+    if (op == OA_BC_OP_SHL || op == OA_BC_OP_SHR)
+        op_type = oa_bc_type(compiler, a) == OA_BC_DOUBLE ? OA_BC_DOUBLE : OA_BC_UINT64;
+    else if (op_type != OA_BC_DOUBLE)
+        op_type = OA_BC_UINT64;
+
+    static const enum oa_bc_opcode u_opcodes[] = {
+        [OA_BC_OP_ADD] = OA_BC_UADD,
+        [OA_BC_OP_SUB] = OA_BC_USUB,
+        [OA_BC_OP_MUL] = OA_BC_UMUL,
+        [OA_BC_OP_DIV] = OA_BC_UDIV,
+        [OA_BC_OP_MIN] = OA_BC_UMIN,
+        [OA_BC_OP_MAX] = OA_BC_END,
+        [OA_BC_OP_SHL] = OA_BC_SHL,
+        [OA_BC_OP_SHR] = OA_BC_SHR,
+        [OA_BC_OP_AND] = OA_BC_AND,
+    };
+    static const enum oa_bc_opcode f_opcodes[] = {
+        [OA_BC_OP_ADD] = OA_BC_FADD,
+        [OA_BC_OP_SUB] = OA_BC_FSUB,
+        [OA_BC_OP_MUL] = OA_BC_FMUL,
+        [OA_BC_OP_DIV] = OA_BC_FDIV,
+        [OA_BC_OP_MIN] = OA_BC_FMIN,
+        [OA_BC_OP_MAX] = OA_BC_FMAX,
+        [OA_BC_OP_SHL] = OA_BC_END,
+        [OA_BC_OP_SHR] = OA_BC_END,
+        [OA_BC_OP_AND] = OA_BC_END,
+    };
+    enum oa_bc_opcode opcode =
+        op_type == OA_BC_DOUBLE ? f_opcodes[op] : u_opcodes[op];
+    if (opcode == OA_BC_END) {
+        compiler->error = "unsupported operand types";
+        return oa_bc_const_u64(compiler, 0);
+    }
+
+    /* Shifts keep the type of their first operand, the shift count being
+     * taken as is.
+     */
+    a = oa_bc_convert_node(compiler, a, op_type);
+    if (op != OA_BC_OP_SHL && op != OA_BC_OP_SHR)
+        b = oa_bc_convert_node(compiler, b, op_type);
+    else
+        b = oa_bc_convert_node(compiler, b, OA_BC_UINT64);
+
+    int node;
+    if (opcode == OA_BC_UMUL && (oa_bc_is_const(compiler, a) || oa_bc_is_const(compiler, b))) {
+        if (oa_bc_is_const(compiler, a)) {
+            int tmp = a;
+            a = b;
+            b = tmp;
+        }
+        node = oa_bc_insn(compiler, OA_BC_UINT64, OA_BC_UMUL_IMM, a, -1,
+                          compiler->nodes[b].value.u);
+    } else if (opcode == OA_BC_UDIV && oa_bc_is_const(compiler, b)) {
+        uint64_t divisor = compiler->nodes[b].value.u;
+        if (!divisor)
+            node = oa_bc_const_u64(compiler, 0);
+        else
+            node = oa_bc_insn(compiler, OA_BC_UINT64, OA_BC_UDIV_INV, a, -1, divisor);
+    } else if (opcode == OA_BC_FDIV &&
+               compiler->nodes[a].key.kind == OA_BC_NODE_INSN &&
+               compiler->nodes[a].key.opcode == OA_BC_U2F &&
+               compiler->nodes[b].key.kind == OA_BC_NODE_INSN &&
+               compiler->nodes[b].key.opcode == OA_BC_U2F) {
+        /* The usual percentage of cycles and the like */
+        node = oa_bc_insn(compiler, OA_BC_DOUBLE, OA_BC_FDIV_U,
+                          compiler->nodes[a].key.src0,
+                          compiler->nodes[b].key.src0, 0);
+    } else
+        node = oa_bc_insn(compiler, op_type, opcode, a, b, 0);
+
+    return oa_bc_convert_node(compiler, node, type);
+}
+
+static const struct {
+    const char *name;
+    size_t offset;
+    enum oa_bc_type type;
+} oa_bc_hw_vars[] = {
+#define HW_VAR(name, field, type) { name, offsetof(struct gputop_devinfo, field), type }
+    HW_VAR("$EuCoresTotalCount", n_eus, OA_BC_UINT64),
+    HW_VAR("$EuSlicesTotalCount", n_eu_slices, OA_BC_UINT64),
+    HW_VAR("$EuSubslicesTotalCount", n_eu_sub_slices, OA_BC_UINT64),
+    HW_VAR("$EuThreadsCount", eu_threads_count, OA_BC_UINT64),
+    HW_VAR("$SliceMask", slice_mask, OA_BC_UINT64),
+    HW_VAR("$SubsliceMask", subslice_mask, OA_BC_UINT64),
+    HW_VAR("$DualSubsliceMask", subslice_mask, OA_BC_UINT64),
+    HW_VAR("$GpuTimestampFrequency", timestamp_frequency, OA_BC_UINT64),
+    HW_VAR("$GpuMinFrequency", gt_min_freq, OA_BC_UINT64),
+    HW_VAR("$GpuMaxFrequency", gt_max_freq, OA_BC_UINT64),
+    HW_VAR("$SkuRevisionId", revision, OA_BC_UINT32),
+    HW_VAR("$QueryMode", query_mode, OA_BC_BOOL),
+#undef HW_VAR
+};
+
+static bool
+oa_bc_hw_var(const struct gputop_devinfo *devinfo, const char *name,
+             struct oa_bc_value *value)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(oa_bc_hw_vars); i++) {
+        if (strcmp(oa_bc_hw_vars[i].name, name))
+            continue;
+
+        const uint8_t *field = (const uint8_t *) devinfo + oa_bc_hw_vars[i].offset;
+        value->type = oa_bc_hw_vars[i].type;
+        switch (value->type) {
+        case OA_BC_UINT64: value->u = *(const uint64_t *) field; break;
+        case OA_BC_UINT32: value->u = *(const uint32_t *) field; break;
+        case OA_BC_BOOL: value->u = *(const bool *) field; break;
+        default: unreachable("Invalid variable type");
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static struct oa_xml_counter *
+oa_bc_find_counter(struct oa_bc_compiler *compiler, const char *symbol_name)
+{
+    for (int i = 0; i < compiler->n_counters; i++) {
+        if (!strcmp(compiler->counters[i].symbol_name, symbol_name))
+            return &compiler->counters[i];
+    }
+    return NULL;
+}
+
+static int oa_bc_counter_value(struct oa_bc_compiler *compiler,
+                               struct oa_xml_counter *counter);
+
+static int
+oa_bc_operand(struct oa_bc_compiler *compiler, const char *token)
+{
+    if (token[0] == '$') {
+        struct oa_bc_value value;
+        if (oa_bc_hw_var(compiler->devinfo, token, &value))
+            return oa_bc_const(compiler, value);
+
+        struct oa_xml_counter *counter = oa_bc_find_counter(compiler, token + 1);
+        if (counter)
+            return oa_bc_counter_value(compiler, counter);
+    } else if (token[0] >= '0' && token[0] <= '9') {
+        struct oa_bc_value value = {
+            .type = OA_BC_INT,
+            .i = strtoll(token, NULL, 0),
+        };
+        return oa_bc_const(compiler, value);
+    }
+
+    compiler->error = "unknown operand";
+    return oa_bc_const_u64(compiler, 0);
+}
+
+static int
+oa_bc_read(struct oa_bc_compiler *compiler, const char *type, const char *index)
+{
+    const struct gputop_metric_set *metric_set = compiler->metric_set;
+    int offset = -1;
+
+    if (!strcmp(type, "A"))
+        offset = metric_set->a_offset;
+    else if (!strcmp(type, "B"))
+        offset = metric_set->b_offset;
+    else if (!strcmp(type, "C"))
+        offset = metric_set->c_offset;
+    else if (!strcmp(type, "GPU_TIME"))
+        offset = metric_set->gpu_time_offset;
+    else if (!strcmp(type, "GPU_CLOCK"))
+        offset = metric_set->gpu_clock_offset;
+
+    if (offset < 0) {
+        compiler->error = "invalid READ";
+        return oa_bc_const_u64(compiler, 0);
+    }
+
+    return oa_bc_node(compiler, OA_BC_NODE_READ, OA_BC_UINT64, OA_BC_END, -1, -1,
+                      offset + strtoul(index, NULL, 0));
+}
+
+#define OA_BC_MAX_STACK 64
+
+/* RPN stack entry, operands are only resolved once an op uses them since
+ * READ takes raw tokens.
+ */
+struct oa_bc_stack_entry {
+    const char *token;
+    int node;
+};
+
+static int
+oa_bc_pop(struct oa_bc_compiler *compiler, struct oa_bc_stack_entry *stack, int *n)
+{
+    if (*n < 1) {
+        compiler->error = "stack underflow";
+        return oa_bc_const_u64(compiler, 0);
+    }
+
+    struct oa_bc_stack_entry *entry = &stack[--(*n)];
+    return entry->node >= 0 ? entry->node : oa_bc_operand(compiler, entry->token);
+}
+
+/* Compiles an RPN equation, with the C types of the generated code: F ops
+ * produce doubles and the others uint64 values.
+ */
+static int
+oa_bc_equation(struct oa_bc_compiler *compiler, const char *equation)
+{
+    static const struct {
+        const char *name;
+        enum oa_bc_type type;
+        enum oa_bc_op op;
+        bool convert_operands; /* to type, before the op */
+    } ops[] = {
+        { "FADD",  OA_BC_DOUBLE, OA_BC_OP_ADD, false },
+        { "FSUB",  OA_BC_DOUBLE, OA_BC_OP_SUB, false },
+        { "FMUL",  OA_BC_DOUBLE, OA_BC_OP_MUL, false },
+        { "FDIV",  OA_BC_DOUBLE, OA_BC_OP_DIV, true },
+        { "FMAX",  OA_BC_DOUBLE, OA_BC_OP_MAX, true },
+        { "UADD",  OA_BC_UINT64, OA_BC_OP_ADD, false },
+        { "USUB",  OA_BC_UINT64, OA_BC_OP_SUB, false },
+        { "UMUL",  OA_BC_UINT64, OA_BC_OP_MUL, false },
+        { "UDIV",  OA_BC_UINT64, OA_BC_OP_DIV, true },
+        { "UMIN",  OA_BC_UINT64, OA_BC_OP_MIN, false },
+        { "<<",    OA_BC_UINT64, OA_BC_OP_SHL, false },
+        { ">>",    OA_BC_UINT64, OA_BC_OP_SHR, false },
+        { "AND",   OA_BC_UINT64, OA_BC_OP_AND, false },
+    };
+    struct oa_bc_stack_entry stack[OA_BC_MAX_STACK];
+    int n = 0;
+    char *tokens = ralloc_strdup(compiler->mem_ctx, equation);
+    char *save = NULL;
+
+    for (char *token = strtok_r(tokens, " \t\n", &save);
+         token && !compiler->error;
+         token = strtok_r(NULL, " \t\n", &save)) {
+        int node = -1;
+
+        if (!strcmp(token, "READ")) {
+            if (n < 2 || stack[n - 1].node >= 0 || stack[n - 2].node >= 0) {
+                compiler->error = "invalid READ";
+                break;
+            }
+            node = oa_bc_read(compiler, stack[n - 2].token, stack[n - 1].token);
+            n -= 2;
+        } else if (!strcmp(token, "READ_REG")) {
+            /* Register snapshots are only available in query mode */
+            if (n < 1) {
+                compiler->error = "invalid READ_REG";
+                break;
+            }
+            n--;
+            node = oa_bc_const_u64(compiler, 0);
+        } else {
+            for (unsigned i = 0; i < ARRAY_SIZE(ops); i++) {
+                if (strcmp(token, ops[i].name))
+                    continue;
+
+                int b = oa_bc_pop(compiler, stack, &n);
+                int a = oa_bc_pop(compiler, stack, &n);
+                if (ops[i].convert_operands) {
+                    a = oa_bc_convert_node(compiler, a, ops[i].type);
+                    b = oa_bc_convert_node(compiler, b, ops[i].type);
+                }
+                node = oa_bc_binop(compiler, ops[i].type, ops[i].op, a, b);
+                break;
+            }
+        }
+
+        if (n >= OA_BC_MAX_STACK) {
+            compiler->error = "stack overflow";
+            break;
+        }
+        stack[n].token = token;
+        stack[n].node = node;
+        n++;
+    }
+
+    int node = oa_bc_pop(compiler, stack, &n);
+    if (n != 0 && !compiler->error)
+        compiler->error = "spurious operands";
+
+    return node;
+}
+
+static int
+oa_bc_counter_value(struct oa_bc_compiler *compiler, struct oa_xml_counter *counter)
+{
+    int *value_node = &compiler->value_nodes[counter - compiler->counters];
+
+    if (*value_node >= 0)
+        return *value_node;
+
+    if (*value_node == -2) {
+        compiler->error = "recursive counter reference";
+        return oa_bc_const_u64(compiler, 0);
+    }
+
+    *value_node = -2;
+    int node = oa_bc_equation(compiler, counter->equation);
+
+    /* Converted like the return value of the generated read function */
+    node = oa_bc_convert_node(compiler, node,
+                              strcmp(counter->data_type, "float") ?
+                              OA_BC_UINT64 : OA_BC_DOUBLE);
+    *value_node = node;
+
+    return node;
+}
+
+static void
+oa_bc_add_output(struct oa_bc_compiler *compiler, int node, bool is_float)
+{
+    if (compiler->n_outputs == compiler->size_outputs) {
+        compiler->size_outputs = MAX2(16, compiler->size_outputs * 2);
+        compiler->outputs = reralloc(compiler->mem_ctx, compiler->outputs,
+                                     struct oa_bc_output, compiler->size_outputs);
+    }
+
+    compiler->outputs[compiler->n_outputs].node =
+        oa_bc_convert_node(compiler, node, is_float ? OA_BC_DOUBLE : OA_BC_UINT64);
+    compiler->outputs[compiler->n_outputs].is_float = is_float;
+    compiler->n_outputs++;
+}
+
+static struct oa_bc_compiler *
+oa_bc_compiler_new(void *mem_ctx,
+                   const struct gputop_devinfo *devinfo,
+                   const struct gputop_metric_set *metric_set,
+                   struct oa_xml_counter *counters, int n_counters)
+{
+    struct oa_bc_compiler *compiler = rzalloc(mem_ctx, struct oa_bc_compiler);
+
+    compiler->mem_ctx = compiler;
+    compiler->devinfo = devinfo;
+    compiler->metric_set = metric_set;
+    compiler->counters = counters;
+    compiler->n_counters = n_counters;
+    compiler->node_map = _mesa_hash_table_create(compiler,
+                                                 oa_bc_node_key_hash,
+                                                 oa_bc_node_key_equal);
+
+    compiler->value_nodes = ralloc_array(compiler, int, n_counters);
+    for (int i = 0; i < n_counters; i++)
+        compiler->value_nodes[i] = -1;
+
+    return compiler;
+}
+
+/**/
+
+static int
+oa_bc_node_sources(const struct oa_bc_node *node, int sources[2])
+{
+    int n = 0;
+
+    if (node->key.kind != OA_BC_NODE_INSN)
+        return 0;
+    if (node->key.src0 >= 0)
+        sources[n++] = node->key.src0;
+    if (node->key.src1 >= 0)
+        sources[n++] = node->key.src1;
+    return n;
+}
+
+static uint16_t
+oa_bc_alloc_register(int *free_registers, int *n_free, uint32_t *n_registers)
+{
+    if (*n_free)
+        return free_registers[--(*n_free)];
+    return (*n_registers)++;
+}
+
+/* Lowers the live nodes of the DAG, which are in dependency order, to
+ * instructions reusing registers once their last user has been emitted.
+ */
+static struct gputop_oa_bytecode *
+oa_bc_compiler_emit(struct oa_bc_compiler *compiler, void *mem_ctx)
+{
+    struct oa_bc_node *nodes = compiler->nodes;
+    int sources[2];
+
+    for (int i = 0; i < compiler->n_outputs; i++)
+        nodes[compiler->outputs[i].node].live = true;
+    for (int i = compiler->n_nodes - 1; i >= 0; i--) {
+        if (!nodes[i].live)
+            continue;
+        int n_sources = oa_bc_node_sources(&nodes[i], sources);
+        for (int s = 0; s < n_sources; s++)
+            nodes[sources[s]].live = true;
+    }
+
+    struct gputop_oa_bytecode *program = rzalloc(mem_ctx, struct gputop_oa_bytecode);
+
+    /* Rows of the reads and constants */
+    for (int i = 0; i < compiler->n_nodes; i++) {
+        if (!nodes[i].live)
+            continue;
+        if (nodes[i].key.kind == OA_BC_NODE_READ)
+            program->n_reads++;
+        else if (nodes[i].key.kind == OA_BC_NODE_CONST)
+            program->n_constants++;
+    }
+    program->read_deltas = ralloc_array(program, uint16_t, program->n_reads);
+    program->constants = ralloc_array(program, union oa_bc_lane,
+                                      program->n_constants * OA_BC_TILE);
+    program->n_reads = 0;
+    program->n_constants = 0;
+    for (int i = 0; i < compiler->n_nodes; i++) {
+        if (!nodes[i].live)
+            continue;
+        if (nodes[i].key.kind == OA_BC_NODE_READ) {
+            nodes[i].row = program->n_reads;
+            program->read_deltas[program->n_reads++] = nodes[i].key.imm;
+        } else if (nodes[i].key.kind == OA_BC_NODE_CONST) {
+            struct oa_bc_value value = nodes[i].value;
+            union oa_bc_lane lane;
+
+            if (value.type == OA_BC_DOUBLE)
+                lane.f = value.f;
+            else
+                lane.u = oa_bc_convert(value, OA_BC_UINT64).u;
+
+            nodes[i].row = -2 - program->n_constants;
+            for (int l = 0; l < OA_BC_TILE; l++)
+                program->constants[program->n_constants * OA_BC_TILE + l] = lane;
+            program->n_constants++;
+        }
+    }
+
+    /* Instructions are emitted in node order, each value being stored as
+     * soon as it's computed so that output registers can be reused.
+     */
+    int *order = ralloc_array(compiler, int, compiler->n_nodes + compiler->n_outputs);
+    int n_order = 0;
+    for (int i = 0; i < compiler->n_outputs; i++) {
+        if (nodes[compiler->outputs[i].node].key.kind != OA_BC_NODE_INSN)
+            order[n_order++] = -1 - i;
+    }
+    for (int i = 0; i < compiler->n_nodes; i++) {
+        if (!nodes[i].live || nodes[i].key.kind != OA_BC_NODE_INSN)
+            continue;
+        order[n_order++] = i;
+        for (int o = 0; o < compiler->n_outputs; o++) {
+            if (compiler->outputs[o].node == i)
+                order[n_order++] = -1 - o;
+        }
+    }
+
+    for (int i = 0; i < n_order; i++) {
+        if (order[i] < 0) {
+            nodes[compiler->outputs[-1 - order[i]].node].last_use = i;
+        } else {
+            int n_sources = oa_bc_node_sources(&nodes[order[i]], sources);
+            for (int s = 0; s < n_sources; s++)
+                nodes[sources[s]].last_use = i;
+        }
+    }
+
+    program->insns = ralloc_array(program, struct oa_bc_insn, n_order + 1);
+
+    int *free_registers = ralloc_array(compiler, int, n_order + 1);
+    int n_free = 0;
+    uint32_t first_register = program->n_reads + program->n_constants;
+
+#define ROW(node) ((uint16_t) (nodes[node].row >= 0 ? nodes[node].row :   \
+                               program->n_reads - 2 - nodes[node].row))
+
+    for (int i = 0; i < n_order; i++) {
+        struct oa_bc_insn *insn = &program->insns[program->n_insns++];
+        int n_sources;
+
+        memset(insn, 0, sizeof(*insn));
+
+        if (order[i] < 0) {
+            const struct oa_bc_output *output = &compiler->outputs[-1 - order[i]];
+
+            insn->opcode = output->is_float ? OA_BC_STORE_F : OA_BC_STORE_U;
+            insn->src0 = ROW(output->node);
+            insn->imm = output - compiler->outputs;
+            sources[0] = output->node;
+            n_sources = 1;
+        } else {
+            struct oa_bc_node *node = &nodes[order[i]];
+
+            insn->opcode = node->key.opcode;
+            insn->src0 = node->key.src0 >= 0 ? ROW(node->key.src0) : 0;
+            insn->src1 = node->key.src1 >= 0 ? ROW(node->key.src1) : 0;
+            insn->imm = node->key.imm;
+
+            if (insn->opcode == OA_BC_UDIV_INV) {
+                program->divisors = reralloc(program, program->divisors,
+                                             struct gputop_udiv_invariant,
+                                             program->n_divisors + 1);
+                gputop_udiv_invariant_init(&program->divisors[program->n_divisors],
+                                           node->key.imm);
+                insn->imm = program->n_divisors++;
+            }
+
+            /* The destination is allocated before releasing the sources
+             * so that it never aliases them.
+             */
+            node->row = first_register + oa_bc_alloc_register(free_registers, &n_free,
+                                                              &program->n_registers);
+            insn->dst = node->row;
+
+            n_sources = oa_bc_node_sources(node, sources);
+        }
+
+        for (int s = 0; s < n_sources; s++) {
+            struct oa_bc_node *source = &nodes[sources[s]];
+            if (source->last_use == i && source->row >= (int) first_register &&
+                (s == 0 || sources[0] != sources[1])) {
+                free_registers[n_free++] = source->row - first_register;
+            }
+        }
+    }
+    program->insns[program->n_insns++].opcode = OA_BC_END;
+
+#undef ROW
+
+    program->n_rows = first_register + program->n_registers;
+    assert(program->n_rows <= UINT16_MAX);
+
+    return program;
+}
+
+/**/
+
+#if defined(__GNUC__)
+#define OA_BC_THREADED_DISPATCH 1
+#endif
+
+void
+gputop_oa_bytecode_run(const struct gputop_oa_bytecode *program,
+                       const uint64_t *deltas,
+                       uint32_t n_reports,
+                       double *out)
+{
+    uint32_t tile = MIN2(n_reports, OA_BC_TILE);
+    union oa_bc_lane stack_lanes[1024];
+    union oa_bc_lane *lanes = stack_lanes;
+    const union oa_bc_lane *rows[program->n_rows + 1];
+
+    if (program->n_registers * tile > ARRAY_SIZE(stack_lanes))
+        lanes = malloc(program->n_registers * tile * sizeof(*lanes));
+
+    for (uint32_t i = 0; i < program->n_constants; i++)
+        rows[program->n_reads + i] = program->constants + i * OA_BC_TILE;
+    for (uint32_t i = 0; i < program->n_registers; i++)
+        rows[program->n_reads + program->n_constants + i] = lanes + i * tile;
+
+#define SRC0 rows[insn->src0]
+#define SRC1 rows[insn->src1]
+#define DST ((union oa_bc_lane *) rows[insn->dst])
+#define LOOP(expr) do {                                                 \
+        const union oa_bc_lane *restrict a = SRC0;                      \
+        const union oa_bc_lane *restrict b = SRC1;                      \
+        union oa_bc_lane *restrict d = DST;                             \
+        (void) a; (void) b; (void) d;                                   \
+        for (uint32_t r = 0; r < n; r++)                                \
+            expr;                                                       \
+    } while (0)
+
+#ifdef OA_BC_THREADED_DISPATCH
+    static const void *dispatch[OA_BC_N_OPCODES] = {
+        [OA_BC_END] = &&op_END,
+        [OA_BC_UADD] = &&op_UADD,
+        [OA_BC_USUB] = &&op_USUB,
+        [OA_BC_UMUL] = &&op_UMUL,
+        [OA_BC_UMUL_IMM] = &&op_UMUL_IMM,
+        [OA_BC_UDIV] = &&op_UDIV,
+        [OA_BC_UDIV_INV] = &&op_UDIV_INV,
+        [OA_BC_UMIN] = &&op_UMIN,
+        [OA_BC_SHL] = &&op_SHL,
+        [OA_BC_SHR] = &&op_SHR,
+        [OA_BC_AND] = &&op_AND,
+        [OA_BC_FADD] = &&op_FADD,
+        [OA_BC_FSUB] = &&op_FSUB,
+        [OA_BC_FMUL] = &&op_FMUL,
+        [OA_BC_FDIV] = &&op_FDIV,
+        [OA_BC_FDIV_U] = &&op_FDIV_U,
+        [OA_BC_FMIN] = &&op_FMIN,
+        [OA_BC_FMAX] = &&op_FMAX,
+        [OA_BC_U2F] = &&op_U2F,
+        [OA_BC_F2U] = &&op_F2U,
+        [OA_BC_STORE_U] = &&op_STORE_U,
+        [OA_BC_STORE_F] = &&op_STORE_F,
+    };
+#define OP(name) op_##name:
+#define NEXT() goto *dispatch[(++insn)->opcode]
+#define DISPATCH() goto *dispatch[insn->opcode];
+#else
+#define OP(name) case OA_BC_##name:
+#define NEXT() insn++; continue
+#define DISPATCH() for (;;) switch (insn->opcode)
+#endif
+
+    for (uint32_t r0 = 0; r0 < n_reports; r0 += OA_BC_TILE) {
+        uint32_t n = MIN2(n_reports - r0, OA_BC_TILE);
+        const struct oa_bc_insn *insn = program->insns;
+
+        for (uint32_t i = 0; i < program->n_reads; i++) {
+            rows[i] = (const union oa_bc_lane *)
+                (deltas + (size_t) program->read_deltas[i] * n_reports + r0);
+        }
+
+        DISPATCH() {
+        OP(UADD)     LOOP(d[r].u = a[r].u + b[r].u); NEXT();
+        OP(USUB)     LOOP(d[r].u = a[r].u - b[r].u); NEXT();
+        OP(UMUL)     LOOP(d[r].u = a[r].u * b[r].u); NEXT();
+        OP(UMUL_IMM) {
+            uint64_t imm = insn->imm;
+            LOOP(d[r].u = a[r].u * imm);
+            NEXT();
+        }
+        OP(UDIV)     LOOP(d[r].u = b[r].u ? a[r].u / b[r].u : 0); NEXT();
+        OP(UDIV_INV) {
+            const struct gputop_udiv_invariant div = program->divisors[insn->imm];
+            LOOP(d[r].u = gputop_udiv_invariant(&div, a[r].u));
+            NEXT();
+        }
+        OP(UMIN)     LOOP(d[r].u = MIN2(a[r].u, b[r].u)); NEXT();
+        OP(SHL)      LOOP(d[r].u = a[r].u << b[r].u); NEXT();
+        OP(SHR)      LOOP(d[r].u = a[r].u >> b[r].u); NEXT();
+        OP(AND)      LOOP(d[r].u = a[r].u & b[r].u); NEXT();
+        OP(FADD)     LOOP(d[r].f = a[r].f + b[r].f); NEXT();
+        OP(FSUB)     LOOP(d[r].f = a[r].f - b[r].f); NEXT();
+        OP(FMUL)     LOOP(d[r].f = a[r].f * b[r].f); NEXT();
+        OP(FDIV)     LOOP(d[r].f = b[r].f ? a[r].f / b[r].f : 0); NEXT();
+        OP(FDIV_U)   LOOP(d[r].f = b[r].u ? (double) a[r].u / (double) b[r].u : 0); NEXT();
+        OP(FMIN)     LOOP(d[r].f = MIN2(a[r].f, b[r].f)); NEXT();
+        OP(FMAX)     LOOP(d[r].f = MAX2(a[r].f, b[r].f)); NEXT();
+        OP(U2F)      LOOP(d[r].f = a[r].u); NEXT();
+        OP(F2U)      LOOP(d[r].u = a[r].f); NEXT();
+        OP(STORE_U) {
+            const union oa_bc_lane *restrict a = SRC0;
+            double *restrict o = out + insn->imm * n_reports + r0;
+            for (uint32_t r = 0; r < n; r++)
+                o[r] = a[r].u;
+            NEXT();
+        }
+        OP(STORE_F) {
+            const union oa_bc_lane *restrict a = SRC0;
+            double *restrict o = out + insn->imm * n_reports + r0;
+            for (uint32_t r = 0; r < n; r++)
+                o[r] = a[r].f;
+            NEXT();
+        }
+        OP(END)
+#ifndef OA_BC_THREADED_DISPATCH
+        default:
+#endif
+            goto tile_done;
+        }
+    tile_done:
+        ;
+    }
+
+#undef OP
+#undef NEXT
+#undef DISPATCH
+#undef LOOP
+#undef DST
+#undef SRC1
+#undef SRC0
+
+    if (lanes != stack_lanes)
+        free(lanes);
+}
+
+size_t
+gputop_oa_bytecode_size(const struct gputop_oa_bytecode *program)
+{
+    return sizeof(*program) +
+        program->n_insns * sizeof(program->insns[0]) +
+        program->n_reads * sizeof(program->read_deltas[0]) +
+        program->n_constants * OA_BC_TILE * sizeof(program->constants[0]) +
+        program->n_divisors * sizeof(program->divisors[0]);
+}
+
+/**/
+
+static void
+bytecode_read_all(const struct gputop_devinfo *devinfo,
+                  const struct gputop_metric_set *metric_set,
+                  const uint64_t *deltas,
+                  double *out)
+{
+    gputop_oa_bytecode_run(metric_set->program, deltas, 1, out);
+}
+
+static void
+bytecode_read_all_soa(const struct gputop_devinfo *devinfo,
+                      const struct gputop_metric_set *metric_set,
+                      const uint64_t *deltas,
+                      uint32_t n_reports,
+                      double *out)
+{
+    gputop_oa_bytecode_run(metric_set->program, deltas, n_reports, out);
+}
+
+static uint64_t
+oa_bc_strtou(const char *str)
+{
+    if (!strcmp(str, "true"))
+        return 1;
+    if (!strcmp(str, "false"))
+        return 0;
+    return strtoull(str, NULL, 0);
+}
+
+/* Evaluates an availability expression, RPN over the devinfo variables */
+static bool
+oa_bc_available(const struct gputop_devinfo *devinfo, const char *expression,
+                const char **error)
+{
+    uint64_t stack[OA_BC_MAX_STACK];
+    int n = 0;
+    char *tokens = strdup(expression);
+    char *save = NULL;
+
+    for (char *token = strtok_r(tokens, " \t\n", &save);
+         token && !*error;
+         token = strtok_r(NULL, " \t\n", &save)) {
+        struct oa_bc_value value;
+        bool is_op = !strcmp(token, "AND") || !strcmp(token, "UGTE") ||
+                     !strcmp(token, "ULT") || !strcmp(token, "&&");
+
+        if (is_op) {
+            if (n < 2) {
+                *error = "invalid availability";
+                break;
+            }
+            uint64_t b = stack[--n], a = stack[--n];
+            if (!strcmp(token, "AND"))
+                stack[n++] = a & b;
+            else if (!strcmp(token, "UGTE"))
+                stack[n++] = a >= b;
+            else if (!strcmp(token, "ULT"))
+                stack[n++] = a < b;
+            else
+                stack[n++] = a && b;
+        } else if (n >= OA_BC_MAX_STACK) {
+            *error = "invalid availability";
+        } else if (token[0] == '$') {
+            if (!oa_bc_hw_var(devinfo, token, &value)) {
+                *error = "unknown availability variable";
+                value.u = 0;
+            }
+            stack[n++] = value.u;
+        } else
+            stack[n++] = oa_bc_strtou(token);
+    }
+    free(tokens);
+
+    if (n != 1 && !*error)
+        *error = "invalid availability";
+
+    return n == 1 && stack[0];
+}
+
+static int
+oa_xml_counter_cmp(const void *a, const void *b)
+{
+    const struct oa_xml_counter *ca = a, *cb = b;
+    return strcmp(ca->symbol_name, cb->symbol_name);
+}
+
+static gputop_counter_units_t
+oa_bc_units(const char *units)
+{
+    static const char *names[GPUTOP_PERFQUERY_COUNTER_UNITS_MAX] = {
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_BYTES] = "bytes",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_HZ] = "hz",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_NS] = "ns",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_US] = "us",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_PIXELS] = "pixels",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_TEXELS] = "texels",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_THREADS] = "threads",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_PERCENT] = "percent",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_MESSAGES] = "messages",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_NUMBER] = "number",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_CYCLES] = "cycles",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_EVENTS] = "events",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_UTILIZATION] = "utilization",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_EU_SENDS_TO_L3_CACHE_LINES] = "eu sends to l3 cache lines",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_EU_ATOMIC_REQUESTS_TO_L3_CACHE_LINES] = "eu atomic requests to l3 cache lines",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_EU_REQUESTS_TO_L3_CACHE_LINES] = "eu requests to l3 cache lines",
+        [GPUTOP_PERFQUERY_COUNTER_UNITS_EU_BYTES_PER_L3_CACHE_LINE] = "eu bytes per l3 cache line",
+    };
+
+    for (int i = 0; i < GPUTOP_PERFQUERY_COUNTER_UNITS_MAX; i++) {
+        if (names[i] && !strcmp(names[i], units))
+            return i;
+    }
+    return GPUTOP_PERFQUERY_COUNTER_UNITS_NUMBER;
+}
+
+static gputop_counter_type_t
+oa_bc_semantic_type(const char *type)
+{
+    if (!strcmp(type, "event") || !strcmp(type, "ratio"))
+        return GPUTOP_PERFQUERY_COUNTER_EVENT;
+    if (!strcmp(type, "throughput"))
+        return GPUTOP_PERFQUERY_COUNTER_THROUGHPUT;
+    if (!strcmp(type, "timestamp"))
+        return GPUTOP_PERFQUERY_COUNTER_TIMESTAMP;
+    if (!strcmp(type, "duration_norm"))
+        return GPUTOP_PERFQUERY_COUNTER_DURATION_NORM;
+    if (!strcmp(type, "duration_raw"))
+        return GPUTOP_PERFQUERY_COUNTER_DURATION_RAW;
+    return GPUTOP_PERFQUERY_COUNTER_RAW;
+}
+
+/* Compiles the programs of a metric set: one evaluating all the available
+ * counters for read_all_soa() and one per counter read and max equation.
+ */
+static const char *
+oa_bc_add_metric_set(struct gputop_gen *gen,
+                     const struct gputop_devinfo *devinfo,
+                     const struct oa_xml_tag *set_tag,
+                     struct oa_xml_counter *counters, int n_counters)
+{
+    const char *chipset = oa_xml_attr(set_tag, "chipset");
+    const char *error = NULL;
+
+    struct gputop_metric_set *metric_set = rzalloc(gen, struct gputop_metric_set);
+    metric_set->name = ralloc_strdup(metric_set, oa_xml_attr(set_tag, "name"));
+    metric_set->symbol_name = ralloc_strdup(metric_set, oa_xml_attr(set_tag, "symbol_name"));
+    metric_set->hw_config_guid = ralloc_strdup(metric_set, oa_xml_attr(set_tag, "hw_config_guid"));
+    metric_set->counters = rzalloc_array(metric_set, struct gputop_metric_set_counter, n_counters);
+    metric_set->perf_oa_metrics_set = 0; // determined at runtime
+    metric_set->read_all = bytecode_read_all;
+    metric_set->read_all_soa = bytecode_read_all_soa;
+
+    /* Same as the format table of gputop-oa-codegen.py */
+    gputop_cc_oa_metric_set_init_format(metric_set,
+                                        chipset && !strcasecmp(chipset, "hsw") ?
+                                        I915_OA_FORMAT_A45_B8_C8 :
+                                        I915_OA_FORMAT_A32u40_A4u32_B8_C8);
+
+    qsort(counters, n_counters, sizeof(counters[0]), oa_xml_counter_cmp);
+
+    struct oa_bc_compiler *compiler =
+        oa_bc_compiler_new(metric_set, devinfo, metric_set, counters, n_counters);
+
+    for (int i = 0; i < n_counters && !error; i++) {
+        struct oa_xml_counter *xml_counter = &counters[i];
+
+        if (xml_counter->availability &&
+            !oa_bc_available(devinfo, xml_counter->availability, &error))
+            continue;
+
+        struct gputop_metric_set_counter *counter =
+            &metric_set->counters[metric_set->n_counters++];
+        bool is_float = !strcmp(xml_counter->data_type, "float");
+
+        counter->metric_set = metric_set;
+        counter->name = ralloc_strdup(metric_set, xml_counter->name);
+        counter->symbol_name = ralloc_strdup(metric_set, xml_counter->symbol_name);
+        counter->desc = ralloc_strdup(metric_set, xml_counter->description);
+        counter->type = oa_bc_semantic_type(xml_counter->semantic_type);
+        counter->data_type = is_float ? GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT :
+                                        GPUTOP_PERFQUERY_COUNTER_DATA_UINT64;
+        counter->units = oa_bc_units(xml_counter->units);
+
+        oa_bc_add_output(compiler, oa_bc_counter_value(compiler, xml_counter), is_float);
+
+        struct oa_bc_compiler *read_compiler =
+            oa_bc_compiler_new(metric_set, devinfo, metric_set, counters, n_counters);
+        oa_bc_add_output(read_compiler, oa_bc_counter_value(read_compiler, xml_counter), is_float);
+        counter->read_program = oa_bc_compiler_emit(read_compiler, metric_set);
+        error = read_compiler->error;
+        ralloc_free(read_compiler);
+
+        if (xml_counter->max_equation && !error) {
+            struct oa_bc_compiler *max_compiler =
+                oa_bc_compiler_new(metric_set, devinfo, metric_set, counters, n_counters);
+            oa_bc_add_output(max_compiler,
+                             oa_bc_equation(max_compiler, xml_counter->max_equation),
+                             is_float);
+            counter->max_program = oa_bc_compiler_emit(max_compiler, metric_set);
+            error = max_compiler->error;
+            ralloc_free(max_compiler);
+        }
+
+        gputop_gen_add_counter(gen, counter, xml_counter->mdapi_group ?
+                               xml_counter->mdapi_group : "");
+    }
+
+    if (!error) {
+        metric_set->program = oa_bc_compiler_emit(compiler, metric_set);
+        error = compiler->error;
+    }
+    ralloc_free(compiler);
+
+    if (error)
+        return error;
+
+    gputop_gen_add_metric_set(gen, metric_set);
+    return NULL;
+}
+
+struct gputop_gen *
+gputop_oa_bytecode_load_gen(const struct gputop_devinfo *devinfo,
+                            const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *buffer = malloc(size + 1);
+    if (!buffer || fread(buffer, 1, size, file) != size) {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    buffer[size] = '\0';
+    fclose(file);
+
+    struct gputop_gen *gen = gputop_gen_new(devinfo);
+    struct oa_xml_tag set_tag = { 0 }, tag;
+    bool in_set = false;
+    struct oa_xml_counter *counters = NULL;
+    int n_counters = 0, size_counters = 0;
+    const char *error = NULL;
+    char *cursor = buffer;
+
+    while (!error && oa_xml_next_tag(&cursor, &tag)) {
+        if (!strcmp(tag.name, "set")) {
+            if (tag.closing) {
+                if (in_set)
+                    error = oa_bc_add_metric_set(gen, devinfo, &set_tag, counters, n_counters);
+                in_set = false;
+            } else {
+                set_tag = tag;
+                in_set = true;
+                n_counters = 0;
+            }
+        } else if (in_set && !tag.closing && !strcmp(tag.name, "counter")) {
+            if (n_counters == size_counters) {
+                size_counters = MAX2(32, size_counters * 2);
+                counters = realloc(counters, size_counters * sizeof(*counters));
+            }
+
+            struct oa_xml_counter *counter = &counters[n_counters++];
+            counter->name = oa_xml_attr(&tag, "name");
+            counter->symbol_name = oa_xml_attr(&tag, "symbol_name");
+            counter->description = oa_xml_attr(&tag, "description");
+            counter->data_type = oa_xml_attr(&tag, "data_type");
+            counter->semantic_type = oa_xml_attr(&tag, "semantic_type");
+            counter->units = oa_xml_attr(&tag, "units");
+            counter->equation = oa_xml_attr(&tag, "equation");
+            counter->max_equation = oa_xml_attr(&tag, "max_equation");
+            counter->availability = oa_xml_attr(&tag, "availability");
+            counter->mdapi_group = oa_xml_attr(&tag, "mdapi_group");
+
+            if (!counter->name || !counter->symbol_name || !counter->description ||
+                !counter->data_type || !counter->semantic_type ||
+                !counter->units || !counter->equation)
+                error = "incomplete counter";
+        }
+    }
+
+    if (!error && in_set)
+        error = "truncated file";
+    if (!error && list_empty(&gen->metric_sets))
+        error = "no metric set";
+
+    free(counters);
+    free(buffer);
+
+    if (error) {
+        gputop_cr_console_log("Failed to load metrics from %s: %s", filename, error);
+        ralloc_free(gen);
+        return NULL;
+    }
+
+    return gen;
+}
@@ -0,0 +1,67 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "gputop-oa-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Alternative to the metrics compiled into gputop-gens-metrics.c: the
+ * metric sets of a single oa-<chipset>.xml file are loaded at runtime and
+ * their equations compiled into register based bytecode, specialized for
+ * one device (all the devinfo variables are folded as constants).
+ *
+ * Programs are evaluated over SoA delta vectors (see
+ * gputop_metric_set::read_all_soa), one instruction at a time over tiles
+ * of reports so that dispatching costs are shared by the whole tile.
+ */
+struct gputop_oa_bytecode;
+
+/* Parses filename and registers its metric sets, or returns NULL on
+ * error. The devinfo variables of the equations must have been built and
+ * devinfo must outlive the returned gen.
+ */
+struct gputop_gen *gputop_oa_bytecode_load_gen(const struct gputop_devinfo *devinfo,
+                                               const char *filename);
+
+/* Evaluates a program over n_reports SoA delta vectors, writing output i
+ * of report r at out[i * n_reports + r].
+ */
+void gputop_oa_bytecode_run(const struct gputop_oa_bytecode *program,
+                            const uint64_t *deltas,
+                            uint32_t n_reports,
+                            double *out);
+
+/* Bytes used by a program, for comparing with the generated code. */
+size_t gputop_oa_bytecode_size(const struct gputop_oa_bytecode *program);
+
+#ifdef __cplusplus
+}
+#endif
@@ -30,8 +30,15 @@
 #define EMSCRIPTEN_KEEPALIVE
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 
+#ifndef EMSCRIPTEN
+#include <pthread.h>
+#endif
+
+#include "util/macros.h"
+
 #include "gputop-oa-counters.h"
 
 #ifdef GPUTOP_CLIENT
@@ -84,7 +91,64 @@ gputop_u32_clock_progress(struct gputop_u32_clock *clock,
     clock->clock_count += u32_end_timestamp - u32_start_timestamp;
 }
 
-static void
+/*
+ * OA report formats
+ *
+ * Each supported report format is described by the list of counter
+ * ranges found in a report. The deltas of consecutive ranges are packed
+ * one after the other at the start of accumulator->deltas[], so a format
+ * only touches as many deltas as it has counters.
+ *
+ * Every format gets its own accumulation kernels, instantiated from its
+ * field list by OA_FORMAT_KERNELS() so the compiler sees a constant layout
+ * and the hot loop never has to switch on the format. Supporting a new
+ * format should only need a field list and an OA_FORMATS() entry.
+ */
+
+enum oa_field_type {
+    OA_FIELD_UINT32,
+    OA_FIELD_UINT40,
+};
+
+struct oa_field_range {
+    enum oa_field_type type;
+    int offset;         /* dword holding the (low 32 bits of the) first counter */
+    int high_offset;    /* dword where the high bytes of 40bit counters start */
+    int count;
+};
+
+/* Gen8+, including Gen12 whose metrics are read through the same layout */
+static const struct oa_field_range a32u40_a4u32_b8_c8_fields[] = {
+    { OA_FIELD_UINT32,  1,  0,  1 }, /* timestamp */
+    { OA_FIELD_UINT32,  3,  0,  1 }, /* clock */
+    { OA_FIELD_UINT40,  4, 40, 32 }, /* A0-31 */
+    { OA_FIELD_UINT32, 36,  0,  4 }, /* A32-35 */
+    { OA_FIELD_UINT32, 48,  0, 16 }, /* B0-7, C0-7 */
+};
+
+/* Haswell */
+static const struct oa_field_range a45_b8_c8_fields[] = {
+    { OA_FIELD_UINT32,  1,  0,  1 }, /* timestamp */
+    { OA_FIELD_UINT32,  3,  0, 61 }, /* A0-44, B0-7, C0-7 */
+};
+
+/* X(name, i915 format, report size, n_deltas,
+ *   gpu_time_offset, gpu_clock_offset, a_offset, b_offset, c_offset)
+ *
+ * Offsets index accumulator->deltas[], gpu_clock_offset is -1 for formats
+ * without a clock counter.
+ */
+#define OA_FORMATS(X)                                                   \
+    X(a32u40_a4u32_b8_c8, I915_OA_FORMAT_A32u40_A4u32_B8_C8, 256, 54,   \
+      0, 1, 2, 38, 46)                                                  \
+    X(a45_b8_c8, I915_OA_FORMAT_A45_B8_C8, 256, 62,                     \
+      0, -1, 1, 46, 54)
+
+typedef void (*oa_accumulate_kernel_t)(const uint32_t *start,
+                                       const uint32_t *end,
+                                       uint64_t *deltas);
+
+static inline void
 accumulate_uint32(const uint32_t *report0,
                   const uint32_t *report1,
                   uint64_t *deltas)
@@ -92,18 +156,19 @@ accumulate_uint32(const uint32_t *report0,
    *deltas += (uint32_t)(*report1 - *report0);
 }
 
-static void
-accumulate_uint40(int a_index,
+static inline void
+accumulate_uint40(const struct oa_field_range *field,
+                  int index,
                   const uint32_t *report0,
                   const uint32_t *report1,
                   uint64_t *deltas)
 {
-    const uint8_t *high_bytes0 = (uint8_t *)(report0 + 40);
-    const uint8_t *high_bytes1 = (uint8_t *)(report1 + 40);
-    uint64_t high0 = (uint64_t)(high_bytes0[a_index]) << 32;
-    uint64_t high1 = (uint64_t)(high_bytes1[a_index]) << 32;
-    uint64_t value0 = report0[a_index + 4] | high0;
-    uint64_t value1 = report1[a_index + 4] | high1;
+    const uint8_t *high_bytes0 = (uint8_t *)(report0 + field->high_offset);
+    const uint8_t *high_bytes1 = (uint8_t *)(report1 + field->high_offset);
+    uint64_t high0 = (uint64_t)(high_bytes0[index]) << 32;
+    uint64_t high1 = (uint64_t)(high_bytes1[index]) << 32;
+    uint64_t value0 = report0[field->offset + index] | high0;
+    uint64_t value1 = report1[field->offset + index] | high1;
     uint64_t delta;
 
     if (value0 > value1)
@@ -114,17 +179,439 @@ accumulate_uint40(int a_index,
     *deltas += delta;
 }
 
+/* Scalar reference path, the vectorized variants below must produce
+ * exactly the same deltas.
+ */
+static inline __attribute__((always_inline)) void
+accumulate_fields_scalar(const struct oa_field_range *fields,
+                         int n_fields,
+                         const uint32_t *start,
+                         const uint32_t *end,
+                         uint64_t *deltas)
+{
+#pragma GCC unroll 16
+    for (int f = 0; f < n_fields; f++) {
+        const struct oa_field_range *field = &fields[f];
+
+        for (int i = 0; i < field->count; i++) {
+            if (field->type == OA_FIELD_UINT40)
+                accumulate_uint40(field, i, start, end, deltas++);
+            else
+                accumulate_uint32(start + field->offset + i,
+                                  end + field->offset + i, deltas++);
+        }
+    }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(EMSCRIPTEN)
+#define HAVE_OA_SIMD_KERNELS
+
+#include <immintrin.h>
+
+/* The 40bit A counters are split between a dword holding the low 32 bits
+ * and a byte holding the high 8 bits. Both readings are below 2^40 so
+ * masking the 64bit difference to 40 bits gives the same result as the
+ * explicit wraparound in accumulate_uint40() without a branch.
+ */
+#define OA_40BIT_MASK ((1ULL << 40) - 1)
+
+__attribute__((target("sse4.1"))) static inline void
+accumulate_uint32_x2_sse41(const uint32_t *start, const uint32_t *end,
+                           uint64_t *deltas)
+{
+    __m128i v0 = _mm_loadl_epi64((const __m128i *) start);
+    __m128i v1 = _mm_loadl_epi64((const __m128i *) end);
+    __m128i d = _mm_cvtepu32_epi64(_mm_sub_epi32(v1, v0));
+    __m128i acc = _mm_loadu_si128((const __m128i *) deltas);
+
+    _mm_storeu_si128((__m128i *) deltas, _mm_add_epi64(acc, d));
+}
+
+__attribute__((target("sse4.1"))) static inline void
+accumulate_uint40_x2_sse41(const struct oa_field_range *field, int index,
+                           const uint32_t *start, const uint32_t *end,
+                           uint64_t *deltas)
+{
+    const uint8_t *high0 = (const uint8_t *)(start + field->high_offset) + index;
+    const uint8_t *high1 = (const uint8_t *)(end + field->high_offset) + index;
+    uint16_t h0, h1;
+
+    memcpy(&h0, high0, sizeof(h0));
+    memcpy(&h1, high1, sizeof(h1));
+
+    __m128i lo0 = _mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)(start + field->offset + index)));
+    __m128i lo1 = _mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)(end + field->offset + index)));
+    __m128i hi0 = _mm_slli_epi64(_mm_cvtepu8_epi64(_mm_cvtsi32_si128(h0)), 32);
+    __m128i hi1 = _mm_slli_epi64(_mm_cvtepu8_epi64(_mm_cvtsi32_si128(h1)), 32);
+    __m128i d = _mm_sub_epi64(_mm_or_si128(lo1, hi1), _mm_or_si128(lo0, hi0));
+    __m128i acc = _mm_loadu_si128((const __m128i *) deltas);
+
+    d = _mm_and_si128(d, _mm_set1_epi64x(OA_40BIT_MASK));
+    _mm_storeu_si128((__m128i *) deltas, _mm_add_epi64(acc, d));
+}
+
+__attribute__((target("sse4.1"))) static inline __attribute__((always_inline)) void
+accumulate_fields_sse41(const struct oa_field_range *fields,
+                        int n_fields,
+                        const uint32_t *start,
+                        const uint32_t *end,
+                        uint64_t *deltas)
+{
+#pragma GCC unroll 16
+    for (int f = 0; f < n_fields; f++) {
+        const struct oa_field_range *field = &fields[f];
+        int i = 0;
+
+        if (field->type == OA_FIELD_UINT40) {
+            for (; i + 2 <= field->count; i += 2)
+                accumulate_uint40_x2_sse41(field, i, start, end, deltas + i);
+            for (; i < field->count; i++)
+                accumulate_uint40(field, i, start, end, deltas + i);
+        } else {
+            for (; i + 2 <= field->count; i += 2)
+                accumulate_uint32_x2_sse41(start + field->offset + i,
+                                           end + field->offset + i, deltas + i);
+            for (; i < field->count; i++)
+                accumulate_uint32(start + field->offset + i,
+                                  end + field->offset + i, deltas + i);
+        }
+
+        deltas += field->count;
+    }
+}
+
+__attribute__((target("avx2"))) static inline void
+accumulate_uint32_x4_avx2(const uint32_t *start, const uint32_t *end,
+                          uint64_t *deltas)
+{
+    __m128i v0 = _mm_loadu_si128((const __m128i *) start);
+    __m128i v1 = _mm_loadu_si128((const __m128i *) end);
+    __m256i d = _mm256_cvtepu32_epi64(_mm_sub_epi32(v1, v0));
+    __m256i acc = _mm256_loadu_si256((const __m256i *) deltas);
+
+    _mm256_storeu_si256((__m256i *) deltas, _mm256_add_epi64(acc, d));
+}
+
+__attribute__((target("avx2"))) static inline void
+accumulate_uint40_x4_avx2(const struct oa_field_range *field, int index,
+                          const uint32_t *start, const uint32_t *end,
+                          uint64_t *deltas)
+{
+    const uint8_t *high0 = (const uint8_t *)(start + field->high_offset) + index;
+    const uint8_t *high1 = (const uint8_t *)(end + field->high_offset) + index;
+    int32_t h0, h1;
+
+    memcpy(&h0, high0, sizeof(h0));
+    memcpy(&h1, high1, sizeof(h1));
+
+    __m256i lo0 = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(start + field->offset + index)));
+    __m256i lo1 = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(end + field->offset + index)));
+    __m256i hi0 = _mm256_slli_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(h0)), 32);
+    __m256i hi1 = _mm256_slli_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(h1)), 32);
+    __m256i d = _mm256_sub_epi64(_mm256_or_si256(lo1, hi1), _mm256_or_si256(lo0, hi0));
+    __m256i acc = _mm256_loadu_si256((const __m256i *) deltas);
+
+    d = _mm256_and_si256(d, _mm256_set1_epi64x(OA_40BIT_MASK));
+    _mm256_storeu_si256((__m256i *) deltas, _mm256_add_epi64(acc, d));
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) void
+accumulate_fields_avx2(const struct oa_field_range *fields,
+                       int n_fields,
+                       const uint32_t *start,
+                       const uint32_t *end,
+                       uint64_t *deltas)
+{
+#pragma GCC unroll 16
+    for (int f = 0; f < n_fields; f++) {
+        const struct oa_field_range *field = &fields[f];
+        int i = 0;
+
+        if (field->type == OA_FIELD_UINT40) {
+            for (; i + 4 <= field->count; i += 4)
+                accumulate_uint40_x4_avx2(field, i, start, end, deltas + i);
+            for (; i + 2 <= field->count; i += 2)
+                accumulate_uint40_x2_sse41(field, i, start, end, deltas + i);
+            for (; i < field->count; i++)
+                accumulate_uint40(field, i, start, end, deltas + i);
+        } else {
+            for (; i + 4 <= field->count; i += 4)
+                accumulate_uint32_x4_avx2(start + field->offset + i,
+                                          end + field->offset + i, deltas + i);
+            for (; i + 2 <= field->count; i += 2)
+                accumulate_uint32_x2_sse41(start + field->offset + i,
+                                           end + field->offset + i, deltas + i);
+            for (; i < field->count; i++)
+                accumulate_uint32(start + field->offset + i,
+                                  end + field->offset + i, deltas + i);
+        }
+
+        deltas += field->count;
+    }
+}
+#endif
+
+enum oa_kernel_level {
+    OA_KERNELS_SCALAR,
+#ifdef HAVE_OA_SIMD_KERNELS
+    OA_KERNELS_SSE41,
+    OA_KERNELS_AVX2,
+#endif
+    OA_KERNELS_N_LEVELS
+};
+
+#ifdef HAVE_OA_SIMD_KERNELS
+#define OA_FORMAT_SIMD_KERNELS(name)                                    \
+    __attribute__((target("sse4.1"))) static void                       \
+    accumulate_##name##_sse41(const uint32_t *start,                    \
+                              const uint32_t *end,                      \
+                              uint64_t *deltas)                         \
+    {                                                                   \
+        accumulate_fields_sse41(name##_fields, ARRAY_SIZE(name##_fields), \
+                                start, end, deltas);                    \
+    }                                                                   \
+    __attribute__((target("avx2"))) static void                         \
+    accumulate_##name##_avx2(const uint32_t *start,                     \
+                             const uint32_t *end,                       \
+                             uint64_t *deltas)                          \
+    {                                                                   \
+        accumulate_fields_avx2(name##_fields, ARRAY_SIZE(name##_fields), \
+                               start, end, deltas);                     \
+    }
+#define OA_FORMAT_SIMD_KERNEL_ENTRIES(name)                             \
+    [OA_KERNELS_SSE41] = accumulate_##name##_sse41,                     \
+    [OA_KERNELS_AVX2] = accumulate_##name##_avx2,
+#else
+#define OA_FORMAT_SIMD_KERNELS(name)
+#define OA_FORMAT_SIMD_KERNEL_ENTRIES(name)
+#endif
+
+#define OA_FORMAT_KERNELS(name, ...)                                    \
+    static void                                                         \
+    accumulate_##name##_scalar(const uint32_t *start,                   \
+                               const uint32_t *end,                     \
+                               uint64_t *deltas)                        \
+    {                                                                   \
+        accumulate_fields_scalar(name##_fields, ARRAY_SIZE(name##_fields), \
+                                 start, end, deltas);                   \
+    }                                                                   \
+    OA_FORMAT_SIMD_KERNELS(name)
+
+OA_FORMATS(OA_FORMAT_KERNELS)
+
+struct oa_format_desc {
+    struct gputop_oa_format info;
+
+    const struct oa_field_range *fields;
+    int n_fields;
+
+    oa_accumulate_kernel_t kernels[OA_KERNELS_N_LEVELS];
+};
+
+#define OA_FORMAT_DESC(_name, _format, _size, _n_deltas,                \
+                       _time, _clock, _a, _b, _c)                       \
+    {                                                                   \
+        .info = {                                                       \
+            .name = #_name,                                             \
+            .perf_oa_format = _format,                                  \
+            .report_size = _size,                                       \
+            .n_deltas = _n_deltas,                                      \
+            .gpu_time_offset = _time,                                   \
+            .gpu_clock_offset = _clock,                                 \
+            .a_offset = _a,                                             \
+            .b_offset = _b,                                             \
+            .c_offset = _c,                                             \
+        },                                                              \
+        .fields = _name##_fields,                                       \
+        .n_fields = ARRAY_SIZE(_name##_fields),                         \
+        .kernels = {                                                    \
+            [OA_KERNELS_SCALAR] = accumulate_##_name##_scalar,          \
+            OA_FORMAT_SIMD_KERNEL_ENTRIES(_name)                        \
+        },                                                              \
+    },
+
+static const struct oa_format_desc oa_formats[] = {
+    OA_FORMATS(OA_FORMAT_DESC)
+};
+
+static int
+oa_format_n_deltas(const struct oa_format_desc *format)
+{
+    int n_deltas = 0;
+
+    for (int f = 0; f < format->n_fields; f++)
+        n_deltas += format->fields[f].count;
+
+    return n_deltas;
+}
+
+#ifdef HAVE_OA_SIMD_KERNELS
+/* Compare the vectorized kernels of every format against the scalar
+ * reference on a pair of reports exercising 32bit and 40bit wraparound
+ * before trusting them.
+ */
+static bool
+oa_kernels_match_scalar(enum oa_kernel_level level)
+{
+    uint32_t report0[64], report1[64];
+    uint64_t ref_deltas[MAX_RAW_OA_COUNTERS];
+    uint64_t deltas[MAX_RAW_OA_COUNTERS];
+
+    for (int i = 0; i < 64; i++) {
+        report0[i] = 0x9e3779b9u * (i + 1);
+        report1[i] = report0[i] + (i & 1 ? 0x1234567u : -0x89abu);
+    }
+
+    for (unsigned f = 0; f < ARRAY_SIZE(oa_formats); f++) {
+        const struct oa_format_desc *format = &oa_formats[f];
+
+        for (int r = 0; r < format->n_fields; r++) {
+            const struct oa_field_range *field = &format->fields[r];
+            uint8_t *high0 = (uint8_t *)(report0 + field->high_offset);
+            uint8_t *high1 = (uint8_t *)(report1 + field->high_offset);
+
+            if (field->type != OA_FIELD_UINT40)
+                continue;
+
+            for (int i = 0; i < field->count; i++) {
+                high0[i] = (uint8_t)(0x5a + i * 7);
+                high1[i] = (uint8_t)(high0[i] + (i % 3 == 0 ? -1 : i));
+            }
+        }
+
+        for (int i = 0; i < MAX_RAW_OA_COUNTERS; i++)
+            ref_deltas[i] = deltas[i] = 0xfedcba987654ULL * i;
+
+        format->kernels[OA_KERNELS_SCALAR](report0, report1, ref_deltas);
+        format->kernels[level](report0, report1, deltas);
+
+        if (memcmp(ref_deltas, deltas, sizeof(deltas)) != 0)
+            return false;
+    }
+
+    return true;
+}
+#endif
+
+/* Picked once for all the accumulators, which can be initialized from
+ * several threads (worker pool, ingest thread) */
+static enum oa_kernel_level oa_kernel_level;
+
+static void
+select_oa_kernel_level(void)
+{
+    enum oa_kernel_level level = OA_KERNELS_SCALAR;
+
+    for (unsigned f = 0; f < ARRAY_SIZE(oa_formats); f++) {
+        assert(oa_formats[f].info.n_deltas <= MAX_RAW_OA_COUNTERS);
+        assert(oa_format_n_deltas(&oa_formats[f]) == oa_formats[f].info.n_deltas);
+    }
+
+#ifdef HAVE_OA_SIMD_KERNELS
+    const char *disable = getenv("GPUTOP_DISABLE_OA_SIMD");
+
+    if (!disable || strcmp(disable, "1") != 0) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            level = OA_KERNELS_AVX2;
+        else if (__builtin_cpu_supports("sse4.1"))
+            level = OA_KERNELS_SSE41;
+
+        if (level != OA_KERNELS_SCALAR && !oa_kernels_match_scalar(level)) {
+            dbg("i915_oa: %s accumulation kernels disagree with scalar code, disabling\n",
+                level == OA_KERNELS_AVX2 ? "avx2" : "sse4.1");
+            level = OA_KERNELS_SCALAR;
+        }
+    }
+#endif
+
+    oa_kernel_level = level;
+}
+
+static void
+init_oa_kernel_level(void)
+{
+#ifndef EMSCRIPTEN
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, select_oa_kernel_level);
+#else
+    static bool selected;
+
+    if (!selected) {
+        select_oa_kernel_level();
+        selected = true;
+    }
+#endif
+}
+
+static const struct oa_format_desc *
+oa_format_desc_for_id(int perf_oa_format)
+{
+    for (unsigned f = 0; f < ARRAY_SIZE(oa_formats); f++) {
+        if (oa_formats[f].info.perf_oa_format == perf_oa_format)
+            return &oa_formats[f];
+    }
+
+    return NULL;
+}
+
+const struct gputop_oa_format *
+gputop_cc_oa_format_for_id(int perf_oa_format)
+{
+    const struct oa_format_desc *format = oa_format_desc_for_id(perf_oa_format);
+
+    return format ? &format->info : NULL;
+}
+
+void
+gputop_cc_oa_metric_set_init_format(struct gputop_metric_set *metric_set,
+                                    int perf_oa_format)
+{
+    const struct gputop_oa_format *format =
+        gputop_cc_oa_format_for_id(perf_oa_format);
+
+    assert(format);
+
+    metric_set->perf_oa_format = format->perf_oa_format;
+    metric_set->perf_raw_size = format->report_size;
+    metric_set->gpu_time_offset = format->gpu_time_offset;
+    metric_set->gpu_clock_offset = format->gpu_clock_offset;
+    metric_set->a_offset = format->a_offset;
+    metric_set->b_offset = format->b_offset;
+    metric_set->c_offset = format->c_offset;
+}
+
+
+static void
+accumulator_start(struct gputop_cc_oa_accumulator *accumulator,
+                  const uint8_t *report0)
+{
+    if (!accumulator->clock.devinfo)
+        gputop_u32_clock_init(&accumulator->clock, accumulator->devinfo,
+                              gputop_cc_oa_report_get_timestamp(report0));
+    //gputop_u32_clock_progress(&accumulator->clock, start[1]);
+    if (!accumulator->first_timestamp)
+        accumulator->first_timestamp =
+            gputop_u32_clock_get_time(&accumulator->clock);
+}
+
+static void
+accumulator_progress(struct gputop_cc_oa_accumulator *accumulator,
+                     const uint32_t *start, const uint32_t *end)
+{
+    gputop_u32_clock_progress(&accumulator->clock, start[1], end[1]);
+    accumulator->last_timestamp =
+        gputop_u32_clock_get_time(&accumulator->clock);
+}
+
 bool
 gputop_cc_oa_accumulate_reports(struct gputop_cc_oa_accumulator *accumulator,
                                 const uint8_t *report0,
                                 const uint8_t *report1)
 {
-    const struct gputop_metric_set *metric_set = accumulator->metric_set;
-    uint64_t *deltas = accumulator->deltas;
     const uint32_t *start = (const uint32_t *)report0;
     const uint32_t *end = (const uint32_t *)report1;
-    int idx = 0;
-    int i;
 
     assert(report0 != report1);
 
@@ -136,55 +623,508 @@ gputop_cc_oa_accumulate_reports(struct gputop_cc_oa_accumulator *accumulator,
         return false;
     }
 
-    if (!accumulator->clock.devinfo)
-        gputop_u32_clock_init(&accumulator->clock, accumulator->devinfo,
-                              gputop_cc_oa_report_get_timestamp(report0));
-    //gputop_u32_clock_progress(&accumulator->clock, start[1]);
-    if (!accumulator->first_timestamp)
-        accumulator->first_timestamp =
-            gputop_u32_clock_get_time(&accumulator->clock);
+    accumulator_start(accumulator, report0);
+
+    accumulator->accumulate(start, end, accumulator->deltas);
+
+    accumulator_progress(accumulator, start, end);
+
+    return true;
+}
+
+/* Over a short enough span of time none of the counters can wrap more than
+ * once, so summing the deltas of each consecutive pair of reports gives the
+ * same result as the delta between the first and last report of the span.
+ *
+ * The fastest counters increment at most once per EU per GPU clock, we
+ * leave a generous margin on top of that to cover counters aggregating
+ * several events per EU per clock. That bound was checked against the
+ * counters of data/oa-*.xml that have one: the percentages of a single A
+ * counter reach n_eus per clock (EuActive), those of a B or C counter 1 per
+ * clock, and the A counters with a max_equation n_subslices per clock
+ * (SlmBytesRead). Without a plausible GPU frequency (in Hz, gt_max_freq
+ * above the timestamp frequency) we can't bound the span and fold one pair
+ * of reports at a time.
+ */
+#define OA_TELESCOPE_MARGIN 16
+
+static uint32_t
+oa_max_telescope_ticks(const struct gputop_devinfo *devinfo)
+{
+    if (!devinfo->timestamp_frequency || !devinfo->n_eus ||
+        devinfo->gt_max_freq < devinfo->timestamp_frequency)
+        return 0;
+
+    uint64_t clocks_per_tick =
+        DIV_ROUND_UP(devinfo->gt_max_freq, devinfo->timestamp_frequency);
+    uint64_t max_increment_per_tick =
+        clocks_per_tick * devinfo->n_eus * OA_TELESCOPE_MARGIN;
 
-    switch (metric_set->perf_oa_format) {
-    case I915_OA_FORMAT_A32u40_A4u32_B8_C8:
+    return (1ULL << 32) / max_increment_per_tick;
+}
 
-        accumulate_uint32(start + 1, end + 1, deltas + idx++); /* timestamp */
-        accumulate_uint32(start + 3, end + 3, deltas + idx++); /* clock */
+static uint32_t
+oa_report_reason(const struct gputop_devinfo *devinfo, const uint32_t *report)
+{
+    if (devinfo->gen < 8)
+        return 0;
 
-        /* 32x 40bit A counters... */
-        for (i = 0; i < 32; i++)
-            accumulate_uint40(i, start, end, deltas + idx++);
+    return (report[0] >> OAREPORT_REASON_SHIFT) & OAREPORT_REASON_MASK;
+}
 
-        /* 4x 32bit A counters... */
-        for (i = 0; i < 4; i++)
-            accumulate_uint32(start + 36 + i, end + 36 + i, deltas + idx++);
+uint32_t
+gputop_cc_oa_accumulate_report_range(struct gputop_cc_oa_accumulator **accumulators,
+                                     int n_accumulators,
+                                     const struct gputop_i915_perf_configuration *config,
+                                     const struct drm_i915_perf_record_header *records,
+                                     uint32_t stride,
+                                     uint32_t n_records,
+                                     uint32_t split_mask,
+                                     enum gputop_cc_oa_range_split *split)
+{
+    const struct gputop_devinfo *devinfo = accumulators[0]->devinfo;
+    const int n_deltas = accumulators[0]->format->n_deltas;
+    oa_accumulate_kernel_t kernel = accumulators[0]->accumulate;
+    const uint32_t max_span_ticks = oa_max_telescope_ticks(devinfo);
+    uint64_t deltas[MAX_RAW_OA_COUNTERS] = { 0, };
+    const uint32_t *span_start, *prev;
+    uint32_t i, last = 0;
 
-        /* 8x 32bit B counters + 8x 32bit C counters... */
-        for (i = 0; i < 16; i++)
-            accumulate_uint32(start + 48 + i, end + 48 + i, deltas + idx++);
-        break;
+    *split = GPUTOP_CC_OA_RANGE_END;
 
-    case I915_OA_FORMAT_A45_B8_C8:
+    if (n_records < 2)
+        return 0;
 
-        accumulate_uint32(start + 1, end + 1, deltas); /* timestamp */
+    prev = span_start = (const uint32_t *)
+        gputop_i915_perf_record_field(config, records,
+                                      GPUTOP_I915_PERF_FIELD_OA_REPORT);
+    if (records->type != DRM_I915_PERF_RECORD_SAMPLE || prev[1] == 0) {
+        *split = GPUTOP_CC_OA_RANGE_SPLIT_RECORD;
+        return 0;
+    }
 
-        for (i = 0; i < 61; i++)
-            accumulate_uint32(start + 3 + i, end + 3 + i, deltas + 1 + i);
-        break;
-    default:
-        assert(0);
+    for (int a = 0; a < n_accumulators; a++) {
+        assert(accumulators[a]->accumulate == kernel);
+        accumulator_start(accumulators[a], (const uint8_t *) prev);
     }
 
-    gputop_u32_clock_progress(&accumulator->clock, start[1], end[1]);
-    accumulator->last_timestamp =
-        gputop_u32_clock_get_time(&accumulator->clock);
+    for (i = 1; i < n_records; i++) {
+        const struct drm_i915_perf_record_header *header =
+            (const struct drm_i915_perf_record_header *)
+            ((const uint8_t *) records + i * stride);
 
-    return true;
+        if (header->type != DRM_I915_PERF_RECORD_SAMPLE ||
+            header->size != stride) {
+            *split = GPUTOP_CC_OA_RANGE_SPLIT_RECORD;
+            break;
+        }
+
+        const uint32_t *report = (const uint32_t *)
+            gputop_i915_perf_record_field(config, header,
+                                          GPUTOP_I915_PERF_FIELD_OA_REPORT);
+        if (report[1] == 0) {
+            *split = GPUTOP_CC_OA_RANGE_SPLIT_RECORD;
+            break;
+        }
+
+        /* Close the current span if the counters might have wrapped more
+         * than once since its first report.
+         */
+        if ((uint32_t)(report[1] - span_start[1]) > max_span_ticks) {
+            if (prev != span_start)
+                kernel(span_start, prev, deltas);
+            span_start = prev;
+        }
+
+        for (int a = 0; a < n_accumulators; a++)
+            accumulator_progress(accumulators[a], prev, report);
+
+        last = i;
+
+        if ((split_mask & GPUTOP_CC_OA_RANGE_SPLIT_CTX_ID) &&
+            gputop_cc_oa_report_get_ctx_id(devinfo, (const uint8_t *) prev) !=
+            gputop_cc_oa_report_get_ctx_id(devinfo, (const uint8_t *) report))
+            *split = GPUTOP_CC_OA_RANGE_SPLIT_CTX_ID;
+        else if ((split_mask & GPUTOP_CC_OA_RANGE_SPLIT_REASON) &&
+                 oa_report_reason(devinfo, prev) != oa_report_reason(devinfo, report))
+            *split = GPUTOP_CC_OA_RANGE_SPLIT_REASON;
+        else if (split_mask & GPUTOP_CC_OA_RANGE_SPLIT_PERIOD) {
+            for (int a = 0; a < n_accumulators; a++) {
+                const struct gputop_cc_oa_accumulator *accumulator = accumulators[a];
+
+                if (accumulator->aggregation_period &&
+                    (accumulator->last_timestamp - accumulator->first_timestamp) >
+                    accumulator->aggregation_period) {
+                    *split = GPUTOP_CC_OA_RANGE_SPLIT_PERIOD;
+                    break;
+                }
+            }
+        }
+
+        prev = report;
+
+        if (*split != GPUTOP_CC_OA_RANGE_END)
+            break;
+    }
+
+    if (prev != span_start)
+        kernel(span_start, prev, deltas);
+
+    for (int a = 0; a < n_accumulators; a++) {
+        uint64_t *acc_deltas = accumulators[a]->deltas;
+
+        for (int d = 0; d < n_deltas; d++)
+            acc_deltas[d] += deltas[d];
+    }
+
+    return last;
+}
+
+/*
+ * Parallel replay of report ranges
+ *
+ * Deltas are summed with wrapping 64bit arithmetic, so a long range can be
+ * cut into slices at report boundaries and each slice accumulated on its
+ * own, into a scratch accumulator, on a pool of threads. Consecutive
+ * slices share their boundary report so every pair of reports belongs to
+ * exactly one slice. The partial accumulators are then merged in timestamp
+ * order into the real ones.
+ *
+ * Slices look for the same splits as the serial path, except for the
+ * aggregation period which depends on the state of the real accumulators.
+ * The clock increments of a slice don't though, so the merge can tell from
+ * a slice's total whether an accumulator goes over its period within the
+ * slice, in which case that slice is replayed serially on the real
+ * accumulators to find the exact report to stop at.
+ *
+ * Slices are dispatched in waves of one per thread, starting small and
+ * growing as long as no split is found, so that little work past a split
+ * gets thrown away.
+ */
+
+#define OA_REPLAY_MIN_SLICE 64
+#define OA_REPLAY_MAX_SLICE 4096
+#define OA_REPLAY_MAX_THREADS 64
+
+struct oa_replay_slice {
+    const struct drm_i915_perf_record_header *records;
+    uint32_t n_records;
+
+    uint32_t last;
+    enum gputop_cc_oa_range_split split;
+    struct gputop_cc_oa_accumulator accumulator;
+};
+
+#ifndef EMSCRIPTEN
+struct gputop_cc_oa_worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+
+    pthread_t *threads;
+    int n_threads;
+    bool quit;
+
+    /* Current wave, protected by lock */
+    uint32_t generation;
+    const struct gputop_i915_perf_configuration *config;
+    uint32_t stride;
+    uint32_t split_mask;
+    struct oa_replay_slice *slices;
+    uint32_t n_slices;
+    uint32_t next_slice;
+    uint32_t n_pending;
+};
+
+/* Called with pool->lock held */
+static void
+oa_replay_run_slices(struct gputop_cc_oa_worker_pool *pool)
+{
+    while (pool->next_slice < pool->n_slices) {
+        struct oa_replay_slice *slice = &pool->slices[pool->next_slice++];
+        struct gputop_cc_oa_accumulator *accumulator = &slice->accumulator;
+
+        pthread_mutex_unlock(&pool->lock);
+        slice->last =
+            gputop_cc_oa_accumulate_report_range(&accumulator, 1, pool->config,
+                                                 slice->records, pool->stride,
+                                                 slice->n_records, pool->split_mask,
+                                                 &slice->split);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->n_pending == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+}
+
+static void *
+oa_replay_worker(void *data)
+{
+    struct gputop_cc_oa_worker_pool *pool = data;
+
+    pthread_mutex_lock(&pool->lock);
+
+    uint32_t generation = pool->generation;
+    for (;;) {
+        while (!pool->quit && pool->generation == generation)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->quit)
+            break;
+
+        generation = pool->generation;
+        oa_replay_run_slices(pool);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void
+oa_replay_run_wave(struct gputop_cc_oa_worker_pool *pool,
+                   const struct gputop_i915_perf_configuration *config,
+                   uint32_t stride, uint32_t split_mask, uint32_t n_slices)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    pool->config = config;
+    pool->stride = stride;
+    pool->split_mask = split_mask;
+    pool->n_slices = pool->n_pending = n_slices;
+    pool->next_slice = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+
+    /* The calling thread takes its share of slices too. */
+    oa_replay_run_slices(pool);
+
+    while (pool->n_pending)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+struct gputop_cc_oa_worker_pool *
+gputop_cc_oa_worker_pool_new(int n_threads)
+{
+    n_threads = MIN2(n_threads, OA_REPLAY_MAX_THREADS);
+    if (n_threads < 2)
+        return NULL;
+
+    struct gputop_cc_oa_worker_pool *pool = calloc(1, sizeof(*pool));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->slices = calloc(n_threads, sizeof(pool->slices[0]));
+    pool->threads = calloc(n_threads - 1, sizeof(pool->threads[0]));
+    for (int i = 0; i < n_threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, oa_replay_worker, pool) != 0) {
+            dbg("i915_oa: failed to start accumulation thread\n");
+            break;
+        }
+        pool->n_threads++;
+    }
+
+    if (!pool->n_threads) {
+        gputop_cc_oa_worker_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void
+gputop_cc_oa_worker_pool_destroy(struct gputop_cc_oa_worker_pool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->threads);
+    free(pool->slices);
+    free(pool);
+}
+
+/* Whether one of the accumulators goes over its aggregation period by the
+ * end of the slice.
+ */
+static bool
+oa_replay_slice_ends_period(struct gputop_cc_oa_accumulator **accumulators,
+                            int n_accumulators,
+                            const struct oa_replay_slice *slice)
+{
+    const struct gputop_u32_clock *clock = &slice->accumulator.clock;
+    uint64_t slice_ns = clock->timestamp - clock->start;
+
+    for (int a = 0; a < n_accumulators; a++) {
+        const struct gputop_cc_oa_accumulator *accumulator = accumulators[a];
+
+        if (accumulator->aggregation_period &&
+            (accumulator->clock.timestamp + slice_ns - accumulator->first_timestamp) >
+            accumulator->aggregation_period)
+            return true;
+    }
+
+    return false;
+}
+
+static void
+oa_replay_merge_slice(struct gputop_cc_oa_accumulator **accumulators,
+                      int n_accumulators,
+                      const struct oa_replay_slice *slice)
+{
+    const struct gputop_cc_oa_accumulator *partial = &slice->accumulator;
+    const int n_deltas = partial->format->n_deltas;
+
+    if (slice->last == 0)
+        return;
+
+    for (int a = 0; a < n_accumulators; a++) {
+        struct gputop_cc_oa_accumulator *accumulator = accumulators[a];
+
+        accumulator->clock.timestamp += partial->clock.timestamp - partial->clock.start;
+        accumulator->clock.clock_count += partial->clock.clock_count;
+        accumulator->clock.last_u32 = partial->clock.last_u32;
+        accumulator->last_timestamp = gputop_u32_clock_get_time(&accumulator->clock);
+
+        for (int d = 0; d < n_deltas; d++)
+            accumulator->deltas[d] += partial->deltas[d];
+    }
+}
+#else
+struct gputop_cc_oa_worker_pool *
+gputop_cc_oa_worker_pool_new(int n_threads)
+{
+    return NULL;
+}
+
+void
+gputop_cc_oa_worker_pool_destroy(struct gputop_cc_oa_worker_pool *pool)
+{
+}
+#endif
+
+uint32_t
+gputop_cc_oa_accumulate_report_range_parallel(struct gputop_cc_oa_worker_pool *pool,
+                                              struct gputop_cc_oa_accumulator **accumulators,
+                                              int n_accumulators,
+                                              const struct gputop_i915_perf_configuration *config,
+                                              const struct drm_i915_perf_record_header *records,
+                                              uint32_t stride,
+                                              uint32_t n_records,
+                                              uint32_t split_mask,
+                                              enum gputop_cc_oa_range_split *split)
+{
+#ifndef EMSCRIPTEN
+    const uint32_t *first = n_records >= 2 * OA_REPLAY_MIN_SLICE ?
+        (const uint32_t *) gputop_i915_perf_record_field(config, records,
+                                                         GPUTOP_I915_PERF_FIELD_OA_REPORT) :
+        NULL;
+    bool parallel = pool && first &&
+        records->type == DRM_I915_PERF_RECORD_SAMPLE && first[1] != 0;
+
+    /* The clock increment of the first pair depends on where the
+     * accumulators' clocks last stopped, slices only know about the
+     * reports themselves.
+     */
+    for (int a = 0; parallel && a < n_accumulators; a++) {
+        const struct gputop_cc_oa_accumulator *accumulator = accumulators[a];
+
+        if (accumulator->clock.devinfo && accumulator->clock.last_u32 != first[1])
+            parallel = false;
+    }
+
+    if (!parallel)
+#endif
+        return gputop_cc_oa_accumulate_report_range(accumulators, n_accumulators,
+                                                    config, records, stride,
+                                                    n_records, split_mask, split);
+
+#ifndef EMSCRIPTEN
+    const struct gputop_cc_oa_accumulator *model = accumulators[0];
+    uint32_t slice_split_mask = split_mask & ~GPUTOP_CC_OA_RANGE_SPLIT_PERIOD;
+    uint32_t slice_records = OA_REPLAY_MIN_SLICE;
+    uint32_t base = 0;
+
+    for (int a = 0; a < n_accumulators; a++) {
+        assert(accumulators[a]->accumulate == model->accumulate);
+        accumulator_start(accumulators[a], (const uint8_t *) first);
+    }
+
+    *split = GPUTOP_CC_OA_RANGE_END;
+
+    while (base < n_records - 1) {
+        uint32_t n_slices = 0, slice_base = base;
+
+        while (n_slices < pool->n_threads + 1 && base < n_records - 1) {
+            struct oa_replay_slice *slice = &pool->slices[n_slices++];
+            struct gputop_cc_oa_accumulator *partial = &slice->accumulator;
+
+            slice->records = (const struct drm_i915_perf_record_header *)
+                ((const uint8_t *) records + base * stride);
+            slice->n_records = MIN2(slice_records + 1, n_records - base);
+
+            memset(partial, 0, sizeof(*partial));
+            partial->devinfo = model->devinfo;
+            partial->metric_set = model->metric_set;
+            partial->format = model->format;
+            partial->accumulate = model->accumulate;
+
+            base += slice->n_records - 1;
+        }
+
+        oa_replay_run_wave(pool, config, stride, slice_split_mask, n_slices);
+
+        for (uint32_t s = 0; s < n_slices; s++) {
+            const struct oa_replay_slice *slice = &pool->slices[s];
+
+            if ((split_mask & GPUTOP_CC_OA_RANGE_SPLIT_PERIOD) &&
+                oa_replay_slice_ends_period(accumulators, n_accumulators, slice)) {
+                uint32_t last =
+                    gputop_cc_oa_accumulate_report_range(accumulators, n_accumulators,
+                                                         config, slice->records, stride,
+                                                         slice->last + 1, split_mask,
+                                                         split);
+                if (*split == GPUTOP_CC_OA_RANGE_END)
+                    *split = slice->split;
+                if (*split != GPUTOP_CC_OA_RANGE_END)
+                    return slice_base + last;
+            } else {
+                oa_replay_merge_slice(accumulators, n_accumulators, slice);
+                if (slice->split != GPUTOP_CC_OA_RANGE_END) {
+                    *split = slice->split;
+                    return slice_base + slice->last;
+                }
+            }
+
+            slice_base += slice->n_records - 1;
+        }
+
+        slice_records = MIN2(slice_records * 2, OA_REPLAY_MAX_SLICE);
+    }
+
+    return n_records - 1;
+#endif
 }
 
 void EMSCRIPTEN_KEEPALIVE
 gputop_cc_oa_accumulator_clear(struct gputop_cc_oa_accumulator *accumulator)
 {
-    memset(accumulator->deltas, 0, sizeof(accumulator->deltas));
+    memset(accumulator->deltas, 0,
+           accumulator->format->n_deltas * sizeof(accumulator->deltas[0]));
     accumulator->first_timestamp = 0;
     accumulator->last_timestamp = 0;
 }
@@ -200,9 +1140,17 @@ gputop_cc_oa_accumulator_init(struct gputop_cc_oa_accumulator *accumulator,
     assert(metric_set);
     assert(metric_set->perf_oa_format);
 
+    const struct oa_format_desc *format =
+        oa_format_desc_for_id(metric_set->perf_oa_format);
+    assert(format);
+
+    init_oa_kernel_level();
+
     memset(accumulator, 0, sizeof(*accumulator));
     accumulator->devinfo = devinfo;
     accumulator->metric_set = metric_set;
+    accumulator->format = &format->info;
+    accumulator->accumulate = format->kernels[oa_kernel_level];
     accumulator->aggregation_period = aggregation_period;
 
     if (first_report) {
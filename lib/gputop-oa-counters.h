@@ -50,10 +50,37 @@ struct gputop_u32_clock {
     uint64_t clock_count;
 };
 
+/* Layout of an OA report format as seen by the generated counter read
+ * functions, see the format table in gputop-oa-counters.c
+ */
+struct gputop_oa_format {
+    const char *name;
+    int perf_oa_format;
+    int report_size;
+
+    /* Number of leading accumulator->deltas[] used by the format */
+    int n_deltas;
+
+    /* For indexing into accumulator->deltas[], gpu_clock_offset is -1 if
+     * the format has no clock counter.
+     */
+    int gpu_time_offset;
+    int gpu_clock_offset;
+    int a_offset;
+    int b_offset;
+    int c_offset;
+};
+
 struct gputop_cc_oa_accumulator
 {
     const struct gputop_devinfo *devinfo;
     const struct gputop_metric_set *metric_set;
+    const struct gputop_oa_format *format;
+
+    /* Kernel specialized for the metric set's report format */
+    void (*accumulate)(const uint32_t *start,
+                       const uint32_t *end,
+                       uint64_t *deltas);
 
     uint64_t aggregation_period;
 
@@ -64,6 +91,10 @@ struct gputop_cc_oa_accumulator
     struct gputop_u32_clock clock;
 };
 
+const struct gputop_oa_format *gputop_cc_oa_format_for_id(int perf_oa_format);
+void gputop_cc_oa_metric_set_init_format(struct gputop_metric_set *metric_set,
+                                         int perf_oa_format);
+
 void gputop_cc_oa_accumulator_init(struct gputop_cc_oa_accumulator *accumulator,
                                    const struct gputop_devinfo *devinfo,
                                    const struct gputop_metric_set *metric_set,
@@ -77,19 +108,19 @@ bool gputop_cc_oa_accumulate_reports(struct gputop_cc_oa_accumulator *accumulato
 static inline uint64_t
 gputop_time_scale_timebase(const struct gputop_devinfo *devinfo, uint64_t ns_time)
 {
-    return (ns_time * devinfo->timestamp_frequency) / 1000000000ULL;
+    return gputop_fixed_scale(&devinfo->ns_to_timebase, ns_time);
 }
 
 static inline uint64_t
 gputop_timebase_scale_ns(const struct gputop_devinfo *devinfo, uint64_t u32_time)
 {
-    return (u32_time * 1000000000ULL) / devinfo->timestamp_frequency;
+    return gputop_fixed_scale(&devinfo->timebase_to_ns, u32_time);
 }
 
 static inline uint64_t
 gputop_oa_exponent_to_period_ns(const struct gputop_devinfo *devinfo, uint32_t exponent)
 {
-    return ((2ULL << exponent) * 1000000000ULL) / devinfo->timestamp_frequency;
+    return gputop_fixed_scale(&devinfo->timebase_to_ns, 2ULL << exponent);
 }
 
 uint32_t gputop_time_to_oa_exponent(struct gputop_devinfo *devinfo, uint64_t period_ns);
@@ -238,6 +269,75 @@ gputop_i915_perf_record_reason(const struct gputop_i915_perf_configuration *conf
     }
 }
 
+/* Reasons for gputop_cc_oa_accumulate_report_range() to stop folding
+ * reports, the corresponding bits can be set in split_mask to request a
+ * split.
+ */
+enum gputop_cc_oa_range_split {
+    GPUTOP_CC_OA_RANGE_END = 0,
+
+    /* The last folded report belongs to a different context than the
+     * report before it.
+     */
+    GPUTOP_CC_OA_RANGE_SPLIT_CTX_ID = 1 << 0,
+
+    /* The last folded report was triggered for a different reason than
+     * the report before it.
+     */
+    GPUTOP_CC_OA_RANGE_SPLIT_REASON = 1 << 1,
+
+    /* One of the accumulators went over its aggregation period with the
+     * last folded report.
+     */
+    GPUTOP_CC_OA_RANGE_SPLIT_PERIOD = 1 << 2,
+
+    /* The record following the last folded report isn't an OA sample of
+     * the expected size or has a zero timestamp. Always enabled.
+     */
+    GPUTOP_CC_OA_RANGE_SPLIT_RECORD = 1 << 3,
+};
+
+/* Accumulate the deltas between n_records consecutive i915 perf records,
+ * laid out every stride bytes starting at records, into each of the given
+ * accumulators. All accumulators must use the same metric set.
+ *
+ * Returns the index of the last record folded in, which is the report the
+ * next range should start from. The reason for stopping is written to
+ * split.
+ */
+uint32_t gputop_cc_oa_accumulate_report_range(struct gputop_cc_oa_accumulator **accumulators,
+                                              int n_accumulators,
+                                              const struct gputop_i915_perf_configuration *config,
+                                              const struct drm_i915_perf_record_header *records,
+                                              uint32_t stride,
+                                              uint32_t n_records,
+                                              uint32_t split_mask,
+                                              enum gputop_cc_oa_range_split *split);
+
+/* Threads helping gputop_cc_oa_accumulate_report_range_parallel(), n_threads
+ * counts the calling thread. Returns NULL if fewer than 2 threads are
+ * requested or threads aren't available (Emscripten).
+ */
+struct gputop_cc_oa_worker_pool;
+
+struct gputop_cc_oa_worker_pool *gputop_cc_oa_worker_pool_new(int n_threads);
+void gputop_cc_oa_worker_pool_destroy(struct gputop_cc_oa_worker_pool *pool);
+
+/* Same as gputop_cc_oa_accumulate_report_range(), with identical results,
+ * but long ranges are cut into slices accumulated in parallel on the
+ * threads of pool and merged in timestamp order. Falls back to the serial
+ * path if pool is NULL or the range is short.
+ */
+uint32_t gputop_cc_oa_accumulate_report_range_parallel(struct gputop_cc_oa_worker_pool *pool,
+                                                       struct gputop_cc_oa_accumulator **accumulators,
+                                                       int n_accumulators,
+                                                       const struct gputop_i915_perf_configuration *config,
+                                                       const struct drm_i915_perf_record_header *records,
+                                                       uint32_t stride,
+                                                       uint32_t n_records,
+                                                       uint32_t split_mask,
+                                                       enum gputop_cc_oa_range_split *split);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,14 +23,19 @@
  */
 
 #include "gputop-oa-metrics.h"
+#include "gputop-oa-bytecode.h"
+#ifndef GPUTOP_CLIENT_XML_METRICS
 #include "gputop-gens-metrics.h"
+#endif
 
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "util/hash_table.h"
 #include "util/ralloc.h"
 
+#ifndef GPUTOP_CLIENT_XML_METRICS
 struct gputop_gen *
 gputop_gen_for_devinfo(const struct gen_device_info *devinfo)
 {
@@ -86,14 +91,17 @@ gputop_gen_for_devinfo(const struct gen_device_info *devinfo)
         return gputop_oa_get_metrics_tgl(&gputop_devinfo);
     return NULL;
 }
+#endif
 
 static struct gputop_counter_group *
 gputop_counter_group_new(struct gputop_gen *gen,
                          struct gputop_counter_group *parent,
+                         const char *path,
                          const char *name)
 {
     struct gputop_counter_group *group = ralloc(gen, struct gputop_counter_group);
 
+    group->path = ralloc_strdup(group, path);
     group->name = ralloc_strdup(group, name);
 
     list_inithead(&group->counters);
@@ -108,11 +116,16 @@ gputop_counter_group_new(struct gputop_gen *gen,
 }
 
 struct gputop_gen *
-gputop_gen_new(void)
+gputop_gen_new(const struct gputop_devinfo *devinfo)
 {
     struct gputop_gen *gen = ralloc(NULL, struct gputop_gen);
 
-    gen->root_group = gputop_counter_group_new(gen, NULL, "");
+    gen->devinfo = *devinfo;
+
+    gen->root_group = gputop_counter_group_new(gen, NULL, "", "");
+    gen->groups_map = _mesa_hash_table_create(gen,
+                                              _mesa_hash_string,
+                                              _mesa_key_string_equal);
 
     list_inithead(&gen->metric_sets);
     gen->metric_sets_map = _mesa_hash_table_create(gen,
@@ -122,48 +135,193 @@ gputop_gen_new(void)
     return gen;
 }
 
-void
-gputop_gen_add_counter(struct gputop_gen *gen,
-                       struct gputop_metric_set_counter *counter,
-                       const char *group_path)
+/* Returns the group of a "parent/child" path, creating it and any missing
+ * ancestor.
+ */
+static struct gputop_counter_group *
+gputop_gen_get_group(struct gputop_gen *gen, const char *group_path)
 {
-    const char *group_path_end = group_path + strlen(group_path);
-    struct gputop_counter_group *group = gen->root_group, *child_group = NULL;
-    const char *name = group_path;
+    struct hash_entry *entry = _mesa_hash_table_search(gen->groups_map, group_path);
 
-    while (name < group_path_end) {
-        const char *name_end = strstr(name, "/");
-        char group_name[128] = { 0, };
+    if (entry)
+        return entry->data;
 
-        if (!name_end)
-            name_end = group_path_end;
+    struct gputop_counter_group *parent = gen->root_group;
+    const char *name = strrchr(group_path, '/');
 
-        memcpy(group_name, name, name_end - name);
+    if (name) {
+        char *parent_path = strndup(group_path, name - group_path);
+        parent = gputop_gen_get_group(gen, parent_path);
+        free(parent_path);
+        name++;
+    } else
+        name = group_path;
 
-        child_group = NULL;
-        list_for_each_entry(struct gputop_counter_group, iter_group,
-                            &group->groups, link) {
-            if (!strcmp(iter_group->name, group_name)) {
-                child_group = iter_group;
-                break;
-            }
-        }
+    struct gputop_counter_group *group =
+        gputop_counter_group_new(gen, parent, group_path, name);
+    _mesa_hash_table_insert(gen->groups_map, group->path, group);
 
-        if (!child_group)
-            child_group = gputop_counter_group_new(gen, group, group_name);
+    return group;
+}
 
-        name = name_end + 1;
-        group = child_group;
-    }
+void
+gputop_gen_add_counter(struct gputop_gen *gen,
+                       struct gputop_metric_set_counter *counter,
+                       const char *group_path)
+{
+    struct gputop_counter_group *group = gputop_gen_get_group(gen, group_path);
 
-    list_addtail(&counter->link, &child_group->counters);
+    list_addtail(&counter->link, &group->counters);
 }
 
 void
 gputop_gen_add_metric_set(struct gputop_gen *gen,
                           struct gputop_metric_set *metric_set)
 {
+    metric_set->gen = gen;
     list_addtail(&metric_set->link, &gen->metric_sets);
     _mesa_hash_table_insert(gen->metric_sets_map,
                             metric_set->hw_config_guid, metric_set);
 }
+
+void
+gputop_register_progs_append(struct gputop_register_prog *regs,
+                             uint32_t *n_regs,
+                             const struct gputop_register_prog *progs,
+                             uint32_t n)
+{
+    memcpy(regs + *n_regs, progs, n * sizeof(progs[0]));
+    *n_regs += n;
+}
+
+void
+gputop_metric_set_alloc_counters(struct gputop_metric_set *metric_set,
+                                 int n_infos)
+{
+    metric_set->counters = rzalloc_array(metric_set, struct gputop_metric_set_counter,
+                                         n_infos);
+    metric_set->n_counters = 0;
+
+    metric_set->read_all_slots = ralloc_array(metric_set, int, n_infos);
+    for (int i = 0; i < n_infos; i++)
+        metric_set->read_all_slots[i] = -1;
+}
+
+void
+gputop_metric_set_add_counters(struct gputop_gen *gen,
+                               struct gputop_metric_set *metric_set,
+                               const struct gputop_metric_set_counter_info *const *infos,
+                               int first, int n)
+{
+    for (int i = first; i < first + n; i++) {
+        const struct gputop_metric_set_counter_info *info = infos[i];
+        struct gputop_metric_set_counter *counter =
+            &metric_set->counters[metric_set->n_counters];
+
+        metric_set->read_all_slots[i] = metric_set->n_counters++;
+
+        counter->metric_set = metric_set;
+        counter->name = info->name;
+        counter->symbol_name = info->symbol_name;
+        counter->desc = info->desc;
+        counter->type = info->type;
+        counter->data_type = info->data_type;
+        counter->units = info->units;
+        /* Copies the function whichever the data type */
+        counter->max_float = info->max_float;
+        counter->oa_counter_read_float = info->oa_counter_read_float;
+
+        gputop_gen_add_counter(gen, counter, info->group);
+    }
+}
+
+void
+gputop_metric_set_ensure_counters(const struct gputop_metric_set *const_metric_set)
+{
+    /* Only the lazily built parts are written */
+    struct gputop_metric_set *metric_set = (struct gputop_metric_set *) const_metric_set;
+    void (*add_counters)(struct gputop_gen *gen,
+                         struct gputop_metric_set *metric_set) = metric_set->add_counters;
+
+    if (!add_counters)
+        return;
+
+    metric_set->add_counters = NULL;
+    add_counters(metric_set->gen, metric_set);
+}
+
+void
+gputop_metric_set_ensure_registers(const struct gputop_metric_set *const_metric_set)
+{
+    struct gputop_metric_set *metric_set = (struct gputop_metric_set *) const_metric_set;
+    void (*add_registers)(struct gputop_gen *gen,
+                          struct gputop_metric_set *metric_set) = metric_set->add_registers;
+
+    if (!add_registers)
+        return;
+
+    metric_set->add_registers = NULL;
+    add_registers(metric_set->gen, metric_set);
+}
+
+void
+gputop_gen_ensure_counters(struct gputop_gen *gen)
+{
+    list_for_each_entry(struct gputop_metric_set, metric_set,
+                        &gen->metric_sets, link)
+        gputop_metric_set_ensure_counters(metric_set);
+}
+
+double
+gputop_metric_set_counter_read(const struct gputop_devinfo *devinfo,
+                               const struct gputop_metric_set_counter *counter,
+                               uint64_t *deltas)
+{
+    if (counter->read_program) {
+        double value;
+        gputop_oa_bytecode_run(counter->read_program, deltas, 1, &value);
+        return value;
+    }
+
+    switch (counter->data_type) {
+    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
+    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
+    case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
+        return counter->oa_counter_read_uint64(devinfo, counter->metric_set, deltas);
+    case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
+    case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
+        return counter->oa_counter_read_float(devinfo, counter->metric_set, deltas);
+    }
+
+    return 0;
+}
+
+bool
+gputop_metric_set_counter_has_max(const struct gputop_metric_set_counter *counter)
+{
+    return counter->max_program || counter->max_uint64;
+}
+
+double
+gputop_metric_set_counter_max(const struct gputop_devinfo *devinfo,
+                              const struct gputop_metric_set_counter *counter,
+                              uint64_t *deltas)
+{
+    if (counter->max_program) {
+        double value;
+        gputop_oa_bytecode_run(counter->max_program, deltas, 1, &value);
+        return value;
+    }
+
+    switch (counter->data_type) {
+    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
+    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
+    case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
+        return counter->max_uint64(devinfo, counter->metric_set, deltas);
+    case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
+    case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
+        return counter->max_float(devinfo, counter->metric_set, deltas);
+    }
+
+    return 0;
+}
@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <i915_drm.h>
@@ -50,6 +51,118 @@ struct gputop_devtopology {
     uint32_t engines[5];
 };
 
+/* Unsigned division by a divisor only known at runtime but invariant for
+ * a device, as a multiply and shifts (Granlund & Montgomery, "Division by
+ * Invariant Integers using Multiplication", figure 4.1). Like the
+ * equations dividing with it, division by zero gives zero.
+ */
+struct gputop_udiv_invariant {
+    uint64_t divisor;
+    uint64_t magic;
+    uint8_t shift1;
+    uint8_t shift2;
+};
+
+#if defined(__SIZEOF_INT128__) && !defined(EMSCRIPTEN)
+#define GPUTOP_UDIV_INVARIANT_MULHI 1
+#endif
+
+static inline void
+gputop_udiv_invariant_init(struct gputop_udiv_invariant *div, uint64_t divisor)
+{
+    div->divisor = divisor;
+    div->magic = 0;
+    div->shift1 = div->shift2 = 0;
+
+#ifdef GPUTOP_UDIV_INVARIANT_MULHI
+    if (divisor) {
+        int l = divisor > 1 ? 64 - __builtin_clzll(divisor - 1) : 0;
+        uint64_t t = (l == 64 ? 0 : (1ULL << l)) - divisor;
+
+        div->magic = (uint64_t)(((unsigned __int128)t << 64) / divisor) + 1;
+        div->shift1 = l ? 1 : 0;
+        div->shift2 = l ? l - 1 : 0;
+    }
+#endif
+}
+
+static inline uint64_t
+gputop_udiv_invariant(const struct gputop_udiv_invariant *div, uint64_t n)
+{
+    if (!div->divisor)
+        return 0;
+
+#ifdef GPUTOP_UDIV_INVARIANT_MULHI
+    uint64_t t1 = (uint64_t)(((unsigned __int128)div->magic * n) >> 64);
+    return (t1 + ((n - t1) >> div->shift1)) >> div->shift2;
+#else
+    return n / div->divisor;
+#endif
+}
+
+/* x * numerator / denominator rounded down, without overflowing on the
+ * intermediate product. The ratio is held as an integer part and a 0.128
+ * fixed point fraction rounded up: its error, below 2^-128, scaled by any
+ * 64-bit x stays below 1 / denominator so the result is exact. Without
+ * 128-bit multiplies this falls back to divisions, exact as long as the
+ * denominator fits in 32 bits.
+ */
+struct gputop_fixed_scale {
+    uint64_t denominator;
+    uint64_t integer;
+    uint64_t remainder;
+    uint64_t frac_hi;
+    uint64_t frac_lo;
+};
+
+static inline void
+gputop_fixed_scale_init(struct gputop_fixed_scale *scale,
+                        uint64_t numerator, uint64_t denominator)
+{
+    scale->denominator = denominator;
+    scale->integer = denominator ? numerator / denominator : 0;
+    scale->remainder = denominator ? numerator % denominator : 0;
+    scale->frac_hi = scale->frac_lo = 0;
+
+#ifdef GPUTOP_UDIV_INVARIANT_MULHI
+    if (scale->remainder) {
+        unsigned __int128 n = (unsigned __int128)scale->remainder << 64;
+        uint64_t hi = (uint64_t)(n / denominator);
+
+        n = (unsigned __int128)(uint64_t)(n % denominator) << 64;
+        uint64_t lo = (uint64_t)(n / denominator);
+        bool inexact = (n % denominator) != 0;
+
+        scale->frac_lo = lo + inexact;
+        scale->frac_hi = hi + (inexact && scale->frac_lo == 0);
+    }
+#endif
+}
+
+static inline uint64_t
+gputop_fixed_scale(const struct gputop_fixed_scale *scale, uint64_t x)
+{
+#ifdef GPUTOP_UDIV_INVARIANT_MULHI
+    unsigned __int128 t = ((unsigned __int128)x * scale->frac_lo) >> 64;
+
+    t += (unsigned __int128)x * scale->frac_hi;
+    return x * scale->integer + (uint64_t)(t >> 64);
+#else
+    if (!scale->denominator)
+        return 0;
+
+    return x * scale->integer +
+        (x / scale->denominator) * scale->remainder +
+        (x % scale->denominator) * scale->remainder / scale->denominator;
+#endif
+}
+
+/* Room for the devinfo only subexpressions of the XML equations, see
+ * gputop_oa_build_equation_constants().
+ */
+#define GPUTOP_MAX_EQUATION_CONSTANTS 32
+#define GPUTOP_MAX_EQUATION_DIVISORS 8
+
 struct gputop_devinfo {
     char devname[20];
     char prettyname[100];
@@ -79,8 +192,33 @@ struct gputop_devinfo {
     uint64_t subslice_mask;
     uint64_t slice_mask;
     uint64_t eu_threads_count;
+
+    /* Evaluated from the fields above by
+     * gputop_oa_build_equation_constants() for the generated counter
+     * equations.
+     */
+    union {
+        uint64_t u64;
+        double f;
+    } equation_constants[GPUTOP_MAX_EQUATION_CONSTANTS];
+    struct gputop_udiv_invariant equation_divisors[GPUTOP_MAX_EQUATION_DIVISORS];
+
+    /* Conversions between GPU timestamps and nanoseconds, set up by
+     * gputop_devinfo_init_timebase() from timestamp_frequency.
+     */
+    struct gputop_fixed_scale timebase_to_ns;
+    struct gputop_fixed_scale ns_to_timebase;
 };
 
+static inline void
+gputop_devinfo_init_timebase(struct gputop_devinfo *devinfo)
+{
+    gputop_fixed_scale_init(&devinfo->timebase_to_ns,
+                            1000000000ULL, devinfo->timestamp_frequency);
+    gputop_fixed_scale_init(&devinfo->ns_to_timebase,
+                            devinfo->timestamp_frequency, 1000000000ULL);
+}
+
 typedef enum {
     GPUTOP_PERFQUERY_COUNTER_DATA_UINT64,
     GPUTOP_PERFQUERY_COUNTER_DATA_UINT32,
@@ -137,6 +275,7 @@ typedef enum {
 #define OAREPORT_REASON_CTX_SWITCH     (1<<3)
 
 struct gputop_metric_set;
+struct gputop_oa_bytecode;
 struct gputop_metric_set_counter {
     const struct gputop_metric_set *metric_set;
     const char *name;
@@ -163,15 +302,55 @@ struct gputop_metric_set_counter {
                                         uint64_t *deltas);
     };
 
+    /* Counters loaded by gputop-oa-bytecode.c have programs instead of the
+     * functions above, see gputop_metric_set_counter_read().
+     */
+    const struct gputop_oa_bytecode *read_program;
+    const struct gputop_oa_bytecode *max_program;
+
     struct list_head link; /* list from gputop_counter_group.counters */
 };
 
+/* Constant part of a generated counter. The generated metric sets point
+ * to these, shared by the sets with identical counters, instead of having
+ * code filling each counter.
+ */
+struct gputop_metric_set_counter_info {
+    const char *name;
+    const char *symbol_name;
+    const char *desc;
+    const char *group;
+    gputop_counter_type_t type;
+    gputop_counter_data_type_t data_type;
+    gputop_counter_units_t units;
+    union {
+        uint64_t (*max_uint64)(const struct gputop_devinfo *devinfo,
+                               const struct gputop_metric_set *metric_set,
+                               uint64_t *deltas);
+        double (*max_float)(const struct gputop_devinfo *devinfo,
+                            const struct gputop_metric_set *metric_set,
+                            uint64_t *deltas);
+    };
+    union {
+        uint64_t (*oa_counter_read_uint64)(const struct gputop_devinfo *devinfo,
+                                           const struct gputop_metric_set *metric_set,
+                                           uint64_t *deltas);
+        double (*oa_counter_read_float)(const struct gputop_devinfo *devinfo,
+                                        const struct gputop_metric_set *metric_set,
+                                        uint64_t *deltas);
+    };
+};
+
 struct gputop_register_prog {
     uint32_t reg;
     uint32_t val;
 };
 
+struct gputop_gen;
+
 struct gputop_metric_set {
+    struct gputop_gen *gen;
+
     const char *name;
     const char *symbol_name;
     const char *hw_config_guid;
@@ -189,6 +368,33 @@ struct gputop_metric_set {
     int b_offset;
     int c_offset;
 
+    /* Evaluate every counter in a single pass, writing one value per entry
+     * of counters[].
+     */
+    void (*read_all)(const struct gputop_devinfo *devinfo,
+                     const struct gputop_metric_set *metric_set,
+                     const uint64_t *deltas,
+                     double *out);
+
+    /* Same as read_all for n_reports delta vectors laid out as
+     * deltas[delta * n_reports + report], with values written as
+     * out[counter * n_reports + report].
+     */
+    void (*read_all_soa)(const struct gputop_devinfo *devinfo,
+                         const struct gputop_metric_set *metric_set,
+                         const uint64_t *deltas,
+                         uint32_t n_reports,
+                         double *out);
+
+    /* Index in counters[] of each counter of the generated read_all_soa,
+     * in symbol name order, -1 for the counters unavailable on the device.
+     * Filled along with counters[].
+     */
+    int *read_all_slots;
+
+    /* Program behind read_all for metric sets loaded at runtime */
+    const struct gputop_oa_bytecode *program;
+
     struct gputop_register_prog *b_counter_regs;
     uint32_t n_b_counter_regs;
 
@@ -198,11 +404,21 @@ struct gputop_metric_set {
     struct gputop_register_prog *flex_regs;
     uint32_t n_flex_regs;
 
+    /* Metric sets are registered with only the fields above the counters,
+     * these fill the counters and the register programs on first use, see
+     * gputop_metric_set_ensure_counters/registers(). NULL once done.
+     */
+    void (*add_counters)(struct gputop_gen *gen,
+                         struct gputop_metric_set *metric_set);
+    void (*add_registers)(struct gputop_gen *gen,
+                          struct gputop_metric_set *metric_set);
+
     struct list_head link;
 };
 
 struct gputop_counter_group {
     const char *name;
+    const char *path;
 
     struct list_head counters;
     struct list_head groups;
@@ -213,7 +429,11 @@ struct gputop_counter_group {
 struct gputop_gen {
     const char *name;
 
+    /* Copy of the device the metric sets are built for */
+    struct gputop_devinfo devinfo;
+
     struct gputop_counter_group *root_group;
+    struct hash_table *groups_map; /* path -> gputop_counter_group */
 
     struct list_head metric_sets;
     struct hash_table *metric_sets_map;
@@ -222,7 +442,7 @@ struct gputop_gen {
 /* Free with ralloc_free() */
 struct gputop_gen *gputop_gen_for_devinfo(const struct gen_device_info *devinfo);
 
-struct gputop_gen *gputop_gen_new(void);
+struct gputop_gen *gputop_gen_new(const struct gputop_devinfo *devinfo);
 
 void gputop_gen_add_counter(struct gputop_gen *gen,
                             struct gputop_metric_set_counter *counter,
@@ -231,6 +451,47 @@ void gputop_gen_add_counter(struct gputop_gen *gen,
 void gputop_gen_add_metric_set(struct gputop_gen *gen,
                                struct gputop_metric_set *metric_set);
 
+/* Copy n register programs at the end of regs, of *n_regs entries. */
+void gputop_register_progs_append(struct gputop_register_prog *regs,
+                                  uint32_t *n_regs,
+                                  const struct gputop_register_prog *progs,
+                                  uint32_t n);
+
+/* Make room for the n_infos counters of a generated metric set, then add
+ * *infos[first] to *infos[first + n - 1], the ones available on the device,
+ * recording their index in metric_set->read_all_slots.
+ */
+void gputop_metric_set_alloc_counters(struct gputop_metric_set *metric_set,
+                                      int n_infos);
+void gputop_metric_set_add_counters(struct gputop_gen *gen,
+                                    struct gputop_metric_set *metric_set,
+                                    const struct gputop_metric_set_counter_info *const *infos,
+                                    int first, int n);
+
+/* Materialize the counters (and their groups in gen->root_group) or the
+ * register programs of a metric set registered as a stub.
+ */
+void gputop_metric_set_ensure_counters(const struct gputop_metric_set *metric_set);
+void gputop_metric_set_ensure_registers(const struct gputop_metric_set *metric_set);
+
+/* Materialize the counters of all the metric sets, for walking the whole
+ * gen->root_group tree.
+ */
+void gputop_gen_ensure_counters(struct gputop_gen *gen);
+
+/* Evaluate a counter, or its maximum when it has one, for a single
+ * accumulated delta vector.
+ */
+double gputop_metric_set_counter_read(const struct gputop_devinfo *devinfo,
+                                      const struct gputop_metric_set_counter *counter,
+                                      uint64_t *deltas);
+
+bool gputop_metric_set_counter_has_max(const struct gputop_metric_set_counter *counter);
+
+double gputop_metric_set_counter_max(const struct gputop_devinfo *devinfo,
+                                     const struct gputop_metric_set_counter *counter,
+                                     uint64_t *deltas);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,85 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gputop-pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+
+void
+gputop_pool_init(struct gputop_pool *pool, size_t object_size,
+                 uint32_t objects_per_slab)
+{
+    pool->object_size = ALIGN_POT(MAX2(object_size, sizeof(void *)), sizeof(void *));
+    pool->objects_per_slab = objects_per_slab;
+    pool->slabs = NULL;
+    pool->free_objects = NULL;
+}
+
+void
+gputop_pool_fini(struct gputop_pool *pool)
+{
+    while (pool->slabs) {
+        void *next = *((void **) pool->slabs);
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_objects = NULL;
+}
+
+static void
+add_slab(struct gputop_pool *pool)
+{
+    /* The first object's worth of the slab links the slabs together. */
+    uint8_t *slab = (uint8_t *)
+        malloc((pool->objects_per_slab + 1) * pool->object_size);
+
+    *((void **) slab) = pool->slabs;
+    pool->slabs = slab;
+
+    for (uint32_t i = pool->objects_per_slab; i > 0; i--)
+        gputop_pool_free(pool, slab + i * pool->object_size);
+}
+
+void *
+gputop_pool_alloc(struct gputop_pool *pool)
+{
+    if (!pool->free_objects)
+        add_slab(pool);
+
+    void *object = pool->free_objects;
+    pool->free_objects = *((void **) object);
+    memset(object, 0, pool->object_size);
+
+    return object;
+}
+
+void
+gputop_pool_free(struct gputop_pool *pool, void *object)
+{
+    *((void **) object) = pool->free_objects;
+    pool->free_objects = object;
+}
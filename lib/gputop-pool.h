@@ -0,0 +1,63 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __GPUTOP_POOL_H__
+#define __GPUTOP_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Allocator of objects of a single type, carved from slabs and recycled
+ * through a free list. Slabs are only released with the pool.
+ */
+struct gputop_pool {
+    size_t object_size;
+    uint32_t objects_per_slab;
+
+    void *slabs; /* chained through their first pointer */
+    void *free_objects; /* chained through their first pointer */
+};
+
+void gputop_pool_init(struct gputop_pool *pool, size_t object_size,
+                      uint32_t objects_per_slab);
+void gputop_pool_fini(struct gputop_pool *pool);
+
+/* Returns a zeroed object. */
+void *gputop_pool_alloc(struct gputop_pool *pool);
+void gputop_pool_free(struct gputop_pool *pool, void *object);
+
+#define gputop_pool_init_type(pool, type, objects_per_slab) \
+    gputop_pool_init(pool, sizeof(type), objects_per_slab)
+#define gputop_pool_alloc_type(pool, type) \
+    ((type *) gputop_pool_alloc(pool))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GPUTOP_POOL_H__ */
@@ -0,0 +1,149 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gputop-u32-map.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_GROUPS 4
+
+static void
+alloc_groups(struct gputop_u32_map *map, uint32_t n_groups)
+{
+    uint32_t n_slots = n_groups * GPUTOP_U32_MAP_GROUP_SIZE;
+
+    map->keys = (uint32_t *) malloc(n_slots * sizeof(map->keys[0]));
+    memset(map->keys, 0xff, n_slots * sizeof(map->keys[0])); /* EMPTY_KEY */
+    map->values = (void **) malloc(n_slots * sizeof(map->values[0]));
+    map->group_mask = n_groups - 1;
+    map->n_entries = 0;
+    map->n_deleted = 0;
+}
+
+void
+gputop_u32_map_init(struct gputop_u32_map *map)
+{
+    alloc_groups(map, INITIAL_GROUPS);
+}
+
+void
+gputop_u32_map_fini(struct gputop_u32_map *map)
+{
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+}
+
+void
+gputop_u32_map_clear(struct gputop_u32_map *map)
+{
+    uint32_t n_slots = (map->group_mask + 1) * GPUTOP_U32_MAP_GROUP_SIZE;
+
+    memset(map->keys, 0xff, n_slots * sizeof(map->keys[0]));
+    map->n_entries = 0;
+    map->n_deleted = 0;
+}
+
+/* First empty or deleted slot on the probe sequence of key. */
+static uint32_t
+find_free_slot(const struct gputop_u32_map *map, uint32_t key)
+{
+    uint32_t group = gputop_u32_map_hash(key) & map->group_mask;
+
+    while (true) {
+        const uint32_t *keys = &map->keys[group * GPUTOP_U32_MAP_GROUP_SIZE];
+        uint32_t match =
+            gputop_u32_map_group_match(keys, GPUTOP_U32_MAP_EMPTY_KEY) |
+            gputop_u32_map_group_match(keys, GPUTOP_U32_MAP_DELETED_KEY);
+
+        if (match)
+            return group * GPUTOP_U32_MAP_GROUP_SIZE + __builtin_ctz(match);
+
+        group = (group + 1) & map->group_mask;
+    }
+}
+
+static void
+rehash(struct gputop_u32_map *map, uint32_t n_groups)
+{
+    struct gputop_u32_map old = *map;
+    uint32_t n_old_slots = (old.group_mask + 1) * GPUTOP_U32_MAP_GROUP_SIZE;
+
+    alloc_groups(map, n_groups);
+    for (uint32_t i = 0; i < n_old_slots; i++) {
+        if (old.keys[i] >= GPUTOP_U32_MAP_DELETED_KEY)
+            continue;
+
+        uint32_t slot = find_free_slot(map, old.keys[i]);
+        map->keys[slot] = old.keys[i];
+        map->values[slot] = old.values[i];
+        map->n_entries++;
+    }
+
+    gputop_u32_map_fini(&old);
+}
+
+void
+gputop_u32_map_insert(struct gputop_u32_map *map, uint32_t key, void *value)
+{
+    assert(key < GPUTOP_U32_MAP_DELETED_KEY);
+
+    int64_t slot = gputop_u32_map_find(map, key);
+    if (slot >= 0) {
+        map->values[slot] = value;
+        return;
+    }
+
+    /* Keep at least a quarter of the slots empty so that probes stay
+     * short, dropping the deleted slots when they are what fills the map.
+     */
+    uint32_t n_groups = map->group_mask + 1;
+    uint32_t n_slots = n_groups * GPUTOP_U32_MAP_GROUP_SIZE;
+    if ((map->n_entries + map->n_deleted + 1) * 4 > n_slots * 3)
+        rehash(map, (map->n_entries + 1) * 2 > n_slots ? n_groups * 2 : n_groups);
+
+    slot = find_free_slot(map, key);
+    if (map->keys[slot] == GPUTOP_U32_MAP_DELETED_KEY)
+        map->n_deleted--;
+    map->keys[slot] = key;
+    map->values[slot] = value;
+    map->n_entries++;
+}
+
+void *
+gputop_u32_map_remove(struct gputop_u32_map *map, uint32_t key)
+{
+    int64_t slot = gputop_u32_map_find(map, key);
+    if (slot < 0)
+        return NULL;
+
+    map->keys[slot] = GPUTOP_U32_MAP_DELETED_KEY;
+    map->n_entries--;
+    map->n_deleted++;
+
+    return map->values[slot];
+}
@@ -0,0 +1,129 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __GPUTOP_U32_MAP_H__
+#define __GPUTOP_U32_MAP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Open addressing map from 32bits keys to pointers, for the hardware
+ * context ids and pids looked up while accumulating. Keys live apart from
+ * the values in groups of 4 probed at once, the groups being probed
+ * linearly. The 2 largest keys are reserved to mark the empty and deleted
+ * slots.
+ */
+#define GPUTOP_U32_MAP_EMPTY_KEY (UINT32_MAX)
+#define GPUTOP_U32_MAP_DELETED_KEY (UINT32_MAX - 1)
+#define GPUTOP_U32_MAP_GROUP_SIZE 4
+
+struct gputop_u32_map {
+    uint32_t *keys;
+    void **values;
+    uint32_t group_mask; /* number of groups - 1 */
+    uint32_t n_entries;
+    uint32_t n_deleted;
+};
+
+void gputop_u32_map_init(struct gputop_u32_map *map);
+void gputop_u32_map_fini(struct gputop_u32_map *map);
+void gputop_u32_map_clear(struct gputop_u32_map *map);
+
+/* Replaces the value of a key already in the map. */
+void gputop_u32_map_insert(struct gputop_u32_map *map, uint32_t key, void *value);
+
+/* Returns the value removed, NULL if the key wasn't in the map. */
+void *gputop_u32_map_remove(struct gputop_u32_map *map, uint32_t key);
+
+static inline uint32_t
+gputop_u32_map_num_entries(const struct gputop_u32_map *map)
+{
+    return map->n_entries;
+}
+
+static inline uint32_t
+gputop_u32_map_hash(uint32_t key)
+{
+    key *= 0x9e3779b1;
+    return key ^ (key >> 16);
+}
+
+/* Bit i set if the slot i of the group holds key. */
+static inline uint32_t
+gputop_u32_map_group_match(const uint32_t *group, uint32_t key)
+{
+#ifdef __SSE2__
+    __m128i keys = _mm_loadu_si128((const __m128i *) group);
+    __m128i match = _mm_cmpeq_epi32(keys, _mm_set1_epi32(key));
+    return _mm_movemask_ps(_mm_castsi128_ps(match));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GPUTOP_U32_MAP_GROUP_SIZE; i++)
+        mask |= (group[i] == key) << i;
+    return mask;
+#endif
+}
+
+/* Index of the slot holding key, -1 if absent. */
+static inline int64_t
+gputop_u32_map_find(const struct gputop_u32_map *map, uint32_t key)
+{
+    uint32_t group = gputop_u32_map_hash(key) & map->group_mask;
+
+    if (key >= GPUTOP_U32_MAP_DELETED_KEY)
+        return -1;
+
+    while (true) {
+        const uint32_t *keys = &map->keys[group * GPUTOP_U32_MAP_GROUP_SIZE];
+        uint32_t match = gputop_u32_map_group_match(keys, key);
+
+        if (match)
+            return group * GPUTOP_U32_MAP_GROUP_SIZE + __builtin_ctz(match);
+        if (gputop_u32_map_group_match(keys, GPUTOP_U32_MAP_EMPTY_KEY))
+            return -1;
+
+        group = (group + 1) & map->group_mask;
+    }
+}
+
+static inline void *
+gputop_u32_map_search(const struct gputop_u32_map *map, uint32_t key)
+{
+    int64_t slot = gputop_u32_map_find(map, key);
+    return slot < 0 ? NULL : map->values[slot];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GPUTOP_U32_MAP_H__ */
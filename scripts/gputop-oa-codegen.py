@@ -36,6 +36,13 @@ c = None
 hashed_funcs = {}
 xml_equations = None
 
+# OA report format used by each chipset, the layout of each format is
+# described by the format table in gputop-oa-counters.c
+default_oa_format = "I915_OA_FORMAT_A32u40_A4u32_B8_C8"
+oa_formats = {
+    "hsw": "I915_OA_FORMAT_A45_B8_C8",
+}
+
 def check_operand_type(set, arg):
     if arg.isdigit():
         return "\n<mn>" + arg + "</mn>"
@@ -139,92 +146,277 @@ def mathml_splice_and(set, args):
         operand_1 = put_brackets(args[1][0])
     return [operand_1 + "\n<mo>&amp;</mo>" + operand_0, and_precedence]
 
-def emit_fadd(tmp_id, args):
-    c("double tmp{0} = {1} + {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+# Equations are parsed into a DAG of Nodes before any code is emitted.
+# Nodes are hash-consed on their key within an Equations instance which
+# gives common subexpression elimination for free, ops whose operands are
+# all literals are folded and subexpressions that only depend on devinfo
+# are hoisted into per-device constants (see EquationConstants).
+#
+# Each op keeps the exact C semantics of evaluating it into a temporary
+# of the op's type, with the operands in their own C types.
 
-# Be careful to check for divide by zero...
-def emit_fdiv(tmp_id, args):
-    c("double tmp{0} = {1};".format(tmp_id, args[1]))
-    c("double tmp{0} = {1};".format(tmp_id + 1, args[0]))
-    c("double tmp{0} = tmp{1} ? tmp{2} / tmp{1} : 0;".format(tmp_id + 2, tmp_id + 1, tmp_id))
-    return tmp_id + 3
-
-def emit_fmax(tmp_id, args):
-    c("double tmp{0} = {1};".format(tmp_id, args[1]))
-    c("double tmp{0} = {1};".format(tmp_id + 1, args[0]))
-    c("double tmp{0} = MAX(tmp{1}, tmp{2});".format(tmp_id + 2, tmp_id, tmp_id + 1))
-    return tmp_id + 3
-
-def emit_fmul(tmp_id, args):
-    c("double tmp{0} = {1} * {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
-
-def emit_fsub(tmp_id, args):
-    c("double tmp{0} = {1} - {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
-
-def emit_read(tmp_id, args):
-    type = args[1].lower()
-    c("uint64_t tmp{0} = accumulator[metric_set->{1}_offset + {2}];".format(tmp_id, type, args[0]))
-    return tmp_id + 1
-
-def emit_read_reg(tmp_id, args):
-    c("uint64_t tmp{0} = 0;".format(tmp_id))
-    return tmp_id + 1
-
-def emit_uadd(tmp_id, args):
-    c("uint64_t tmp{0} = {1} + {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+int_ctypes = {
+    "int": (True, 32),
+    "uint32_t": (False, 32),
+    "uint64_t": (False, 64),
+}
+
+class Node:
+    def __init__(self, key, kind, ctype, text=None, op=None, args=(),
+                 value=None, device_const=False):
+        self.key = key
+        self.kind = kind        # "leaf", "read", "ref", "op" or "cast"
+        self.ctype = ctype
+        self.text = text
+        self.op = op
+        self.args = args
+        self.value = value      # Python value of literals and folded ops
+        self.device_const = device_const
+
+    # Whether the node is evaluated when emitted, as opposed to leaves
+    # which are just spliced into the expressions using them.
+    @property
+    def computed(self):
+        return self.kind in ("op", "cast")
+
+
+# The type C arithmetic converts a binary op's operands to
+def arith_ctype(a, b):
+    if "double" in (a, b):
+        return "double"
+    if "uint64_t" in (a, b):
+        return "uint64_t"
+    if "uint32_t" in (a, b):
+        return "uint32_t"
+    return "int"
+
+# Converts a folded value to ctype, None if the result would depend on
+# undefined behaviour.
+def fold_value(ctype, value):
+    if ctype == "double":
+        return float(value)
+    signed, bits = int_ctypes[ctype]
+    if isinstance(value, float):
+        if value != value or value < 0 or value >= 2 ** bits:
+            return None
+        value = int(value)
+    if signed:
+        if value < -2 ** (bits - 1) or value >= 2 ** (bits - 1):
+            return None
+        return value
+    return value % (2 ** bits)
+
+# The type of a folded binary op, before conversion to the op's type
+def fold_ctype(op, a, b):
+    if op in ("<<", ">>"):
+        return a.ctype
+    return arith_ctype(a.ctype, b.ctype)
+
+def fold_binop(op, a, b):
+    ctype = fold_ctype(op, a, b)
+    if op in ("<<", ">>"):
+        if ctype == "double" or b.ctype == "double":
+            return None
+        x = fold_value(ctype, a.value)
+        y = b.value
+        if x is None or x < 0 or y < 0 or y >= int_ctypes[ctype][1]:
+            return None
+        return fold_value(ctype, x << y if op == "<<" else x >> y)
+
+    x = fold_value(ctype, a.value)
+    y = fold_value(ctype, b.value)
+    if x is None or y is None:
+        return None
+    if op == "+":
+        value = x + y
+    elif op == "-":
+        value = x - y
+    elif op == "*":
+        value = x * y
+    elif op == "&":
+        value = x & y
+    elif op == "MIN":
+        value = min(x, y)
+    elif op == "MAX":
+        value = max(x, y)
+    elif op == "/":
+        if not y:
+            value = 0
+        elif ctype == "double":
+            value = x / y
+        else:
+            value = x // y
+    else:
+        return None
+    if ctype == "double" and abs(value) == float("inf"):
+        return None
+    return fold_value(ctype, value)
+
+def literal_text(ctype, value):
+    if ctype == "double":
+        return repr(value)
+    elif ctype == "uint64_t":
+        return "UINT64_C({0})".format(value)
+    elif ctype == "int":
+        return str(value)
+    else:
+        return "({0}){1}".format(ctype, value)
+
+op_templates = {
+    "+": "{0} + {1}",
+    "-": "{0} - {1}",
+    "*": "{0} * {1}",
+    "/": "{1} ? {0} / {1} : 0",
+    "<<": "{0} << {1}",
+    ">>": "{0} >> {1}",
+    "&": "{0} & {1}",
+    "MIN": "MIN({0}, {1})",
+    "MAX": "MAX({0}, {1})",
+}
+
+class Equations:
+    def __init__(self, set, counter_ref=None):
+        self.set = set
+        self.counter_ref = counter_ref  # None resolves references inline
+        self.nodes = {}
+        self.values = {}
+
+    def node(self, key, *args, **kwargs):
+        if key not in self.nodes:
+            self.nodes[key] = Node(key, *args, **kwargs)
+        return self.nodes[key]
+
+    def literal(self, ctype, value):
+        return self.node("lit:" + ctype + ":" + str(value), "leaf", ctype,
+                         text=literal_text(ctype, value), value=value,
+                         device_const=True)
+
+    def hw_var(self, name):
+        var = hw_vars[name]
+        return self.node("hw:" + name, "leaf", var.get('ctype', "uint64_t"),
+                         text=var['c'], device_const=True)
+
+    def read(self, type, index):
+        return self.node("read:" + type + ":" + index, "read", "uint64_t",
+                         text=(type, index))
+
+    def cast(self, ctype, node):
+        if node.ctype == ctype:
+            return node
+        if node.value is not None:
+            value = fold_value(ctype, node.value)
+            if value is not None:
+                return self.literal(ctype, value)
+        return self.node("cast:" + ctype + "(" + node.key + ")", "cast", ctype,
+                         args=(node,), device_const=node.device_const)
+
+    def binop(self, ctype, op, a, b):
+        if a.value is not None and b.value is not None:
+            value = fold_binop(op, a, b)
+            if value is not None:
+                return self.cast(ctype, self.literal(fold_ctype(op, a, b), value))
+        return self.node(ctype + ":" + op + "(" + a.key + "," + b.key + ")",
+                         "op", ctype, op=op, args=(a, b),
+                         device_const=a.device_const and b.device_const)
+
+    def counter(self, symbol):
+        counter = self.set.counter_vars[symbol]
+        ctype = data_type_to_ctype(counter.get('data_type'))
+        if self.counter_ref:
+            return self.node("ref:" + symbol, "ref", ctype,
+                             text=self.counter_ref(self.set, symbol))
+        return self.value(counter)
+
+    # The value of a counter converted to the type its read function
+    # returns.
+    def value(self, counter):
+        symbol = counter.get('symbol_name')
+        if symbol not in self.values:
+            self.values[symbol] = self.cast(data_type_to_ctype(counter.get('data_type')),
+                                            self.parse(counter, counter.get('equation')))
+        return self.values[symbol]
+
+    def parse(self, counter, equation):
+        tokens = equation.split()
+        stack = []
+
+        for token in tokens:
+            stack.append(token)
+            while stack and stack[-1] in ops:
+                op = stack.pop()
+                argc, callback, mathml_callback = ops[op]
+                args = []
+                for i in range(0, argc):
+                    operand = stack.pop()
+                    if op not in ("READ", "READ_REG") and not isinstance(operand, Node):
+                        operand = self.operand(counter, equation, operand)
+                    args.append(operand)
+
+                stack.append(callback(self, args))
+
+        if len(stack) != 1:
+            raise Exception("Spurious empty rpn code for " + self.set.name + " :: " +
+                    counter.get('name') + ".\nThis is probably due to some unhandled RPN function, in the equation \"" +
+                    equation + "\"")
+
+        if isinstance(stack[-1], Node):
+            return stack[-1]
+        return self.operand(counter, equation, stack[-1])
+
+    def operand(self, counter, equation, token):
+        if token[0] == "$":
+            if token in hw_vars:
+                return self.hw_var(token)
+            elif token in self.set.counter_vars:
+                return self.counter(token)
+            else:
+                raise Exception("Failed to resolve variable " + token + " in equation " + equation + " for " + self.set.name + " :: " + counter.get('name'));
+        elif token.isdigit():
+            return self.literal("int", int(token))
+        else:
+            raise Exception("Unexpected operand " + token + " in equation " + equation + " for " + self.set.name + " :: " + counter.get('name'))
 
-# Be careful to check for divide by zero...
-def emit_udiv(tmp_id, args):
-    c("uint64_t tmp{0} = {1};".format(tmp_id, args[1]))
-    c("uint64_t tmp{0} = {1};".format(tmp_id + 1, args[0]))
-    c("uint64_t tmp{0} = tmp{1} ? tmp{2} / tmp{1} : 0;".format(tmp_id + 2, tmp_id + 1, tmp_id))
-    return tmp_id + 3
 
-def emit_umul(tmp_id, args):
-    c("uint64_t tmp{0} = {1} * {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+# Callbacks building the IR of RPN ops, args[0] is the top of the stack.
+def fop(op):
+    return lambda eqs, args: eqs.binop("double", op, args[1], args[0])
 
-def emit_usub(tmp_id, args):
-    c("uint64_t tmp{0} = {1} - {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+def uop(op):
+    return lambda eqs, args: eqs.binop("uint64_t", op, args[1], args[0])
 
-def emit_umin(tmp_id, args):
-    c("uint64_t tmp{0} = MIN({1}, {2});".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+# Be careful to check for divide by zero...
+def build_fdiv(eqs, args):
+    return eqs.binop("double", "/", eqs.cast("double", args[1]), eqs.cast("double", args[0]))
+
+def build_fmax(eqs, args):
+    return eqs.binop("double", "MAX", eqs.cast("double", args[1]), eqs.cast("double", args[0]))
 
-def emit_lshft(tmp_id, args):
-    c("uint64_t tmp{0} = {1} << {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+def build_udiv(eqs, args):
+    return eqs.binop("uint64_t", "/", eqs.cast("uint64_t", args[1]), eqs.cast("uint64_t", args[0]))
 
-def emit_rshft(tmp_id, args):
-    c("uint64_t tmp{0} = {1} >> {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+def build_read(eqs, args):
+    return eqs.read(args[1].lower(), args[0])
 
-def emit_and(tmp_id, args):
-    c("uint64_t tmp{0} = {1} & {2};".format(tmp_id, args[1], args[0]))
-    return tmp_id + 1
+def build_read_reg(eqs, args):
+    return eqs.literal("uint64_t", 0)
 
 ops = {}
-#                     (n operands, emitter1, emitter2)
-ops["FADD"]     = (2, emit_fadd, mathml_splice_add)
-ops["FDIV"]     = (2, emit_fdiv, mathml_splice_div)
-ops["FMAX"]     = (2, emit_fmax, mathml_splice_max)
-ops["FMUL"]     = (2, emit_fmul, mathml_splice_mul)
-ops["FSUB"]     = (2, emit_fsub, mathml_splice_sub)
-ops["READ"]     = (2, emit_read, mathml_splice_read)
-ops["READ_REG"] = (1, emit_read_reg, mathml_splice_read_reg)
-ops["UADD"]     = (2, emit_uadd, mathml_splice_add)
-ops["UDIV"]     = (2, emit_udiv, mathml_splice_div)
-ops["UMUL"]     = (2, emit_umul, mathml_splice_mul)
-ops["USUB"]     = (2, emit_usub, mathml_splice_sub)
-ops["UMIN"]     = (2, emit_umin, mathml_splice_min)
-ops["<<"]       = (2, emit_lshft, mathml_splice_lshft)
-ops[">>"]       = (2, emit_rshft, mathml_splice_rshft)
-ops["AND"]      = (2, emit_and, mathml_splice_and)
+#                     (n operands, IR builder, mathml emitter)
+ops["FADD"]     = (2, fop("+"), mathml_splice_add)
+ops["FDIV"]     = (2, build_fdiv, mathml_splice_div)
+ops["FMAX"]     = (2, build_fmax, mathml_splice_max)
+ops["FMUL"]     = (2, fop("*"), mathml_splice_mul)
+ops["FSUB"]     = (2, fop("-"), mathml_splice_sub)
+ops["READ"]     = (2, build_read, mathml_splice_read)
+ops["READ_REG"] = (1, build_read_reg, mathml_splice_read_reg)
+ops["UADD"]     = (2, uop("+"), mathml_splice_add)
+ops["UDIV"]     = (2, build_udiv, mathml_splice_div)
+ops["UMUL"]     = (2, uop("*"), mathml_splice_mul)
+ops["USUB"]     = (2, uop("-"), mathml_splice_sub)
+ops["UMIN"]     = (2, uop("MIN"), mathml_splice_min)
+ops["<<"]       = (2, uop("<<"), mathml_splice_lshft)
+ops[">>"]       = (2, uop(">>"), mathml_splice_rshft)
+ops["AND"]      = (2, uop("&"), mathml_splice_and)
 
 def brkt(subexp):
     if " " in subexp:
@@ -266,8 +458,8 @@ hw_vars = {
         "$GpuTimestampFrequency": { 'c': "devinfo->timestamp_frequency" },
         "$GpuMinFrequency": { 'c': "devinfo->gt_min_freq" },
         "$GpuMaxFrequency": { 'c': "devinfo->gt_max_freq" },
-        "$SkuRevisionId": { 'c': "devinfo->revision" },
-        "$QueryMode": { 'c': "devinfo->query_mode" },
+        "$SkuRevisionId": { 'c': "devinfo->revision", 'ctype': "uint32_t" },
+        "$QueryMode": { 'c': "devinfo->query_mode", 'ctype': "bool" },
 }
 
 def splice_mathml_expression(set, equation, tag):
@@ -291,50 +483,163 @@ def splice_mathml_expression(set, equation, tag):
     equation_descr = "<mi>" + tag + "</mi><mo> = </mo>"
     return "<mathml_" + tag + ">" + equation_descr + xml_string + "</mathml_" + tag + ">"
 
+# Subexpressions only depending on devinfo, shared by the equations of all
+# gens. gputop_oa_build_equation_constants() evaluates them once per
+# device into devinfo->equation_constants[] and prepares the divisors of
+# unsigned divisions by such constants in devinfo->equation_divisors[].
+class EquationConstants:
+    def __init__(self):
+        self.constants = []
+        self.divisors = []
+        self.slots = {}
+
+    def slot(self, nodes, prefix, node):
+        key = prefix + node.key
+        if key not in self.slots:
+            self.slots[key] = len(nodes)
+            nodes.append(node)
+        return self.slots[key]
+
+    def constant_slot(self, node):
+        return self.slot(self.constants, "constant:", node)
+
+    def divisor_slot(self, node):
+        return self.slot(self.divisors, "divisor:", node)
+
+    def constant(self, node):
+        return "devinfo->equation_constants[{0}].{1}".format(self.constant_slot(node),
+                                                              "f" if node.ctype == "double" else "u64")
+
+    def divisor(self, node):
+        return "&devinfo->equation_divisors[{0}]".format(self.divisor_slot(node))
+
+equation_constants = EquationConstants()
+
+
+# How READ operands index the deltas of a single report
+read_template = "accumulator[metric_set->{0}_offset + {1}]"
+
+# Emits the code evaluating Nodes, each computed node into a temporary
+# once per scope.
+class Emitter:
+    def __init__(self, read_template, hoist=True):
+        self.read_template = read_template
+        self.hoist = hoist
+        self.scopes = [{}]
+        self.divisor_refs = {}
+        self.n_tmps = 0
+
+    def hoisted(self, node):
+        return self.hoist and node.device_const and node.computed
+
+    # The devinfo only divisor of an unsigned division
+    def divisor(self, node):
+        if (self.hoist and node.kind == "op" and node.op == "/" and
+            node.ctype == "uint64_t" and not node.device_const and
+            node.args[1].device_const and node.args[1].value is None):
+            return node.args[1]
+        return None
+
+    # The nodes emitting node emits first
+    def dependencies(self, node):
+        if not node.computed or self.hoisted(node):
+            return ()
+        if self.divisor(node):
+            return node.args[:1]
+        return node.args
+
+    def push_scope(self):
+        self.scopes.append({})
+
+    def pop_scope(self):
+        self.scopes.pop()
+
+    def bind(self, node, name):
+        self.scopes[-1][node.key] = name
+
+    def lookup(self, node):
+        for scope in reversed(self.scopes):
+            if node.key in scope:
+                return scope[node.key]
+        return None
+
+    # Whether the expression of node needs temporaries for its operands
+    def needs_temporaries(self, node):
+        for dep in self.dependencies(node):
+            if dep.computed and not self.hoisted(dep) and self.lookup(dep) is None:
+                return True
+        return False
+
+    # Returns the C expression of node, without a temporary for it
+    def expression(self, node):
+        name = self.lookup(node)
+        if name is not None:
+            return name
+        if node.kind == "read":
+            return self.read_template.format(*node.text)
+        if not node.computed:
+            return node.text
+        if self.hoisted(node):
+            return equation_constants.constant(node)
+
+        divisor = self.divisor(node)
+        if divisor:
+            divisor_ref = self.divisor_refs.get(divisor.key)
+            if divisor_ref is None:
+                divisor_ref = equation_constants.divisor(divisor)
+            return "gputop_udiv_invariant({0}, {1})".format(divisor_ref, self.emit(node.args[0]))
+        if node.kind == "cast":
+            return self.emit(node.args[0])
+        return op_templates[node.op].format(*[self.emit(arg) for arg in node.args])
+
+    # Returns a name or leaf expression for the value of node, emitting a
+    # temporary if it has to be computed.
+    def emit(self, node, name=None):
+        expression = self.expression(node)
+        if self.lookup(node) is not None or not node.computed or self.hoisted(node):
+            return expression
+        if name is None:
+            name = "tmp{0}".format(self.n_tmps)
+            self.n_tmps += 1
+        c("{0} {1} = {2};".format(node.ctype, name, expression))
+        self.bind(node, name)
+        return name
+
+    # Copies the hoisted constants and divisors needed to evaluate nodes
+    # into locals, so that loops don't reload them through devinfo.
+    def load_constants(self, nodes):
+        seen = {}
+        stack = list(reversed(nodes))
+        while stack:
+            node = stack.pop()
+            if node.key in seen:
+                continue
+            seen[node.key] = True
+            if self.hoisted(node):
+                name = "constant{0}".format(equation_constants.constant_slot(node))
+                c("const {0} {1} = {2};".format(node.ctype, name,
+                                                equation_constants.constant(node)))
+                self.bind(node, name)
+                continue
+            divisor = self.divisor(node)
+            if divisor and divisor.key not in self.divisor_refs:
+                slot = equation_constants.divisor_slot(divisor)
+                c("const struct gputop_udiv_invariant divisor{0} = devinfo->equation_divisors[{0}];".format(slot))
+                self.divisor_refs[divisor.key] = "&divisor{0}".format(slot)
+            stack.extend(reversed(self.dependencies(node)))
+
+
+def counter_read_call(set, operand):
+    return set.read_funcs[operand[1:]] + "(devinfo, metric_set, accumulator)"
+
+# Emits the code evaluating an RPN equation and returning the result,
+# counter references being calls to the counters' read functions.
 def output_rpn_equation_code(set, counter, equation):
     c("/* RPN equation: " + equation + " */")
-    tokens = equation.split()
-    stack = []
-    tmp_id = 0
-    tmp = None
-
-    for token in tokens:
-        stack.append(token)
-        while stack and stack[-1] in ops:
-            op = stack.pop()
-            argc, callback, mathml_callback = ops[op]
-            args = []
-            for i in range(0, argc):
-                operand = stack.pop()
-                if operand[0] == "$":
-                    if operand in hw_vars:
-                        operand = hw_vars[operand]['c']
-                    elif operand in set.counter_vars:
-                        reference = set.counter_vars[operand]
-                        operand = set.read_funcs[operand[1:]] + "(devinfo, metric_set, accumulator)"
-                    else:
-                        raise Exception("Failed to resolve variable " + operand + " in equation " + equation + " for " + set.name + " :: " + counter.get('name'));
-                args.append(operand)
-
-            tmp_id = callback(tmp_id, args)
-
-            tmp = "tmp{0}".format(tmp_id - 1)
-            stack.append(tmp)
-
-    if len(stack) != 1:
-        raise Exception("Spurious empty rpn code for " + set.name + " :: " +
-                counter.get('name') + ".\nThis is probably due to some unhandled RPN function, in the equation \"" +
-                equation + "\"")
-
-    value = stack[-1]
-
-    if value in hw_vars:
-        value = hw_vars[value]['c']
-    if value in set.counter_vars:
-        value = set.read_funcs[value[1:]] + "(devinfo, metric_set, accumulator)"
-
+    equations = Equations(set, counter_ref=counter_read_call)
+    emitter = Emitter(read_template)
+    value = emitter.emit(equations.parse(counter, equation))
     c("\nreturn " + value + ";")
-
 def splice_rpn_expression(set, counter_name, expression):
     tokens = expression.split()
     stack = []
@@ -444,6 +749,161 @@ def output_counter_max(gen, set, counter):
         hashed_funcs[counter.max_hash] = counter.max_sym
 
 
+# Picks the computed nodes the read_all_soa functions evaluate into named
+# values: the values of counters used by other equations or by several
+# counters and any subexpression the evaluation of more than one of the
+# named values or counters would otherwise repeat. Returned in an order
+# where every node comes after the nodes it uses.
+def read_all_shared_nodes(emitter, values):
+    shared = {}
+    n_users = {}
+    for node in values:
+        n_users[node.key] = n_users.get(node.key, 0) + 1
+    for key in n_users:
+        if n_users[key] > 1:
+            shared[key] = True
+
+    changed = True
+    while changed:
+        changed = False
+        heads = [node for node in values if node.computed] + \
+                [node for node in emitter_nodes(emitter, values) if node.key in shared]
+        users = {}
+        for head in heads:
+            seen = {}
+            stack = list(emitter.dependencies(head))
+            while stack:
+                node = stack.pop()
+                if node.key in seen or not node.computed or emitter.hoisted(node):
+                    continue
+                seen[node.key] = True
+                users.setdefault(node.key, {})[head.key] = True
+                if node.key not in n_users and node.key not in shared:
+                    stack.extend(emitter.dependencies(node))
+        for key in users:
+            if key not in shared and (key in n_users or len(users[key]) > 1):
+                shared[key] = True
+                changed = True
+
+    return [node for node in emitter_nodes(emitter, values) if node.key in shared]
+
+# The computed nodes evaluating values depends on, in dependency order
+def emitter_nodes(emitter, values):
+    ordered = []
+    visited = {}
+
+    def visit(node):
+        if node.key in visited or not node.computed or emitter.hoisted(node):
+            return
+        visited[node.key] = True
+        for dep in emitter.dependencies(node):
+            visit(dep)
+        ordered.append(node)
+
+    for node in values:
+        visit(node)
+
+    return ordered
+
+
+# Evaluates every counter of a set over n_reports delta vectors, with the
+# equations of all the counters in one DAG so that referenced counters and
+# common subexpressions are only computed once. The reports are worked
+# through in tiles: the shared nodes are computed for the whole tile in a
+# first loop, then each counter is evaluated over the tile in its own loop
+# so that it only streams through the deltas it reads and the values it
+# writes. Single reports go through read_all_report(), as tiles of one.
+def output_read_all(gen, set):
+    counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
+    equations = Equations(set)
+    values = [equations.value(counter) for counter in counters]
+
+    names = {}
+    for counter, value in zip(counters, values):
+        names.setdefault(value.key, set.read_all_vars[counter.get('symbol_name')])
+
+    c("\n")
+    c("/* {0} :: read all counters of n_reports SoA delta vectors */".format(set.name))
+    c("static void")
+    c(set.read_all_soa_sym + "(const struct gputop_devinfo *devinfo,\n")
+    c.indent(len(set.read_all_soa_sym) + 1)
+    c("const struct gputop_metric_set *metric_set,\n")
+    c("const uint64_t *deltas,\n")
+    c("uint32_t n_reports,\n")
+    c("double *out)\n")
+    c.outdent(len(set.read_all_soa_sym) + 1)
+    c("{")
+    c.indent(4)
+    c("const int *slots = metric_set->read_all_slots;")
+    emitter = Emitter("deltas[(metric_set->{0}_offset + {1}) * n_reports + r0 + r]")
+    emitter.load_constants(values)
+    shared = read_all_shared_nodes(emitter, values)
+    c("\n")
+    c("for (uint32_t r0 = 0; r0 < n_reports; r0 += READ_ALL_TILE) {")
+    c.indent(4)
+    c("uint32_t n_tile = MIN(n_reports - r0, READ_ALL_TILE);")
+    for i, node in enumerate(shared):
+        names.setdefault(node.key, "tile{0}".format(i))
+        c("{0} {1}[READ_ALL_TILE];".format(node.ctype, names[node.key]))
+    if shared:
+        c("\n")
+        c("for (uint32_t r = 0; r < n_tile; r++) {")
+        c.indent(4)
+        for node in shared:
+            emitter.push_scope()
+            c(names[node.key] + "[r] = " + emitter.expression(node) + ";")
+            emitter.pop_scope()
+            emitter.bind(node, names[node.key] + "[r]")
+        c.outdent(4)
+        c("}")
+    for i, value in enumerate(values):
+        out = "out[slots[{0}] * n_reports + r0 + r]".format(i)
+        c("\n")
+        if not emitter.needs_temporaries(value):
+            c("if (slots[{0}] >= 0)".format(i))
+            c("    for (uint32_t r = 0; r < n_tile; r++)")
+            c("        " + out + " = " + emitter.expression(value) + ";")
+            continue
+        c("if (slots[{0}] >= 0) {{".format(i))
+        c.indent(4)
+        c("for (uint32_t r = 0; r < n_tile; r++) {")
+        c.indent(4)
+        emitter.push_scope()
+        c(out + " = " + emitter.expression(value) + ";")
+        emitter.pop_scope()
+        c.outdent(4)
+        c("}")
+        c.outdent(4)
+        c("}")
+    c.outdent(4)
+    c("}")
+    c.outdent(4)
+    c("}")
+
+def output_equation_constants():
+    n_constants = len(equation_constants.constants)
+    n_divisors = len(equation_constants.divisors)
+
+    c("\n")
+    c("#if {0} > GPUTOP_MAX_EQUATION_CONSTANTS || {1} > GPUTOP_MAX_EQUATION_DIVISORS".format(n_constants, n_divisors))
+    c("#error \"Too many devinfo equation constants for struct gputop_devinfo\"")
+    c("#endif")
+    c("\n")
+    c("void")
+    c("gputop_oa_build_equation_constants(struct gputop_devinfo *devinfo)")
+    c("{")
+    c.indent(4)
+    emitter = Emitter(None, hoist=False)
+    for slot, node in enumerate(equation_constants.constants):
+        value = emitter.emit(node)
+        c("devinfo->equation_constants[{0}].{1} = {2};".format(slot, "f" if node.ctype == "double" else "u64", value))
+    for slot, node in enumerate(equation_constants.divisors):
+        value = emitter.emit(node)
+        c("gputop_udiv_invariant_init(&devinfo->equation_divisors[{0}], {1});".format(slot, value))
+    c.outdent(4)
+    c("}")
+
+
 semantic_type_map = {
     "duration": "raw",
     "ratio": "event"
@@ -468,51 +928,102 @@ def output_units(unit):
     return unit.replace(' ', '_').upper()
 
 
-def output_counter_report(set, counter):
-    data_type = counter.get('data_type')
-    data_type_uc = data_type.upper()
-    c_type = data_type
+# The counter infos and register tables already emitted, by content, for
+# the sets of all gens to share them: most sets repeat counters and register
+# configs of other sets and gens.
+counter_infos = {}
+register_tables = {}
+
+# The function a read or max symbol stands for, hashed_funcs aliasing the
+# functions of identical equations with #defines.
+def counter_func(sym, eq, hash):
+    if not eq or eq == "100":
+        return sym
+    return hashed_funcs[hash]
 
-    if "uint" in c_type:
-        c_type = c_type + "_t"
+# Emits the gputop_metric_set_counter_info of a counter unless an identical
+# one exists, returns the name of the info to use.
+def output_counter_info(set, counter):
+    data_type = counter.get('data_type')
 
     semantic_type = counter.get('semantic_type')
     if semantic_type in semantic_type_map:
         semantic_type = semantic_type_map[semantic_type]
 
-    semantic_type_uc = semantic_type.upper()
+    fields = [
+        "\"{0}\", \"{1}\",".format(counter.get('name'), counter.get('symbol_name')),
+        "\"{0}\", \"{1}\",".format(counter.get('description'), counter.get('mdapi_group')),
+        "GPUTOP_PERFQUERY_COUNTER_{0}, GPUTOP_PERFQUERY_COUNTER_DATA_{1}, GPUTOP_PERFQUERY_COUNTER_UNITS_{2},".format(
+            semantic_type.upper(), data_type.upper(), output_units(counter.get('units'))),
+        "{{ .max_{0} = {1} }}, {{ .oa_counter_read_{0} = {2} }},".format(
+            data_type,
+            counter_func(counter.max_sym, counter.get('max_equation'), counter.max_hash),
+            counter_func(counter.read_sym, counter.get('equation'), counter.read_hash)),
+    ]
+    key = "\n".join(fields)
+    if key in counter_infos:
+        return counter_infos[key]
 
     c("\n")
+    c("static const struct gputop_metric_set_counter_info " + counter.info_sym + " = {")
+    c.indent(4)
+    for field in fields:
+        c(field)
+    c.outdent(4)
+    c("};")
+
+    counter_infos[key] = counter.info_sym
+    return counter.info_sym
+
+
+# Emits the calls adding the counters available on the device, one per run
+# of consecutive counters with the same availability.
+def output_add_counters(set, counters, infos):
+    first = 0
+    while first < len(counters):
+        availability = counters[first].get('availability')
+        n = 1
+        while (first + n < len(counters) and
+               counters[first + n].get('availability') == availability):
+            n += 1
 
-    availability = counter.get('availability')
-    if availability:
-        output_availability(set, availability, counter.get('name'))
-        c.indent(4)
+        if availability:
+            output_availability(set, availability, counters[first].get('name'))
+            c.indent(4)
+        c("gputop_metric_set_add_counters(gen, metric_set, {0}, {1}, {2});".format(infos, first, n))
+        if availability:
+            c.outdent(4)
+            c("}")
 
-    c("counter = &metric_set->counters[metric_set->n_counters++];\n")
-    c("counter->metric_set = metric_set;\n")
-    c("counter->oa_counter_read_{0} = {1};\n".format(data_type, set.read_funcs[counter.get('symbol_name')]))
-    c("counter->name = \"{0}\";\n".format(counter.get('name')))
-    c("counter->symbol_name = \"{0}\";\n".format(counter.get('symbol_name')));
-    c("counter->desc = \"{0}\";\n".format(counter.get('description')))
-    c("counter->type = GPUTOP_PERFQUERY_COUNTER_{0};\n".format(semantic_type_uc))
-    c("counter->data_type = GPUTOP_PERFQUERY_COUNTER_DATA_{0};\n".format(data_type_uc))
-    c("counter->units = GPUTOP_PERFQUERY_COUNTER_UNITS_{0};\n".format(output_units(counter.get('units'))))
-    c("counter->max_{0} = {1};\n".format(data_type, set.max_funcs[counter.get('symbol_name')]))
-    c("gputop_gen_add_counter(gen, counter, \"{0}\");\n".format(counter.get('mdapi_group')))
-
-    if availability:
-        c.outdent(4)
-        c("}\n")
+        first += n
 
 
-def generate_register_configs(set):
-    register_types = {
-        'FLEX': 'flex_regs',
-        'NOA': 'mux_regs',
-        'OA': 'b_counter_regs',
-    }
+register_types = {
+    'FLEX': 'flex_regs',
+    'NOA': 'mux_regs',
+    'OA': 'b_counter_regs',
+}
 
+# Emits the table of each register config of a set unless an identical one
+# exists, returns the names of the tables to use in register config order.
+def output_register_tables(set, prefix):
+    tables = []
+    for i, register_config in enumerate(set.findall('register_config')):
+        registers = ["{{ {0}, {1} }},".format(register.get('address'), register.get('value'))
+                     for register in register_config.findall('register')]
+        key = "\n".join(registers)
+        if key not in register_tables:
+            register_tables[key] = "{0}_registers{1}".format(prefix, i)
+            c("\nstatic const struct gputop_register_prog {0}[] = {{".format(register_tables[key]))
+            c.indent(4)
+            for register in registers:
+                c(register)
+            c.outdent(4)
+            c("};")
+        tables.append(register_tables[key])
+    return tables
+
+def generate_register_configs(set, tables):
     # allocate memory
     total_n_registers = {}
     register_configs = set.findall('register_config')
@@ -529,8 +1040,7 @@ def generate_register_configs(set):
     c("\n")
 
     # fill in register/values
-    register_configs = set.findall('register_config')
-    for register_config in register_configs:
+    for i, register_config in enumerate(register_configs):
         t = register_types[register_config.get('type')]
 
         availability = register_config.get('availability')
@@ -538,14 +1048,13 @@ def generate_register_configs(set):
             output_availability(set, availability, register_config.get('type') + ' register config')
             c.indent(4)
 
-        for register in register_config.findall('register'):
-            c("metric_set->%s[metric_set->n_%s++] = (struct gputop_register_prog) { .reg = %s, .val = %s };" %
-              (t, t, register.get('address'), register.get('value')))
+        c("gputop_register_progs_append(metric_set->{0}, &metric_set->n_{0},".format(t))
+        c("                             {0}, {1});".format(
+            tables[i], len(register_config.findall('register'))))
 
         if availability:
             c.outdent(4)
             c("}")
-        c("\n")
 
 #
 
@@ -559,6 +1068,9 @@ class Counter:
         self.read_sym = "{0}__{1}__{2}__read".format(self.set.gen.chipset,
                                                      self.set.underscore_name,
                                                      self.xml.get('underscore_name'))
+        self.info_sym = "{0}__{1}__{2}__info".format(self.set.gen.chipset,
+                                                     self.set.underscore_name,
+                                                     self.xml.get('underscore_name'))
 
         max_eq = self.xml.get('max_equation')
         if not max_eq:
@@ -601,6 +1113,7 @@ class Set:
         self.counter_vars = {}
         self.max_funcs = {}
         self.read_funcs = {}
+        self.read_all_vars = {}
         self.counter_hashes = {}
 
         self.counters = []
@@ -611,6 +1124,10 @@ class Set:
             self.counter_vars["$" + counter.get('symbol_name')] = counter
             self.max_funcs[counter.get('symbol_name')] = counter.max_sym
             self.read_funcs[counter.get('symbol_name')] = counter.read_sym
+            self.read_all_vars[counter.get('symbol_name')] = counter.get('underscore_name')
+
+        self.read_all_soa_sym = "{0}__{1}__read_all_soa".format(self.gen.chipset,
+                                                                self.underscore_name)
 
         for counter in self.counters:
             counter.compute_hashes()
@@ -723,12 +1240,25 @@ def main():
         #include <string.h>
 
         #include "gputop-oa-metrics.h"
+        #include "gputop-oa-counters.h"
 
         #include "util/ralloc.h"
 
         #define MIN(x, y) (((x) < (y)) ? (x) : (y))
         #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
+        /* Number of reports evaluated at a time by the read_all_soa functions */
+        #define READ_ALL_TILE 64
+
+        static void
+        read_all_report(const struct gputop_devinfo *devinfo,
+                        const struct gputop_metric_set *metric_set,
+                        const uint64_t *deltas,
+                        double *out)
+        {
+           metric_set->read_all_soa(devinfo, metric_set, deltas, 1, out);
+        }
+
         static double
         percentage_max_callback_float(const struct gputop_devinfo *devinfo,
                                       const struct gputop_metric_set *metric_set,
@@ -753,65 +1283,76 @@ def main():
             for counter in set.counters:
                 output_counter_read(gen, set, counter)
                 output_counter_max(gen, set, counter)
+            output_read_all(gen, set)
+
+    output_equation_constants()
 
     # Print out all set registration functions for each set in each
-    # generation.
+    # generation. Sets are registered as stubs, their counters and
+    # register programs being added on first use.
     for gen in gens:
         for set in gen.sets:
+            prefix = gen.chipset + "_" + set.underscore_name
+            counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
+
+            set_register_tables = output_register_tables(set, prefix)
+
             c("\nstatic void\n")
-            c(gen.chipset + "_add_" + set.underscore_name + "_metric_set(struct gputop_gen *gen,")
+            c(prefix + "_add_registers(struct gputop_gen *gen,")
             c.indent(4)
-            c("const struct gputop_devinfo *devinfo)")
+            c("struct gputop_metric_set *metric_set)")
             c.outdent(4)
             c("{\n")
             c.indent(4)
+            c("const struct gputop_devinfo *devinfo = &gen->devinfo;\n\n")
+            c("(void) devinfo;\n\n")
+            generate_register_configs(set, set_register_tables)
+            c.outdent(4)
+            c("}\n")
 
-            c("struct gputop_metric_set *metric_set;\n")
-            c("struct gputop_metric_set_counter *counter;\n\n")
+            infos = [output_counter_info(set, counter) for counter in counters]
+            c("\nstatic const struct gputop_metric_set_counter_info *const " + prefix + "_counters[] = {")
+            c.indent(4)
+            for info in infos:
+                c("&" + info + ",")
+            c.outdent(4)
+            c("};")
 
-            counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
+            c("\nstatic void\n")
+            c(prefix + "_add_counters(struct gputop_gen *gen,")
+            c.indent(4)
+            c("struct gputop_metric_set *metric_set)")
+            c.outdent(4)
+            c("{\n")
+            c.indent(4)
+            c("const struct gputop_devinfo *devinfo = &gen->devinfo;\n")
+            c("(void) devinfo;\n\n")
+            c("gputop_metric_set_alloc_counters(metric_set, {0});".format(len(counters)))
+            output_add_counters(set, counters, prefix + "_counters")
+            c.outdent(4)
+            c("}\n")
+
+            c("\nstatic void\n")
+            c(gen.chipset + "_add_" + set.underscore_name + "_metric_set(struct gputop_gen *gen)")
+            c("{\n")
+            c.indent(4)
+
+            c("struct gputop_metric_set *metric_set;\n\n")
 
             c("metric_set = rzalloc(gen, struct gputop_metric_set);\n")
             c("metric_set->name = \"" + set.name + "\";\n")
             c("metric_set->symbol_name = \"" + set.symbol_name + "\";\n")
             c("metric_set->hw_config_guid = \"" + set.hw_config_guid + "\";\n")
-            c("metric_set->counters = rzalloc_array(metric_set, struct gputop_metric_set_counter,  {0});\n".format(str(len(counters))))
-            c("metric_set->n_counters = 0;\n")
             c("metric_set->perf_oa_metrics_set = 0; // determined at runtime\n")
+            c("metric_set->read_all = read_all_report;\n")
+            c("metric_set->read_all_soa = " + set.read_all_soa_sym + ";\n")
+            c("metric_set->add_counters = " + prefix + "_add_counters;\n")
+            c("metric_set->add_registers = " + prefix + "_add_registers;\n")
 
-            if gen.chipset == "hsw":
-                c(textwrap.dedent("""\
-                    metric_set->perf_oa_format = I915_OA_FORMAT_A45_B8_C8;
-
-                    metric_set->perf_raw_size = 256;
-                    metric_set->gpu_time_offset = 0;
-                    metric_set->a_offset = 1;
-                    metric_set->b_offset = metric_set->a_offset + 45;
-                    metric_set->c_offset = metric_set->b_offset + 8;
-
-                    """))
-            else:
-                c(textwrap.dedent("""\
-                    metric_set->perf_oa_format = I915_OA_FORMAT_A32u40_A4u32_B8_C8;
-
-                    metric_set->perf_raw_size = 256;
-                    metric_set->gpu_time_offset = 0;
-                    metric_set->gpu_clock_offset = 1;
-                    metric_set->a_offset = 2;
-                    metric_set->b_offset = metric_set->a_offset + 36;
-                    metric_set->c_offset = metric_set->b_offset + 8;
-
-                    """))
+            oa_format = oa_formats.get(gen.chipset, default_oa_format)
+            c("gputop_cc_oa_metric_set_init_format(metric_set, " + oa_format + ");\n")
 
             c("gputop_gen_add_metric_set(gen, metric_set);");
-            c("\n")
-
-            generate_register_configs(set)
-
-            for counter in counters:
-                output_counter_report(set, counter)
-
-            c("\nassert(metric_set->n_counters <= {0});\n".format(len(counters)));
 
             c.outdent(4)
             c("}\n")
@@ -827,6 +1368,8 @@ def main():
 
         """))
 
+    h("void gputop_oa_build_equation_constants(struct gputop_devinfo *devinfo);\n\n")
+
     # Print out all set registration functions for each generation.
     for gen in gens:
         h("struct gputop_gen *gputop_oa_get_metrics_" + gen.chipset + "(const struct gputop_devinfo *devinfo);\n\n")
@@ -836,11 +1379,11 @@ def main():
         c("{")
         c.indent(4)
 
-        c("struct gputop_gen *gen = gputop_gen_new();\n")
+        c("struct gputop_gen *gen = gputop_gen_new(devinfo);\n")
         c("\n")
 
         for set in gen.sets:
-            c("{0}_add_{1}_metric_set(gen, devinfo);".format(gen.chipset, set.underscore_name))
+            c("{0}_add_{1}_metric_set(gen);".format(gen.chipset, set.underscore_name))
 
         c("\n")
         c("return gen;")
@@ -64,7 +64,13 @@ usage(void)
            "     --disable-oaconfig            Disable loading of OA configs\n\n"
            "     --dry-run                     Print the environment variables\n"
            "                                   without executing the program\n\n"
-           "     --fake                        Run gputop using fake metrics\n\n");
+           "     --fake                        Run gputop using fake metrics\n\n"
+           "     --i915-perf-ring-size=<MiB>   Size of the ring i915 perf records\n"
+           "                                   are buffered in before being sent\n"
+           "                                   (default 16)\n\n"
+           "     --reader-threads              Read each kernel stream from a thread\n"
+           "                                   of its own, waking the main loop in\n"
+           "                                   batches\n\n");
 #ifdef SUPPORT_GL
     printf("     --libgl=<libgl_filename>      Explicitly specify the real libGL\n"
            "                                   library to intercept\n\n"
@@ -86,6 +92,16 @@ usage(void)
            "\n"
            "     GPUTOP_DISABLE_OACONFIG=1     Prevents gputop to load OA configs\n"
            "     GPUTOP_FAKE_MODE=1            Configure gputop to use fake mode\n"
+           "     GPUTOP_I915_PERF_RING_SIZE=MiB\n"
+           "                                   Size of the i915 perf records ring\n"
+           "     GPUTOP_READER_THREADS=1       Read kernel streams from threads\n"
+           "     GPUTOP_READER_WAKEUP_BYTES=bytes\n"
+           "                                   Data a reader thread accumulates\n"
+           "                                   before waking the main loop\n"
+           "                                   (default 262144)\n"
+           "     GPUTOP_READER_WAKEUP_MS=ms    Longest a reader thread holds data\n"
+           "                                   before waking the main loop\n"
+           "                                   (default 10)\n"
            "     GPUTOP_MODE=remote            Currently only one mode\n"
            "     GPUTOP_PORT=port              Port gputop should listen to\n"
            "\n"
@@ -294,6 +310,12 @@ print_gputop_env_vars(void)
 {
     if (getenv("GPUTOP_FAKE_MODE"))
         fprintf(stderr, "GPUTOP_FAKE_MODE=%s \\\n", getenv("GPUTOP_FAKE_MODE"));
+    if (getenv("GPUTOP_I915_PERF_RING_SIZE"))
+        fprintf(stderr, "GPUTOP_I915_PERF_RING_SIZE=%s \\\n",
+                getenv("GPUTOP_I915_PERF_RING_SIZE"));
+    if (getenv("GPUTOP_READER_THREADS"))
+        fprintf(stderr, "GPUTOP_READER_THREADS=%s \\\n",
+                getenv("GPUTOP_READER_THREADS"));
 
 #ifdef SUPPORT_GL
     if (getenv("GPUTOP_GL_LIBRARY"))
@@ -414,6 +436,8 @@ main (int argc, char **argv)
 #define GPUTOP_SCISSOR_TEST     (CHAR_MAX + 7)
 #define PORT_OPT                (CHAR_MAX + 8)
 #define DISABLE_OACONFIG        (CHAR_MAX + 9)
+#define I915_PERF_RING_SIZE_OPT (CHAR_MAX + 10)
+#define READER_THREADS_OPT      (CHAR_MAX + 11)
 
     /* The initial '+' means that getopt will stop looking for
      * options after the first non-option argument. */
@@ -431,6 +455,8 @@ main (int argc, char **argv)
         {"enable-gl-scissor-test",  optional_argument,  0, GPUTOP_SCISSOR_TEST},
 #endif
         {"port",            required_argument,  0, PORT_OPT},
+        {"i915-perf-ring-size", required_argument,  0, I915_PERF_RING_SIZE_OPT},
+        {"reader-threads",  no_argument,        0, READER_THREADS_OPT},
         {0, 0, 0, 0}
     };
     char *ld_preload_path;
@@ -481,6 +507,12 @@ main (int argc, char **argv)
             case PORT_OPT:
                 setenv("GPUTOP_PORT", optarg, true);
                 break;
+            case I915_PERF_RING_SIZE_OPT:
+                setenv("GPUTOP_I915_PERF_RING_SIZE", optarg, true);
+                break;
+            case READER_THREADS_OPT:
+                setenv("GPUTOP_READER_THREADS", "1", true);
+                break;
             default:
                 fprintf(stderr, "Internal error: "
                         "unexpected getopt value: %d\n", opt);
@@ -35,6 +35,7 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 
 #include <limits.h>
 #include <errno.h>
@@ -47,6 +48,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include <uv.h>
 #include <dirent.h>
@@ -59,6 +61,7 @@
 #include "gputop-log.h"
 #include "gputop-perf.h"
 #include "gputop-oa-metrics.h"
+#include "gputop-oa-counters.h"
 #include "gputop-cpu.h"
 
 #include "gputop-gens-metrics.h"
@@ -73,9 +76,28 @@ struct oa_sample {
     uint8_t oa_report[];
 };
 
-#define MAX_I915_PERF_OA_SAMPLE_SIZE (8 +   /* drm_i915_perf_record_header */ \
-				      256)  /* raw OA counter snapshot */
+/* Default size of the ring i915 perf records are drained into, in MiB,
+ * overridden with GPUTOP_I915_PERF_RING_SIZE. */
+#define I915_PERF_RING_SIZE_MB 16
 
+/* Defaults for when a reader thread wakes the main loop, overridden with
+ * GPUTOP_READER_WAKEUP_BYTES and GPUTOP_READER_WAKEUP_MS */
+#define READER_WAKEUP_BYTES (256 * 1024)
+#define READER_WAKEUP_MS 10
+
+/* i915 perf checks the OA buffer every 5ms, waking up pollers as soon as it
+ * has a report */
+#define I915_PERF_POLL_PERIOD_NS 5000000ull
+
+/* Streams woken up for each of the kernel's checks are read from a timer
+ * instead, every 20ms at most or less if the OA buffer (16MiB) could get
+ * more than half full in the meantime. The switch happens after a few
+ * quick wakeups in a row and is undone after a few idle ticks. */
+#define I915_PERF_COALESCE_PERIOD_NS 20000000ull
+#define I915_PERF_OA_BUFFER_SIZE (16 * 1024 * 1024)
+#define I915_PERF_COALESCE_WAKEUPS 4
+
+#define I915_PERF_MIN_READ_SIZE 4096
 
 #define TAKEN(HEAD, TAIL, POT_SIZE)    (((HEAD) - (TAIL)) & (POT_SIZE - 1))
 
@@ -115,6 +137,11 @@ static bool gputop_disable_oaconfig = false;
 static struct intel_device intel_dev;
 
 static unsigned int page_size;
+static uint32_t i915_perf_ring_size;
+
+static bool reader_threads;
+static uint32_t reader_wakeup_bytes;
+static uint32_t reader_wakeup_ms;
 
 struct gputop_gen *gen_metrics;
 struct array *gputop_perf_oa_supported_metric_set_uuids;
@@ -313,22 +340,95 @@ perf_event_open (struct perf_event_attr *hw_event,
     return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
 }
 
+static uint64_t read_perf_head(struct perf_event_mmap_page *mmap_page);
+
 static void
-perf_ready_cb(uv_poll_t *poll, int status, int events)
+stream_ready(struct gputop_perf_stream *stream)
 {
-    struct gputop_perf_stream *stream = poll->data;
+    stream->n_wakeups++;
+
+    /* NB: the bytes of i915 perf streams are counted as they are drained */
+    if (stream->type == GPUTOP_STREAM_PERF) {
+	uint64_t head = read_perf_head(stream->perf.mmap_page);
+
+	stream->n_wakeup_bytes += head - stream->perf.wakeup_head;
+	stream->perf.wakeup_head = head;
+    }
 
     if (stream->ready_cb)
 	stream->ready_cb(stream);
 }
 
+static void
+perf_ready_cb(uv_poll_t *poll, int status, int events)
+{
+    stream_ready(poll->data);
+}
+
 static void
 perf_fake_ready_cb(uv_timer_t *poll)
+{
+    stream_ready(poll->data);
+}
+
+static void
+reader_async_cb(uv_async_t *async)
+{
+    stream_ready(async->data);
+}
+
+static void i915_perf_poll_cb(uv_poll_t *poll, int status, int events);
+
+static void
+i915_perf_coalesce_cb(uv_timer_t *timer)
+{
+    struct gputop_perf_stream *stream = timer->data;
+
+    stream_ready(stream);
+
+    /* NB: the bytes drained since the last tick include those of any other
+     * update of the stream */
+    if (stream->n_wakeup_bytes == stream->oa.last_wakeup_bytes) {
+	if (++stream->oa.n_idle_wakeups >= I915_PERF_COALESCE_WAKEUPS) {
+	    uv_timer_stop(&stream->fd_timer);
+	    /* NB: a full ring is polled again once it has room */
+	    if (!stream->oa.ring_full)
+		uv_poll_start(&stream->fd_poll, UV_READABLE, i915_perf_poll_cb);
+	    stream->oa.coalescing = false;
+	    stream->oa.n_quick_wakeups = 0;
+	}
+    } else
+	stream->oa.n_idle_wakeups = 0;
+
+    stream->oa.last_wakeup = gputop_get_time();
+    stream->oa.last_wakeup_bytes = stream->n_wakeup_bytes;
+}
+
+static void
+i915_perf_poll_cb(uv_poll_t *poll, int status, int events)
 {
     struct gputop_perf_stream *stream = poll->data;
+    uint64_t now = gputop_get_time();
+
+    if (stream->oa.coalesce_period_ns &&
+	now - stream->oa.last_wakeup < stream->oa.coalesce_period_ns) {
+	if (++stream->oa.n_quick_wakeups >= I915_PERF_COALESCE_WAKEUPS) {
+	    uint64_t period_ms = stream->oa.coalesce_period_ns / 1000000;
+
+	    uv_poll_stop(&stream->fd_poll);
+	    uv_timer_start(&stream->fd_timer, i915_perf_coalesce_cb,
+			   period_ms, period_ms);
+	    stream->oa.coalescing = true;
+	    stream->oa.n_idle_wakeups = 0;
+	}
+    } else
+	stream->oa.n_quick_wakeups = 0;
 
-    if (stream->ready_cb)
-	stream->ready_cb(stream);
+    stream->oa.last_wakeup = now;
+
+    stream_ready(stream);
+
+    stream->oa.last_wakeup_bytes = stream->n_wakeup_bytes;
 }
 
 void
@@ -373,6 +473,14 @@ finish_stream_close(struct gputop_perf_stream *stream)
 		stream->oa.bufs[i] = NULL;
 	    }
 	}
+	if (stream->oa.ring) {
+	    munmap(stream->oa.ring, stream->oa.ring_size * 2);
+	    stream->oa.ring = NULL;
+	}
+	if (stream->reader.ring) {
+	    munmap(stream->reader.ring, stream->reader.ring_size * 2);
+	    stream->reader.ring = NULL;
+	}
 	if (stream->fd == -1)
 	    server_dbg("closed i915 fake perf stream\n");
 	else if (stream->fd > 0) {
@@ -398,10 +506,31 @@ stream_handle_closed_cb(uv_handle_t *handle)
 {
     struct gputop_perf_stream *stream = handle->data;
 
-    if (--(stream->n_closing_uv_handles) == 0)
+    /* The async handle of a reader thread failing to start is closed
+     * while the stream is still open, that stream finishes closing with
+     * its other handles once gputop_perf_stream_close() is called. */
+    if (--(stream->n_closing_uv_handles) == 0 && stream->on_close_cb)
 	finish_stream_close(stream);
 }
 
+/* Joins the reader thread, after which the stream's async handle can be
+ * closed like a poll handle */
+static void
+stop_reader_thread(struct gputop_perf_stream *stream)
+{
+    uint64_t quit = 1;
+
+    while (write(stream->reader.quit_fd, &quit, sizeof(quit)) < 0 &&
+	   errno == EINTR)
+	;
+    pthread_join(stream->reader.thread, NULL);
+    close(stream->reader.quit_fd);
+    stream->reader.running = false;
+
+    uv_close((uv_handle_t *)&stream->reader.async, stream_handle_closed_cb);
+    stream->n_closing_uv_handles++;
+}
+
 void
 gputop_perf_stream_close(struct gputop_perf_stream *stream,
 			 void (*on_close_cb)(struct gputop_perf_stream *stream))
@@ -413,18 +542,20 @@ gputop_perf_stream_close(struct gputop_perf_stream *stream,
      */
     switch(stream->type) {
     case GPUTOP_STREAM_PERF:
-	if (stream->fd >= 0) {
+	if (stream->reader.running)
+	    stop_reader_thread(stream);
+	else if (stream->fd >= 0) {
 	    uv_close((uv_handle_t *)&stream->fd_poll, stream_handle_closed_cb);
 	    stream->n_closing_uv_handles++;
 	}
 	break;
     case GPUTOP_STREAM_I915_PERF:
-	if (stream->fd == -1) {
-	    uv_close((uv_handle_t *)&stream->fd_timer, stream_handle_closed_cb);
-	    stream->n_closing_uv_handles++;
+	uv_close((uv_handle_t *)&stream->fd_timer, stream_handle_closed_cb);
+	stream->n_closing_uv_handles++;
 
-	}
-	if (stream->fd >= 0) {
+	if (stream->reader.running)
+	    stop_reader_thread(stream);
+	else if (stream->fd >= 0) {
 	    uv_close((uv_handle_t *)&stream->fd_poll, stream_handle_closed_cb);
 	    stream->n_closing_uv_handles++;
 	}
@@ -458,6 +589,294 @@ gputop_perf_stream_unref(struct gputop_perf_stream *stream)
     }
 }
 
+/* Size of the sample records read from an i915 perf stream */
+static inline uint32_t
+i915_perf_record_size(struct gputop_perf_stream *stream)
+{
+    return (sizeof(struct drm_i915_perf_record_header) +
+	    stream->metric_set->perf_raw_size +
+	    (stream->oa.cpu_timestamps ? 8 : 0) +
+	    (stream->oa.gpu_timestamps ? 8 : 0));
+}
+
+/* Maps a ring of size bytes twice in a row so that records can be read()
+ * in and forwarded without having to split them at the end of the ring.
+ */
+static uint8_t *
+map_i915_perf_ring(uint32_t size, char **error)
+{
+    uint8_t *ring;
+    int fd = memfd_create("gputop-i915-perf-ring", MFD_CLOEXEC);
+
+    if (fd < 0) {
+	int ret = asprintf(error, "Error creating i915 perf ring: %m\n");
+	(void) ret;
+	return NULL;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+	int ret = asprintf(error, "Error sizing i915 perf ring: %m\n");
+	(void) ret;
+	close(fd);
+	return NULL;
+    }
+
+    ring = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED ||
+	mmap(ring, size, PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	mmap(ring + size, size, PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+	int ret = asprintf(error, "Error mapping i915 perf ring: %m\n");
+	(void) ret;
+	if (ring != MAP_FAILED)
+	    munmap(ring, size * 2);
+	close(fd);
+	return NULL;
+    }
+
+    /* The mappings keep the memory alive */
+    close(fd);
+
+    return ring;
+}
+
+/* Time in ms until a wakeup is due for data pending since @since */
+static int
+reader_wakeup_timeout(uint64_t since)
+{
+    uint64_t elapsed_ms = (gputop_get_time() - since) / 1000000;
+
+    return elapsed_ms >= reader_wakeup_ms ? 0 : reader_wakeup_ms - elapsed_ms;
+}
+
+/* Reads an i915 perf stream into stream->reader.ring as soon as it has data,
+ * as much as the ring can take at once, waking the main loop once enough
+ * records are pending or they have been pending long enough. */
+static void *
+i915_perf_reader_thread(void *data)
+{
+    struct gputop_perf_stream *stream = data;
+    const uint32_t mask = stream->reader.ring_size - 1;
+    const uint32_t record_size = i915_perf_record_size(stream);
+    uint64_t head = stream->reader.head;
+    uint64_t pending = 0;
+    uint64_t pending_since = 0;
+
+    while (true) {
+	uint64_t tail = __atomic_load_n(&stream->reader.tail, __ATOMIC_ACQUIRE);
+	uint32_t space = stream->reader.ring_size - (head - tail);
+	struct pollfd pollfds[2] = {
+	    { stream->reader.quit_fd, POLLIN, 0 },
+	    { stream->fd, POLLIN, 0 },
+	};
+	/* The stream isn't polled while the ring is full, the main loop
+	 * being checked on instead */
+	bool can_read = space >= record_size;
+	int timeout = -1;
+	int ret;
+
+	if (pending)
+	    timeout = reader_wakeup_timeout(pending_since);
+	else if (!can_read)
+	    timeout = reader_wakeup_ms;
+
+	ret = poll(pollfds, can_read ? 2 : 1, timeout);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    dbg("Error polling i915 perf stream %m\n");
+	    break;
+	}
+
+	if (pollfds[0].revents)
+	    break;
+
+	if (can_read && pollfds[1].revents) {
+	    /* The ring being mapped twice, the read can go past its end */
+	    int count = read(stream->fd, stream->reader.ring + (head & mask), space);
+
+	    __atomic_add_fetch(&stream->n_reads, 1, __ATOMIC_RELAXED);
+	    if (count > 0) {
+		__atomic_add_fetch(&stream->n_read_bytes, count, __ATOMIC_RELAXED);
+		head += count;
+		space -= count;
+		__atomic_store_n(&stream->reader.head, head, __ATOMIC_RELEASE);
+
+		if (!pending)
+		    pending_since = gputop_get_time();
+		pending += count;
+	    } else if (count < 0 && errno != EINTR && errno != EAGAIN) {
+		dbg("Error reading i915 perf stream %m\n");
+		break;
+	    }
+	}
+
+	if (pending &&
+	    (pending >= reader_wakeup_bytes || space < record_size ||
+	     reader_wakeup_timeout(pending_since) == 0)) {
+	    uv_async_send(&stream->reader.async);
+	    pending = 0;
+	}
+    }
+
+    return NULL;
+}
+
+/* Perf writes the samples straight into the stream's mmap buffer, so the
+ * thread only has to batch the main loop's wakeups: it checks on the buffer
+ * every GPUTOP_READER_WAKEUP_MS, or sooner if the stream signals data while
+ * the buffer has been caught up with. */
+static void *
+perf_reader_thread(void *data)
+{
+    struct gputop_perf_stream *stream = data;
+    uint64_t woken_head = read_perf_head(stream->perf.mmap_page);
+    uint64_t pending_since = 0;
+
+    while (true) {
+	uint64_t head = read_perf_head(stream->perf.mmap_page);
+	uint64_t tail = __atomic_load_n(&stream->perf.mmap_page->data_tail,
+					__ATOMIC_ACQUIRE);
+	struct pollfd pollfds[2] = {
+	    { stream->reader.quit_fd, POLLIN, 0 },
+	    { stream->fd, POLLIN, 0 },
+	};
+	bool idle = head == tail;
+	int ret;
+
+	if (head != woken_head) {
+	    if (!pending_since)
+		pending_since = gputop_get_time();
+
+	    if (head - woken_head >= reader_wakeup_bytes ||
+		reader_wakeup_timeout(pending_since) == 0) {
+		uv_async_send(&stream->reader.async);
+		woken_head = head;
+		pending_since = 0;
+	    }
+	}
+
+	ret = poll(pollfds, idle ? 2 : 1,
+		   pending_since ? reader_wakeup_timeout(pending_since) :
+		   (int)reader_wakeup_ms);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    dbg("Error polling perf stream %m\n");
+	    break;
+	}
+
+	if (pollfds[0].revents)
+	    break;
+    }
+
+    return NULL;
+}
+
+/* Services the stream's fd with a thread of its own if enabled with
+ * GPUTOP_READER_THREADS, falling back to polling it from the main loop. */
+static bool
+start_reader_thread(struct gputop_perf_stream *stream,
+		    void *(*thread_func)(void *))
+{
+    if (!reader_threads)
+	return false;
+
+    stream->reader.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (stream->reader.quit_fd < 0) {
+	dbg("Failed to create reader thread eventfd: %m\n");
+	return false;
+    }
+
+    stream->reader.async.data = stream;
+    uv_async_init(gputop_mainloop, &stream->reader.async, reader_async_cb);
+
+    if (pthread_create(&stream->reader.thread, NULL, thread_func, stream) != 0) {
+	dbg("Failed to create reader thread\n");
+	close(stream->reader.quit_fd);
+	/* NB: the handle must be closed before the stream is freed */
+	uv_close((uv_handle_t *)&stream->reader.async, stream_handle_closed_cb);
+	stream->n_closing_uv_handles++;
+	return false;
+    }
+
+    stream->reader.running = true;
+
+    return true;
+}
+
+static bool
+start_i915_perf_reader_thread(struct gputop_perf_stream *stream)
+{
+    char *error = NULL;
+
+    if (!reader_threads)
+	return false;
+
+    stream->reader.ring_size = i915_perf_ring_size / 4;
+    stream->reader.ring = map_i915_perf_ring(stream->reader.ring_size, &error);
+    if (!stream->reader.ring) {
+	dbg("%s", error);
+	free(error);
+	return false;
+    }
+
+    if (!start_reader_thread(stream, i915_perf_reader_thread)) {
+	munmap(stream->reader.ring, stream->reader.ring_size * 2);
+	stream->reader.ring = NULL;
+	return false;
+    }
+
+    return true;
+}
+
+/* Power of two read size for a stream's reads to fetch about @bytes */
+static uint32_t
+i915_perf_read_size(struct gputop_perf_stream *stream, uint64_t bytes)
+{
+    bytes = CLAMP(bytes, stream->oa.min_read_size, stream->oa.max_read_size);
+
+    return 1u << util_last_bit(bytes - 1);
+}
+
+/* Picks the initial size of the reads from the reports the kernel could
+ * have for each of its checks, and the period at which the stream is read
+ * when it is woken up too often. */
+static void
+init_i915_perf_read_size(struct gputop_perf_stream *stream)
+{
+    uint64_t period_ns =
+	gputop_oa_exponent_to_period_ns(&gputop_devinfo, stream->oa.period_exponent);
+    uint32_t record_size = i915_perf_record_size(stream);
+    uint64_t half_oa_buffer_ns =
+	(I915_PERF_OA_BUFFER_SIZE / 2 / stream->metric_set->perf_raw_size) * period_ns;
+
+    stream->oa.min_read_size = MAX2(I915_PERF_MIN_READ_SIZE, record_size);
+    /* NB: as much is kept free in the ring for the reads, including in
+     * flight recorder mode */
+    stream->oa.max_read_size = stream->oa.ring_size / 16;
+    stream->oa.avg_wakeup_bytes =
+	(I915_PERF_POLL_PERIOD_NS / period_ns + 1) * record_size;
+    stream->oa.read_size =
+	i915_perf_read_size(stream, 2 * (uint64_t)stream->oa.avg_wakeup_bytes);
+
+    stream->oa.coalesce_period_ns = MIN(I915_PERF_COALESCE_PERIOD_NS,
+					half_oa_buffer_ns);
+    if (stream->oa.coalesce_period_ns <= I915_PERF_POLL_PERIOD_NS)
+	stream->oa.coalesce_period_ns = 0;
+}
+
+/* Aims for a read per wakeup, with room for the wakeups bringing twice as
+ * much as they do on average */
+static void
+adapt_i915_perf_read_size(struct gputop_perf_stream *stream, uint32_t bytes)
+{
+    stream->oa.avg_wakeup_bytes += ((int64_t)bytes - stream->oa.avg_wakeup_bytes) / 8;
+    stream->oa.read_size =
+	i915_perf_read_size(stream, 2 * (uint64_t)stream->oa.avg_wakeup_bytes);
+}
+
 struct gputop_perf_stream *
 gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
 				int period_exponent,
@@ -472,6 +891,11 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
     struct drm_i915_perf_open_param param;
     int stream_fd = -1;
     int oa_stream_fd = drm_fd;
+    uint8_t *ring;
+
+    ring = map_i915_perf_ring(i915_perf_ring_size, error);
+    if (!ring)
+	return NULL;
 
     if (!gputop_fake_mode) {
 	uint64_t properties[DRM_I915_PERF_PROP_MAX * 2];
@@ -528,6 +952,7 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
 	if (stream_fd == -1) {
 	    int ret = asprintf(error, "Error opening i915 perf OA event: %m\n");
 	    (void) ret;
+	    munmap(ring, i915_perf_ring_size * 2);
 	    return NULL;
 	}
     }
@@ -539,6 +964,11 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
     stream->ready_cb = ready_cb;
     stream->per_ctx_mode = ctx != NULL;
 
+    stream->oa.period_exponent = period_exponent;
+    stream->oa.ctx = ctx;
+    stream->oa.cpu_timestamps = cpu_timestamps;
+    stream->oa.gpu_timestamps = gpu_timestamps;
+
     stream->fd = stream_fd;
 
     if (gputop_fake_mode) {
@@ -548,33 +978,38 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
 	stream->prev_timestamp = gputop_get_time();
     }
 
-    /* We double buffer the samples we read from the kernel so
-     * we can maintain a stream->last pointer for calculating
-     * counter deltas */
-    stream->oa.buf_sizes = (MAX_I915_PERF_OA_SAMPLE_SIZE +
-                            (cpu_timestamps ? 8 : 0) +
-                            (gpu_timestamps ? 8 : 0)) * 100;
-    stream->oa.bufs[0] = xmalloc0(stream->oa.buf_sizes);
-    stream->oa.bufs[1] = xmalloc0(stream->oa.buf_sizes);
+    stream->oa.ring = ring;
+    stream->oa.ring_size = i915_perf_ring_size;
 
+    init_i915_perf_read_size(stream);
+
+    /* In flight recorder mode the stream is drained like any other, the
+     * oldest records in the ring being overwritten unless a snapshot of
+     * the ring is being forwarded. */
     stream->overwrite = overwrite;
     if (overwrite) {
-#warning "TODO: support flight-recorder mode"
-	assert(0);
+	dbg("i915 perf flight recorder holding up to %"PRIu64"ms of reports\n",
+	    (stream->oa.ring_size / i915_perf_record_size(stream)) *
+	    gputop_oa_exponent_to_period_ns(&gputop_devinfo, period_exponent) /
+	    1000000);
     }
 
     stream->fd_poll.data = stream;
     stream->fd_timer.data = stream;
+    uv_timer_init(gputop_mainloop, &stream->fd_timer);
 
     if (gputop_fake_mode)
     {
-	uv_timer_init(gputop_mainloop, &stream->fd_timer);
 	uv_timer_start(&stream->fd_timer, perf_fake_ready_cb, 1000, 1000);
     }
-    else
+    else if (!ready_cb || !start_i915_perf_reader_thread(stream))
     {
+	/* Nothing reads the stream without a ready_cb */
+	if (!ready_cb)
+	    stream->oa.coalesce_period_ns = 0;
+
 	uv_poll_init(gputop_mainloop, &stream->fd_poll, stream->fd);
-	uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
+	uv_poll_start(&stream->fd_poll, UV_READABLE, i915_perf_poll_cb);
     }
 
 
@@ -659,9 +1094,11 @@ gputop_perf_open_tracepoint(int pid,
 	    xmalloc(sizeof(uint32_t) * expected_max_samples);
     }
 
-    stream->fd_poll.data = stream;
-    uv_poll_init(gputop_mainloop, &stream->fd_poll, stream->fd);
-    uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
+    if (!ready_cb || !start_reader_thread(stream, perf_reader_thread)) {
+	stream->fd_poll.data = stream;
+	uv_poll_init(gputop_mainloop, &stream->fd_poll, stream->fd);
+	uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
+    }
 
     return stream;
 }
@@ -1039,8 +1476,9 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 
     if (gputop_fake_mode) {
         fill_topology_from_masks(topology, 0x1, 0x1, 8);
-        gputop_devinfo.gt_min_freq = 500;
-        gputop_devinfo.gt_max_freq = 1100;
+        /* In Hz, like the sysfs values below */
+        gputop_devinfo.gt_min_freq = 500000000;
+        gputop_devinfo.gt_max_freq = 1100000000;
     } else {
         drm_i915_getparam_t gp;
 	int revision, timestamp_frequency;
@@ -1075,6 +1513,8 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 	gputop_devinfo.gt_max_freq *= 1000000;
     }
 
+    gputop_devinfo_init_timebase(&gputop_devinfo);
+
     if (devinfo->is_haswell) {
 	SET_NAMES(gputop_devinfo, "hsw", "Haswell");
 	gen_metrics = gputop_oa_get_metrics_hsw(&gputop_devinfo);
@@ -1162,10 +1602,10 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 #undef SET_NAMES
 }
 
-static unsigned int
+static uint64_t
 read_perf_head(struct perf_event_mmap_page *mmap_page)
 {
-    unsigned int head = (*(volatile uint64_t *)&mmap_page->data_head);
+    uint64_t head = (*(volatile uint64_t *)&mmap_page->data_head);
     rmb();
 
     return head;
@@ -1173,7 +1613,7 @@ read_perf_head(struct perf_event_mmap_page *mmap_page)
 
 static void
 write_perf_tail(struct perf_event_mmap_page *mmap_page,
-		unsigned int tail)
+		uint64_t tail)
 {
     /* Make sure we've finished reading all the sample data we
      * we're consuming before updating the tail... */
@@ -1300,7 +1740,6 @@ gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
     uint64_t perf_tail;
     uint32_t buf_head;
     uint32_t buf_tail;
-    uint32_t n_new = 0;
 
     perf_head = read_perf_head(stream->perf.mmap_page);
 
@@ -1324,24 +1763,11 @@ gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
     buf_head = hdr_buf->head;
     buf_tail = hdr_buf->tail;
 
-#if 1
-    printf("perf records:\n");
-    printf("> fd = %d\n", stream->fd);
-    printf("> size = %lu\n", stream->perf.buffer_size);
-    printf("> tail_ptr = %p\n", &stream->perf.mmap_page->data_tail);
-    printf("> head=%"PRIu64"\n", perf_head);
-    printf("> tail=%"PRIu64"\n", (uint64_t)stream->perf.mmap_page->data_tail);
-    printf("> TAKEN=%"PRIu64"\n", (uint64_t)TAKEN(perf_head, stream->perf.mmap_page->data_tail, stream->perf.buffer_size));
-    printf("> records:\n");
-#endif
-
     while (TAKEN(perf_head, perf_tail, stream->perf.buffer_size)) {
 	uint64_t perf_offset = perf_tail & mask;
 	const struct perf_event_header *header =
 	    (const struct perf_event_header *)(data + perf_offset);
 
-	n_new++;
-
 	if (header->size == 0) {
 	    dbg("Spurious header size == 0\n");
 	    /* XXX: How should we handle this instead of exiting() */
@@ -1399,24 +1825,49 @@ gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
 
     hdr_buf->head = buf_head;
     hdr_buf->tail = buf_tail;
+}
 
-#if 1
-    printf("headers update:\n");
-    printf("n new records = %d\n", n_new);
-    printf("buf len = %d\n", hdr_buf->len);
-    printf("perf head = %"PRIu64"\n", perf_head);
-    printf("perf tail = %"PRIu64"\n", perf_tail);
-    printf("buf head = %"PRIu32"\n", hdr_buf->head);
-    printf("buf tail = %"PRIu32"\n", hdr_buf->tail);
-
-    if (!hdr_buf->full) {
-	float percentage = (hdr_buf->offsets[(hdr_buf->head - 1) % hdr_buf->len] / (float)stream->perf.buffer_size) * 100.0f;
-	printf("> %d%% full\n", (int)percentage);
-    } else
-	printf("> 100%% full\n");
+/* Stops perf from writing into the buffer of a stream opened in flight
+ * recorder mode, so the records it holds can be read without being
+ * overwritten, until gputop_perf_flight_recorder_resume(). The range
+ * of the records written since @since, the end of the previous range
+ * taken, is returned in perf's head/tail terms.
+ */
+void
+gputop_perf_flight_recorder_pause(struct gputop_perf_stream *stream,
+				  uint64_t since,
+				  uint64_t *start, uint64_t *end)
+{
+    struct gputop_perf_header_buf *hdr_buf = &stream->perf.header_buf;
+    uint64_t taken;
 
-    printf("> n records = %u\n", (hdr_buf->head - hdr_buf->tail));
-#endif
+    assert(stream->type == GPUTOP_STREAM_PERF && stream->overwrite);
+
+    if (perf_ioctl(stream->fd, PERF_EVENT_IOC_DISABLE, 0) < 0)
+	dbg("Failed to pause perf flight recorder: %m\n");
+
+    /* Catch up with the last records written */
+    gputop_perf_update_header_offsets(stream);
+
+    *end = stream->perf.mmap_page->data_tail;
+    if (hdr_buf->head == hdr_buf->tail) {
+	*start = *end;
+	return;
+    }
+
+    /* NB: the oldest record is at the head offset when the buffer is
+     * exactly full */
+    taken = TAKEN(*end, hdr_buf->offsets[hdr_buf->tail % hdr_buf->len],
+		  stream->perf.buffer_size);
+    *start = *end - (taken ? taken : stream->perf.buffer_size);
+    *start = MAX2(*start, since);
+}
+
+void
+gputop_perf_flight_recorder_resume(struct gputop_perf_stream *stream)
+{
+    if (perf_ioctl(stream->fd, PERF_EVENT_IOC_ENABLE, 0) < 0)
+	dbg("Failed to resume perf flight recorder: %m\n");
 }
 
 void
@@ -1552,6 +2003,15 @@ gputop_perf_fake_read(struct gputop_perf_stream *stream,
 static void
 read_i915_perf_samples(struct gputop_perf_stream *stream)
 {
+    /* We double buffer the samples we read from the kernel so
+     * we can maintain a stream->last pointer for calculating
+     * counter deltas. Only streams read this way need them. */
+    if (!stream->oa.bufs[0]) {
+	stream->oa.buf_sizes = stream->oa.read_size;
+	stream->oa.bufs[0] = xmalloc0(stream->oa.buf_sizes);
+	stream->oa.bufs[1] = xmalloc0(stream->oa.buf_sizes);
+    }
+
     do {
 	int offset = 0;
 	int buf_idx;
@@ -1625,6 +2085,140 @@ read_i915_perf_samples(struct gputop_perf_stream *stream)
     } while(1);
 }
 
+/* Takes whole records off the reader thread's ring, as a read() of the
+ * stream would */
+static int
+read_i915_perf_reader_ring(struct gputop_perf_stream *stream,
+			   uint8_t *buf, uint32_t len)
+{
+    const uint32_t mask = stream->reader.ring_size - 1;
+    uint64_t head = __atomic_load_n(&stream->reader.head, __ATOMIC_ACQUIRE);
+    uint64_t tail = stream->reader.tail;
+    uint32_t count = 0;
+
+    while (tail + count < head) {
+	const struct drm_i915_perf_record_header *header = (const void *)
+	    (stream->reader.ring + ((tail + count) & mask));
+
+	if (count + header->size > len)
+	    break;
+	count += header->size;
+    }
+
+    if (count == 0) {
+	errno = head == tail ? EAGAIN : ENOSPC;
+	return -1;
+    }
+
+    memcpy(buf, stream->reader.ring + (tail & mask), count);
+    __atomic_store_n(&stream->reader.tail, tail + count, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+/* The stream staying readable while there's no room left to read it into,
+ * it's not polled until the ring has room again. Streams read by a timer or
+ * by the reader thread are left alone. */
+static void
+set_i915_perf_ring_full(struct gputop_perf_stream *stream, bool full)
+{
+    if (stream->oa.ring_full == full)
+	return;
+
+    stream->oa.ring_full = full;
+
+    if (gputop_fake_mode || stream->reader.running || stream->oa.coalescing)
+	return;
+
+    if (full)
+	uv_poll_stop(&stream->fd_poll);
+    else
+	uv_poll_start(&stream->fd_poll, UV_READABLE, i915_perf_poll_cb);
+}
+
+/* Drains the kernel's buffer into the stream's ring. When the ring is
+ * full, the oldest records are dropped to make room, unless they end after
+ * @pinned, the position of the records still being sent to a client. Returns
+ * the number of bytes added.
+ */
+uint32_t
+gputop_i915_perf_fill_ring(struct gputop_perf_stream *stream, uint64_t pinned)
+{
+    const uint32_t mask = stream->oa.ring_size - 1;
+    uint32_t total = 0;
+    bool full = false;
+
+    pinned = MIN(pinned, stream->oa.ring_head);
+
+    while (true) {
+	uint32_t space = stream->oa.ring_size -
+	    (stream->oa.ring_head - stream->oa.ring_tail);
+	int count;
+
+	/* NB: @pinned may be in the middle of a record partly sent */
+	while (space < stream->oa.read_size && stream->oa.ring_tail < pinned) {
+	    const struct drm_i915_perf_record_header *header = (const void *)
+		(stream->oa.ring + (stream->oa.ring_tail & mask));
+
+	    if (stream->oa.ring_tail + header->size > pinned)
+		break;
+
+	    stream->oa.ring_tail += header->size;
+	    stream->oa.ring_dropped += header->size;
+	    space += header->size;
+	}
+
+	if (space == 0) {
+	    full = true;
+	    break;
+	}
+
+	/* The ring being mapped twice, the read can go past its end */
+	if (gputop_fake_mode)
+	    count = gputop_perf_fake_read(stream,
+					  stream->oa.ring + (stream->oa.ring_head & mask),
+					  MIN(space, stream->oa.read_size));
+	else if (stream->reader.running)
+	    count = read_i915_perf_reader_ring(stream,
+					       stream->oa.ring + (stream->oa.ring_head & mask),
+					       MIN(space, stream->oa.read_size));
+	else {
+	    count = read(stream->fd,
+			 stream->oa.ring + (stream->oa.ring_head & mask),
+			 MIN(space, stream->oa.read_size));
+	    stream->n_reads++;
+	    if (count > 0)
+		stream->n_read_bytes += count;
+	}
+
+	if (count < 0) {
+	    if (errno == EINTR)
+		continue;
+	    /* ENOSPC: not enough room left for a record */
+	    if (errno == ENOSPC)
+		full = true;
+	    else if (errno != EAGAIN)
+		dbg("Error reading i915 perf stream %m\n");
+	    break;
+	}
+	if (count == 0)
+	    break;
+
+	stream->oa.ring_head += count;
+	total += count;
+    }
+
+    stream->n_wakeup_bytes += total;
+
+    set_i915_perf_ring_full(stream, full);
+
+    /* NB: updates finding the ring already drained don't count */
+    if (total)
+	adapt_i915_perf_read_size(stream, total);
+
+    return total;
+}
+
 void
 gputop_perf_read_samples(struct gputop_perf_stream *stream)
 {
@@ -1757,6 +2351,8 @@ gputop_reload_userspace_metrics(int fd)
 		continue; /* Leave the test config untouched */
 	}
 
+	gputop_metric_set_ensure_registers(metric_set);
+
 	memset(&config, 0, sizeof(config));
 
 	memcpy(config.uuid, metric_set->hw_config_guid, sizeof(config.uuid));
@@ -1906,6 +2502,31 @@ gputop_perf_initialize(void)
     /* NB: eu_count needs to be initialized before declaring counters */
     page_size = sysconf(_SC_PAGE_SIZE);
 
+    if (getenv("GPUTOP_I915_PERF_RING_SIZE")) {
+	unsigned long mb = strtoul(getenv("GPUTOP_I915_PERF_RING_SIZE"), NULL, 10);
+
+	/* Rounded up to a power of two */
+	mb = CLAMP(mb, 1, 1024);
+	i915_perf_ring_size = (1u << util_last_bit(mb - 1)) << 20;
+    } else
+	i915_perf_ring_size = I915_PERF_RING_SIZE_MB << 20;
+
+    /* Reader threads only service the streams of a real device */
+    if (getenv("GPUTOP_READER_THREADS") &&
+	strcmp(getenv("GPUTOP_READER_THREADS"), "1") == 0 &&
+	!gputop_fake_mode)
+	reader_threads = true;
+
+    if (getenv("GPUTOP_READER_WAKEUP_BYTES"))
+	reader_wakeup_bytes = MAX2(strtoul(getenv("GPUTOP_READER_WAKEUP_BYTES"), NULL, 10), 1);
+    else
+	reader_wakeup_bytes = READER_WAKEUP_BYTES;
+
+    if (getenv("GPUTOP_READER_WAKEUP_MS"))
+	reader_wakeup_ms = CLAMP(strtoul(getenv("GPUTOP_READER_WAKEUP_MS"), NULL, 10), 1, 1000);
+    else
+	reader_wakeup_ms = READER_WAKEUP_MS;
+
     gen_metrics = NULL;
     gputop_perf_oa_supported_metric_set_uuids = array_new(sizeof(char*), 1);
 
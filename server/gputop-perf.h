@@ -25,6 +25,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <uv.h>
 #include <time.h>
@@ -155,8 +156,44 @@ struct gputop_perf_stream
             uint8_t *last;
             int last_buf_idx;
 
-            bool header_written;
-            uint32_t total_len;
+            /* The configuration, so that clients asking for the same can
+             * share the stream */
+            int period_exponent;
+            struct ctx_handle *ctx;
+            bool cpu_timestamps;
+            bool gpu_timestamps;
+
+            /* Records read from the kernel, kept for all the readers of
+             * the stream to forward at their own pace. ring_head is a
+             * free running byte count of the data written, readers keep
+             * their own position the same way. ring_tail is the start of
+             * the oldest record still in the ring, those before it having
+             * been overwritten (ring_dropped bytes in total). The ring is
+             * mapped twice in a row so records never wrap. */
+            uint8_t *ring;
+            uint32_t ring_size;
+            uint64_t ring_head;
+            uint64_t ring_tail;
+            uint64_t ring_dropped;
+            /* Set while the records being sent leave no room to read more */
+            bool ring_full;
+
+            /* Bytes asked of each read(), adapted to the bytes each wakeup
+             * brings (avg_wakeup_bytes) between min and max_read_size */
+            uint32_t read_size;
+            uint32_t min_read_size;
+            uint32_t max_read_size;
+            uint32_t avg_wakeup_bytes;
+
+            /* When the stream is woken up too often, it is read every
+             * coalesce_period_ns from fd_timer instead of being polled,
+             * until the timer finds it idle. */
+            uint64_t coalesce_period_ns;
+            bool coalescing;
+            int n_quick_wakeups;
+            int n_idle_wakeups;
+            uint64_t last_wakeup;
+            uint64_t last_wakeup_bytes;
         } oa;
         /* linux perf event */
         struct {
@@ -167,10 +204,10 @@ struct gputop_perf_stream
 
             struct gputop_perf_header_buf header_buf;
 
-            bool header_written;
-            uint32_t total_len;
             uint64_t head;
             uint64_t tail;
+
+            uint64_t wakeup_head; /* perf's head at the last wakeup */
         } perf;
         /* /proc/stat */
         struct {
@@ -188,6 +225,34 @@ struct gputop_perf_stream
     uv_timer_t fd_timer;
     void (*ready_cb)(struct gputop_perf_stream *);
 
+    /* With GPUTOP_READER_THREADS=1 the fd is serviced by a thread of its
+     * own, which only wakes the main loop through async once enough data
+     * is pending or it has been pending long enough. */
+    struct {
+        pthread_t thread;
+        bool running;
+        int quit_fd;
+        uv_async_t async;
+
+        /* i915 perf: records read by the thread for the main loop to
+         * consume, head being only written by the thread and tail by the
+         * main loop. Mapped twice in a row like oa.ring. */
+        uint8_t *ring;
+        uint32_t ring_size;
+        uint64_t head;
+        uint64_t tail;
+    } reader;
+
+    /* Wakeups of the main loop for the stream's data and the bytes they
+     * brought */
+    uint64_t n_wakeups;
+    uint64_t n_wakeup_bytes;
+
+    /* read() syscalls made on the fd and the bytes they returned, counted
+     * by the reader thread if the stream has one */
+    uint64_t n_reads;
+    uint64_t n_read_bytes;
+
     bool live_updates;
 
     int n_closing_uv_handles;
@@ -205,11 +270,17 @@ struct gputop_perf_stream
 
     /* XXX: reserved for whoever opens the stream */
     struct {
-        uint32_t id;
         struct list_head link;
+        struct list_head subscriptions;
         void *data;
         void (*destroy_cb)(struct gputop_perf_stream *stream);
-        bool flushing;
+
+        /* Counters at the last stats sent */
+        uint64_t stats_time;
+        uint64_t stats_wakeups;
+        uint64_t stats_wakeup_bytes;
+        uint64_t stats_reads;
+        uint64_t stats_read_bytes;
     } user;
 };
 
@@ -272,11 +343,19 @@ bool gputop_stream_data_pending(struct gputop_perf_stream *stream);
 
 void gputop_perf_update_header_offsets(struct gputop_perf_stream *stream);
 
+void gputop_perf_flight_recorder_pause(struct gputop_perf_stream *stream,
+                                       uint64_t since,
+                                       uint64_t *start, uint64_t *end);
+void gputop_perf_flight_recorder_resume(struct gputop_perf_stream *stream);
+
 int gputop_perf_fake_read(struct gputop_perf_stream *stream,
                           uint8_t *buf, int buf_length);
 
 void gputop_perf_read_samples(struct gputop_perf_stream *stream);
 
+uint32_t gputop_i915_perf_fill_ring(struct gputop_perf_stream *stream,
+                                    uint64_t pinned);
+
 void gputop_i915_perf_print_records(struct gputop_perf_stream *stream,
                                     uint8_t *buf,
                                     int len);
@@ -26,6 +26,8 @@
 
 #include <linux/perf_event.h>
 
+#include <i915_drm.h>
+
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,7 +64,6 @@
 #include "gputop-gl.h"
 #endif
 
-static h2o_websocket_conn_t *h2o_conn;
 static h2o_globalconf_t config;
 static h2o_context_t ctx;
 static SSL_CTX *ssl_ctx;
@@ -79,8 +80,55 @@ enum {
     WS_MESSAGE_I915_PERF,
 };
 
+/* A websocket connection, e.g. a UI or a wrapper recording metrics */
+struct client {
+    struct list_head link;
+    h2o_websocket_conn_t *conn;
+    struct list_head subscriptions;
+};
+
+/* A client's use of a stream. i915 perf streams opened with the same
+ * configuration are shared by the clients, each one forwarding the data
+ * read from the kernel at its own pace.
+ */
+struct subscription {
+    struct list_head client_link;
+    struct list_head stream_link;
+    struct client *client; /* NULL once disconnected */
+    struct gputop_perf_stream *stream;
+
+    uint32_t id; /* As given by the client */
+    char *close_uuid;
+
+    bool flushing;
+    bool pending_close;
+    bool header_written;
+    uint32_t total_len;
+
+    /* i915 perf streams: range of the stream's ring being forwarded */
+    uint64_t cursor;
+    uint64_t end;
+
+    /* i915 perf streams: records overwritten in the ring before they
+     * could be forwarded, and what the client was last told */
+    uint32_t ring_overruns;
+    uint64_t ring_lost_bytes;
+    uint32_t notified_fill;
+    uint32_t notified_overruns;
+
+    /* Flight recorder streams: set while the recorded data is being sent,
+     * the request being ACKed once it's all been sent. Each snapshot only
+     * sends the records following snapshot_end, the end of the last one. */
+    char *snapshot_uuid;
+    uint64_t snapshot_end;
+};
+
+static struct list_head clients;
 static struct list_head streams;
 static struct list_head closing_streams;
+static struct list_head closing_subscriptions;
+
+static void queue_update(void);
 
 static void
 send_pb_message(h2o_websocket_conn_t *conn, ProtobufCMessage *pb_message)
@@ -113,37 +161,133 @@ stream_closed_cb(struct gputop_perf_stream *stream)
 }
 
 static void
-stream_closed_notify_cb(struct gputop_perf_stream *stream)
+notify_subscription_closed(struct subscription *sub)
 {
     Gputop__Message message_ack = GPUTOP__MESSAGE__INIT;
     Gputop__Message message = GPUTOP__MESSAGE__INIT;
     Gputop__CloseNotify notify = GPUTOP__CLOSE_NOTIFY__INIT;
 
-    /* stream->user.data will = a UUID if it was closed
-     * in response to a remote request which we need to
-     * ACK... */
-    if (stream->user.data) {
+    if (sub->client) {
+        /* sub->close_uuid is set if it was closed in response to a
+         * remote request which we need to ACK... */
+        if (sub->close_uuid) {
+            message_ack.reply_uuid = sub->close_uuid;
+            message_ack.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
+            message_ack.ack = true;
+
+            dbg("CMD_ACK: %s\n", sub->close_uuid);
 
-        message_ack.reply_uuid = stream->user.data;
-        message_ack.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
-        message_ack.ack = true;
+            send_pb_message(sub->client->conn, &message_ack.base);
+        }
 
-        dbg("CMD_ACK: %s\n", (char *)stream->user.data);
+        notify.id = sub->id;
 
-        send_pb_message(h2o_conn, &message_ack.base);
+        message.cmd_case = GPUTOP__MESSAGE__CMD_CLOSE_NOTIFY;
+        message.close_notify = &notify;
 
-        free(stream->user.data);
+        send_pb_message(sub->client->conn, &message.base);
+    }
+
+    free(sub->close_uuid);
+    free(sub->snapshot_uuid);
+    free(sub);
+}
+
+static void
+stream_closed_notify_cb(struct gputop_perf_stream *stream)
+{
+    /* stream->user.data is the last subscription to the stream. Its
+     * closing is only notified now so that the client may open the same
+     * stream again straight away. */
+    if (stream->user.data) {
+        notify_subscription_closed(stream->user.data);
         stream->user.data = NULL;
     }
 
-    notify.id = stream->user.id;
+    stream_closed_cb(stream);
+}
 
-    message.cmd_case = GPUTOP__MESSAGE__CMD_CLOSE_NOTIFY;
-    message.close_notify = &notify;
+static void
+add_stream(struct gputop_perf_stream *stream, bool live_updates)
+{
+    stream->live_updates = live_updates;
+    stream->user.stats_time = gputop_get_time();
+    list_inithead(&stream->user.subscriptions);
+    list_addtail(&stream->user.link, &streams);
+}
 
-    send_pb_message(h2o_conn, &message.base);
+static void
+close_stream(struct gputop_perf_stream *stream)
+{
+    /* By moving the stream into the closing_streams list we ensure we
+     * won't forward anymore for the stream in case we can't close the
+     * stream immediately.
+     */
+    list_del(&stream->user.link);
+    list_addtail(&stream->user.link, &closing_streams);
+    stream->pending_close = true;
 
-    stream_closed_cb(stream);
+    gputop_perf_stream_close(stream, stream_closed_notify_cb);
+}
+
+static void
+subscribe(struct client *client, struct gputop_perf_stream *stream, uint32_t id)
+{
+    struct subscription *sub = xmalloc0(sizeof(*sub));
+
+    sub->client = client;
+    sub->stream = stream;
+    sub->id = id;
+
+    /* Clients joining a shared stream start with the next records read */
+    if (stream->type == GPUTOP_STREAM_I915_PERF)
+        sub->cursor = sub->end = stream->oa.ring_head;
+
+    list_addtail(&sub->client_link, &client->subscriptions);
+    list_addtail(&sub->stream_link, &stream->user.subscriptions);
+}
+
+static void
+finish_unsubscribe(struct subscription *sub)
+{
+    struct gputop_perf_stream *stream = sub->stream;
+
+    list_del(&sub->stream_link);
+
+    if (list_empty(&stream->user.subscriptions)) {
+        stream->user.data = sub;
+        close_stream(stream);
+    } else
+        notify_subscription_closed(sub);
+}
+
+static void
+unsubscribe(struct subscription *sub)
+{
+    list_delinit(&sub->client_link);
+
+    /* NB: we can't drop the subscription if we're in the middle of writing
+     * its samples to the websocket, it's then finished from update_cb()
+     * once the write completes...
+     */
+    if (sub->flushing)
+        sub->pending_close = true;
+    else
+        finish_unsubscribe(sub);
+}
+
+static void
+finish_flushing(struct subscription *sub)
+{
+    sub->flushing = false;
+
+    if (sub->pending_close) {
+        list_addtail(&sub->client_link, &closing_subscriptions);
+        queue_update();
+    } else if (sub->snapshot_uuid ||
+               (sub->stream->type == GPUTOP_STREAM_I915_PERF &&
+                sub->stream->oa.ring_full))
+        queue_update();
 }
 
 /*
@@ -175,10 +319,10 @@ struct perf_flush_closure {
     uint64_t tail;
 };
 
-static unsigned int
+static uint64_t
 read_perf_head(struct perf_event_mmap_page *mmap_page)
 {
-    unsigned int head = (*(volatile uint64_t *)&mmap_page->data_head);
+    uint64_t head = (*(volatile uint64_t *)&mmap_page->data_head);
     rmb();
 
     return head;
@@ -186,7 +330,7 @@ read_perf_head(struct perf_event_mmap_page *mmap_page)
 
 static void
 write_perf_tail(struct perf_event_mmap_page *mmap_page,
-                unsigned int tail)
+                uint64_t tail)
 {
     /* Make sure we've finished reading all the sample data we
      * were consuming before updating the tail... */
@@ -203,34 +347,34 @@ fragmented_perf_read_cb(wslay_event_context_ptr ctx,
 {
     union wslay_event_msg_source *source =
         (union wslay_event_msg_source *) _source;
-    struct gputop_perf_stream *stream = source->data;
+    struct subscription *sub = source->data;
+    struct gputop_perf_stream *stream;
     uint64_t mask;
     int read_len;
     int total = 0;
     uint64_t head;
     uint64_t tail;
-    uint64_t remainder;
     uint8_t *buffer;
-    uint8_t *p;
 
-    if (!stream) {
+    if (!sub) {
         *eof = 1;
         return 0;
     }
 
+    stream = sub->stream;
     mask = stream->perf.buffer_size - 1;
 
-    if (!stream->perf.header_written) {
+    if (!sub->header_written) {
         assert(len > 8);
 
         memset(data, 0, 8);
         data[0] = WS_MESSAGE_PERF;
-        *(uint32_t *)(data + 4) = stream->user.id;
+        *(uint32_t *)(data + 4) = sub->id;
 
         total = 8;
         data += 8;
         len -= 8;
-        stream->perf.header_written = true;
+        sub->header_written = true;
     }
 
     head = stream->perf.head;
@@ -238,41 +382,34 @@ fragmented_perf_read_cb(wslay_event_context_ptr ctx,
 
     buffer = stream->perf.buffer;
 
-    if ((head & mask) < (tail & mask)) {
-        int before;
+    /* NB: head and tail are free running so that a full buffer can be
+     * forwarded too. The range may wrap around the end of the buffer. */
+    if ((tail & mask) + (head - tail) > stream->perf.buffer_size) {
+        int before = stream->perf.buffer_size - (tail & mask);
 
-        p = buffer + (tail & mask);
-        before = stream->perf.buffer_size - (tail & mask);
         read_len = MIN(before, len);
-        memcpy(data, p, read_len);
+        memcpy(data, buffer + (tail & mask), read_len);
 
         len -= read_len;
         tail += read_len;
         data += read_len;
         total += read_len;
-
-        stream->perf.tail = tail;
     }
 
-    p = buffer + (tail & mask);
-    remainder = TAKEN(head, tail, stream->perf.buffer_size);
-    read_len = MIN(remainder, len);
-    memcpy(data, p, read_len);
+    read_len = MIN(head - tail, len);
+    memcpy(data, buffer + (tail & mask), read_len);
 
-    len -= read_len;
     tail += read_len;
     total += read_len;
     stream->perf.tail = tail;
 
-    stream->perf.total_len += total;
+    sub->total_len += total;
 
-    if (TAKEN(head, tail, stream->perf.buffer_size) == 0) {
+    if (head == tail) {
         *eof = 1;
         write_perf_tail(stream->perf.mmap_page, tail);
 
-        stream->user.flushing = false;
-        if (stream->pending_close)
-            gputop_perf_stream_close(stream, stream_closed_notify_cb);
+        finish_flushing(sub);
 
         source->data = NULL;
     }
@@ -281,32 +418,41 @@ fragmented_perf_read_cb(wslay_event_context_ptr ctx,
 }
 
 static void
-flush_perf_stream_samples(struct gputop_perf_stream *stream)
+flush_perf_stream_range(struct subscription *sub, uint64_t head, uint64_t tail)
 {
-    uint64_t head = read_perf_head(stream->perf.mmap_page);
-    uint64_t tail = stream->perf.mmap_page->data_tail;
+    struct gputop_perf_stream *stream = sub->stream;
+    h2o_websocket_conn_t *conn = sub->client->conn;
     struct wslay_event_fragmented_msg msg;
 
-    if (stream->user.flushing)
-        return;
-
-    stream->user.flushing = true;
+    sub->flushing = true;
 
     //gputop_perf_print_records(stream, head, tail, false);
 
-    stream->perf.header_written = false;
-    stream->perf.total_len = 0;
+    sub->header_written = false;
+    sub->total_len = 0;
     stream->perf.head = head;
     stream->perf.tail = tail;
 
     memset(&msg, 0, sizeof(msg));
     msg.opcode = WSLAY_BINARY_FRAME;
-    msg.source.data = stream;
+    msg.source.data = sub;
     msg.read_callback = fragmented_perf_read_cb;
 
-    wslay_event_queue_fragmented_msg(h2o_conn->ws_ctx, &msg);
+    wslay_event_queue_fragmented_msg(conn->ws_ctx, &msg);
+
+    wslay_event_send(conn->ws_ctx);
+}
+
+static void
+flush_perf_stream_samples(struct subscription *sub)
+{
+    struct gputop_perf_stream *stream = sub->stream;
+
+    if (sub->flushing)
+        return;
 
-    wslay_event_send(h2o_conn->ws_ctx);
+    flush_perf_stream_range(sub, read_perf_head(stream->perf.mmap_page),
+                            stream->perf.mmap_page->data_tail);
 }
 
 static ssize_t
@@ -318,44 +464,45 @@ fragmented_i915_perf_read_cb(wslay_event_context_ptr ctx,
 {
     union wslay_event_msg_source *source =
         (union wslay_event_msg_source *) _source;
-    struct gputop_perf_stream *stream = source->data;
+    struct subscription *sub = source->data;
+    struct gputop_perf_stream *stream;
     int total = 0;
     int read_len;
 
-    if (!stream) {
+    if (!sub) {
         *eof = 1;
         return 0;
     }
 
-    if (!stream->oa.header_written) {
+    stream = sub->stream;
+
+    if (!sub->header_written) {
         assert(len > 8);
 
         memset(data, 0, 8);
         data[0] = WS_MESSAGE_I915_PERF;
-        *(uint32_t *)(data + 4) = stream->user.id;
+        *(uint32_t *)(data + 4) = sub->id;
 
         total = 8;
         data += 8;
         len -= 8;
-        stream->oa.header_written = true;
+        sub->header_written = true;
     }
 
-    if (gputop_fake_mode)
-        read_len = gputop_perf_fake_read(stream, data, len);
-    else
-        while ((read_len = read(stream->fd, data, len)) < 0 && errno == EINTR)
-            ;
-    if (read_len > 0) {
-        total += read_len;
-        stream->oa.total_len += total;
-    } else {
+    /* NB: the ring is mapped twice in a row so the range never wraps */
+    read_len = MIN(len, sub->end - sub->cursor);
+    memcpy(data,
+           stream->oa.ring + (sub->cursor & (stream->oa.ring_size - 1)),
+           read_len);
+    total += read_len;
+    sub->cursor += read_len;
+
+    sub->total_len += total;
+
+    if (sub->cursor == sub->end) {
         *eof = 1;
-        if (!gputop_fake_mode && errno != EAGAIN)
-            dbg("Error reading i915 perf stream %m\n");
 
-        stream->user.flushing = false;
-        if (stream->pending_close)
-            gputop_perf_stream_close(stream, stream_closed_notify_cb);
+        finish_flushing(sub);
 
         source->data = NULL;
     }
@@ -363,34 +510,115 @@ fragmented_i915_perf_read_cb(wslay_event_context_ptr ctx,
     return total;
 }
 
+/* Lets the client know how far behind it is in the ring, and whether
+ * records have been overwritten before it could be sent them, unlike the
+ * kernel's buffer overflows that are reported within the records. */
+static void
+notify_i915_perf_fill(struct subscription *sub)
+{
+    struct gputop_perf_stream *stream = sub->stream;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__BufferFillNotify notify = GPUTOP__BUFFER_FILL_NOTIFY__INIT;
+    /* A flight recorder's fill is that of the whole ring */
+    uint64_t backlog = stream->oa.ring_head -
+        (stream->live_updates ?
+         MAX2(sub->cursor, stream->oa.ring_tail) : stream->oa.ring_tail);
+    uint32_t fill = backlog * 100 / stream->oa.ring_size;
+
+    if (fill == sub->notified_fill &&
+        sub->ring_overruns == sub->notified_overruns)
+        return;
+
+    notify.stream_id = sub->id;
+    notify.fill_percentage = fill;
+    notify.has_ring_overruns = true;
+    notify.ring_overruns = sub->ring_overruns;
+    notify.has_ring_lost_bytes = true;
+    notify.ring_lost_bytes = sub->ring_lost_bytes;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_FILL_NOTIFY;
+    message.fill_notify = &notify;
+
+    send_pb_message(sub->client->conn, &message.base);
+
+    sub->notified_fill = fill;
+    sub->notified_overruns = sub->ring_overruns;
+}
+
 static void
-flush_i915_perf_stream_samples(struct gputop_perf_stream *stream)
+flush_i915_perf_stream_samples(struct subscription *sub, uint64_t head)
 {
+    struct gputop_perf_stream *stream = sub->stream;
+    h2o_websocket_conn_t *conn = sub->client->conn;
     struct wslay_event_fragmented_msg msg;
+    const uint32_t mask = stream->oa.ring_size - 1;
+    const uint64_t max_len = stream->oa.ring_size / 4;
 
-    if (stream->user.flushing)
+    if (sub->flushing)
         return;
 
-    //gputop_perf_print_records(stream, head, tail, false);
+    /* The records were overwritten while the client was catching up */
+    if (sub->cursor < stream->oa.ring_tail) {
+        sub->ring_overruns++;
+        sub->ring_lost_bytes += stream->oa.ring_tail - sub->cursor;
+        sub->cursor = stream->oa.ring_tail;
+    }
+
+    notify_i915_perf_fill(sub);
+
+    if (sub->cursor == head)
+        return;
+
+    sub->flushing = true;
 
-    stream->user.flushing = true;
+    sub->header_written = false;
+    sub->total_len = 0;
 
-    stream->oa.header_written = false;
-    stream->oa.total_len = 0;
+    /* The records being sent can't be overwritten, so a client far behind
+     * is sent its backlog in several messages, leaving room to keep
+     * draining the kernel's buffer */
+    sub->end = head;
+    if (sub->end - sub->cursor > max_len) {
+        sub->end = sub->cursor;
+        do {
+            const struct drm_i915_perf_record_header *header = (const void *)
+                (stream->oa.ring + (sub->end & mask));
+
+            sub->end += header->size;
+        } while (sub->end - sub->cursor < max_len);
+    }
 
     memset(&msg, 0, sizeof(msg));
     msg.opcode = WSLAY_BINARY_FRAME;
-    msg.source.data = stream;
+    msg.source.data = sub;
     msg.read_callback = fragmented_i915_perf_read_cb;
 
-    wslay_event_queue_fragmented_msg(h2o_conn->ws_ctx, &msg);
+    wslay_event_queue_fragmented_msg(conn->ws_ctx, &msg);
+
+    wslay_event_send(conn->ws_ctx);
+}
+
+/* Reads the kernel stream once for all its clients. Only the records
+ * being sent, as live updates or snapshots, are kept, a client's backlog
+ * being overwritten instead of holding up the reads, which it's told about
+ * as ring overruns. */
+static void
+fill_i915_perf_ring(struct gputop_perf_stream *stream)
+{
+    uint64_t pinned = stream->oa.ring_head;
+
+    list_for_each_entry(struct subscription, sub,
+                        &stream->user.subscriptions, stream_link) {
+        if (sub->flushing || sub->snapshot_uuid)
+            pinned = MIN(pinned, sub->cursor);
+    }
 
-    wslay_event_send(h2o_conn->ws_ctx);
+    gputop_i915_perf_fill_ring(stream, pinned);
 }
 
 static void
-flush_cpu_stats(struct gputop_perf_stream *stream)
+flush_cpu_stats(struct subscription *sub)
 {
+    struct gputop_perf_stream *stream = sub->stream;
     int n_cpus = gputop_cpu_count();
     int n;
     int pos;
@@ -420,7 +648,7 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
 
         message.cpu_stats = &set;
 
-        set.id = stream->user.id;
+        set.id = sub->id;
         set.n_cpus = n_cpus;
         set.cpus = stats_vec;
 
@@ -440,7 +668,7 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
             stats[i].guest_nice = stat[i].guest_nice;
         }
 
-        send_pb_message(h2o_conn, &message.base);
+        send_pb_message(sub->client->conn, &message.base);
 
         pos += n_cpus;
         if (pos >= stream->cpu.stats_buf_len)
@@ -452,35 +680,37 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
 }
 
 static void
-flush_stream_samples(struct gputop_perf_stream *stream)
+flush_stream_samples(struct subscription *sub)
 {
-    if (stream->user.flushing) {
+    struct gputop_perf_stream *stream = sub->stream;
+
+    if (sub->flushing) {
         fprintf(stderr, "Throttling websocket forwarding\n");
         return;
     }
 
+    assert(!sub->pending_close);
     assert(!stream->pending_close);
     assert(!stream->closed);
 
-    if (!gputop_stream_data_pending(stream))
-        return;
-
     switch (stream->type) {
     case GPUTOP_STREAM_PERF:
-        flush_perf_stream_samples(stream);
+        if (gputop_stream_data_pending(stream))
+            flush_perf_stream_samples(sub);
         break;
     case GPUTOP_STREAM_I915_PERF:
-        flush_i915_perf_stream_samples(stream);
+        flush_i915_perf_stream_samples(sub, stream->oa.ring_head);
         break;
     case GPUTOP_STREAM_CPU:
-        flush_cpu_stats(stream);
+        flush_cpu_stats(sub);
         break;
     }
 }
 
 static void
-update_perf_head_pointers(struct gputop_perf_stream *stream)
+update_perf_head_pointers(struct subscription *sub)
 {
+    struct gputop_perf_stream *stream = sub->stream;
     struct gputop_perf_header_buf *hdr_buf = &stream->perf.header_buf;
 
     gputop_perf_update_header_offsets(stream);
@@ -489,25 +719,140 @@ update_perf_head_pointers(struct gputop_perf_stream *stream)
         Gputop__Message message = GPUTOP__MESSAGE__INIT;
         Gputop__BufferFillNotify notify = GPUTOP__BUFFER_FILL_NOTIFY__INIT;
 
-        notify.stream_id = stream->user.id;
+        notify.stream_id = sub->id;
         notify.fill_percentage =
             (hdr_buf->offsets[(hdr_buf->head - 1) % hdr_buf->len] /
              (float)stream->perf.buffer_size) * 100.0f;
         message.cmd_case = GPUTOP__MESSAGE__CMD_FILL_NOTIFY;
         message.fill_notify = &notify;
 
-        send_pb_message(h2o_conn, &message.base);
+        send_pb_message(sub->client->conn, &message.base);
+    }
+}
+
+static void
+finish_snapshot(struct subscription *sub)
+{
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+
+    if (sub->stream->type == GPUTOP_STREAM_PERF)
+        gputop_perf_flight_recorder_resume(sub->stream);
+
+    message.reply_uuid = sub->snapshot_uuid;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
+    message.ack = true;
+    send_pb_message(sub->client->conn, &message.base);
+
+    free(sub->snapshot_uuid);
+    sub->snapshot_uuid = NULL;
+}
+
+/* Sends the rest of a snapshot, i915 perf records being sent in several
+ * messages */
+static void
+update_snapshot(struct subscription *sub)
+{
+    if (sub->flushing)
+        return;
+
+    if (sub->stream->type == GPUTOP_STREAM_I915_PERF &&
+        sub->cursor != sub->snapshot_end) {
+        flush_i915_perf_stream_samples(sub, sub->snapshot_end);
+        return;
+    }
+
+    finish_snapshot(sub);
+}
+
+/* Keeps track of the records of streams opened in overwrite mode without
+ * forwarding them */
+static void
+update_flight_recorder(struct subscription *sub)
+{
+    switch (sub->stream->type) {
+    case GPUTOP_STREAM_PERF:
+        update_perf_head_pointers(sub);
+        break;
+    case GPUTOP_STREAM_I915_PERF:
+        notify_i915_perf_fill(sub);
+        break;
+    case GPUTOP_STREAM_CPU:
+        break;
+    }
+}
+
+/* Tells the clients how often the main loop is woken up for the stream's
+ * data and how much data each wakeup and read brings, about once a
+ * second */
+static void
+send_stream_stats(struct gputop_perf_stream *stream)
+{
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__StreamStats stats = GPUTOP__STREAM_STATS__INIT;
+    uint64_t now = gputop_get_time();
+    uint64_t elapsed = now - stream->user.stats_time;
+    uint64_t n_wakeups = stream->n_wakeups - stream->user.stats_wakeups;
+    uint64_t n_bytes = stream->n_wakeup_bytes - stream->user.stats_wakeup_bytes;
+    /* NB: a reader thread updates these concurrently */
+    uint64_t reads = __atomic_load_n(&stream->n_reads, __ATOMIC_RELAXED);
+    uint64_t read_bytes = __atomic_load_n(&stream->n_read_bytes, __ATOMIC_RELAXED);
+
+    if (stream->type == GPUTOP_STREAM_CPU || elapsed < 1000000000)
+        return;
+
+    stream->user.stats_time = now;
+    stream->user.stats_wakeups = stream->n_wakeups;
+    stream->user.stats_wakeup_bytes = stream->n_wakeup_bytes;
+
+    stats.wakeups_per_sec = n_wakeups * 1000000000.0 / elapsed;
+    stats.bytes_per_wakeup = n_wakeups ? n_bytes / n_wakeups : 0;
+
+    stats.reads_per_sec = (reads - stream->user.stats_reads) * 1000000000.0 / elapsed;
+    stats.bytes_per_read = reads > stream->user.stats_reads ?
+        (read_bytes - stream->user.stats_read_bytes) / (reads - stream->user.stats_reads) : 0;
+    stream->user.stats_reads = reads;
+    stream->user.stats_read_bytes = read_bytes;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_STREAM_STATS;
+    message.stream_stats = &stats;
+
+    list_for_each_entry(struct subscription, sub,
+                        &stream->user.subscriptions, stream_link) {
+        if (sub->pending_close)
+            continue;
+
+        stats.stream_id = sub->id;
+        send_pb_message(sub->client->conn, &message.base);
     }
 }
 
 static void
 update_streams(void)
 {
+    list_for_each_entry_safe(struct subscription, sub,
+                             &closing_subscriptions, client_link) {
+        list_delinit(&sub->client_link);
+        finish_unsubscribe(sub);
+    }
+
     list_for_each_entry_safe(struct gputop_perf_stream, stream, &streams, user.link) {
-        if (stream->live_updates)
-            flush_stream_samples(stream);
-        else if (stream->type == GPUTOP_STREAM_PERF)
-            update_perf_head_pointers(stream);
+        if ((stream->live_updates || stream->overwrite) &&
+            stream->type == GPUTOP_STREAM_I915_PERF)
+            fill_i915_perf_ring(stream);
+
+        list_for_each_entry(struct subscription, sub,
+                            &stream->user.subscriptions, stream_link) {
+            if (sub->pending_close)
+                continue;
+
+            if (sub->snapshot_uuid)
+                update_snapshot(sub);
+            else if (stream->live_updates)
+                flush_stream_samples(sub);
+            else if (stream->overwrite)
+                update_flight_recorder(sub);
+        }
+
+        send_stream_stats(stream);
     }
 }
 
@@ -524,7 +869,8 @@ forward_logs(void)
         msg.cmd_case = GPUTOP__MESSAGE__CMD_LOG;
         msg.log = log;
 
-        send_pb_message(h2o_conn, &msg.base);
+        list_for_each_entry(struct client, client, &clients, link)
+            send_pb_message(client->conn, &msg.base);
 
         gputop_pb_log_free(log);
     }
@@ -561,14 +907,50 @@ periodic_update_cb(uv_timer_t *timer)
     queue_update();
 }
 
+/* The kernel's buffer is drained as soon as it has data, so that slow
+ * websocket writes don't leave it to overflow */
 static void
 i915_perf_ready_cb(struct gputop_perf_stream *stream)
 {
+    if (!stream->pending_close)
+        fill_i915_perf_ring(stream);
+
     queue_update();
 }
 
+/* Forwards the samples of live streams as soon as perf (or the stream's
+ * reader thread) signals them, and keeps up with the records a flight
+ * recorder overwrites as it wraps around */
+static void
+perf_stream_ready_cb(struct gputop_perf_stream *stream)
+{
+    queue_update();
+}
+
+static struct gputop_perf_stream *
+find_shared_i915_perf_stream(struct gputop_metric_set *metric_set,
+                             struct ctx_handle *ctx,
+                             Gputop__OpenStream *open_stream)
+{
+    Gputop__OAStreamInfo *oa_stream_info = open_stream->oa_stream;
+
+    list_for_each_entry(struct gputop_perf_stream, stream, &streams, user.link) {
+        if (stream->type == GPUTOP_STREAM_I915_PERF &&
+            stream->metric_set == metric_set &&
+            stream->oa.period_exponent == oa_stream_info->period_exponent &&
+            stream->oa.ctx == ctx &&
+            stream->oa.cpu_timestamps == oa_stream_info->cpu_timestamps &&
+            stream->oa.gpu_timestamps == oa_stream_info->gpu_timestamps &&
+            stream->live_updates == open_stream->live_updates &&
+            stream->overwrite == open_stream->overwrite)
+            return stream;
+    }
+
+    return NULL;
+}
+
 static void
-handle_open_i915_perf_oa_stream(h2o_websocket_conn_t *conn,
+handle_open_i915_perf_oa_stream(struct client *client,
                                 Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
@@ -610,45 +992,50 @@ handle_open_i915_perf_oa_stream(h2o_websocket_conn_t *conn,
             goto err;
     }
 
-    stream = gputop_open_i915_perf_oa_stream(metric_set,
-                                             oa_stream_info->period_exponent,
-                                             ctx,
-                                             oa_stream_info->cpu_timestamps,
-                                             oa_stream_info->gpu_timestamps,
-                                             (open_stream->live_updates ?
-                                              i915_perf_ready_cb : NULL),
-                                             open_stream->overwrite,
-                                             &error);
+    stream = find_shared_i915_perf_stream(metric_set, ctx, open_stream);
     if (stream) {
-        stream->user.id = id;
-        list_addtail(&stream->user.link, &streams);
-
-        stream->live_updates = open_stream->live_updates;
+        dbg("sharing i915 perf stream set=%s period=%d\n",
+            oa_stream_info->uuid, oa_stream_info->period_exponent);
     } else {
-        dbg("Failed to open perf stream set=%s period=%d: %s\n",
-            oa_stream_info->uuid, oa_stream_info->period_exponent,
-            error);
-        goto err;
+        stream = gputop_open_i915_perf_oa_stream(metric_set,
+                                                 oa_stream_info->period_exponent,
+                                                 ctx,
+                                                 oa_stream_info->cpu_timestamps,
+                                                 oa_stream_info->gpu_timestamps,
+                                                 ((open_stream->live_updates ||
+                                                   open_stream->overwrite) ?
+                                                  i915_perf_ready_cb : NULL),
+                                                 open_stream->overwrite,
+                                                 &error);
+        if (!stream) {
+            dbg("Failed to open perf stream set=%s period=%d: %s\n",
+                oa_stream_info->uuid, oa_stream_info->period_exponent,
+                error);
+            goto err;
+        }
+        add_stream(stream, open_stream->live_updates);
     }
 
+    subscribe(client, stream, id);
+
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client->conn, &message.base);
 
     return;
 
 err:
     message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
     message.error = error;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client->conn, &message.base);
     free(error);
 
     return;
 }
 
 static void
-handle_open_tracepoint(h2o_websocket_conn_t *conn,
+handle_open_tracepoint(struct client *client,
                        Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
@@ -663,7 +1050,7 @@ handle_open_tracepoint(h2o_websocket_conn_t *conn,
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "Failed to initialize perf\n";
-        send_pb_message(conn, &message.base);
+        send_pb_message(client->conn, &message.base);
         return;
     }
 
@@ -681,14 +1068,14 @@ handle_open_tracepoint(h2o_websocket_conn_t *conn,
                                               * used to estimate number of samples
                                               * that will fit in buffer */
                                          buffer_size,
-                                         NULL,
+                                         ((open_stream->live_updates ||
+                                           open_stream->overwrite) ?
+                                          perf_stream_ready_cb : NULL),
                                          open_stream->overwrite,
                                          &error);
     if (stream) {
-        stream->user.id = id;
-        list_addtail(&stream->user.link, &streams);
-
-        stream->live_updates = open_stream->live_updates;
+        add_stream(stream, open_stream->live_updates);
+        subscribe(client, stream, id);
     } else {
         dbg("Failed to open trace %"PRIu32": %s\n", config->id, error);
         free(error);
@@ -697,11 +1084,11 @@ handle_open_tracepoint(h2o_websocket_conn_t *conn,
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client->conn, &message.base);
 }
 
 static void
-handle_open_generic_stream(h2o_websocket_conn_t *conn,
+handle_open_generic_stream(struct client *client,
                           Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
@@ -716,7 +1103,7 @@ handle_open_generic_stream(h2o_websocket_conn_t *conn,
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "Failed to initialize perf\n";
-        send_pb_message(conn, &message.base);
+        send_pb_message(client->conn, &message.base);
         return;
     }
 
@@ -736,11 +1123,8 @@ handle_open_generic_stream(h2o_websocket_conn_t *conn,
                                               open_stream->overwrite,
                                               &error);
     if (stream) {
-        stream->user.id = id;
-        list_inithead(&stream->user.link);
-        list_addtail(&stream->user.link, &streams);
-
-        stream->live_updates = open_stream->live_updates;
+        add_stream(stream, open_stream->live_updates);
+        subscribe(client, stream, id);
     } else {
         dbg("Failed to open perf event: %s\n", error);
         free(error);
@@ -749,11 +1133,11 @@ handle_open_generic_stream(h2o_websocket_conn_t *conn,
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client->conn, &message.base);
 }
 
 static void
-handle_open_cpu_stats(h2o_websocket_conn_t *conn,
+handle_open_cpu_stats(struct client *client,
                       Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
@@ -766,28 +1150,25 @@ handle_open_cpu_stats(h2o_websocket_conn_t *conn,
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "Failed to initialize perf\n";
-        send_pb_message(conn, &message.base);
+        send_pb_message(client->conn, &message.base);
         return;
     }
 
     stream = gputop_perf_open_cpu_stats(open_stream->overwrite,
                                         stats_info->sample_period_ms);
     if (stream) {
-        stream->user.id = id;
-        list_inithead(&stream->user.link);
-        list_addtail(&stream->user.link, &streams);
-
-        stream->live_updates = open_stream->live_updates;
+        add_stream(stream, open_stream->live_updates);
+        subscribe(client, stream, id);
     }
 
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client->conn, &message.base);
 }
 
 static void
-handle_open_stream(h2o_websocket_conn_t *conn, Gputop__Request *request)
+handle_open_stream(struct client *client, Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
     Gputop__Message message = GPUTOP__MESSAGE__INIT;
@@ -795,74 +1176,135 @@ handle_open_stream(h2o_websocket_conn_t *conn, Gputop__Request *request)
 
     switch (open_stream->type_case) {
     case GPUTOP__OPEN_STREAM__TYPE_OA_STREAM:
-        handle_open_i915_perf_oa_stream(conn, request);
+        handle_open_i915_perf_oa_stream(client, request);
         break;
     case GPUTOP__OPEN_STREAM__TYPE_TRACEPOINT:
-        handle_open_tracepoint(conn, request);
+        handle_open_tracepoint(client, request);
         break;
     case GPUTOP__OPEN_STREAM__TYPE_GENERIC:
-        handle_open_generic_stream(conn, request);
+        handle_open_generic_stream(client, request);
         break;
     case GPUTOP__OPEN_STREAM__TYPE_CPU_STATS:
-        handle_open_cpu_stats(conn, request);
+        handle_open_cpu_stats(client, request);
         break;
     default:
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "FIXME: implement support for opening GL queries\n";
 
-        send_pb_message(conn, &message.base);
+        send_pb_message(client->conn, &message.base);
         fprintf(stderr, "TODO: support opening GL queries");
     }
 }
 
 static void
-close_stream(struct gputop_perf_stream *stream)
+handle_close_stream(struct client *client,
+                   Gputop__Request *request)
 {
-    /* By moving the stream into the closing_streams list we ensure we
-     * won't forward anymore for the stream in case we can't close the
-     * stream immediately.
-     */
-    list_del(&stream->user.link);
-    list_addtail(&stream->user.link, &closing_streams);
-    stream->pending_close = true;
+    uint32_t id = request->close_stream;
 
-    /* NB: we can't synchronously close the perf event if we're in the
-     * middle of writing samples to the websocket...
-     */
-    if (!stream->user.flushing)
-        gputop_perf_stream_close(stream, stream_closed_notify_cb);
+    dbg("handle_close_stream: id=%d, request_uuid=%s\n", id, request->uuid);
+
+    list_for_each_entry(struct subscription, sub, &client->subscriptions, client_link) {
+        if (sub->id == id) {
+            assert(sub->close_uuid == NULL);
+            sub->close_uuid = strdup(request->uuid);
+            unsubscribe(sub);
+            return;
+        }
+    }
 }
 
 static void
-terminate_all_streams(void)
+handle_snapshot_stream(struct client *client,
+                       Gputop__Request *request)
 {
-    list_for_each_entry_safe(struct gputop_perf_stream, stream,
-                             &streams, user.link) {
-        gputop_perf_stream_close(stream, stream_closed_cb);
+    uint32_t id = request->snapshot_stream;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    struct subscription *sub = NULL;
+    struct gputop_perf_stream *stream;
+    uint64_t start, end;
+
+    dbg("handle_snapshot_stream: id=%d, request_uuid=%s\n", id, request->uuid);
+
+    list_for_each_entry(struct subscription, s, &client->subscriptions, client_link) {
+        if (s->id == id) {
+            sub = s;
+            break;
+        }
     }
-    list_for_each_entry_safe(struct gputop_perf_stream, stream,
-                             &closing_streams, user.link) {
-        gputop_perf_stream_close(stream, stream_closed_cb);
+
+    message.reply_uuid = request->uuid;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
+    if (!sub) {
+        message.error = "Unknown stream\n";
+        send_pb_message(client->conn, &message.base);
+        return;
+    }
+    stream = sub->stream;
+    if (!stream->overwrite || stream->live_updates) {
+        message.error = "Not a flight recorder stream\n";
+        send_pb_message(client->conn, &message.base);
+        return;
+    }
+    if (sub->snapshot_uuid) {
+        message.error = "Snapshot already in progress\n";
+        send_pb_message(client->conn, &message.base);
+        return;
+    }
+
+    switch (stream->type) {
+    case GPUTOP_STREAM_PERF:
+        gputop_perf_flight_recorder_pause(stream, sub->snapshot_end,
+                                          &start, &end);
+        sub->snapshot_end = end;
+        if (start != end)
+            flush_perf_stream_range(sub, end, start);
+        break;
+    case GPUTOP_STREAM_I915_PERF:
+        /* What's still in the ring of what the previous snapshot didn't
+         * send, the records being pinned until sent */
+        fill_i915_perf_ring(stream);
+        sub->cursor = MAX2(stream->oa.ring_tail, sub->snapshot_end);
+        sub->snapshot_end = stream->oa.ring_head;
+        break;
+    case GPUTOP_STREAM_CPU:
+        flush_cpu_stats(sub);
+        break;
     }
+
+    sub->snapshot_uuid = strdup(request->uuid);
+    update_snapshot(sub);
 }
 
 static void
-handle_close_stream(h2o_websocket_conn_t *conn,
-                   Gputop__Request *request)
+remove_client(struct client *client)
 {
-    uint32_t id = request->close_stream;
-
-    dbg("handle_close_stream: id=%d, request_uuid=%s\n", id, request->uuid);
-
-    list_for_each_entry_safe(struct gputop_perf_stream, stream, &streams, user.link) {
-        if (stream->user.id == id) {
-            assert(stream->user.data == NULL);
-            stream->user.data = strdup(request->uuid);
-            close_stream(stream);
-            return;
+    list_for_each_entry_safe(struct gputop_perf_stream, stream,
+                             &streams, user.link) {
+        list_for_each_entry_safe(struct subscription, sub,
+                                 &stream->user.subscriptions, stream_link) {
+            if (sub->client != client)
+                continue;
+
+            /* Queued websocket messages are dropped with the connection,
+             * nothing is being forwarded anymore. */
+            list_delinit(&sub->client_link);
+            sub->client = NULL;
+            sub->flushing = false;
+            finish_unsubscribe(sub);
         }
     }
+    list_for_each_entry(struct gputop_perf_stream, stream,
+                        &closing_streams, user.link) {
+        struct subscription *sub = stream->user.data;
+
+        if (sub && sub->client == client)
+            sub->client = NULL;
+    }
+
+    list_del(&client->link);
+    free(client);
 }
 
 static bool
@@ -1242,14 +1684,14 @@ handle_get_features(h2o_websocket_conn_t *conn,
 static void on_ws_message(h2o_websocket_conn_t *conn,
                           const struct wslay_event_on_msg_recv_arg *arg)
 {
+    struct client *client = conn->data;
     Gputop__Request *request;
     //fprintf(stderr, "on_ws_message\n");
     //dbg("on_ws_message\n");
 
     if (arg == NULL) {
         //dbg("socket closed\n");
-        h2o_conn = NULL;
-        terminate_all_streams();
+        remove_client(client);
         h2o_websocket_close(conn);
         return;
     }
@@ -1284,11 +1726,15 @@ static void on_ws_message(h2o_websocket_conn_t *conn,
         break;
     case GPUTOP__REQUEST__REQ_OPEN_STREAM:
         server_dbg("OpenStream request received\n");
-        handle_open_stream(conn, request);
+        handle_open_stream(client, request);
         break;
     case GPUTOP__REQUEST__REQ_CLOSE_STREAM:
         server_dbg("CloseStream request received\n");
-        handle_close_stream(conn, request);
+        handle_close_stream(client, request);
+        break;
+    case GPUTOP__REQUEST__REQ_SNAPSHOT_STREAM:
+        server_dbg("SnapshotStream request received\n");
+        handle_snapshot_stream(client, request);
         break;
     case GPUTOP__REQUEST__REQ_TEST_LOG:
         server_dbg("TEST LOG: %s\n", request->test_log);
@@ -1305,6 +1751,7 @@ static void on_ws_message(h2o_websocket_conn_t *conn,
 
 static int on_req(h2o_handler_t *self, h2o_req_t *req)
 {
+    struct client *client;
     const char *client_key;
     ssize_t proto_header_index;
 
@@ -1326,7 +1773,10 @@ static int on_req(h2o_handler_t *self, h2o_req_t *req)
                               0, NULL, "binary", strlen("binary"));
     }
 
-    h2o_conn = h2o_upgrade_to_websocket(req, client_key, NULL, on_ws_message);
+    client = xmalloc0(sizeof(*client));
+    list_inithead(&client->subscriptions);
+    list_addtail(&client->link, &clients);
+    client->conn = h2o_upgrade_to_websocket(req, client_key, client, on_ws_message);
 
     return 0;
 }
@@ -1419,8 +1869,10 @@ bool gputop_server_run(void)
     char *port_env;
     unsigned long port;
 
+    list_inithead(&clients);
     list_inithead(&streams);
     list_inithead(&closing_streams);
+    list_inithead(&closing_subscriptions);
 
     loop = gputop_mainloop;
 
@@ -24,6 +24,8 @@
 
 #include "gputop-network.h"
 
+#include <string.h>
+
 #include <emscripten/emscripten.h>
 
 struct _gputop_connection_t {
@@ -32,6 +34,7 @@ struct _gputop_connection_t {
 
     gputop_on_ready_cb_t ready_cb;
     gputop_on_data_cb_t data_cb;
+    gputop_on_buffer_cb_t buffer_cb;
     gputop_on_close_cb_t close_cb;
     void *user_data;
 };
@@ -46,7 +49,18 @@ EMSCRIPTEN_KEEPALIVE static void
 gputop_emscripten_network_on_message(gputop_connection_t *conn,
                                      const void *data, size_t length)
 {
-    conn->data_cb(conn, data, length, conn->user_data);
+    /* The data only lives on the stack for the duration of the call,
+     * without a copy it can only be handled in place. */
+    gputop_buffer_t *buffer = conn->buffer_cb ? gputop_buffer_new(length) : NULL;
+    if (!buffer) {
+        conn->data_cb(conn, data, length, conn->user_data);
+        return;
+    }
+
+    memcpy((uint8_t *) buffer->data, data, length);
+
+    conn->buffer_cb(conn, buffer, conn->user_data);
+    gputop_buffer_unref(buffer);
 }
 
 EMSCRIPTEN_KEEPALIVE static void
@@ -111,6 +125,13 @@ gputop_connect(const char *host, int port,
     return conn;
 }
 
+void
+gputop_connection_set_buffer_cb(gputop_connection_t *conn,
+                                gputop_on_buffer_cb_t buffer_cb)
+{
+    conn->buffer_cb = buffer_cb;
+}
+
 void
 gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
 {
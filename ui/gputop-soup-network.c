@@ -33,6 +33,7 @@ struct _gputop_connection_t {
 
     gputop_on_ready_cb_t ready_cb;
     gputop_on_data_cb_t data_cb;
+    gputop_on_buffer_cb_t buffer_cb;
     gputop_on_close_cb_t close_cb;
     void *user_data;
 };
@@ -46,6 +47,23 @@ gputop_connection_free(gputop_connection_t *conn)
     g_free(conn);
 }
 
+/* Wraps the GBytes of a message so that receivers can keep it without a
+ * copy.
+ */
+struct gbytes_buffer {
+    gputop_buffer_t base;
+    GBytes *bytes;
+};
+
+static void
+gbytes_buffer_destroy(gputop_buffer_t *buffer)
+{
+    struct gbytes_buffer *gbuffer = (struct gbytes_buffer *) buffer;
+
+    g_bytes_unref(gbuffer->bytes);
+    g_free(gbuffer);
+}
+
 static void
 on_websocket_message(SoupWebsocketConnection *self,
                      gint type, GBytes *message,
@@ -53,10 +71,25 @@ on_websocket_message(SoupWebsocketConnection *self,
 {
     gputop_connection_t *conn = user_data;
 
-    conn->data_cb(conn,
-                  g_bytes_get_data(message, NULL),
-                  g_bytes_get_size(message),
-                  conn->user_data);
+    if (!conn->buffer_cb) {
+        conn->data_cb(conn,
+                      g_bytes_get_data(message, NULL),
+                      g_bytes_get_size(message),
+                      conn->user_data);
+        return;
+    }
+
+    struct gbytes_buffer *gbuffer = g_new0(struct gbytes_buffer, 1);
+    gsize len;
+
+    gbuffer->bytes = g_bytes_ref(message);
+    gbuffer->base.refcount = 1;
+    gbuffer->base.data = g_bytes_get_data(message, &len);
+    gbuffer->base.len = len;
+    gbuffer->base.destroy = gbytes_buffer_destroy;
+
+    conn->buffer_cb(conn, &gbuffer->base, conn->user_data);
+    gputop_buffer_unref(&gbuffer->base);
 }
 
 static void
@@ -116,6 +149,13 @@ gputop_connect(const char *host, int port,
     return conn;
 }
 
+void
+gputop_connection_set_buffer_cb(gputop_connection_t *conn,
+                                gputop_on_buffer_cb_t buffer_cb)
+{
+    conn->buffer_cb = buffer_cb;
+}
+
 void
 gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
 {
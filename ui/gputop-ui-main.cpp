@@ -103,6 +103,9 @@ struct timeline_window {
     uint32_t n_accumulated_reports;
     int32_t hovered_report;
     float *accumulated_values;
+    const struct drm_i915_perf_record_header **report_headers;
+    uint32_t *report_timestamps;
+    uint32_t n_report_headers;
 
     struct gputop_perf_tracepoint tracepoint;
     uint64_t tracepoint_selected_ts;
@@ -273,20 +276,34 @@ update_cpu_colors(int n_cpus)
 }
 
 static void
-on_connection_data(gputop_connection_t *conn,
-                   const void *payload, size_t payload_len,
-                   void *user_data)
+on_connection_message(void)
 {
     struct gputop_client_context *ctx = &context.ctx;
 
-    gputop_client_context_handle_data(ctx, payload, payload_len);
-
     if (ctx->features && context.n_cpu_colors != ctx->features->features->n_cpus)
         update_cpu_colors(ctx->features->features->n_cpus);
 
     ImGui_ScheduleFrame();
 }
 
+static void
+on_connection_data(gputop_connection_t *conn,
+                   const void *payload, size_t payload_len,
+                   void *user_data)
+{
+    gputop_client_context_handle_data(&context.ctx, payload, payload_len);
+    on_connection_message();
+}
+
+static void
+on_connection_buffer(gputop_connection_t *conn,
+                     gputop_buffer_t *buffer,
+                     void *user_data)
+{
+    gputop_client_context_handle_buffer(&context.ctx, buffer);
+    on_connection_message();
+}
+
 static void
 on_connection_closed(gputop_connection_t *conn,
                      const char *error,
@@ -322,6 +339,7 @@ reconnect(void)
                                      on_connection_ready,
                                      on_connection_data,
                                      on_connection_closed, NULL);
+    gputop_connection_set_buffer_cb(ctx->connection, on_connection_buffer);
 }
 
 /**/
@@ -339,23 +357,9 @@ read_counter_max(struct gputop_client_context *ctx,
                  const struct gputop_metric_set_counter *counter,
                  float max_value)
 {
-    switch (counter->data_type) {
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-        if (counter->max_uint64)
-            return counter->max_uint64(&ctx->devinfo,
-                                       ctx->metric_set,
-                                       sample->accumulator.deltas);
-        break;
-    case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-    case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-        if (counter->max_float)
-            return counter->max_float(&ctx->devinfo,
-                                      ctx->metric_set,
-                                      sample->accumulator.deltas);
-        break;
-    }
+    if (gputop_metric_set_counter_has_max(counter))
+        return gputop_metric_set_counter_max(&ctx->devinfo, counter,
+                                             sample->accumulator.deltas);
 
     return max_value;
 }
@@ -433,8 +437,7 @@ display_live_i915_perf_counters_window(struct window *win)
         return;
 
     struct gputop_accumulated_samples *last_sample =
-        list_empty(&ctx->graphs) ? NULL :
-        list_last_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
+        gputop_samples_ring_last(&ctx->graphs);
 
     ImGui::BeginChild("##counters");
     display_i915_perf_counters(ctx, &filter, last_sample, true);
@@ -503,23 +506,24 @@ show_live_i915_perf_usage_window(void)
 static float *
 get_counter_samples(struct gputop_client_context *ctx,
                     int max_graphs,
-                    struct gputop_accumulated_samples *first_samples,
+                    const struct gputop_samples_ring *graphs,
                     struct i915_perf_window_counter *counter,
                     float *max_value)
 {
     float *values = ensure_plot_accumulator(max_graphs);
+    uint32_t column = counter->counter - ctx->metric_set->counters;
+    int n_graphs = column < graphs->n_columns ?
+        MIN2((int) gputop_samples_ring_length(graphs), max_graphs) : 0;
     int i;
 
-    for (i = 0; i < (max_graphs - ctx->n_graphs); i++)
+    for (i = 0; i < (max_graphs - n_graphs); i++)
         values[i] = 0.0f;
 
     *max_value = 0.0f;
-    struct gputop_accumulated_samples *sample = first_samples;
-    for (; i < max_graphs; i++) {
-        values[i] = gputop_client_context_read_counter_value(ctx, sample, counter->counter);
+    uint32_t first = gputop_samples_ring_length(graphs) - n_graphs;
+    for (uint32_t s = first; i < max_graphs; i++, s++) {
+        values[i] = gputop_samples_ring_value(graphs, column, s);
         *max_value = MAX2(*max_value, values[i]);
-        sample = list_first_entry(&sample->link,
-                                  struct gputop_accumulated_samples, link);
     }
 
     return values;
@@ -543,7 +547,7 @@ select_i915_perf_counter(struct gputop_client_context *ctx,
     if (!ctx->metric_set) return false;
 
     struct gputop_accumulated_samples *last_sample =
-        list_last_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
+        gputop_samples_ring_last(&ctx->graphs);
 
     ImGui::BeginChild("##block", ImVec2(0, 300));
     for (int c = 0; c < ctx->metric_set->n_counters; c++) {
@@ -602,9 +606,9 @@ display_global_i915_perf_window(struct window *win)
         cleanup_counters_i915_perf_window(window);
     } ImGui::SameLine();
     if (StartStopSamplingButton(ctx)) { toggle_start_stop_sampling(ctx); }
-    if (ctx->n_graphs < max_graphs) {
+    if (gputop_samples_ring_length(&ctx->graphs) < max_graphs) {
         ImGui::SameLine(); ImGui::Text("Loading:"); ImGui::SameLine();
-        ImGui::ProgressBar((float) ctx->n_graphs / max_graphs);
+        ImGui::ProgressBar((float) gputop_samples_ring_length(&ctx->graphs) / max_graphs);
     }
 
 
@@ -626,10 +630,10 @@ display_global_i915_perf_window(struct window *win)
         if (ImGui::IsItemHovered()) { ImGui::SetTooltip("Change max behavior"); } ImGui::SameLine();
 
         struct gputop_accumulated_samples *first_samples =
-          list_first_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
+            gputop_samples_ring_first(&ctx->graphs);
         float max_value = 0.0f;
         const float *values =
-            get_counter_samples(ctx, max_graphs, first_samples, c, &max_value);
+            get_counter_samples(ctx, max_graphs, &ctx->graphs, c, &max_value);
         int hovered =
             Gputop::PlotLines("", values, max_graphs, 0, -1,
                               c->counter->name,
@@ -709,9 +713,9 @@ display_contexts_i915_perf_window(struct window *win)
         cleanup_counters_i915_perf_window(window);
     } ImGui::SameLine();
     if (StartStopSamplingButton(ctx)) { toggle_start_stop_sampling(ctx); }
-    if (ctx->n_graphs < max_graphs) {
+    if (gputop_samples_ring_length(&ctx->graphs) < max_graphs) {
         ImGui::SameLine(); ImGui::Text("Loading:"); ImGui::SameLine();
-        ImGui::ProgressBar((float) ctx->n_graphs / max_graphs);
+        ImGui::ProgressBar((float) gputop_samples_ring_length(&ctx->graphs) / max_graphs);
     }
 
     ImGui::BeginChild("##block");
@@ -738,10 +742,10 @@ display_contexts_i915_perf_window(struct window *win)
 
             ImGui::Text("%s", context->name);
             struct gputop_accumulated_samples *first_samples =
-              list_first_entry(&context->graphs, struct gputop_accumulated_samples, link);
+                gputop_samples_ring_first(&context->graphs);
             float max_value = 0.0f;
             const float *values =
-                get_counter_samples(ctx, max_graphs, first_samples, c, &max_value);
+                get_counter_samples(ctx, max_graphs, &context->graphs, c, &max_value);
             int hovered =
                 Gputop::PlotLines("", values, max_graphs, 0, -1,
                                   "",
@@ -878,11 +882,11 @@ display_report_window(struct window *win)
     }
 
     // ImGui::NextColumn();
-    // if (ctx->n_timelines > 0) {
+    // if (gputop_samples_ring_length(&ctx->timelines) > 0) {
     //     struct gputop_accumulated_samples *first =
-    //         list_first_entry(&ctx->timelines, struct gputop_accumulated_samples, link);
+    //         gputop_samples_ring_first(&ctx->timelines);
     //     struct gputop_accumulated_samples *last =
-    //         list_last_entry(&ctx->timelines, struct gputop_accumulated_samples, link);
+    //         gputop_samples_ring_last(&ctx->timelines);
     //     uint64_t total_time = last->timestamp_start - first->timestamp_end;
 
     //     list_for_each_entry_safe(struct gputop_hw_context, context,
@@ -916,7 +920,9 @@ display_report_window(struct window *win)
         uint64_t start;
         uint64_t end;
     } hovered_window = { 0ULL, 0ULL };
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
+    for (uint32_t i = 0; i < gputop_samples_ring_length(&ctx->timelines); i++) {
+        struct gputop_accumulated_samples *samples =
+            gputop_samples_ring_get(&ctx->timelines, i);
         const uint64_t *cpu_ts0 = (const uint64_t *)
             gputop_i915_perf_record_field(&ctx->i915_perf_config,
                                           samples->start_report.header,
@@ -1037,11 +1043,10 @@ static uint64_t
 get_end_timeline_ts(struct gputop_client_context *ctx,
                     bool for_i915_perf)
 {
-    struct gputop_accumulated_samples *oa_end = list_empty(&ctx->timelines) ?
-        NULL : list_last_entry(&ctx->timelines, struct gputop_accumulated_samples, link);
-    struct gputop_perf_tracepoint_data *tp_end = list_empty(&ctx->perf_tracepoints_data) ?
-        NULL : list_last_entry(&ctx->perf_tracepoints_data,
-                               struct gputop_perf_tracepoint_data, link);
+    struct gputop_accumulated_samples *oa_end = gputop_samples_ring_last(&ctx->timelines);
+    uint32_t n_tp_data = gputop_client_context_merge_tracepoints_data(ctx);
+    struct gputop_perf_tracepoint_data *tp_end = n_tp_data == 0 ?
+        NULL : gputop_client_context_tracepoint_data(ctx, n_tp_data - 1);
 
     if (for_i915_perf && !ctx->i915_perf_config.cpu_timestamps)
         tp_end = NULL;
@@ -1068,17 +1073,52 @@ get_timeline_bounds(struct timeline_window *window,
     *end = end_ts;
 }
 
+/* Index of the first tracepoint record at or after ts. */
+static uint32_t
+search_tracepoints_data(struct gputop_client_context *ctx,
+                        uint32_t n_data, uint64_t ts)
+{
+    uint32_t low = 0, high = n_data;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (gputop_client_context_tracepoint_data(ctx, mid)->data.time < ts)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static struct gputop_perf_tracepoint_data *
+find_tracepoint_data(struct gputop_client_context *ctx,
+                     struct gputop_perf_tracepoint *tp,
+                     int64_t idx, int direction)
+{
+    int64_t n_data = ctx->n_perf_tracepoints_data;
+
+    for (idx += direction; idx >= 0 && idx < n_data; idx += direction) {
+        struct gputop_perf_tracepoint_data *data =
+            gputop_client_context_tracepoint_data(ctx, idx);
+        if (data->tp == tp)
+            return data;
+    }
+
+    return NULL;
+}
+
 static void
 tracepoint_print_prev_next(struct gputop_client_context *ctx,
-                           char *buf, size_t len,
-                           struct gputop_perf_tracepoint_data *data)
+                           char *buf, size_t len, uint32_t idx)
 {
-    struct gputop_perf_tracepoint *tp = data->tp;
+    struct gputop_perf_tracepoint_data *data =
+        gputop_client_context_tracepoint_data(ctx, idx);
     struct gputop_perf_tracepoint_data *other;
     char pretty_value[100];
 
-    other = (data->tp_link.prev == &tp->data) ? NULL :
-        LIST_ENTRY(struct gputop_perf_tracepoint_data, data->tp_link.prev, tp_link);
+    other = find_tracepoint_data(ctx, data->tp, idx, -1);
     if (other) {
         gputop_client_pretty_print_value(GPUTOP_PERFQUERY_COUNTER_UNITS_NS,
                                          data->data.time - other->data.time,
@@ -1089,8 +1129,7 @@ tracepoint_print_prev_next(struct gputop_client_context *ctx,
         len -= l;
     }
 
-    other = (data->tp_link.next == &tp->data) ? NULL :
-        LIST_ENTRY(struct gputop_perf_tracepoint_data, data->tp_link.next, tp_link);
+    other = find_tracepoint_data(ctx, data->tp, idx, 1);
     if (other) {
         gputop_client_pretty_print_value(GPUTOP_PERFQUERY_COUNTER_UNITS_NS,
                                          other->data.time - data->data.time,
@@ -1131,9 +1170,10 @@ timeline_focus_on_first_sample(struct timeline_window *window,
     get_timeline_bounds(window, ctx, true, &start_ts, &end_ts,
                         window->zoom_start, window->zoom_length);
 
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
-        if (samples->timestamp_end < start_ts)
-            continue;
+    for (uint32_t i = gputop_samples_ring_search(&ctx->timelines, start_ts);
+         i < gputop_samples_ring_length(&ctx->timelines); i++) {
+        struct gputop_accumulated_samples *samples =
+            gputop_samples_ring_get(&ctx->timelines, i);
         if (samples->timestamp_start > end_ts)
             break;
         if (samples->context != context)
@@ -1179,25 +1219,24 @@ timeline_focus_on_gt_timestamp(struct timeline_window *window,
                                struct gputop_client_context *ctx,
                                uint64_t gt_timestamp)
 {
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
-        if (gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->end_report.header) < gt_timestamp)
-            continue;
-        if (gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->start_report.header) > gt_timestamp)
-            break;
+    uint64_t gt_ts = gputop_client_context_extend_gt_timestamp(ctx, gt_timestamp);
+    uint32_t idx = gputop_samples_ring_search_gt(&ctx->timelines, gt_ts);
+    if (idx >= gputop_samples_ring_length(&ctx->timelines))
+        return;
 
-        const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
-        uint64_t total_end_ts = get_end_timeline_ts(ctx, true);
+    struct gputop_accumulated_samples *samples =
+        gputop_samples_ring_get(&ctx->timelines, idx);
+    if (samples->gt_timestamp_start > gt_ts)
+        return;
 
-        uint64_t ts_length = samples->timestamp_end - samples->timestamp_start;
-        ts_length *= 2;
+    const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
+    uint64_t total_end_ts = get_end_timeline_ts(ctx, true);
 
-        window->zoom_start = (samples->timestamp_start - ts_length / 4) - (total_end_ts - max_length);
-        window->zoom_length = ts_length;
+    uint64_t ts_length = samples->timestamp_end - samples->timestamp_start;
+    ts_length *= 2;
 
-        break;
-    }
+    window->zoom_start = (samples->timestamp_start - ts_length / 4) - (total_end_ts - max_length);
+    window->zoom_length = ts_length;
 }
 
 static void
@@ -1266,27 +1305,32 @@ search_timeline_reports_for_timestamp(struct timeline_window *window,
         return;
     }
 
-    const struct drm_i915_perf_record_header *last = NULL;
-    struct gputop_record_iterator iter;
+    /* Find the first report past the timestamp, comparing timestamps
+     * relative to the first report of the sample so that wrap-arounds of
+     * the GT timestamp within the sample are handled.
+     */
     uint32_t ts = strtol(window->timestamp_search, NULL, 16);
-    int report = 0;
-    gputop_record_iterator_init(&iter, &window->selected_sample);
-    while (gputop_record_iterator_next(&iter)) {
-        if (iter.header->type != DRM_I915_PERF_RECORD_SAMPLE)
-            continue;
-
-        uint32_t report_ts =
-            gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              iter.header);
-
-        if (ts < report_ts) {
-            window->searched_timestamp = report_ts;
-            window->hovered_report = report;
-            update_timeline_report_range(window, ctx, last, iter.header);
-            return;
+    uint32_t low = 0, high = window->n_report_headers;
+    if (high > 0) {
+        uint32_t base_ts = window->report_timestamps[0];
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+
+            if ((uint32_t) (window->report_timestamps[mid] - base_ts) <=
+                (uint32_t) (ts - base_ts))
+                low = mid + 1;
+            else
+                high = mid;
         }
-        last = iter.header;
-        report++;
+    }
+
+    if (low < window->n_report_headers) {
+        window->searched_timestamp = window->report_timestamps[low];
+        window->hovered_report = low;
+        update_timeline_report_range(window, ctx,
+                                     low > 0 ? window->report_headers[low - 1] : NULL,
+                                     window->report_headers[low]);
+        return;
     }
 
     window->searched_timestamp = -1;
@@ -1312,6 +1356,22 @@ update_timeline_selected_reports(struct timeline_window *window,
             n_reports++;
     }
 
+    /* Timestamps of the reports, to search them by timestamp. */
+    window->report_headers = (const struct drm_i915_perf_record_header **)
+        realloc(window->report_headers, n_reports * sizeof(window->report_headers[0]));
+    window->report_timestamps = (uint32_t *)
+        realloc(window->report_timestamps, n_reports * sizeof(window->report_timestamps[0]));
+    window->n_report_headers = 0;
+    gputop_record_iterator_init(&iter, sample);
+    while (gputop_record_iterator_next(&iter)) {
+        if (iter.header->type != DRM_I915_PERF_RECORD_SAMPLE)
+            continue;
+
+        window->report_headers[window->n_report_headers] = iter.header;
+        window->report_timestamps[window->n_report_headers++] =
+            gputop_i915_perf_record_timestamp(&ctx->i915_perf_config, iter.header);
+    }
+
     assert(n_reports > 1);
     int n_accumulated_reports = n_reports - 1;
 
@@ -1323,6 +1383,16 @@ update_timeline_selected_reports(struct timeline_window *window,
     window->n_accumulated_reports = n_accumulated_reports;
     window->hovered_report = -1;
 
+    /* Gather the per report deltas as SoA so that all the counters can be
+     * evaluated in one batch.
+     */
+    struct gputop_cc_oa_accumulator accumulator;
+    gputop_cc_oa_accumulator_init(&accumulator, &ctx->devinfo,
+                                  ctx->metric_set, 0, NULL);
+    int n_deltas = accumulator.format->n_deltas;
+    uint64_t *deltas = (uint64_t *)
+        malloc(n_accumulated_reports * n_deltas * sizeof(uint64_t));
+
     const uint8_t *last_report = NULL;
     int i = 0;
     gputop_record_iterator_init(&iter, sample);
@@ -1338,38 +1408,26 @@ update_timeline_selected_reports(struct timeline_window *window,
             continue;
         }
 
-        struct gputop_cc_oa_accumulator accumulator;
-        gputop_cc_oa_accumulator_init(&accumulator, &ctx->devinfo,
-                                      ctx->metric_set, 0, NULL);
+        gputop_cc_oa_accumulator_clear(&accumulator);
         gputop_cc_oa_accumulate_reports(&accumulator, last_report, report);
 
-        for (int c = 0; c < n_counters; c++) {
-            struct gputop_metric_set_counter *counter =
-                &ctx->metric_set->counters[c];
-
-            float *value = &window->accumulated_values[c * n_accumulated_reports + i];
-
-            switch (counter->data_type) {
-            case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-                *value = counter->oa_counter_read_uint64(&ctx->devinfo,
-                                                         ctx->metric_set,
-                                                         accumulator.deltas);
-                break;
-            case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-                *value = counter->oa_counter_read_float(&ctx->devinfo,
-                                                        ctx->metric_set,
-                                                        accumulator.deltas);
-                break;
-            }
-        }
+        for (int d = 0; d < n_deltas; d++)
+            deltas[d * n_accumulated_reports + i] = accumulator.deltas[d];
 
         i++;
         last_report = report;
     }
 
+    double *values = (double *)
+        malloc(n_accumulated_reports * n_counters * sizeof(double));
+    ctx->metric_set->read_all_soa(&ctx->devinfo, ctx->metric_set,
+                                  deltas, n_accumulated_reports, values);
+    for (int v = 0; v < n_accumulated_reports * n_counters; v++)
+        window->accumulated_values[v] = values[v];
+
+    free(values);
+    free(deltas);
+
     search_timeline_reports_for_timestamp(window, ctx);
 }
 
@@ -1426,11 +1484,12 @@ display_timeline_window(struct window *win)
 
     ImVec2 new_zoom;
     static const char *units[] = { "ns", "us", "ms", "s" };
-    char **row_names =
-        ensure_timeline_names(_mesa_hash_table_num_entries(ctx->hw_contexts_table));
-    uint32_t n_rows = 0;
+    uint32_t n_rows = ctx->n_timeline_rows;
+    char **row_names = ensure_timeline_names(n_rows);
+    for (uint32_t r = 0; r < n_rows; r++)
+        row_names[r] = (char *) "";
     list_for_each_entry(struct gputop_hw_context, context, &ctx->hw_contexts, link)
-        row_names[n_rows++] = context->name;
+        row_names[context->timeline_row] = context->name;
     int n_tps = list_length(&ctx->perf_tracepoints);
     Gputop::BeginTimeline("i915-perf-timeline", n_rows, n_tps,
                           end_ts - start_ts,
@@ -1438,22 +1497,18 @@ display_timeline_window(struct window *win)
 
     list_for_each_entry(struct gputop_hw_context, context, &ctx->hw_contexts, link) {
         context->visible_time = end_ts - start_ts;
-        context->visible_time_spent = 0UL;
+        context->visible_time_spent =
+            gputop_hw_context_time_spent(context, start_ts, end_ts);
     }
 
     uint32_t n_entries = 0;
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
-        if (samples->timestamp_end < start_ts)
-            continue;
+    for (uint32_t i = gputop_samples_ring_search(&ctx->timelines, start_ts);
+         i < gputop_samples_ring_length(&ctx->timelines); i++) {
+        struct gputop_accumulated_samples *samples =
+            gputop_samples_ring_get(&ctx->timelines, i);
         if (samples->timestamp_start > end_ts)
             break;
 
-        if (samples->context) {
-            samples->context->visible_time_spent +=
-                MIN2(samples->timestamp_end, end_ts) -
-                MAX2(samples->timestamp_start, start_ts);
-        }
-
         n_entries++;
         assert(samples->context->timeline_row < n_rows);
 
@@ -1527,10 +1582,10 @@ display_timeline_window(struct window *win)
                               ImVec2(ImGui::GetContentRegionAvailWidth(), 300.0f));
     }
 
-    list_for_each_entry(struct gputop_perf_tracepoint_data, data,
-                        &ctx->perf_tracepoints_data, link) {
-        if (data->data.time < start_ts)
-            continue;
+    uint32_t n_tp_data = gputop_client_context_merge_tracepoints_data(ctx);
+    for (uint32_t i = search_tracepoints_data(ctx, n_tp_data, start_ts); i < n_tp_data; i++) {
+        struct gputop_perf_tracepoint_data *data =
+            gputop_client_context_tracepoint_data(ctx, i);
         if (data->data.time > end_ts)
             break;
 
@@ -1544,7 +1599,7 @@ display_timeline_window(struct window *win)
                                                         data, true);
             if (!strcmp(tp->name, "drm/drm_vblank_event")) {
                 char prev_next[100];
-                tracepoint_print_prev_next(ctx, prev_next, sizeof(prev_next), data);
+                tracepoint_print_prev_next(ctx, prev_next, sizeof(prev_next), i);
                 ImGui::SetTooltip("%s\n%s", point_desc, prev_next);
             } else {
                 ImGui::SetTooltip("%s", point_desc);
@@ -1577,7 +1632,7 @@ display_timeline_counters(struct window *win)
       (struct timeline_window *) container_of(win, window, counters_window);
     struct gputop_client_context *ctx = &context.ctx;
 
-    int n_contexts = _mesa_hash_table_num_entries(ctx->hw_contexts_table);
+    int n_contexts = ctx->n_timeline_rows;
     ImGui::ColorButton("##selected_context",
                        Gputop::GetHueColor(window->selected_context.timeline_row, n_contexts),
                        ImGuiColorEditFlags_NoInputs | ImGuiColorEditFlags_NoTooltip); ImGui::SameLine();
@@ -1608,10 +1663,10 @@ display_timeline_events(struct window *win)
 
     int n_items = 0, n_tps = list_length(&ctx->perf_tracepoints);
     window->tracepoint_selected_ts = 0ULL;
-    list_for_each_entry(struct gputop_perf_tracepoint_data, data,
-                        &ctx->perf_tracepoints_data, link) {
-        if (data->data.time < start_ts)
-            continue;
+    uint32_t n_tp_data = gputop_client_context_merge_tracepoints_data(ctx);
+    for (uint32_t i = search_tracepoints_data(ctx, n_tp_data, start_ts); i < n_tp_data; i++) {
+        struct gputop_perf_tracepoint_data *data =
+            gputop_client_context_tracepoint_data(ctx, i);
         if (data->data.time > end_ts || n_items > 100)
             break;
 
@@ -1664,7 +1719,7 @@ display_timeline_reports(struct window *win)
     if (ctx->is_sampling || !ctx->metric_set)
         return;
 
-    int n_contexts = _mesa_hash_table_num_entries(ctx->hw_contexts_table);
+    int n_contexts = ctx->n_timeline_rows;
     ImGui::ColorButton("##selected_context",
                        Gputop::GetHueColor(window->selected_context.timeline_row, n_contexts),
                        ImGuiColorEditFlags_NoInputs | ImGuiColorEditFlags_NoTooltip); ImGui::SameLine();
@@ -1835,6 +1890,17 @@ hide_timeline_window(struct window *win)
 
     window->reports_window.opened = false;
     window->usage_window.opened = false;
+
+    /* Rebuilt from the selected sample when the window is shown again. */
+    window->selected_sample.start_report.header = NULL;
+    free(window->report_headers);
+    window->report_headers = NULL;
+    free(window->report_timestamps);
+    window->report_timestamps = NULL;
+    window->n_report_headers = 0;
+    free(window->accumulated_values);
+    window->accumulated_values = NULL;
+    window->n_accumulated_reports = 0;
 }
 
 static void
@@ -2107,12 +2173,14 @@ display_streams_window(struct window *win)
     list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
         ImGui::Text("tp=%s id=%i", tp->name, tp->event_id);
     }
-    ImGui::Text("n_timelines=%i", ctx->n_timelines);
-    ImGui::Text("n_graphs=%i", ctx->n_graphs);
+    ImGui::Text("n_timelines=%u", gputop_samples_ring_length(&ctx->timelines));
+    ImGui::Text("n_graphs=%u", gputop_samples_ring_length(&ctx->graphs));
     ImGui::Text("n_cpu_stats=%i", ctx->n_cpu_stats);
 
-    list_for_each_entry(struct gputop_perf_tracepoint_data, data,
-                        &ctx->perf_tracepoints_data, link) {
+    uint32_t n_tp_data = gputop_client_context_merge_tracepoints_data(ctx);
+    for (uint32_t i = 0; i < n_tp_data; i++) {
+        struct gputop_perf_tracepoint_data *data =
+            gputop_client_context_tracepoint_data(ctx, i);
         ImGui::Text("%s time=%" PRIx64, data->tp->name, data->data.time);
     }
 }
@@ -2236,6 +2304,7 @@ select_metric_set(struct gputop_client_context *ctx,
 
         if (filter.PassFilter(metric_set->name) &&
             ImGui::Selectable(metric_set->name)) {
+            gputop_metric_set_ensure_counters(metric_set);
             *out_metric_set = metric_set;
             selected = true;
         }
@@ -2291,6 +2360,11 @@ select_metric_set_from_counter(struct gputop_client_context *ctx,
 
     if (!ctx->features) return false;
 
+    /* The counter groups are only complete once all the metric sets have
+     * their counters.
+     */
+    gputop_gen_ensure_counters(ctx->gen_metrics);
+
     ImGui::BeginChild("##block");
     bool selected =
         select_metric_set_from_group_counter(ctx->gen_metrics->root_group,
@@ -2470,6 +2544,14 @@ display_main_window(struct window *win)
                 pretty_sampling, pretty_bandwidth);
     ImGui::SliderFloat("OA visible sampling (s)",
                        &ctx->oa_visible_timeline_s, 0.1f, 15.0f);
+    if (ImGui::Checkbox("Flight recorder", &ctx->flight_recorder))
+        maybe_restart_sampling(ctx);
+    if (ctx->flight_recorder) {
+        ImGui::SameLine();
+        if (ImGui::Button("Snapshot") && ctx->is_sampling) {
+            gputop_client_context_snapshot_sampling(ctx);
+        }
+    }
     if (StartStopSamplingButton(ctx)) { toggle_start_stop_sampling(ctx); } ImGui::SameLine();
     if (ImGui::Button("Live counters")) { show_live_i915_perf_counters_window(); } ImGui::SameLine();
     if (ImGui::Button("Live usage")) { show_live_i915_perf_usage_window(); }
@@ -2590,9 +2672,12 @@ repaint_window(void *user_data)
 
     ImGui_ImplSdlGLES2_NewFrame(context.window);
 
+    /* The context can be updated by its ingest thread. */
+    gputop_client_context_lock(&context.ctx);
     show_main_window();
 
     display_windows();
+    gputop_client_context_unlock(&context.ctx);
 
     glViewport(0, 0, (int)ImGui::GetIO().DisplaySize.x, (int)ImGui::GetIO().DisplaySize.y);
     glClearColor(context.clear_color.x, context.clear_color.y, context.clear_color.z, 1.0);
@@ -2613,9 +2698,11 @@ repaint_window(CoglOnscreen *onscreen, void *user_data)
 {
     ImGui_ImplGtk3Cogl_NewFrame();
 
+    gputop_client_context_lock(&context.ctx);
     show_main_window();
 
     display_windows();
+    gputop_client_context_unlock(&context.ctx);
 
     /* Rendering */
     {
@@ -2647,9 +2734,11 @@ repaint_window(void *user_data)
 
     ImGui_ImplGlfwGL3_NewFrame();
 
+    gputop_client_context_lock(&context.ctx);
     show_main_window();
 
     display_windows();
+    gputop_client_context_unlock(&context.ctx);
 
     int display_w, display_h;
     glfwGetFramebufferSize(context.window, &display_w, &display_h);
@@ -2757,6 +2846,7 @@ main(int argc, char *argv[])
 
     gtk_main();
 
+    gputop_client_context_fini(&context.ctx);
     ImGui::DestroyContext();
 #elif defined(GPUTOP_UI_GLFW)
     const struct option long_options[] = {
@@ -2800,6 +2890,7 @@ main(int argc, char *argv[])
 
     uv_run(uv_default_loop(), UV_RUN_DEFAULT);
 
+    gputop_client_context_fini(&context.ctx);
     ImGui::DestroyContext();
 #endif
 
@@ -49,9 +49,17 @@ struct _gputop_connection_t {
 
     gputop_on_ready_cb_t ready_cb;
     gputop_on_data_cb_t data_cb;
+    gputop_on_buffer_cb_t buffer_cb;
     gputop_on_close_cb_t close_cb;
     void *user_data;
 
+    /* Message being assembled from the received data frames, handed over
+     * to the receiver once complete.
+     */
+    gputop_buffer_t *msg;
+    bool frame_is_data;
+    bool frame_fin;
+
     char http_client_header[1024];
     char http_server_header[64 * 1024];
 };
@@ -97,6 +105,8 @@ on_close_cb(uv_handle_t *handle)
     gputop_connection_t *conn = handle->data;
 
     wslay_event_context_free(conn->wslay_ctx);
+    if (conn->msg)
+        gputop_buffer_unref(conn->msg);
     free(conn);
 }
 
@@ -126,12 +136,84 @@ on_wslay_msg_recv_cb(wslay_event_context_ptr ctx,
 {
     gputop_connection_t *conn = user_data;
 
-    if (arg->opcode == WSLAY_CONNECTION_CLOSE) {
+    /* Data messages are assembled by the frame callbacks below. */
+    if (arg->opcode == WSLAY_CONNECTION_CLOSE &&
+        !uv_is_closing((uv_handle_t *) &conn->tcp_handle))
         gputop_connection_end(conn, NULL);
+}
+
+static void
+on_wslay_frame_recv_start_cb(wslay_event_context_ptr ctx,
+                             const struct wslay_event_on_frame_recv_start_arg *arg,
+                             void *user_data)
+{
+    gputop_connection_t *conn = user_data;
+
+    /* Control frames (opcodes 0x8-0xf) can be interleaved with the
+     * fragments of a message and are left to wslay.
+     */
+    conn->frame_is_data = (arg->opcode & 0x8) == 0 &&
+        !uv_is_closing((uv_handle_t *) &conn->tcp_handle);
+    conn->frame_fin = arg->fin;
+    if (!conn->frame_is_data)
         return;
+
+    if (!conn->msg) {
+        conn->msg = gputop_buffer_new(arg->payload_length);
+        if (conn->msg)
+            conn->msg->len = 0;
+    } else {
+        /* Not shared with anyone until complete, so it can move. */
+        gputop_buffer_t *msg = realloc(conn->msg, sizeof(*conn->msg) +
+                                       conn->msg->len + arg->payload_length);
+        if (msg) {
+            conn->msg = msg;
+            conn->msg->data = (const uint8_t *) (conn->msg + 1);
+        } else {
+            gputop_buffer_unref(conn->msg);
+            conn->msg = NULL;
+        }
+    }
+
+    /* Rather than handing over a truncated message, drop the connection
+     * and ignore the rest of the data already received.
+     */
+    if (!conn->msg) {
+        conn->frame_is_data = false;
+        conn->read_buf = NULL;
+        gputop_connection_end(conn, "Failed to allocate a received message");
     }
+}
+
+static void
+on_wslay_frame_recv_chunk_cb(wslay_event_context_ptr ctx,
+                             const struct wslay_event_on_frame_recv_chunk_arg *arg,
+                             void *user_data)
+{
+    gputop_connection_t *conn = user_data;
+
+    if (!conn->frame_is_data)
+        return;
+
+    memcpy((uint8_t *) conn->msg->data + conn->msg->len, arg->data, arg->data_length);
+    conn->msg->len += arg->data_length;
+}
+
+static void
+on_wslay_frame_recv_end_cb(wslay_event_context_ptr ctx, void *user_data)
+{
+    gputop_connection_t *conn = user_data;
+    gputop_buffer_t *msg = conn->msg;
+
+    if (!conn->frame_is_data || !conn->frame_fin)
+        return;
 
-    conn->data_cb(conn, arg->msg, arg->msg_length, conn->user_data);
+    conn->msg = NULL;
+    if (conn->buffer_cb)
+        conn->buffer_cb(conn, msg, conn->user_data);
+    else
+        conn->data_cb(conn, msg->data, msg->len, conn->user_data);
+    gputop_buffer_unref(msg);
 }
 
 static ssize_t
@@ -251,9 +333,9 @@ gputop_connect(const char *host, int port,
         on_wslay_recv_cb,
         on_wslay_send_cb,
         on_wslay_genmask_cb,
-        NULL,
-        NULL,
-        NULL,
+        on_wslay_frame_recv_start_cb,
+        on_wslay_frame_recv_chunk_cb,
+        on_wslay_frame_recv_end_cb,
         on_wslay_msg_recv_cb,
     };
     uv_getaddrinfo_t req;
@@ -264,6 +346,10 @@ gputop_connect(const char *host, int port,
     conn->close_cb = close_cb;
 
     wslay_event_context_client_init(&conn->wslay_ctx, &callbacks, conn);
+    /* Don't let wslay copy the data messages, we assemble them ourselves
+     * into buffers receivers can keep.
+     */
+    wslay_event_config_set_no_buffering(conn->wslay_ctx, 1);
 
     uv_tcp_init(uv_default_loop(), &conn->tcp_handle);
     conn->tcp_handle.data = conn;
@@ -318,6 +404,13 @@ gputop_connect(const char *host, int port,
     return conn;
 }
 
+void
+gputop_connection_set_buffer_cb(gputop_connection_t *conn,
+                                gputop_on_buffer_cb_t buffer_cb)
+{
+    conn->buffer_cb = buffer_cb;
+}
+
 void
 gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
 {
@@ -75,6 +75,9 @@ static struct {
     bool child_exited;
     uint32_t max_idle_child_time_ms;
 
+    /* Accumulations can be reported from the context's ingest thread */
+    uv_async_t quit_async;
+
     struct hash_table *process_ids;
 } context;
 
@@ -218,6 +221,19 @@ static void on_ctrl_c(uv_signal_t* handle, int signum)
     quit();
 }
 
+static void on_snapshot(uv_signal_t* handle, int signum)
+{
+    if (context.ctx.is_sampling) {
+        comment("Snapshot requested.\n");
+        gputop_client_context_snapshot_sampling(&context.ctx);
+    }
+}
+
+static void on_quit_async(uv_async_t *handle)
+{
+    quit();
+}
+
 static void on_child_timer(uv_timer_t* handle)
 {
     uv_timer_stop(&context.child_process_timer_handle);
@@ -439,8 +455,10 @@ static bool match_process(struct gputop_hw_context *hw_context)
 }
 
 static void print_accumulated_columns(struct gputop_client_context *ctx,
-                                      struct gputop_accumulated_samples *samples)
+                                      const struct gputop_samples_ring *graphs,
+                                      uint32_t idx)
 {
+    struct gputop_accumulated_samples *samples = gputop_samples_ring_get(graphs, idx);
     int i;
     for (i = 0; i < context.n_metric_columns; i++) {
         const struct gputop_metric_set_counter *counter =
@@ -451,7 +469,8 @@ static void print_accumulated_columns(struct gputop_client_context *ctx,
             snprintf(svalue, sizeof(svalue), "%" PRIu64,
                      samples->accumulator.first_timestamp);
         } else {
-            double value = gputop_client_context_read_counter_value(ctx, samples, counter);
+            double value =
+                gputop_samples_ring_value(graphs, counter - ctx->metric_set->counters, idx);
             if (context.human_units)
                 gputop_client_pretty_print_value(counter->units, value, svalue, sizeof(svalue));
             else
@@ -466,26 +485,25 @@ static void print_accumulated_columns(struct gputop_client_context *ctx,
 static void print_columns(struct gputop_client_context *ctx,
                           struct gputop_hw_context *hw_context)
 {
-    struct list_head *list;
+    struct gputop_samples_ring *graphs;
 
     if (!match_process(hw_context))
         return;
 
     context.n_accumulations++;
-    list = hw_context == NULL ? &ctx->graphs : &hw_context->graphs;
+    graphs = hw_context == NULL ? &ctx->graphs : &hw_context->graphs;
 
     if (context.last_samples == NULL) {
-        list_for_each_entry(struct gputop_accumulated_samples, samples, list, link) {
-            print_accumulated_columns(ctx, samples);
-        }
-        context.last_samples = list_last_entry(list, struct gputop_accumulated_samples, link);
+        for (uint32_t i = 0; i < gputop_samples_ring_length(graphs); i++)
+            print_accumulated_columns(ctx, graphs, i);
+        context.last_samples = gputop_samples_ring_last(graphs);
     } else {
-        context.last_samples = list_last_entry(list, struct gputop_accumulated_samples, link);
-        print_accumulated_columns(ctx, context.last_samples);
+        context.last_samples = gputop_samples_ring_last(graphs);
+        print_accumulated_columns(ctx, graphs, gputop_samples_ring_length(graphs) - 1);
     }
 
     if (context.child_exited)
-        quit();
+        uv_async_send(&context.quit_async);
 }
 
 static bool handle_features()
@@ -499,6 +517,7 @@ static bool handle_features()
         print_metrics();
         return true;
     }
+    gputop_metric_set_ensure_counters(ctx->metric_set);
     if (!context.metric_columns) {
         if (!context.all_columns) {
             print_metric_counter(ctx, ctx->metric_set);
@@ -556,13 +575,10 @@ static void on_ready(gputop_connection_t *conn, void *user_data)
     gputop_client_context_reset(&context.ctx, conn);
 }
 
-static void on_data(gputop_connection_t *conn,
-                    const void *data, size_t len,
-                    void *user_data)
+static void on_message(void)
 {
     static bool features_handled = false;
 
-    gputop_client_context_handle_data(&context.ctx, data, len);
     if (!features_handled && context.ctx.features) {
         features_handled = true;
         if (handle_features()) {
@@ -590,6 +606,22 @@ static void on_data(gputop_connection_t *conn,
     }
 }
 
+static void on_data(gputop_connection_t *conn,
+                    const void *data, size_t len,
+                    void *user_data)
+{
+    gputop_client_context_handle_data(&context.ctx, data, len);
+    on_message();
+}
+
+static void on_buffer(gputop_connection_t *conn,
+                      gputop_buffer_t *buffer,
+                      void *user_data)
+{
+    gputop_client_context_handle_buffer(&context.ctx, buffer);
+    on_message();
+}
+
 static void on_close(gputop_connection_t *conn, const char *error,
                      void *user_data)
 {
@@ -634,6 +666,8 @@ static void usage(void)
            "\t                                   (disables human readable units)\n"
            "\t -w, --max-inactive-time <time>    Maximum time of inactivity before killing\n"
            "\t                                   the child process (in seconds, floating point)\n"
+           "\t -f, --flight-recorder             Only receive the server's data on SIGUSR1\n"
+           "\t                                   (snapshot of the most recent samples)\n"
            "\n"
         );
 }
@@ -665,6 +699,7 @@ int main (int argc, char **argv)
         { "child-output",      required_argument,  0, 'O' },
         { "output",            required_argument,  0, 'o' },
         { "max-inactive-time", required_argument,  0, 'w' },
+        { "flight-recorder",   no_argument,        0, 'f' },
         { NULL,                required_argument,  0, '-' },
         { 0, 0, 0, 0 }
     };
@@ -675,6 +710,7 @@ int main (int argc, char **argv)
     uv_loop_t *loop;
     uv_signal_t ctrl_c_handle;
     uv_signal_t child_process_handle;
+    uv_signal_t snapshot_handle;
 
     init_context();
 
@@ -683,7 +719,7 @@ int main (int argc, char **argv)
     context.ctx.oa_aggregation_period_ns = 1000000000ULL;
 
     while (!opt_done &&
-           (opt = getopt_long(argc, argv, "c:hH:m:Mp:P:-nNO:o:w:", long_options, NULL)) != -1)
+           (opt = getopt_long(argc, argv, "c:fhH:m:Mp:P:-nNO:o:w:", long_options, NULL)) != -1)
     {
         switch (opt) {
         case 'h':
@@ -746,6 +782,9 @@ int main (int argc, char **argv)
         case 'w':
             context.max_idle_child_time_ms = atof(optarg) * 1000.0f;
             break;
+        case 'f':
+            context.ctx.flight_recorder = true;
+            break;
         case '-':
             opt_done = true;
             break;
@@ -762,7 +801,18 @@ int main (int argc, char **argv)
     uv_signal_init(loop, &child_process_handle);
     uv_signal_start_oneshot(&child_process_handle, on_child_process_exit, SIGCHLD);
 
-    gputop_connect(host, port, on_ready, on_data, on_close, NULL);
+    uv_signal_init(loop, &snapshot_handle);
+    if (context.ctx.flight_recorder) {
+        uv_signal_start(&snapshot_handle, on_snapshot, SIGUSR1);
+        uv_unref((uv_handle_t *) &snapshot_handle);
+    }
+
+    uv_async_init(loop, &context.quit_async, on_quit_async);
+    uv_unref((uv_handle_t *) &context.quit_async);
+
+    gputop_connection_t *conn =
+        gputop_connect(host, port, on_ready, on_data, on_close, NULL);
+    gputop_connection_set_buffer_cb(conn, on_buffer);
 
     gputop_client_pretty_print_value(GPUTOP_PERFQUERY_COUNTER_UNITS_NS,
                                      context.ctx.oa_aggregation_period_ns,
@@ -786,8 +836,9 @@ int main (int argc, char **argv)
     uv_run(loop, UV_RUN_DEFAULT);
     uv_signal_stop(&ctrl_c_handle);
     uv_signal_stop(&child_process_handle);
+    uv_signal_stop(&snapshot_handle);
 
-    gputop_client_context_reset(&context.ctx, NULL);
+    gputop_client_context_fini(&context.ctx);
 
     comment("Finished.\n");
 